@@ -0,0 +1,430 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "autotune.h"
+#include "pool.h"
+
+/**
+ * Return 1 if a binary split search over M images of `data` should count with
+ * bitsets under `tuning` (which may be NULL, or made for another dataset).
+ */
+int dt_tuning_use_bitset(const DTTuning *tuning, Dataset *data, int M) {
+    return tuning != NULL && tuning -> data == data && tuning -> bit_of != NULL
+        && tuning -> profile.bitset_min_items >= 0 && M >= tuning -> profile.bitset_min_items;
+}
+
+/**
+ * Return 1 if a grayscale split search over M images of `data` should fill
+ * its histograms image-major under `tuning` (which may be NULL).
+ */
+int dt_tuning_use_image_major(const DTTuning *tuning, Dataset *data, int M) {
+    return tuning != NULL && tuning -> data == data && tuning -> all_hist != NULL
+        && tuning -> profile.image_major_min_items >= 0 && M >= tuning -> profile.image_major_min_items;
+}
+
+/**
+ * Claim the image-major histograms of `tuning` for one search and return 1,
+ * or return 0 if another search (of a node built in parallel) holds them.
+ */
+int dt_tuning_claim_histograms(DTTuning *tuning) {
+    return !__atomic_exchange_n(&(tuning -> histograms_claimed), 1, __ATOMIC_ACQUIRE);
+}
+
+/* Hand back the histograms claimed with dt_tuning_claim_histograms(), cleared */
+void dt_tuning_release_histograms(DTTuning *tuning) {
+    __atomic_store_n(&(tuning -> histograms_claimed), 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Helper for dt_tuning_count_bitset. Store in `right_freq` the popcounts of
+ * the columns of one label ANDed with the label's membership bitset, over
+ * words [first, last]. Compiled for popcnt when the CPU has it.
+ */
+__attribute__((target_clones("popcnt", "default")))
+static void count_label_columns(const uint64_t *columns, const uint64_t *members, int words,
+                                int first, int last, int *right_freq) {
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        const uint64_t *column = columns + (size_t) p * words;
+        int count = 0;
+        for (int w = first; w <= last; w++) {
+            count += __builtin_popcountll(column[w] & members[w]);
+        }
+        right_freq[p] = count;
+    }
+}
+
+/**
+ * Store in right_freq[label][pixel] the number of the M images (indices into
+ * `tuning -> data`) of each label whose color at each pixel is >=
+ * BINARY_THRESHOLD, like the scan in dectree.c, using the bitsets. The labels
+ * are read from the label segments of the images when they are grouped by
+ * label (`segments` not NULL, see `dataset_group_labels()`).
+ */
+void dt_tuning_count_bitset(const DTTuning *tuning, int M, const int *indices, const int *segments,
+                            int (*right_freq)[NUM_PIXELS]) {
+    // membership bitsets of the node, per label, private to the call so nodes
+    // can be counted in parallel
+    uint64_t *members[10];
+    int total_words = 0;
+    for (int k = 0; k < 10; k++) {
+        total_words += tuning -> label_words[k];
+    }
+    uint64_t *words = calloc(total_words + 1, sizeof(uint64_t));
+    if (words == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return;
+    }
+
+    int first[10], last[10];
+    for (int k = 0, offset = 0; k < 10; k++) {
+        members[k] = words + offset;
+        offset += tuning -> label_words[k];
+        first[k] = INT_MAX;
+        last[k] = -1;
+    }
+    for (int i = 0, k = 0; i < M; i++) {
+        if (segments == NULL) {
+            k = tuning -> data -> labels[indices[i]];
+        } else {
+            while (i >= segments[k + 1]) { // next non-empty segment
+                k++;
+            }
+        }
+        int word = tuning -> bit_of[indices[i]] / 64;
+        members[k][word] |= (uint64_t) 1 << (tuning -> bit_of[indices[i]] % 64);
+        first[k] = word < first[k] ? word : first[k];
+        last[k] = word > last[k] ? word : last[k];
+    }
+    for (int k = 0; k < 10; k++) {
+        if (last[k] == -1) { // no image of this label
+            memset(right_freq[k], 0, sizeof(int) * NUM_PIXELS);
+        } else {
+            count_label_columns(tuning -> columns[k], members[k], tuning -> label_words[k],
+                                first[k], last[k], right_freq[k]);
+        }
+    }
+    free(words);
+}
+
+/* Helper for dt_tuning_new. Build the bitset columns of `tuning -> data` */
+static void build_columns(DTTuning *tuning) {
+    Dataset *data = tuning -> data;
+    tuning -> bit_of = malloc(sizeof(int) * data -> num_items);
+    for (int i = 0; i < data -> num_items; i++) {
+        tuning -> bit_of[i] = tuning -> label_count[data -> labels[i]]++;
+    }
+    for (int k = 0; k < 10; k++) {
+        tuning -> label_words[k] = (tuning -> label_count[k] + 63) / 64;
+        tuning -> columns[k] = calloc((size_t) NUM_PIXELS * tuning -> label_words[k] + 1, sizeof(uint64_t));
+        if (tuning -> columns[k] == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+        }
+    }
+
+    unsigned char pixels[NUM_PIXELS];
+    for (int i = 0; i < data -> num_items; i++) {
+        int k = data -> labels[i];
+        image_read(&(data -> images[i]), pixels);
+        uint64_t bit = (uint64_t) 1 << (tuning -> bit_of[i] % 64);
+        uint64_t *column = tuning -> columns[k] + tuning -> bit_of[i] / 64;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            if (pixels[p] >= BINARY_THRESHOLD) {
+                column[(size_t) p * tuning -> label_words[k]] |= bit;
+            }
+        }
+    }
+}
+
+/* Helper for dt_tuning_new and dt_autotune. Free the bitset columns */
+static void free_columns(DTTuning *tuning) {
+    free(tuning -> bit_of);
+    tuning -> bit_of = NULL;
+    for (int k = 0; k < 10; k++) {
+        free(tuning -> columns[k]);
+        tuning -> columns[k] = NULL;
+        tuning -> label_count[k] = 0;
+    }
+}
+
+/* Helper for dt_tuning_new and dt_autotune. Free the image-major histograms */
+static void free_histograms(DTTuning *tuning) {
+    free(tuning -> all_hist);
+    free(tuning -> all_bin_count);
+    tuning -> all_hist = NULL;
+    tuning -> all_bin_count = NULL;
+}
+
+/**
+ * Return the strategy choices of `profile` for `data`, with the bitsets and
+ * histogram tables of every strategy the profile may use (a crossover other
+ * than INT_MAX) set up. To use them, point `DTParams.tuning` at the result
+ * and build trees on `data`.
+ */
+DTTuning *dt_tuning_new(Dataset *data, const DTProfile *profile) {
+    DTTuning *tuning = calloc(1, sizeof(DTTuning));
+    if (tuning == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    tuning -> profile = *profile;
+    tuning -> data = data;
+    if (profile -> bitset_min_items != INT_MAX) {
+        build_columns(tuning);
+    }
+    if (profile -> image_major_min_items != INT_MAX) {
+        tuning -> all_hist = calloc(NUM_PIXELS, sizeof(*(tuning -> all_hist)));
+        tuning -> all_bin_count = calloc(NUM_PIXELS, sizeof(*(tuning -> all_bin_count)));
+        if (tuning -> all_hist == NULL || tuning -> all_bin_count == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+        }
+    }
+    return tuning;
+}
+
+/**
+ * Helper for dt_calibrate. Return the mean time of `find_best_split()` on
+ * nodes of M items, with the strategy the profile currently picks. The calls
+ * cycle through the `num_nodes` nodes stored back to back in `indices`, so
+ * they do not find the images in cache any more than a real build would.
+ * Like the builder's, the nodes are grouped by label along `segments`.
+ */
+static double time_split(DTTuning *tuning, const DTParams *params, int M, int *indices,
+                         int (*segments)[11], int num_nodes) {
+    int threshold, calls = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        int n = calls % num_nodes;
+        find_best_split(tuning -> data, M, indices + (size_t) n * M, segments[n], params, &threshold);
+        calls++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < CALIBRATION_SECONDS);
+    return elapsed / calls;
+}
+
+/* Helper for dt_calibrate, comparing ints for qsort */
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Time the split search of `params` (binary or grayscale) with each of its
+ * strategies, on random nodes of CALIBRATION_MIN_ITEMS, 4x as many, ... up to
+ * every item of `tuning -> data`, and store in `tuning -> profile` the
+ * smallest node size from which the second strategy is faster at every size
+ * measured (INT_MAX if it never is).
+ */
+void dt_calibrate(DTTuning *tuning, const DTParams *params) {
+    int N = tuning -> data -> num_items;
+    int *crossover = params -> grayscale ? &(tuning -> profile.image_major_min_items)
+                                         : &(tuning -> profile.bitset_min_items);
+    tuning -> profile.num_items = N;
+    if (N == 0) { // no node to time
+        *crossover = INT_MAX;
+        return;
+    }
+    DTParams node_params = *params;
+    dt_params_resolve(&node_params, tuning -> data);
+    node_params.tuning = tuning;
+
+    // a random permutation of the items, cut into nodes of M items (sorted,
+    // then grouped by label)
+    int *order = malloc(sizeof(int) * N);
+    int *indices = malloc(sizeof(int) * N);
+    int (*segments)[11] = malloc(sizeof(*segments) * CALIBRATION_NODES);
+    unsigned int seed = 1;
+    for (int i = 0; i < N; i++) {
+        order[i] = i;
+    }
+    for (int i = N - 1; i > 0; i--) {
+        int j = rand_r(&seed) % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    int result = INT_MAX;
+    for (long M = CALIBRATION_MIN_ITEMS; ; M *= 4) {
+        int size = M < N ? (int) M : N;
+        int num_nodes = N / size < CALIBRATION_NODES ? N / size : CALIBRATION_NODES;
+        memcpy(indices, order, sizeof(int) * size * num_nodes);
+        for (int n = 0; n < num_nodes; n++) {
+            qsort(indices + n * size, size, sizeof(int), compare_ints);
+            dataset_group_labels(tuning -> data, size, indices + n * size, segments[n]);
+        }
+
+        *crossover = INT_MAX;
+        double first_time = time_split(tuning, &node_params, size, indices, segments, num_nodes);
+        *crossover = 0;
+        double second_time = time_split(tuning, &node_params, size, indices, segments, num_nodes);
+        if (second_time < first_time) {
+            result = result == INT_MAX ? (M == CALIBRATION_MIN_ITEMS ? 0 : size) : result;
+        } else {
+            result = INT_MAX;
+        }
+        if (size == N) {
+            break;
+        }
+    }
+    *crossover = result;
+
+    free(segments);
+    free(order);
+    free(indices);
+}
+
+/* Helper for host_hash. Mix the bytes of `text` into `hash`, FNV-1a style */
+static uint64_t hash_text(uint64_t hash, const char *text) {
+    for (; *text != '\0'; text++) {
+        hash = (hash ^ (unsigned char) *text) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Return a hash of what the crossovers depend on besides the data: the CPU
+ * model (from /proc/cpuinfo, where there is one), its cache sizes and the
+ * number of CPUs online.
+ */
+static uint64_t host_hash(void) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (strncmp(line, "model name", 10) == 0) {
+                hash = hash_text(hash, line);
+                break;
+            }
+        }
+        fclose(file);
+    }
+    char sizes[128];
+    long l1 = -1, l2 = -1, l3 = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    snprintf(sizes, sizeof(sizes), "%ld %ld %ld %ld", l1, l2, l3, sysconf(_SC_NPROCESSORS_ONLN));
+    return hash_text(hash, sizes);
+}
+
+/**
+ * Load the profile file `path` into `profile`. Return 0 if it was measured on
+ * `data` (same size and dataset_hash()) on this machine (see host_hash()),
+ * and -1 if it is missing, invalid or was measured on other data or another
+ * machine (`profile` then holds no measurements, only the keys of `data`).
+ *
+ * A profile file is text, one "name value" line per field of DTProfile, the
+ * hashes in hexadecimal.
+ */
+int dt_profile_load(const char *path, Dataset *data, DTProfile *profile) {
+    *profile = (DTProfile) {data -> num_items, -1, -1, dataset_hash(data), host_hash()};
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    DTProfile loaded = {-1, -1, -1, 0, 0};
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[64];
+        int value;
+        uint64_t hash;
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "data_hash %" SCNx64, &hash) == 1) {
+            loaded.data_hash = hash;
+        } else if (sscanf(line, "host_hash %" SCNx64, &hash) == 1) {
+            loaded.host_hash = hash;
+        } else if (sscanf(line, "%63s %d", name, &value) != 2) {
+            continue;
+        } else if (strcmp(name, "num_items") == 0) {
+            loaded.num_items = value;
+        } else if (strcmp(name, "bitset_min_items") == 0) {
+            loaded.bitset_min_items = value;
+        } else if (strcmp(name, "image_major_min_items") == 0) {
+            loaded.image_major_min_items = value;
+        }
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+    }
+    if (loaded.num_items != profile -> num_items || loaded.data_hash != profile -> data_hash
+            || loaded.host_hash != profile -> host_hash) {
+        return -1;
+    }
+    *profile = loaded;
+    return 0;
+}
+
+/**
+ * Write `profile` to the file `path` (see dt_profile_load()). Return 0 on
+ * success.
+ */
+int dt_profile_save(const char *path, const DTProfile *profile) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: could not open file\n");
+        return -1;
+    }
+    fprintf(file, "# decision tree split strategy crossovers (node sizes, %d = never, -1 = not measured)\n", INT_MAX);
+    fprintf(file, "num_items %d\n", profile -> num_items);
+    fprintf(file, "bitset_min_items %d\n", profile -> bitset_min_items);
+    fprintf(file, "image_major_min_items %d\n", profile -> image_major_min_items);
+    fprintf(file, "data_hash %016" PRIx64 "\n", profile -> data_hash);
+    fprintf(file, "host_hash %016" PRIx64 "\n", profile -> host_hash);
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Return the strategy choices for building trees on `data` with `params`.
+ * The crossover the build needs (binary or grayscale) is read from the
+ * profile file `profile_path` if it was measured on this data and machine,
+ * and otherwise calibrated now and saved to the file (when `profile_path` is
+ * not NULL).
+ */
+DTTuning *dt_autotune(Dataset *data, const DTParams *params, const char *profile_path) {
+    DTProfile profile = {data -> num_items, -1, -1, 0, 0};
+    if (profile_path != NULL) {
+        dt_profile_load(profile_path, data, &profile);
+    }
+    int *crossover = params -> grayscale ? &(profile.image_major_min_items) : &(profile.bitset_min_items);
+
+    // the strategies of the other mode are not needed
+    DTProfile effective = profile;
+    *(params -> grayscale ? &(effective.bitset_min_items) : &(effective.image_major_min_items)) = INT_MAX;
+    DTTuning *tuning = dt_tuning_new(data, &effective);
+
+    if (*crossover == -1) {
+        dt_calibrate(tuning, params);
+        *crossover = params -> grayscale ? tuning -> profile.image_major_min_items
+                                         : tuning -> profile.bitset_min_items;
+        if (profile_path != NULL) {
+            dt_profile_save(profile_path, &profile);
+        }
+    }
+
+    // drop the structures of a strategy that never wins
+    if (tuning -> profile.bitset_min_items == INT_MAX) {
+        free_columns(tuning);
+    }
+    if (tuning -> profile.image_major_min_items == INT_MAX) {
+        free_histograms(tuning);
+    }
+    return tuning;
+}
+
+/**
+ * Free the strategy choices and their data structures.
+ */
+void free_dt_tuning(DTTuning *tuning) {
+    free_columns(tuning);
+    free_histograms(tuning);
+    free(tuning);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+
+/**
+ * Per-node choice of the split search strategy, from crossover points
+ * measured on the machine and the training data.
+ *
+ * Binary split searches count, for every pixel, the images of each label on
+ * the right side. Two strategies compute the same counts:
+ *
+ *  - scan:   add the comparisons of every image of the node to the row of its
+ *            label (cost ~ node size x NUM_PIXELS);
+ *  - bitset: AND the node's membership bitset with a precomputed bitset
+ *            column per (label, pixel) and popcount (cost ~ dataset size x
+ *            NUM_PIXELS / 64, whatever the node size).
+ *
+ * Grayscale searches fill a (bin, label) histogram per pixel, either one pixel
+ * at a time over the node's images (pixel-major, reads each image NUM_PIXELS
+ * times) or all pixels in one pass over the images (image-major, touches a
+ * NUM_PIXELS x 256 x 10 table).
+ *
+ * Every strategy gives the same counts, so the tree does not depend on the
+ * profile, only the build time does.
+ */
+
+/* Node sizes at which the strategies are timed: CALIBRATION_MIN_ITEMS, 4x that, ... */
+#ifndef CALIBRATION_MIN_ITEMS
+#define CALIBRATION_MIN_ITEMS 64
+#endif
+
+/* Number of distinct random nodes timed per node size */
+#ifndef CALIBRATION_NODES
+#define CALIBRATION_NODES 64
+#endif
+
+/* Each strategy is timed over at least this many seconds per node size */
+#ifndef CALIBRATION_SECONDS
+#define CALIBRATION_SECONDS 0.02
+#endif
+
+/**
+ * Crossover points measured for one dataset on one machine. Nodes with at
+ * least `bitset_min_items` images count with bitsets (binary) and nodes with
+ * at least `image_major_min_items` images fill their histograms image-major
+ * (grayscale). INT_MAX: never, -1: not measured yet.
+ */
+typedef struct {
+    int num_items;              // Size of the dataset the profile was measured on
+    int bitset_min_items;
+    int image_major_min_items;
+    uint64_t data_hash;         // dataset_hash() of that dataset
+    uint64_t host_hash;         // Hash of the CPU model and cache sizes of the machine
+} DTProfile;
+
+/* Strategy choices and the data structures they need, for one dataset */
+typedef struct dt_tuning {
+    DTProfile profile;
+    Dataset *data;              // Dataset whose items the bitsets index
+
+    // bitsets: the images of label k get bits 0 .. label_count[k] - 1
+    int label_count[10];
+    int label_words[10];        // 64-bit words per bitset of label k
+    int *bit_of;                // Bit of each item in the bitsets of its label
+    uint64_t *columns[10];      // columns[k][p * label_words[k] + w]: images of label k with pixel p >= BINARY_THRESHOLD
+
+    // image-major histograms, cleared after every use. Nodes built in
+    // parallel take turns: a search that finds them claimed fills its
+    // histograms pixel-major instead
+    int (*all_hist)[256][10];   // all_hist[pixel][bin][label]
+    int (*all_bin_count)[256];  // all_bin_count[pixel][bin]
+    int histograms_claimed;     // 1 while a search uses all_hist
+} DTTuning;
+
+int dt_tuning_use_bitset(const DTTuning *tuning, Dataset *data, int M);
+int dt_tuning_use_image_major(const DTTuning *tuning, Dataset *data, int M);
+int dt_tuning_claim_histograms(DTTuning *tuning);
+void dt_tuning_release_histograms(DTTuning *tuning);
+void dt_tuning_count_bitset(const DTTuning *tuning, int M, const int *indices, const int *segments,
+                            int (*right_freq)[NUM_PIXELS]);
+
+DTTuning *dt_tuning_new(Dataset *data, const DTProfile *profile);
+void dt_calibrate(DTTuning *tuning, const DTParams *params);
+int dt_profile_load(const char *path, Dataset *data, DTProfile *profile);
+int dt_profile_save(const char *path, const DTProfile *profile);
+DTTuning *dt_autotune(Dataset *data, const DTParams *params, const char *profile_path);
+void free_dt_tuning(DTTuning *tuning);
@@ -0,0 +1,334 @@
+#include "cache.h"
+#include "pool.h"
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Final avalanche of MurmurHash3 */
+static inline uint64_t fmix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * Store in `hash` a 128-bit hash of the packed image, in the style of
+ * MurmurHash3 x64-128: two 64-bit lanes absorb the rows two at a time.
+ */
+void packed_image_hash(const PackedImage *img, uint64_t hash[2]) {
+    uint64_t h1 = 0x9e3779b97f4a7c15ULL, h2 = 0xc2b2ae3d27d4eb4fULL;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+
+    for (int y = 0; y < WIDTH; y += 2) {
+        uint64_t k1 = img -> rows[y];
+        uint64_t k2 = y + 1 < WIDTH ? img -> rows[y + 1] : 0;
+        k1 = rotl64(k1 * c1, 31) * c2;
+        k2 = rotl64(k2 * c2, 33) * c1;
+        h1 = (rotl64(h1 ^ k1, 27) + h2) * 5 + 0x52dce729;
+        h2 = (rotl64(h2 ^ k2, 31) + h1) * 5 + 0x38495ab5;
+    }
+
+    h1 ^= sizeof(PackedImage);
+    h2 ^= sizeof(PackedImage);
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+/* Helper for model_of. Hash the structure of the tree in pre-order */
+static uint64_t tree_fingerprint(DTNode *node, uint64_t hash) {
+    hash = fmix64(hash ^ ((uint64_t) (node -> pixel + 1) << 40) ^ ((uint64_t) node -> threshold << 20)
+                  ^ (uint64_t) (node -> classification + 1));
+    if (node -> classification == -1) {
+        hash = tree_fingerprint(node -> left, hash);
+        hash = tree_fingerprint(node -> right, hash);
+    }
+    return hash;
+}
+
+/**
+ * Helper for model_of. Copy the model of the cache to `model` without a lock.
+ * Return 0 if it was being updated, in which case the copy is unusable.
+ */
+static int read_model(DTCache *cache, CacheModel *model) {
+    uint32_t seq = __atomic_load_n(&(cache -> model_seq), __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return 0;
+    }
+    model -> root = __atomic_load_n(&(cache -> model.root), __ATOMIC_RELAXED);
+    model -> epoch = __atomic_load_n(&(cache -> model.epoch), __ATOMIC_RELAXED);
+    model -> binary = __atomic_load_n(&(cache -> model.binary), __ATOMIC_RELAXED);
+    model -> generation = __atomic_load_n(&(cache -> model.generation), __ATOMIC_RELAXED);
+    model -> fingerprint = __atomic_load_n(&(cache -> model.fingerprint), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&(cache -> model_seq), __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * Helper for model_of and dt_cache_invalidate. Make `next` the model of the
+ * cache, the model lock held.
+ */
+static void publish_model(DTCache *cache, const CacheModel *next) {
+    uint32_t seq = cache -> model_seq;
+    __atomic_store_n(&(cache -> model_seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&(cache -> model.root), next -> root, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache -> model.epoch), next -> epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache -> model.binary), next -> binary, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache -> model.generation), next -> generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache -> model.fingerprint), next -> fingerprint, __ATOMIC_RELAXED);
+    __atomic_store_n(&(cache -> model_seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Store the model of `root` in `model`. While no tree has changed since the
+ * current model was checked (see `dt_model_generation()`) and `root` is the
+ * current tree, this only copies it. Otherwise the tree is fingerprinted
+ * under the model lock: if it is the same tree, only the generation of the
+ * model moves on; if not, a new epoch is started, which invalidates every
+ * entry at once.
+ */
+static void model_of(DTCache *cache, DTNode *root, CacheModel *model) {
+    unsigned long generation = dt_model_generation();
+    if (read_model(cache, model) && model -> root == root && model -> generation == generation) {
+        return;
+    }
+
+    pthread_mutex_lock(&(cache -> model_lock));
+    CacheModel next = cache -> model;
+    if (next.root != root || next.generation != generation) {
+        uint64_t fingerprint = tree_fingerprint(root, 0);
+        if (next.root != root || next.fingerprint != fingerprint) {
+            next.epoch = ++(cache -> epoch);
+            __atomic_add_fetch(&(cache -> invalidations), 1, __ATOMIC_RELAXED);
+        }
+        next.root = root;
+        next.binary = dec_tree_is_binary(root);
+        next.generation = generation;
+        next.fingerprint = fingerprint;
+        publish_model(cache, &next);
+    }
+    *model = next;
+    pthread_mutex_unlock(&(cache -> model_lock));
+}
+
+/**
+ * Return a new cache holding up to about `capacity` classifications (rounded
+ * up to a power of two sets of CACHE_WAYS slots). With `timing` set, the
+ * latency of every lookup is measured for `dt_cache_stats()`.
+ */
+DTCache *dt_cache_new(int capacity, int timing) {
+    // the counters are cache-line aligned
+    DTCache *cache = NULL;
+    if (posix_memalign((void **) &cache, 64, sizeof(DTCache)) != 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    memset(cache, 0, sizeof(DTCache));
+    cache -> num_sets = 1;
+    while (cache -> num_sets * CACHE_WAYS < capacity) {
+        cache -> num_sets *= 2;
+    }
+    cache -> slots = calloc((size_t) cache -> num_sets * CACHE_WAYS, sizeof(CacheSlot));
+    cache -> hands = calloc(cache -> num_sets, sizeof(uint8_t));
+    if (cache -> slots == NULL || cache -> hands == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+    cache -> timing = timing;
+    cache -> epoch = 0;         // entries start in epoch 0, which no model uses
+    cache -> model_seq = 0;
+    cache -> model = (CacheModel) {NULL, 0, 0, 0, 0};
+    pthread_mutex_init(&(cache -> model_lock), NULL);
+    return cache;
+}
+
+/**
+ * Helper for the lookups. Return the label cached for `key` in `epoch`, or -1.
+ * A slot being written, or rewritten while it is read, counts as a miss.
+ */
+static int lookup(DTCache *cache, const uint64_t key[2], uint32_t epoch) {
+    CacheSlot *set = cache -> slots + (key[0] & (cache -> num_sets - 1)) * CACHE_WAYS;
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        CacheSlot *slot = &set[w];
+        uint32_t seq = __atomic_load_n(&(slot -> seq), __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        uint64_t key0 = __atomic_load_n(&(slot -> key[0]), __ATOMIC_RELAXED);
+        uint64_t key1 = __atomic_load_n(&(slot -> key[1]), __ATOMIC_RELAXED);
+        uint32_t slot_epoch = __atomic_load_n(&(slot -> epoch), __ATOMIC_RELAXED);
+        int label = __atomic_load_n(&(slot -> label), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(slot -> seq), __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (key0 == key[0] && key1 == key[1] && slot_epoch == epoch) {
+            if (!__atomic_load_n(&(slot -> referenced), __ATOMIC_RELAXED)) {
+                __atomic_store_n(&(slot -> referenced), 1, __ATOMIC_RELAXED);
+            }
+            return label;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Helper for the lookups. Cache `label` for `key` in `epoch`. The victim is
+ * a slot of another epoch if the set has one, else the first slot the CLOCK
+ * hand finds with its reference bit clear. If another thread is writing the
+ * victim, the insertion is simply dropped.
+ */
+static void insert(DTCache *cache, const uint64_t key[2], uint32_t epoch, int label) {
+    int set_index = key[0] & (cache -> num_sets - 1);
+    CacheSlot *set = cache -> slots + set_index * CACHE_WAYS;
+
+    int victim = -1;
+    for (int w = 0; w < CACHE_WAYS && victim == -1; w++) {
+        if (__atomic_load_n(&(set[w].epoch), __ATOMIC_RELAXED) != epoch) {
+            victim = w;
+        }
+    }
+    int hand = __atomic_load_n(&(cache -> hands[set_index]), __ATOMIC_RELAXED);
+    for (int step = 0; step < 2 * CACHE_WAYS && victim == -1; step++) {
+        int w = (hand + step) % CACHE_WAYS;
+        if (__atomic_load_n(&(set[w].referenced), __ATOMIC_RELAXED)) {
+            __atomic_store_n(&(set[w].referenced), 0, __ATOMIC_RELAXED);
+        } else {
+            victim = w;
+        }
+    }
+    if (victim == -1) {
+        victim = hand % CACHE_WAYS;
+    }
+    __atomic_store_n(&(cache -> hands[set_index]), (victim + 1) % CACHE_WAYS, __ATOMIC_RELAXED);
+
+    // claim the slot by making its sequence odd
+    CacheSlot *slot = &set[victim];
+    uint32_t seq = __atomic_load_n(&(slot -> seq), __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&(slot -> seq), &seq, seq + 1, 0,
+                                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (__atomic_load_n(&(slot -> epoch), __ATOMIC_RELAXED) == epoch) {
+        __atomic_add_fetch(&(cache -> evictions), 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&(slot -> key[0]), key[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot -> key[1]), key[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot -> epoch), epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot -> label), (int8_t) label, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot -> referenced), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot -> seq), seq + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(cache -> insertions), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Helper for the lookups. Look up the packed image for a binary model, walking
+ * the tree (on the packed image) on a miss.
+ */
+static int classify_cached(DTCache *cache, const CacheModel *model, const PackedImage *img, uint64_t start) {
+    uint64_t key[2];
+    packed_image_hash(img, key);
+
+    int label = lookup(cache, key, model -> epoch);
+    if (label != -1) {
+        __atomic_add_fetch(&(cache -> hits), 1, __ATOMIC_RELAXED);
+        if (cache -> timing) {
+            __atomic_add_fetch(&(cache -> hit_ns), now_ns() - start, __ATOMIC_RELAXED);
+        }
+        return label;
+    }
+
+    label = dec_tree_classify_packed(model -> root, img);
+    insert(cache, key, model -> epoch, label);
+    __atomic_add_fetch(&(cache -> misses), 1, __ATOMIC_RELAXED);
+    if (cache -> timing) {
+        __atomic_add_fetch(&(cache -> miss_ns), now_ns() - start, __ATOMIC_RELAXED);
+    }
+    return label;
+}
+
+/**
+ * Classify the NUM_PIXELS-pixel image with the tree, through the cache. Safe
+ * to call from any number of threads at once.
+ */
+int dt_cache_classify(DTCache *cache, DTNode *root, Image *img) {
+    uint64_t start = cache -> timing ? now_ns() : 0;
+    CacheModel model;
+    model_of(cache, root, &model);
+    if (!model.binary) { // the packed key does not determine the label
+        __atomic_add_fetch(&(cache -> misses), 1, __ATOMIC_RELAXED);
+        int label = dec_tree_classify(root, img);
+        if (cache -> timing) {
+            __atomic_add_fetch(&(cache -> miss_ns), now_ns() - start, __ATOMIC_RELAXED);
+        }
+        return label;
+    }
+
+    PackedImage packed;
+    pack_image(img -> data, &packed);
+    if ((img -> dx | img -> dy) != 0) {
+        shift_packed_image(&packed, img -> dx, img -> dy);
+    }
+    return classify_cached(cache, &model, &packed, start);
+}
+
+/**
+ * Classify the packed image with the tree, which must be binary (see
+ * `dec_tree_is_binary()`), through the cache.
+ */
+int dt_cache_classify_packed(DTCache *cache, DTNode *root, const PackedImage *img) {
+    uint64_t start = cache -> timing ? now_ns() : 0;
+    CacheModel model;
+    model_of(cache, root, &model);
+    return classify_cached(cache, &model, img, start);
+}
+
+/**
+ * Drop every entry of the cache (they are ignored from now on and replaced
+ * as the sets fill up again).
+ */
+void dt_cache_invalidate(DTCache *cache) {
+    pthread_mutex_lock(&(cache -> model_lock));
+    if (cache -> model.root != NULL) {
+        CacheModel next = cache -> model;
+        next.epoch = ++(cache -> epoch);
+        publish_model(cache, &next);
+        __atomic_add_fetch(&(cache -> invalidations), 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(cache -> model_lock));
+}
+
+/**
+ * Store a snapshot of the cache counters in `stats`.
+ */
+void dt_cache_stats(DTCache *cache, DTCacheStats *stats) {
+    stats -> hits = __atomic_load_n(&(cache -> hits), __ATOMIC_RELAXED);
+    stats -> misses = __atomic_load_n(&(cache -> misses), __ATOMIC_RELAXED);
+    stats -> insertions = __atomic_load_n(&(cache -> insertions), __ATOMIC_RELAXED);
+    stats -> evictions = __atomic_load_n(&(cache -> evictions), __ATOMIC_RELAXED);
+    stats -> invalidations = __atomic_load_n(&(cache -> invalidations), __ATOMIC_RELAXED);
+    uint64_t lookups = stats -> hits + stats -> misses;
+    stats -> hit_rate = lookups ? (double) stats -> hits / lookups : 0;
+    stats -> hit_ns = stats -> hits ? (double) cache -> hit_ns / stats -> hits : 0;
+    stats -> miss_ns = stats -> misses ? (double) cache -> miss_ns / stats -> misses : 0;
+}
+
+/**
+ * Free the cache. No other thread may be using it.
+ */
+void free_dt_cache(DTCache *cache) {
+    pthread_mutex_destroy(&(cache -> model_lock));
+    free(cache -> slots);
+    free(cache -> hands);
+    free(cache);
+}
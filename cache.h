@@ -0,0 +1,92 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "dectree.h"
+#include "packed.h"
+
+/**
+ * A bounded, concurrent cache of classifications in front of
+ * `dec_tree_classify()`, for traffic with many exact-duplicate images.
+ *
+ * Entries are keyed by a 128-bit hash of the bit-packed image (see packed.h),
+ * so only binary trees are cached; images classified by a grayscale tree go
+ * straight to the tree. The cache is set-associative with CACHE_WAYS slots
+ * per set and CLOCK eviction within a set. Lookups take no lock: each slot is
+ * guarded by a sequence counter that writers make odd while they update it,
+ * and readers retry-free treat a slot that changed under them as a miss.
+ *
+ * The cache remembers which model its entries belong to. Every call compares
+ * the tree with that model (cheaply, see `dt_model_generation()`), and entries
+ * of a previous model are dropped as soon as a different tree is passed in.
+ */
+
+/* Number of slots in each set of the cache */
+#ifndef CACHE_WAYS
+#define CACHE_WAYS 8
+#endif
+
+/* One cached classification */
+typedef struct {
+    uint32_t seq;           // Even when the slot is stable, odd while written
+    uint32_t epoch;         // Model epoch the entry belongs to
+    uint64_t key[2];        // 128-bit hash of the packed image
+    int8_t label;           // Cached classification
+    uint8_t referenced;     // CLOCK reference bit
+} CacheSlot;
+
+/* Counters, see dt_cache_stats() */
+typedef struct {
+    uint64_t hits;          // Lookups answered from the cache
+    uint64_t misses;        // Lookups that walked the tree
+    uint64_t insertions;    // Entries written
+    uint64_t evictions;     // Valid entries replaced by CLOCK
+    uint64_t invalidations; // Times the model changed
+    double hit_rate;        // hits / (hits + misses)
+    double hit_ns;          // (Timing enabled) Mean latency of a hit
+    double miss_ns;         // (Timing enabled) Mean latency of a miss
+} DTCacheStats;
+
+/**
+ * The model an epoch of the cache belongs to. It is updated in place under
+ * the model lock and guarded by a sequence counter like the slots, so
+ * lookups copy it without a lock and nothing is allocated when it changes.
+ */
+typedef struct {
+    DTNode *root;               // Tree of the epoch
+    uint32_t epoch;             // Epoch stored in the entries of this tree
+    int binary;                 // 1 if the tree can be cached (see dec_tree_is_binary())
+    unsigned long generation;   // dt_model_generation() when the tree was last checked
+    uint64_t fingerprint;       // Structural hash of the tree
+} CacheModel;
+
+typedef struct {
+    int num_sets;           // Number of sets (a power of two)
+    CacheSlot *slots;       // Array of `num_sets * CACHE_WAYS` slots
+    uint8_t *hands;         // CLOCK hand of each set
+    int timing;             // 1 to measure the latency of every lookup
+
+    uint32_t epoch;                 // Last epoch started (entries of other epochs are stale)
+    uint32_t model_seq;             // Even when `model` is stable, odd while it is updated
+    CacheModel model;               // Model of the current epoch
+    pthread_mutex_t model_lock;     // Serializes model changes (never taken by lookups)
+
+    // statistics, each on its own cache line
+    uint64_t hits __attribute__((aligned(64)));
+    uint64_t misses __attribute__((aligned(64)));
+    uint64_t insertions __attribute__((aligned(64)));
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t hit_ns __attribute__((aligned(64)));
+    uint64_t miss_ns __attribute__((aligned(64)));
+} DTCache;
+
+void packed_image_hash(const PackedImage *img, uint64_t hash[2]);
+
+DTCache *dt_cache_new(int capacity, int timing);
+int dt_cache_classify(DTCache *cache, DTNode *root, Image *img);
+int dt_cache_classify_packed(DTCache *cache, DTNode *root, const PackedImage *img);
+void dt_cache_invalidate(DTCache *cache);
+void dt_cache_stats(DTCache *cache, DTCacheStats *stats);
+void free_dt_cache(DTCache *cache);
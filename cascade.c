@@ -0,0 +1,254 @@
+#include "cascade.h"
+#include "pool.h"
+
+/* Append a node to the first stage of `cascade` and return its index */
+static int add_node(Cascade *cascade, int *capacity, CascadeNode node) {
+    if (cascade -> num_nodes == *capacity) {
+        *capacity *= 2;
+        cascade -> nodes = realloc(cascade -> nodes, sizeof(CascadeNode) * *capacity);
+    }
+    cascade -> nodes[cascade -> num_nodes] = node;
+    return cascade -> num_nodes++;
+}
+
+/**
+ * Helper for build_cascade. Build the first-stage subtree of the M images in
+ * `indices`, of at most `depth` levels, the way `build_subtree()` builds a
+ * tree, and store its leaves' confidence. The indices, grouped by label along
+ * `segments`, are partitioned in place (stably, so the children stay grouped)
+ * through `scratch`.
+ */
+static void build_stage(Cascade *cascade, int *capacity, Dataset *data, int M, int *indices,
+                        const int *segments, int *scratch, const DTParams *params, int depth) {
+    int label, freq;
+    get_most_frequent_grouped(segments, &label, &freq);
+
+    int pixel = -1;
+    int threshold = BINARY_THRESHOLD;
+    if (depth > 0 && ((double) freq / (double) M) < THRESHOLD_RATIO) {
+        pixel = find_best_split(data, M, indices, segments, params, &threshold);
+    }
+    if (pixel == -1) { // leaf
+        add_node(cascade, capacity, (CascadeNode) {-1, 0, label, 0, (freq + 1.0f) / (M + 10.0f), -1});
+        return;
+    }
+    int node = add_node(cascade, capacity, (CascadeNode) {pixel, threshold, -1, 0, 0, -1});
+
+    // images going left keep their order at the front, the others follow
+    int left_size = 0, right_size = 0;
+    int left_segments[11], right_segments[11];
+    for (int k = 0; k < 10; k++) {
+        left_segments[k] = left_size;
+        right_segments[k] = right_size;
+        for (int i = segments[k]; i < segments[k + 1]; i++) {
+            int index = indices[i];
+            if (image_pixel(&(data -> images[index]), pixel) < threshold) {
+                indices[left_size++] = index;
+            } else {
+                scratch[right_size++] = index;
+            }
+        }
+    }
+    left_segments[10] = left_size;
+    right_segments[10] = right_size;
+    memcpy(indices + left_size, scratch, sizeof(int) * right_size);
+
+    build_stage(cascade, capacity, data, left_size, indices, left_segments, scratch, params, depth - 1);
+    cascade -> nodes[node].right = cascade -> num_nodes;
+    build_stage(cascade, capacity, data, right_size, indices + left_size, right_segments, scratch, params,
+                depth - 1);
+}
+
+/* Classify a batch of images with the fallback of the cascade */
+static void fallback_classify_batch(const Cascade *cascade, const Image *images, int num_images,
+                                    int *predictions) {
+    if (cascade -> forest != NULL) {
+        forest_classify_batch(cascade -> forest, images, num_images, predictions);
+    } else {
+        dec_tree_classify_batch(cascade -> fallback, images, num_images, predictions);
+    }
+}
+
+/* Return the first-stage leaf reached by the image */
+static inline const CascadeNode *stage_leaf(const Cascade *cascade, const Image *img) {
+    const CascadeNode *nodes = cascade -> nodes;
+    int i = 0;
+    while (nodes[i].pixel != -1) {
+        i = image_pixel(img, nodes[i].pixel) < nodes[i].threshold ? i + 1 : nodes[i].right;
+    }
+    return &nodes[i];
+}
+
+/* An image of the calibration set: its first-stage confidence and which stages get it right */
+typedef struct {
+    float confidence;
+    char stage_correct;
+    char fallback_correct;
+} Calibration;
+
+/* qsort comparator: most confident first */
+static int compare_confidence(const void *a, const void *b) {
+    float x = ((const Calibration *) a) -> confidence, y = ((const Calibration *) b) -> confidence;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Helper for build_cascade. Return the lowest first-stage confidence at which
+ * the cascade, classifying `holdout`, makes at most `max_loss` (a fraction of
+ * the images) more mistakes than the fallback alone, or 2 (nothing stops at
+ * the first stage) if there is none.
+ */
+static double calibrate(Cascade *cascade, Dataset *holdout, double max_loss) {
+    int N = holdout -> num_items;
+    Calibration *images = malloc(sizeof(Calibration) * (N + 1));
+    int *predictions = malloc(sizeof(int) * (N + 1));
+    fallback_classify_batch(cascade, holdout -> images, N, predictions);
+    int fallback_correct = 0;
+    for (int i = 0; i < N; i++) {
+        const CascadeNode *leaf = stage_leaf(cascade, &(holdout -> images[i]));
+        images[i].confidence = leaf -> confidence;
+        images[i].stage_correct = leaf -> classification == holdout -> labels[i];
+        images[i].fallback_correct = predictions[i] == holdout -> labels[i];
+        fallback_correct += images[i].fallback_correct;
+    }
+    qsort(images, N, sizeof(Calibration), compare_confidence);
+
+    // lower the threshold one confidence value at a time: the images of that
+    // value move from the fallback to the first stage
+    double threshold = 2;
+    int correct = fallback_correct;
+    for (int i = 0; i < N; ) {
+        int j = i;
+        for (; j < N && images[j].confidence == images[i].confidence; j++) {
+            correct += images[j].stage_correct - images[j].fallback_correct;
+        }
+        if (fallback_correct - correct <= max_loss * N) {
+            threshold = images[i].confidence;
+        }
+        i = j;
+    }
+    free(images);
+    free(predictions);
+    return threshold;
+}
+
+/**
+ * Build a cascade in front of the `fallback` tree, or of `forest` if it is not
+ * NULL (`fallback` may then be NULL): a first stage of at most
+ * `depth` levels trained on `train` with `params`, whose confidence threshold
+ * is calibrated on `holdout` (images neither tree was trained on) so that
+ * the cascade loses at most `max_loss` accuracy (a fraction) on them.
+ */
+Cascade *build_cascade(Dataset *train, Dataset *holdout, const DTParams *params, int depth,
+                       DTNode *fallback, const Forest *forest, double max_loss) {
+    Cascade *cascade = calloc(1, sizeof(Cascade));
+    int capacity = 64;
+    cascade -> nodes = malloc(sizeof(CascadeNode) * capacity);
+    cascade -> depth = depth;
+    cascade -> fallback = fallback;
+    cascade -> forest = forest;
+
+    int M = train -> num_items;
+    int *indices = malloc(sizeof(int) * (M + 1));
+    int *scratch = malloc(sizeof(int) * (M + 1));
+    for (int i = 0; i < M; i++) {
+        indices[i] = i;
+    }
+    int segments[11];
+    dataset_group_labels(train, M, indices, segments);
+    DTParams stage_params = *params;
+    dt_params_resolve(&stage_params, train);
+    build_stage(cascade, &capacity, train, M, indices, segments, scratch, &stage_params, depth);
+    free(scratch);
+    free(indices);
+
+    cascade -> threshold = calibrate(cascade, holdout, max_loss);
+    return cascade;
+}
+
+/**
+ * Classify one image with the cascade: with the first stage if its leaf is
+ * confident enough, with the fallback otherwise. Counts the image in the
+ * stage that answered (the time spent is only measured by cascade_evaluate()).
+ */
+int cascade_classify(Cascade *cascade, Image *img) {
+    const CascadeNode *leaf = stage_leaf(cascade, img);
+    if (leaf -> confidence >= cascade -> threshold) {
+        __atomic_add_fetch(&(cascade -> stats.images[0]), 1, __ATOMIC_RELAXED);
+        return leaf -> classification;
+    }
+    __atomic_add_fetch(&(cascade -> stats.images[1]), 1, __ATOMIC_RELAXED);
+    if (cascade -> forest != NULL) {
+        return forest_classify(cascade -> forest, img);
+    }
+    return dec_tree_classify(cascade -> fallback, img);
+}
+
+/**
+ * Classify every image in `data` with the cascade and return the number of
+ * correct predictions. All images go through the first stage, then those it
+ * is not confident about go through the fallback in one batch; the time of
+ * both passes is added to the cascade's statistics.
+ */
+int cascade_evaluate(Cascade *cascade, Dataset *data) {
+    int N = data -> num_items;
+    int *predictions = malloc(sizeof(int) * (N + 1));
+    int *deferred = malloc(sizeof(int) * (N + 1));
+    Image *images = malloc(sizeof(Image) * (N + 1));
+
+    uint64_t start = now_ns();
+    int num_deferred = 0;
+    for (int i = 0; i < N; i++) {
+        const CascadeNode *leaf = stage_leaf(cascade, &(data -> images[i]));
+        predictions[i] = leaf -> classification;
+        deferred[num_deferred] = i;
+        num_deferred += leaf -> confidence < cascade -> threshold;
+    }
+    uint64_t middle = now_ns();
+    for (int j = 0; j < num_deferred; j++) {
+        images[j] = data -> images[deferred[j]];
+    }
+    int *fallback_predictions = malloc(sizeof(int) * (num_deferred + 1));
+    fallback_classify_batch(cascade, images, num_deferred, fallback_predictions);
+    for (int j = 0; j < num_deferred; j++) {
+        predictions[deferred[j]] = fallback_predictions[j];
+    }
+    uint64_t end = now_ns();
+
+    cascade -> stats.images[0] += N - num_deferred;
+    cascade -> stats.images[1] += num_deferred;
+    cascade -> stats.ns[0] += middle - start;
+    cascade -> stats.ns[1] += end - middle;
+
+    int total_correct = 0;
+    for (int i = 0; i < N; i++) {
+        total_correct += predictions[i] == data -> labels[i];
+    }
+    free(fallback_predictions);
+    free(images);
+    free(deferred);
+    free(predictions);
+    return total_correct;
+}
+
+/**
+ * Print the share of images each stage answered and its latency per image
+ * (the first stage sees every image, the fallback only the deferred ones).
+ */
+void cascade_print_stats(const Cascade *cascade, FILE *out) {
+    const CascadeStats *stats = &(cascade -> stats);
+    uint64_t total = stats -> images[0] + stats -> images[1];
+    fprintf(out, "cascade: %d-node stage 1 (depth %d, threshold %.3f) answered %.1f%% of %llu images, "
+            "%.0f ns/image; fallback answered %.1f%%, %.0f ns/image\n",
+            cascade -> num_nodes, cascade -> depth, cascade -> threshold,
+            total ? 100.0 * stats -> images[0] / total : 0.0, (unsigned long long) total,
+            total ? (double) stats -> ns[0] / total : 0.0,
+            total ? 100.0 * stats -> images[1] / total : 0.0,
+            stats -> images[1] ? (double) stats -> ns[1] / stats -> images[1] : 0.0);
+}
+
+/* Free the cascade (but not its fallback) */
+void free_cascade(Cascade *cascade) {
+    free(cascade -> nodes);
+    free(cascade);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+#include "forest.h"
+
+/**
+ * Cascade inference: a shallow first-stage tree answers the images it is
+ * confident about, and only the others are classified by the full tree.
+ *
+ * The first stage is a decision tree of at most `depth` levels, stored as a
+ * small preorder array (a depth-6 tree fits in 2 KB, so it stays in L1).
+ * Each of its leaves has a confidence: the smoothed fraction of the training
+ * images reaching the leaf that have its label, (count + 1) / (M + 10). An
+ * image whose leaf has a confidence of at least `threshold` gets the leaf's
+ * label; any other goes on to the fallback: the full tree, or a forest.
+ *
+ * `build_cascade()` calibrates the threshold on held-out images: the lowest
+ * threshold (so the most images stop at the first stage) whose cascade is
+ * at most `max_loss` less accurate than the fallback alone on them.
+ */
+
+/* Default depth of the first stage */
+#ifndef CASCADE_DEPTH
+#define CASCADE_DEPTH 6
+#endif
+
+/* A node of the first stage, in preorder: the left child follows its parent */
+typedef struct {
+    int16_t pixel;          // Pixel tested, or -1 for a leaf
+    int16_t threshold;      // Images with a color < threshold go left
+    int16_t classification; // Label of a leaf
+    int16_t reserved;
+    float confidence;       // Confidence of a leaf
+    int32_t right;          // Index of the right child
+} CascadeNode;
+
+/* Images answered by each stage and the time spent in it, see cascade_evaluate() */
+typedef struct {
+    uint64_t images[2];     // Images classified by stage 1 and by the fallback
+    uint64_t ns[2];         // Time spent classifying them, in nanoseconds
+} CascadeStats;
+
+typedef struct {
+    CascadeNode *nodes;     // First stage
+    int num_nodes;
+    int depth;
+    double threshold;       // Leaves at least this confident answer (> 1: none do)
+    DTNode *fallback;       // Full tree, not owned by the cascade
+    const Forest *forest;   // Forest classifying instead of `fallback` if not NULL, not owned
+    CascadeStats stats;
+} Cascade;
+
+Cascade *build_cascade(Dataset *train, Dataset *holdout, const DTParams *params, int depth,
+                       DTNode *fallback, const Forest *forest, double max_loss);
+int cascade_classify(Cascade *cascade, Image *img);
+int cascade_evaluate(Cascade *cascade, Dataset *data);
+void cascade_print_stats(const Cascade *cascade, FILE *out);
+void free_cascade(Cascade *cascade);
@@ -0,0 +1,512 @@
+#include <stdint.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "features.h"
+#include "pool.h"
+
+/* First bytes of a checkpoint file ("DTCK"), and its format version */
+#define CHECKPOINT_MAGIC 0x4b434454u
+#define CHECKPOINT_VERSION 2
+
+/**
+ * A checkpoint file is a CheckpointHeader followed by `num_nodes` NodeRecords,
+ * `frontier_size` OpenNodes and the `num_items` ints of the item order. The
+ * options and a hash of the training data are recorded so that a checkpoint
+ * is only resumed with the data and options it was made with.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int num_items;              // Number of training items
+    int num_nodes;              // Number of node records
+    int frontier_size;          // Number of open nodes
+    int grayscale;              // Resolved DTParams of the build
+    int bins;
+    int criterion;
+    double class_weights[10];
+    int features;
+    int tuned;                  // 1 if built with per-node search strategies (DTParams.tuning)
+    uint64_t data_hash;         // See dataset_hash()
+} CheckpointHeader;
+
+/* A node of the tree being built. Open nodes have pixel and classification -1 */
+typedef struct {
+    int pixel;              // As in DTNode
+    int threshold;
+    int classification;
+    int left;               // Record number of the left child, or -1
+    int right;              // Record number of the right child, or -1
+} NodeRecord;
+
+/* A node of the frontier, whose items are order[start .. start + count - 1] */
+typedef struct {
+    int node;               // Record number of the node
+    int start;
+    int count;
+} OpenNode;
+
+/* State of a build in progress, all of it saved by a checkpoint */
+typedef struct {
+    Dataset *data;
+    DTParams params;            // Resolved options
+    uint64_t data_hash;
+    int *order;                 // Permutation of the items, see OpenNode
+    int *scratch;               // Partition buffer of `num_items` ints
+    NodeRecord *nodes;          // Node records, the root first
+    int num_nodes;
+    int node_capacity;
+    OpenNode *frontier;         // Stack of open nodes, the next one on top
+    int frontier_size;
+    int frontier_capacity;
+} BuildState;
+
+/**
+ * Helper for the builders. Append a node record (open when `classification`
+ * and `pixel` are -1) and return its number.
+ */
+static int add_node(BuildState *state, int pixel, int threshold, int classification) {
+    if (state -> num_nodes == state -> node_capacity) {
+        state -> node_capacity = 2 * state -> node_capacity + 64;
+        state -> nodes = realloc(state -> nodes, sizeof(NodeRecord) * state -> node_capacity);
+    }
+    state -> nodes[state -> num_nodes] = (NodeRecord) {pixel, threshold, classification, -1, -1};
+    return state -> num_nodes++;
+}
+
+/* Helper for the builders. Push an open node on the frontier */
+static void push_open(BuildState *state, int node, int start, int count) {
+    if (state -> frontier_size == state -> frontier_capacity) {
+        state -> frontier_capacity = 2 * state -> frontier_capacity + 64;
+        state -> frontier = realloc(state -> frontier, sizeof(OpenNode) * state -> frontier_capacity);
+    }
+    state -> frontier[state -> frontier_size++] = (OpenNode) {node, start, count};
+}
+
+/**
+ * Helper for the builders. Set up `state` for building a tree on `data`, with
+ * an empty tree and frontier and the items in dataset order.
+ */
+static void init_state(BuildState *state, Dataset *data, const DTParams *params) {
+    int N = data -> num_items;
+    state -> data = data;
+    state -> params = *params;
+    dt_params_resolve(&(state -> params), data);
+    state -> data_hash = dataset_hash(data);
+    state -> order = malloc(sizeof(int) * N);
+    state -> scratch = malloc(sizeof(int) * N);
+    if ((state -> order == NULL || state -> scratch == NULL) && N > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+    for (int i = 0; i < N; i++) {
+        state -> order[i] = i;
+    }
+    state -> nodes = NULL;
+    state -> num_nodes = 0;
+    state -> node_capacity = 0;
+    state -> frontier = NULL;
+    state -> frontier_size = 0;
+    state -> frontier_capacity = 0;
+}
+
+/* Free the arrays of `state` */
+static void free_state(BuildState *state) {
+    free(state -> order);
+    free(state -> scratch);
+    free(state -> nodes);
+    free(state -> frontier);
+}
+
+/**
+ * Return a serialized checkpoint of `state` (see CheckpointHeader), storing
+ * its size in `*size`.
+ */
+static char *serialize_state(const BuildState *state, size_t *size) {
+    CheckpointHeader header = {0};
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.num_items = state -> data -> num_items;
+    header.num_nodes = state -> num_nodes;
+    header.frontier_size = state -> frontier_size;
+    header.grayscale = state -> params.grayscale;
+    header.bins = state -> params.bins;
+    header.criterion = state -> params.criterion;
+    memcpy(header.class_weights, state -> params.class_weights, sizeof(header.class_weights));
+    header.features = state -> params.features;
+    header.tuned = state -> params.tuning != NULL;
+    header.data_hash = state -> data_hash;
+
+    size_t nodes_size = sizeof(NodeRecord) * state -> num_nodes;
+    size_t frontier_size = sizeof(OpenNode) * state -> frontier_size;
+    size_t order_size = sizeof(int) * header.num_items;
+    *size = sizeof(header) + nodes_size + frontier_size + order_size;
+    char *buffer = malloc(*size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    char *out = buffer;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, state -> nodes, nodes_size);
+    out += nodes_size;
+    memcpy(out, state -> frontier, frontier_size);
+    out += frontier_size;
+    memcpy(out, state -> order, order_size);
+    return buffer;
+}
+
+/**
+ * Helper for load_state. Return 1 if the tree, frontier and item order just
+ * read into `state` form a build in progress on its data: the item order is
+ * a permutation, the children of a split come after it and have no other
+ * parent, splits test existing pixels (or features), leaves have a label,
+ * and the open nodes are exactly the frontier, each owning a range of items.
+ */
+static int valid_state(const BuildState *state) {
+    int N = state -> data -> num_items;
+    int num_nodes = state -> num_nodes;
+    int num_pixels = state -> params.features ? NUM_FEATURES : NUM_PIXELS;
+    char *seen = calloc((size_t) (N > num_nodes ? N : num_nodes) + 1, 1);
+    if (seen == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return 0;
+    }
+    int ok = num_nodes >= 1 && state -> frontier_size >= 0 && state -> frontier_size <= num_nodes;
+    for (int i = 0; i < N && ok; i++) {
+        int item = state -> order[i];
+        ok = item >= 0 && item < N && !seen[item];
+        if (ok) {
+            seen[item] = 1;
+        }
+    }
+
+    // seen[id]: node id is already the child of a split (then: already on the frontier)
+    memset(seen, 0, (size_t) num_nodes);
+    int open_nodes = 0;
+    for (int id = 0; id < num_nodes && ok; id++) {
+        const NodeRecord *node = &(state -> nodes[id]);
+        if (node -> classification == -1 && node -> pixel == -1) {
+            open_nodes++;
+        } else if (node -> classification == -1) {
+            ok = node -> pixel >= 0 && node -> pixel < num_pixels
+                && node -> left > id && node -> left < num_nodes && !seen[node -> left]
+                && node -> right > id && node -> right < num_nodes && !seen[node -> right]
+                && node -> left != node -> right;
+            if (ok) {
+                seen[node -> left] = seen[node -> right] = 1;
+            }
+        } else {
+            ok = node -> classification >= 0 && node -> classification < 10;
+        }
+    }
+    memset(seen, 0, (size_t) num_nodes);
+    for (int f = 0; f < state -> frontier_size && ok; f++) {
+        const OpenNode *open = &(state -> frontier[f]);
+        ok = open -> node >= 0 && open -> node < num_nodes && !seen[open -> node]
+            && state -> nodes[open -> node].classification == -1 && state -> nodes[open -> node].pixel == -1
+            && open -> start >= 0 && open -> count >= 0 && open -> start <= N - open -> count;
+        if (ok) {
+            seen[open -> node] = 1;
+        }
+    }
+    ok = ok && open_nodes == state -> frontier_size;
+    free(seen);
+    return ok;
+}
+
+/**
+ * Helper for resume_dec_tree. Replace the tree, frontier and item order of
+ * `state` (set up by init_state()) with those of the checkpoint file `path`.
+ * Return 0 on success, -1 if there is no checkpoint file, and -2 if it is
+ * invalid or was made with other data or options.
+ */
+static int load_state(BuildState *state, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    CheckpointHeader header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION;
+    if (ok && (header.num_items != state -> data -> num_items || header.data_hash != state -> data_hash)) {
+        fprintf(stderr, "Error: checkpoint %s was made with other training data\n", path);
+        ok = 0;
+    } else if (ok && (header.grayscale != state -> params.grayscale || header.bins != state -> params.bins
+                      || header.criterion != (int) state -> params.criterion
+                      || memcmp(header.class_weights, state -> params.class_weights,
+                                sizeof(header.class_weights)) != 0
+                      || header.features != state -> params.features
+                      || header.tuned != (state -> params.tuning != NULL))) {
+        fprintf(stderr, "Error: checkpoint %s was made with other options\n", path);
+        ok = 0;
+    } else if (ok && (header.num_nodes < 1 || header.num_nodes > 2 * header.num_items + 1
+                      || header.frontier_size < 0 || header.frontier_size > header.num_nodes)) {
+        fprintf(stderr, "Error: checkpoint %s is corrupt\n", path);
+        ok = 0;
+    } else if (ok) {
+        state -> num_nodes = state -> node_capacity = header.num_nodes;
+        state -> frontier_size = state -> frontier_capacity = header.frontier_size;
+        state -> nodes = malloc(sizeof(NodeRecord) * header.num_nodes);
+        state -> frontier = malloc(sizeof(OpenNode) * header.frontier_size);
+        ok = state -> nodes != NULL && state -> frontier != NULL
+            && fread(state -> nodes, sizeof(NodeRecord), header.num_nodes, file) == (size_t) header.num_nodes
+            && fread(state -> frontier, sizeof(OpenNode), header.frontier_size, file) == (size_t) header.frontier_size
+            && fread(state -> order, sizeof(int), header.num_items, file) == (size_t) header.num_items;
+        if (!ok) {
+            fprintf(stderr, "Error: checkpoint %s is truncated\n", path);
+        } else if (!valid_state(state)) {
+            fprintf(stderr, "Error: checkpoint %s is corrupt\n", path);
+            ok = 0;
+        }
+    } else {
+        fprintf(stderr, "Error: %s is not a checkpoint\n", path);
+    }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+    }
+    return ok ? 0 : -2;
+}
+
+/**
+ * Helper for the writer thread. Write `size` bytes to a temporary file next
+ * to `path`, flush them to disk and rename the file over `path`, so that
+ * `path` always holds a complete checkpoint. Return 0 on success.
+ */
+static int write_checkpoint(const char *path, const char *buffer, size_t size) {
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    FILE *file = fopen(temp_path, "wb");
+    int ok = file != NULL && fwrite(buffer, 1, size, file) == size && fflush(file) == 0
+        && fsync(fileno(file)) == 0;
+    if (file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Error: could not write checkpoint %s\n", path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return ok ? 0 : -1;
+}
+
+/* Body of the writer thread: write checkpoints as they are handed over */
+static void *writer_main(void *arg) {
+    CheckpointWriter *writer = arg;
+    pthread_mutex_lock(&(writer -> lock));
+    while (1) {
+        while (writer -> pending == NULL && !writer -> stop) {
+            pthread_cond_wait(&(writer -> wake), &(writer -> lock));
+        }
+        if (writer -> pending == NULL) { // stopped, nothing left to write
+            break;
+        }
+        char *buffer = writer -> pending;
+        size_t size = writer -> pending_size;
+        writer -> pending = NULL;
+        writer -> writing = 1;
+        pthread_mutex_unlock(&(writer -> lock));
+
+        int status = write_checkpoint(writer -> path, buffer, size);
+        free(buffer);
+
+        pthread_mutex_lock(&(writer -> lock));
+        writer -> writing = 0;
+        writer -> written += status == 0;
+        writer -> failed += status != 0;
+    }
+    pthread_mutex_unlock(&(writer -> lock));
+    return NULL;
+}
+
+/* Start the writer thread of checkpoint file `path` */
+static void writer_start(CheckpointWriter *writer, const char *path) {
+    writer -> path = path;
+    writer -> pending = NULL;
+    writer -> pending_size = 0;
+    writer -> writing = 0;
+    writer -> stop = 0;
+    writer -> written = 0;
+    writer -> failed = 0;
+    pthread_mutex_init(&(writer -> lock), NULL);
+    pthread_cond_init(&(writer -> wake), NULL);
+    if (pthread_create(&(writer -> thread), NULL, writer_main, writer) != 0) {
+        fprintf(stderr, "Error: could not start the checkpoint writer\n");
+    }
+}
+
+/**
+ * Return 1 if the writer is idle, so that a checkpoint handed over now would
+ * be written right away.
+ */
+static int writer_idle(CheckpointWriter *writer) {
+    pthread_mutex_lock(&(writer -> lock));
+    int idle = writer -> pending == NULL && !writer -> writing;
+    pthread_mutex_unlock(&(writer -> lock));
+    return idle;
+}
+
+/* Hand the serialized checkpoint `buffer` (freed by the writer) over to the writer */
+static void writer_submit(CheckpointWriter *writer, char *buffer, size_t size) {
+    pthread_mutex_lock(&(writer -> lock));
+    free(writer -> pending); // superseded
+    writer -> pending = buffer;
+    writer -> pending_size = size;
+    pthread_cond_signal(&(writer -> wake));
+    pthread_mutex_unlock(&(writer -> lock));
+}
+
+/* Write the checkpoint still pending, if any, and stop the writer thread */
+static void writer_finish(CheckpointWriter *writer) {
+    pthread_mutex_lock(&(writer -> lock));
+    writer -> stop = 1;
+    pthread_cond_signal(&(writer -> wake));
+    pthread_mutex_unlock(&(writer -> lock));
+    pthread_join(writer -> thread, NULL);
+    pthread_mutex_destroy(&(writer -> lock));
+    pthread_cond_destroy(&(writer -> wake));
+}
+
+/**
+ * Helper for run_build. Build the open node on top of the frontier the way
+ * `build_subtree()` builds a node: it becomes a leaf if its items are pure
+ * enough or cannot be split, and otherwise splits, its items being partitioned
+ * (stably) into the ranges of its two new open children.
+ */
+static void expand_node(BuildState *state) {
+    OpenNode open = state -> frontier[--(state -> frontier_size)];
+    Dataset *data = state -> data;
+    int M = open.count;
+    int *indices = state -> order + open.start;
+
+    // the root's items are grouped by label here, and stay grouped in its
+    // descendants since the partitions are stable
+    int segments[11];
+    dataset_group_labels(data, M, indices, segments);
+    int label, freq;
+    get_most_frequent_grouped(segments, &label, &freq);
+    int pixel_split = -1;
+    int threshold = BINARY_THRESHOLD;
+    if (((double) freq / (double) M) < THRESHOLD_RATIO) {
+        pixel_split = find_best_split(data, M, indices, segments, &(state -> params), &threshold);
+    }
+
+    NodeRecord *node = &(state -> nodes[open.node]);
+    if (pixel_split == -1) { // leaf
+        node -> threshold = 0;
+        node -> classification = label;
+        return;
+    }
+    node -> pixel = pixel_split;
+    node -> threshold = threshold;
+
+    // items going left keep their order at the front, the others follow
+    int left_size = 0, right_size = 0;
+    for (int i = 0; i < M; i++) {
+        int index = indices[i];
+        if (image_pixel(&(data -> images[index]), pixel_split) < threshold) {
+            indices[left_size++] = index;
+        } else {
+            state -> scratch[right_size++] = index;
+        }
+    }
+    memcpy(indices + left_size, state -> scratch, sizeof(int) * right_size);
+
+    int left = add_node(state, -1, 0, -1);
+    int right = add_node(state, -1, 0, -1);
+    state -> nodes[open.node].left = left;  // add_node() may have moved the records
+    state -> nodes[open.node].right = right;
+    // the left child is built first, as by the recursion
+    push_open(state, right, open.start + left_size, right_size);
+    push_open(state, left, open.start, left_size);
+}
+
+/* Return the DTNode tree of record `id` and its descendants */
+static DTNode *tree_from_records(const NodeRecord *nodes, int id) {
+    DTNode *node = malloc(sizeof(DTNode));
+    node -> pixel = nodes[id].pixel;
+    node -> threshold = nodes[id].threshold;
+    node -> classification = nodes[id].classification;
+    node -> left = NULL;
+    node -> right = NULL;
+    if (node -> classification == -1) {
+        node -> left = tree_from_records(nodes, nodes[id].left);
+        node -> right = tree_from_records(nodes, nodes[id].right);
+    }
+    return node;
+}
+
+/**
+ * Helper for the builders. Expand open nodes until the frontier is empty,
+ * handing a checkpoint to the writer whenever `interval` seconds have passed
+ * since the last one and the writer is idle. Return the built tree; the
+ * checkpoint file is removed once the tree is complete.
+ */
+static DTNode *run_build(BuildState *state, const char *path, double interval) {
+    CheckpointWriter writer;
+    writer_start(&writer, path);
+
+    double last_checkpoint = now_seconds();
+    while (state -> frontier_size > 0) {
+        expand_node(state);
+        if (state -> frontier_size > 0 && now_seconds() - last_checkpoint >= interval
+                && writer_idle(&writer)) {
+            size_t size;
+            char *buffer = serialize_state(state, &size);
+            if (buffer != NULL) {
+                writer_submit(&writer, buffer, size);
+            }
+            last_checkpoint = now_seconds();
+        }
+    }
+    writer_finish(&writer);
+    unlink(path);
+
+    DTNode *root = tree_from_records(state -> nodes, 0);
+    dt_model_changed();
+    return root;
+}
+
+/**
+ * Build the decision tree for `data` like `build_dec_tree_params()`, writing
+ * a checkpoint to `path` every `interval` seconds (see checkpoint.h).
+ */
+DTNode *build_dec_tree_checkpointed(Dataset *data, const DTParams *params, const char *path,
+                                    double interval) {
+    BuildState state;
+    init_state(&state, data, params);
+    push_open(&state, add_node(&state, -1, 0, -1), 0, data -> num_items);
+    DTNode *root = run_build(&state, path, interval);
+    free_state(&state);
+    return root;
+}
+
+/**
+ * Continue the build of the decision tree for `data` from the checkpoint at
+ * `path`, checkpointing again every `interval` seconds. The data and options
+ * must be the ones the checkpoint was made with. If there is no checkpoint
+ * yet, the build starts from scratch. Return NULL if the checkpoint cannot be
+ * used.
+ */
+DTNode *resume_dec_tree(Dataset *data, const DTParams *params, const char *path, double interval) {
+    BuildState state;
+    init_state(&state, data, params);
+    int status = load_state(&state, path);
+    if (status == -2) {
+        free_state(&state);
+        return NULL;
+    }
+    if (status == -1) {
+        fprintf(stderr, "No checkpoint at %s, building from scratch\n", path);
+        push_open(&state, add_node(&state, -1, 0, -1), 0, data -> num_items);
+    }
+    DTNode *root = run_build(&state, path, interval);
+    free_state(&state);
+    return root;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "dectree.h"
+
+/**
+ * Tree building that can survive the process being killed. The tree is built
+ * node by node from an explicit frontier instead of the call stack, and every
+ * `interval` seconds a checkpoint of the partially built tree is written to
+ * a file: the nodes built so far, the open nodes of the frontier and, for the
+ * range of the training items each open node owns, the order of the items.
+ * Checkpoints are written by a background thread (see CheckpointWriter), so
+ * training only pauses to copy its state to memory.
+ *
+ * `resume_dec_tree()` continues from the checkpoint file and returns the same
+ * tree as an uninterrupted `build_dec_tree_params()` with the same data and
+ * options.
+ */
+
+/* Default number of seconds between two checkpoints */
+#ifndef CHECKPOINT_INTERVAL
+#define CHECKPOINT_INTERVAL 60.0
+#endif
+
+/**
+ * Writes checkpoints handed over by the builder on its own thread. A new
+ * checkpoint is only accepted when the previous one is on disk, so the
+ * builder never waits for the disk; it just checkpoints again later.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    const char *path;       // Checkpoint file, replaced atomically by each write
+    char *pending;          // Serialized checkpoint waiting to be written (or NULL)
+    size_t pending_size;    // Size of `pending` in bytes
+    int writing;            // 1 while a checkpoint is being written
+    int stop;               // Set to make the thread exit
+    int written;            // Number of checkpoints written
+    int failed;             // Number of checkpoints that could not be written
+} CheckpointWriter;
+
+DTNode *build_dec_tree_checkpointed(Dataset *data, const DTParams *params, const char *path,
+                                    double interval);
+DTNode *resume_dec_tree(Dataset *data, const DTParams *params, const char *path, double interval);
@@ -1,40 +1,513 @@
-#include "dectree.h"
-
-// Makefile included in starter:
-//    To compile:               make
-//    To decompress dataset:    make datasets
-
-/**
- * main() takes in 2 command line arguments:
- *    - training_data: A binary file containing training image / label data
- *    - testing_data: A binary file containing testing image / label data
- * 
- */
-int main(int argc, char *argv[]) {
-  int total_correct = 0;
-
-  // parse command line arguments
-  Dataset *training_data = load_dataset(argv[1]);
-  Dataset *testing_data = load_dataset(argv[2]);
-
-  // build decision tree with training data
-  DTNode *training_root = build_dec_tree(training_data);
-
-  // for each test image, compare predicted label and real label
-  for (int i = 0; i < testing_data -> num_items; i++) {
-    int predicted_label = dec_tree_classify(training_root, &(testing_data -> images[i]));
-    int real_label = testing_data -> labels[i];
-    if (predicted_label == real_label) { // if labels match, increment 'total_correct' by one
-      total_correct += 1;
-    }
-  }
-
-  // free all dynamically allocated data
-  free_dec_tree(training_root);
-  free_dataset(training_data);
-  free_dataset(testing_data);
-
-  // Print out answer
-  printf("%d\n", total_correct);
-  return 0;
-}
+#include "autotune.h"
+#include "cache.h"
+#include "cascade.h"
+#include "checkpoint.h"
+#include "dectree.h"
+#include "features.h"
+#include "forest.h"
+#include "levelwise.h"
+#include "model.h"
+#include "oblivious.h"
+#include "packed.h"
+#include "pool.h"
+#include "remap.h"
+#include "tensor.h"
+
+// Makefile included in starter:
+//    To compile:               make
+//    To decompress dataset:    make datasets
+
+// When no testing file is given, 1 / HOLDOUT_FOLDS of the training file is held out
+#ifndef HOLDOUT_FOLDS
+#define HOLDOUT_FOLDS 6
+#endif
+
+/* How the testing images are stored when classified by a pointer tree */
+typedef enum {
+  TEST_FULL,          // NUM_PIXELS bytes per image
+  TEST_PROJECTED,     // Only the pixels the tree tests (--remap)
+  TEST_PACKED,        // One bit per pixel (--packed)
+  TEST_COMPRESSED,    // Non-empty 16-pixel blocks only (--compressed)
+  TEST_CACHED,        // NUM_PIXELS bytes per image, through a cache (--cache)
+  TEST_TENSOR         // NUM_PIXELS bytes per image, through the tree compiled to matrices (--tensor)
+} TestForm;
+
+// Number of results cached by --cache when no size is given
+#ifndef DEFAULT_CACHE_SIZE
+#define DEFAULT_CACHE_SIZE 65536
+#endif
+
+/**
+ * Classify the testing images with the tree and return the number of correct
+ * predictions, or -1 if the testing images cannot be loaded. The testing
+ * images are `testing_data`, or are loaded from `testing_file` when it is
+ * NULL, and are converted to (or loaded in) `test_form` first. The tree may be
+ * renumbered for TEST_PROJECTED.
+ */
+static int evaluate_dec_tree(DTNode *root, Dataset *training_data, Dataset *testing_data,
+                             const char *testing_file, TestForm test_form, int cache_size) {
+  int total_correct = 0;
+
+  if (test_form == TEST_PACKED || test_form == TEST_COMPRESSED) {
+    if (!dec_tree_is_binary(root)) {
+      fprintf(stderr, "Error: packed images need a binary (non-grayscale) tree\n");
+      return 0;
+    }
+  }
+
+  if (test_form == TEST_PROJECTED) {
+    // keep only the pixels the tree tests, hottest first, and renumber the tree
+    PixelMap *map = pixel_map_from_tree(root, training_data);
+    dec_tree_remap(root, map);
+    Dataset *projected = testing_data == NULL ? load_dataset_projected(testing_file, map)
+                                              : project_dataset(testing_data, map);
+    if (projected == NULL) {
+      free(map);
+      return -1;
+    }
+    int correct = dec_tree_evaluate(root, projected);
+    total_correct = correct < 0 ? 0 : correct;
+    free_dataset(projected);
+    free(map);
+  } else if (test_form == TEST_PACKED) {
+    PackedDataset *packed = testing_data == NULL ? load_dataset_packed(testing_file)
+                                                 : pack_dataset(testing_data);
+    if (packed == NULL) {
+      return -1;
+    }
+    total_correct = packed_evaluate(root, packed);
+    free_packed_dataset(packed);
+  } else if (test_form == TEST_COMPRESSED) {
+    CompressedDataset *compressed = testing_data == NULL ? load_dataset_compressed(testing_file)
+                                                         : compress_dataset(testing_data);
+    if (compressed == NULL) {
+      return -1;
+    }
+    total_correct = compressed_evaluate(root, compressed);
+    free_compressed_dataset(compressed);
+  } else if (test_form == TEST_CACHED) {
+    Dataset *full = testing_data == NULL ? load_dataset(testing_file) : dataset_retain(testing_data);
+    if (full == NULL) {
+      return -1;
+    }
+    DTCache *cache = dt_cache_new(cache_size, 1);
+    for (int i = 0; i < full -> num_items; i++) {
+      total_correct += dt_cache_classify(cache, root, &(full -> images[i])) == full -> labels[i];
+    }
+    DTCacheStats stats;
+    dt_cache_stats(cache, &stats);
+    fprintf(stderr, "cache: %lu hits, %lu misses (%.1f%%), %lu evictions, hit %.0f ns, miss %.0f ns\n",
+            (unsigned long) stats.hits, (unsigned long) stats.misses, 100 * stats.hit_rate,
+            (unsigned long) stats.evictions, stats.hit_ns, stats.miss_ns);
+    free_dt_cache(cache);
+    free_dataset(full);
+  } else if (test_form == TEST_TENSOR) {
+    Dataset *full = testing_data == NULL ? load_dataset(testing_file) : dataset_retain(testing_data);
+    if (full == NULL) {
+      return -1;
+    }
+    TensorTree *tensor = tensor_from_tree(root);
+    if (tensor != NULL) {
+      int correct = tensor_evaluate(tensor, full);
+      total_correct = correct < 0 ? 0 : correct;
+      free_tensor_tree(tensor);
+    }
+    free_dataset(full);
+  } else {
+    Dataset *full = testing_data == NULL ? load_dataset(testing_file) : dataset_retain(testing_data);
+    if (full == NULL) {
+      return -1;
+    }
+    int correct = dec_tree_evaluate(root, full);
+    total_correct = correct < 0 ? 0 : correct;
+    free_dataset(full);
+  }
+  return total_correct;
+}
+
+/**
+ * Return `data` (or NULL) expanded with its derived features (see
+ * features.h), dropping the reference on `data`.
+ */
+static Dataset *expand_features(Dataset *data) {
+  if (data == NULL) {
+    return NULL;
+  }
+  Dataset *expanded = dataset_expand_features(data);
+  free_dataset(data);
+  return expanded;
+}
+
+/**
+ * Put a first stage of at most `depth` levels in front of the tree, or of the
+ * forest if not NULL, calibrated on `calibration_data` to lose at most
+ * `max_loss` accuracy (see cascade.h). Return the number of correct
+ * predictions of the cascade on `testing_data`, and print its statistics.
+ */
+static int evaluate_cascade(Dataset *training_data, Dataset *calibration_data, const DTParams *params,
+                            int depth, DTNode *root, const Forest *forest, double max_loss,
+                            Dataset *testing_data) {
+  Cascade *cascade = build_cascade(training_data, calibration_data, params, depth, root, forest, max_loss);
+  int total_correct = cascade_evaluate(cascade, testing_data);
+  cascade_print_stats(cascade, stderr);
+  free_cascade(cascade);
+  return total_correct;
+}
+
+/**
+ * main() takes in 2 command line arguments:
+ *    - training_data: A binary file containing training image / label data
+ *    - testing_data: A binary file containing testing image / label data
+ * 
+ * If testing_data is omitted, the last 1 / HOLDOUT_FOLDS of training_data is
+ * held out for testing instead (as views, without copying any images).
+ *
+ * Options (anywhere on the command line):
+ *    --grayscale    Search the best threshold of each split instead of < 128
+ *    --bins=K       Number of histogram bins used by --grayscale (default 256)
+ *    --criterion=C  Split criterion: gini (default), entropy or weighted-gini
+ *    --oblivious[=D] Build an oblivious tree of at most D levels (default 12)
+ *    --augment=S    Train on every shift of the training images by up to S
+ *                   pixels in each direction, without copying them
+ *    --checkpoint=F Checkpoint the tree being built to file F (see checkpoint.h)
+ *    --checkpoint-interval=T  Seconds between checkpoints (default 60)
+ *    --resume       Continue the build from the checkpoint given by --checkpoint
+ *    --autotune=F   Pick the split search strategy per node from the profile
+ *                   file F, calibrating and writing it first if it was not
+ *                   measured on this training data (see autotune.h)
+ *    --remap        Classify the testing data projected on the pixels the tree 
+ *                   tests, in the order it uses them (see remap.h)
+ *    --packed       Classify the testing data bit-packed (see packed.h)
+ *    --compressed   Classify the testing data block-compressed (see packed.h)
+ *    --cache[=N]    Classify the testing data through a cache of N results
+ *                   (default 65536, see cache.h) and report its counters
+ *    --tensor       Classify the testing data with matrix products on the tree
+ *                   compiled to dense matrices (see tensor.h)
+ *    --save-model=F Save the tree as a flat model file F, which dtserve maps
+ *                   and serves (see model.h)
+ *    --threads=N    Load, train and evaluate on a pool of N threads (0: one
+ *                   per CPU, see pool.h) and report the time each worker
+ *                   spent busy and idle
+ *    --pin          Pin each thread of the pool to its own CPU
+ *    --forest[=T]   Build a forest of T trees (default 100) on bootstrap
+ *                   samples of the training data and classify in tiles
+ *                   tuned to the caches (see forest.h)
+ *    --cascade[=D]  Classify through a cascade: a first-stage tree of at most
+ *                   D levels (default 6) answers the images it is confident
+ *                   about, the tree (or forest) the others (see cascade.h). Both are
+ *                   trained without 1 / HOLDOUT_FOLDS of the training images,
+ *                   on which the confidence threshold is calibrated; the
+ *                   share of images and latency of each stage are reported
+ *    --cascade-loss=P  Accuracy (in percent of the held-out images) the
+ *                   cascade may lose to the tree alone (default 0)
+ *    --early-stop[=P]  Build the tree level by level without 1 / HOLDOUT_FOLDS
+ *                   of the training images, stop once its accuracy on them has
+ *                   not improved for P levels (default 2) and keep its best
+ *                   depth (see levelwise.h)
+ *    --freeze[=P]   Likewise, but stop growing each subtree on its own once
+ *                   the last P splits on its path did not improve
+ *    --features     Expand the images with derived binary features (pooled
+ *                   blocks, row and column ink counts) that binary trees split
+ *                   on like pixels (see features.h), without --augment
+ */
+int main(int argc, char *argv[]) {
+  int total_correct = 0;
+  int status = 0;
+  Dataset *training_data, *testing_data;
+  DTParams params = dt_default_params();
+  char *files[2];
+  int num_files = 0;
+  int oblivious_depth = -1;
+  int max_shift = 0;
+  const char *checkpoint_file = NULL;
+  double checkpoint_interval = CHECKPOINT_INTERVAL;
+  int resume = 0;
+  const char *profile_file = NULL;
+  const char *model_file = NULL;
+  TestForm test_form = TEST_FULL;
+  int cache_size = DEFAULT_CACHE_SIZE;
+  int num_threads = 1;
+  int pin = 0;
+  int num_trees = 0;
+  int cascade_depth = -1;
+  double cascade_loss = 0;
+  int patience = -1;
+  LevelMode level_mode = LEVEL_STOP;
+  int features = 0;
+
+  // parse command line arguments
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--grayscale") == 0) {
+      params.grayscale = 1;
+    } else if (strncmp(argv[i], "--bins=", 7) == 0) {
+      params.bins = atoi(argv[i] + 7);
+    } else if (strcmp(argv[i], "--criterion=gini") == 0) {
+      params.criterion = CRITERION_GINI;
+    } else if (strcmp(argv[i], "--criterion=entropy") == 0) {
+      params.criterion = CRITERION_ENTROPY;
+    } else if (strcmp(argv[i], "--criterion=weighted-gini") == 0) {
+      params.criterion = CRITERION_WEIGHTED_GINI;
+    } else if (strcmp(argv[i], "--remap") == 0) {
+      test_form = TEST_PROJECTED;
+    } else if (strcmp(argv[i], "--packed") == 0) {
+      test_form = TEST_PACKED;
+    } else if (strcmp(argv[i], "--compressed") == 0) {
+      test_form = TEST_COMPRESSED;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      test_form = TEST_CACHED;
+    } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+      test_form = TEST_CACHED;
+      cache_size = atoi(argv[i] + 8);
+    } else if (strcmp(argv[i], "--tensor") == 0) {
+      test_form = TEST_TENSOR;
+    } else if (strcmp(argv[i], "--oblivious") == 0) {
+      oblivious_depth = OBLIVIOUS_DEFAULT_DEPTH;
+    } else if (strncmp(argv[i], "--oblivious=", 12) == 0) {
+      oblivious_depth = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--augment=", 10) == 0) {
+      max_shift = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+      checkpoint_file = argv[i] + 13;
+    } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+      checkpoint_interval = atof(argv[i] + 22);
+    } else if (strcmp(argv[i], "--resume") == 0) {
+      resume = 1;
+    } else if (strncmp(argv[i], "--autotune=", 11) == 0) {
+      profile_file = argv[i] + 11;
+    } else if (strncmp(argv[i], "--save-model=", 13) == 0) {
+      model_file = argv[i] + 13;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      num_threads = atoi(argv[i] + 10);
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      pin = 1;
+    } else if (strcmp(argv[i], "--forest") == 0) {
+      num_trees = FOREST_TREES;
+    } else if (strncmp(argv[i], "--forest=", 9) == 0) {
+      num_trees = atoi(argv[i] + 9);
+    } else if (strcmp(argv[i], "--cascade") == 0) {
+      cascade_depth = CASCADE_DEPTH;
+    } else if (strncmp(argv[i], "--cascade=", 10) == 0) {
+      cascade_depth = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--cascade-loss=", 15) == 0) {
+      cascade_loss = atof(argv[i] + 15) / 100;
+    } else if (strcmp(argv[i], "--early-stop") == 0 || strcmp(argv[i], "--freeze") == 0) {
+      patience = LEVEL_PATIENCE;
+      level_mode = argv[i][2] == 'f' ? LEVEL_FREEZE : LEVEL_STOP;
+    } else if (strncmp(argv[i], "--early-stop=", 13) == 0) {
+      patience = atoi(argv[i] + 13);
+      level_mode = LEVEL_STOP;
+    } else if (strncmp(argv[i], "--freeze=", 9) == 0) {
+      patience = atoi(argv[i] + 9);
+      level_mode = LEVEL_FREEZE;
+    } else if (strcmp(argv[i], "--features") == 0) {
+      features = 1;
+      params.features = 1;
+    } else if (argv[i][0] != '-' && num_files < 2) {
+      files[num_files++] = argv[i];
+    } else {
+      num_files = 0;
+      break;
+    }
+  }
+  if (resume && checkpoint_file == NULL) {
+    fprintf(stderr, "Error: --resume needs --checkpoint=FILE\n");
+    num_files = 0;
+  }
+  if (cascade_depth >= 0 && (oblivious_depth >= 0 || test_form != TEST_FULL)) {
+    fprintf(stderr, "Error: --cascade classifies full images with a decision tree\n");
+    num_files = 0;
+  }
+  if (num_trees > 0 && (oblivious_depth >= 0 || test_form != TEST_FULL || checkpoint_file != NULL
+                        || model_file != NULL)) {
+    fprintf(stderr, "Error: --forest classifies full images and cannot be checkpointed or saved\n");
+    num_files = 0;
+  }
+  if (patience == 0 || patience < -1) {
+    fprintf(stderr, "Error: --early-stop and --freeze need a patience of at least 1 level\n");
+    num_files = 0;
+  }
+  if (patience >= 0 && (oblivious_depth >= 0 || num_trees > 0 || checkpoint_file != NULL
+                        || cascade_depth >= 0)) {
+    fprintf(stderr, "Error: --early-stop and --freeze build a single decision tree, without checkpoints\n");
+    num_files = 0;
+  }
+  if (features && (params.grayscale || oblivious_depth >= 0 || (test_form != TEST_FULL && test_form != TEST_TENSOR)
+                   || checkpoint_file != NULL || model_file != NULL)) {
+    fprintf(stderr, "Error: --features adds binary features to trees classifying full images in memory\n");
+    num_files = 0;
+  }
+  if (features && max_shift > 0) {
+    // the features of a shifted view would need a copy of each view (see features.h)
+    fprintf(stderr, "Error: --features cannot be combined with --augment\n");
+    num_files = 0;
+  }
+  if (num_files == 0) {
+    fprintf(stderr, "Usage: %s [--grayscale] [--bins=K] [--criterion=C] [--oblivious[=D]] [--augment=S] [--checkpoint=F [--checkpoint-interval=T] [--resume]] [--autotune=F] [--save-model=F] [--threads=N] [--pin] [--forest[=T]] [--cascade[=D] [--cascade-loss=P]] [--early-stop[=P] | --freeze[=P]] [--features] [--remap | --packed | --compressed | --cache[=N] | --tensor] training_data [testing_data]\n", argv[0]);
+    return 1;
+  }
+
+  // every phase below shares one pool of threads
+  if ((num_threads != 1 || pin) && pool_init(num_threads, pin) != 0) {
+    return 1;
+  }
+
+  // a testing file is loaded after training, in the form the model needs,
+  // unless only full images will do
+  testing_data = NULL;
+  if (num_files == 2) {
+    training_data = load_dataset(files[0]);
+    if (training_data != NULL && (features || oblivious_depth >= 0 || num_trees > 0 || cascade_depth >= 0)) {
+      testing_data = load_dataset(files[1]);
+      if (testing_data == NULL) {
+        free_dataset(training_data);
+        return 1;
+      }
+    }
+  } else {
+    Dataset *all_data = load_dataset(files[0]);
+    if (all_data != NULL) {
+      dataset_fold(all_data, HOLDOUT_FOLDS, HOLDOUT_FOLDS - 1, &training_data, &testing_data);
+      free_dataset(all_data); // the views keep the images alive
+    } else {
+      training_data = NULL;
+    }
+  }
+  if (training_data == NULL) {
+    return 1;
+  }
+  Dataset *calibration_data = NULL;
+  if (cascade_depth >= 0) {
+    // hold out (before any augmentation) the images the cascade is calibrated on
+    Dataset *all_training = training_data;
+    dataset_fold(all_training, HOLDOUT_FOLDS, HOLDOUT_FOLDS - 1, &training_data, &calibration_data);
+    free_dataset(all_training);
+  }
+  Dataset *validation_data = NULL;
+  if (patience >= 0) {
+    // likewise, the images the levels of the tree are validated on
+    Dataset *all_training = training_data;
+    dataset_fold(all_training, HOLDOUT_FOLDS, HOLDOUT_FOLDS - 1, &training_data, &validation_data);
+    free_dataset(all_training);
+  }
+  if (max_shift > 0) {
+    // train on shifted views of the training images (see dataset_augment())
+    Dataset *augmented = dataset_augment(training_data, max_shift);
+    if (augmented != NULL) {
+      free_dataset(training_data);
+      training_data = augmented;
+    }
+  }
+  if (features) {
+    // every image the trees see is expanded with its derived features
+    training_data = expand_features(training_data);
+    testing_data = expand_features(testing_data);
+    calibration_data = expand_features(calibration_data);
+    validation_data = expand_features(validation_data);
+  }
+
+  DTTuning *tuning = NULL;
+  if (profile_file != NULL) {
+    tuning = dt_autotune(training_data, &params, profile_file);
+    params.tuning = tuning;
+    fprintf(stderr, "autotune: bitsets from %d images, image-major histograms from %d images\n",
+            tuning -> profile.bitset_min_items, tuning -> profile.image_major_min_items);
+  }
+
+  if (oblivious_depth >= 0) {
+    // build oblivious tree with training data and evaluate it in batch
+    ObliviousTree *tree = build_oblivious_tree(training_data, &params, oblivious_depth);
+    if (tree != NULL) {
+      total_correct = oblivious_evaluate(tree, testing_data);
+      free_oblivious_tree(tree);
+    } else {
+      status = 1;
+    }
+  } else if (num_trees > 0) {
+    // build a forest on bootstrap samples of the training data, and time its tiles
+    Forest *forest = build_forest(training_data, &params, num_trees, 0, 1);
+    if (forest == NULL) {
+      status = 1;
+    } else {
+      forest_tune(forest, training_data);
+      if (cascade_depth >= 0) {
+        total_correct = evaluate_cascade(training_data, calibration_data, &params, cascade_depth, NULL, forest,
+                                         cascade_loss, testing_data);
+      } else {
+        uint64_t start = now_ns();
+        total_correct = forest_evaluate(forest, testing_data);
+        double ns = (double) (now_ns() - start);
+        fprintf(stderr, "forest: %d trees, %d nodes, tiles of %d trees x %d images, %.0f ns/image\n",
+                forest -> num_trees, forest -> num_nodes, forest -> tree_block, forest -> image_block,
+                ns / testing_data -> num_items);
+      }
+      free_forest(forest);
+    }
+  } else {
+    // build decision tree with training data
+    DTNode *training_root;
+    if (resume) {
+      training_root = resume_dec_tree(training_data, &params, checkpoint_file, checkpoint_interval);
+      if (training_root == NULL) {
+        free_dataset(training_data);
+        if (calibration_data != NULL) {
+          free_dataset(calibration_data);
+        }
+        if (testing_data != NULL) {
+          free_dataset(testing_data);
+        }
+        return 1;
+      }
+    } else if (patience >= 0) {
+      training_root = build_dec_tree_levelwise(training_data, validation_data, &params, patience, level_mode,
+                                               stderr);
+      fprintf(stderr, "levelwise: %d nodes, depth %d\n", dec_tree_num_nodes(training_root),
+              dec_tree_depth(training_root));
+    } else if (checkpoint_file != NULL) {
+      training_root = build_dec_tree_checkpointed(training_data, &params, checkpoint_file, checkpoint_interval);
+    } else {
+      training_root = build_dec_tree_params(training_data, &params);
+    }
+    if (model_file != NULL) {
+      dec_tree_save_model(training_root, model_file);
+    }
+
+    if (cascade_depth >= 0) {
+      // put a calibrated shallow tree in front of it
+      total_correct = evaluate_cascade(training_data, calibration_data, &params, cascade_depth, training_root,
+                                       NULL, cascade_loss, testing_data);
+    } else {
+      // for each test image, compare predicted label and real label
+      total_correct = evaluate_dec_tree(training_root, training_data, testing_data, 
+                                        num_files == 2 ? files[1] : NULL, test_form, cache_size);
+      if (total_correct < 0) {
+        status = 1;
+        total_correct = 0;
+      }
+    }
+
+    free_dec_tree(training_root);
+  }
+
+  // free all dynamically allocated data
+  if (tuning != NULL) {
+    free_dt_tuning(tuning);
+  }
+  free_dataset(training_data);
+  if (calibration_data != NULL) {
+    free_dataset(calibration_data);
+  }
+  if (validation_data != NULL) {
+    free_dataset(validation_data);
+  }
+  if (testing_data != NULL) {
+    free_dataset(testing_data);
+  }
+  if (pool_stats(NULL, 0) > 0) {
+    pool_print_stats(stderr);
+    pool_shutdown();
+  }
+
+  // Print out answer
+  printf("%d\n", total_correct);
+  return status;
+}
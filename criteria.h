@@ -0,0 +1,153 @@
+#pragma once
+
+/**
+ * Split criteria. Each criterion is described by its per-class impurity term
+ * TERM(p), where p is the (weighted) fraction of a side of the split that has
+ * a given label, and by whether labels are weighted by `class_weights`:
+ *
+ *      impurity(side) = sum over labels of TERM(p)
+ *      score(split)   = weighted average of the impurity of the two sides
+ *
+ * The split searches are generated once per criterion by `DEFINE_SPLIT_SEARCH`
+ * (instantiated in dectree.c for every entry of `SPLIT_CRITERIA`), so each
+ * criterion gets its own copy of the search loops with TERM inlined and the
+ * weights folded away when unused. `find_best_split()` picks the copy once per
+ * node; there is no indirect call in the loops themselves.
+ *
+ * To add a criterion: add its value to `SplitCriterion` (dectree.h) and a line
+ * to `SPLIT_CRITERIA` below.
+ */
+
+#define GINI_TERM(p)    ((p) * (1 - (p)))
+#define ENTROPY_TERM(p) ((p) > 0 ? -(p) * log2(p) : 0.0)
+
+/*  X(name,           enum value,                term,         weighted) */
+#define SPLIT_CRITERIA(X)                                                    \
+    X(gini,           CRITERION_GINI,            GINI_TERM,    0)            \
+    X(entropy,        CRITERION_ENTROPY,         ENTROPY_TERM, 0)            \
+    X(weighted_gini,  CRITERION_WEIGHTED_GINI,   GINI_TERM,    1)
+
+/**
+ * Generate, for criterion NAME:
+ *
+ *  - NAME_pixel_scores(): given the label frequencies of the images on the
+ *    right side (color >= BINARY_THRESHOLD) of every pixel, laid out 
+ *    label-major as right_freq[label][pixel], store in scores[pixel] the score
+ *    of splitting on each pixel. An empty side contributes nothing, so a pixel
+ *    that does not separate the images scores the impurity of the unsplit 
+ *    set. The loops run across pixels so they vectorize.
+ *
+ *  - NAME_best_threshold(): the grayscale search. Builds the (bin, label)
+ *    histogram of each pixel with `fill_pixel_histogram()`, or of all pixels
+ *    at once with `fill_all_histograms()` for nodes `tuning` deems large (see
+ *    autotune.h), one label segment at a time when the images are grouped by
+ *    label (`segments` not NULL), and scans the bins with prefix sums to score every
+ *    threshold of the pixel. Returns -1 if no
+ *    threshold has two non-empty sides, and breaks ties towards the smallest
+ *    pixel, then the smallest threshold.
+ */
+#define DEFINE_SPLIT_SEARCH(NAME, ENUM, TERM, WEIGHTED)                                 \
+static void NAME##_pixel_scores(int (*right_freq)[NUM_PIXELS], const int *total_freq,  \
+                                const double *weights, double *scores) {                \
+    double a_n[NUM_PIXELS] = {0}, b_n[NUM_PIXELS] = {0};                                \
+    double a_sum[NUM_PIXELS] = {0}, b_sum[NUM_PIXELS] = {0};                            \
+                                                                                        \
+    for (int k = 0; k < 10; k++) {                                                      \
+        double w = (WEIGHTED) ? weights[k] : 1.0;                                       \
+        for (int p = 0; p < NUM_PIXELS; p++) {                                          \
+            b_n[p] += w * right_freq[k][p];                                             \
+            a_n[p] += w * (total_freq[k] - right_freq[k][p]);                           \
+        }                                                                               \
+    }                                                                                   \
+    for (int k = 0; k < 10; k++) {                                                      \
+        double w = (WEIGHTED) ? weights[k] : 1.0;                                       \
+        for (int p = 0; p < NUM_PIXELS; p++) {                                          \
+            double a_i = a_n[p] > 0 ? w * (total_freq[k] - right_freq[k][p]) / a_n[p] : 0; \
+            double b_i = b_n[p] > 0 ? w * right_freq[k][p] / b_n[p] : 0;                \
+            a_sum[p] += TERM(a_i);                                                      \
+            b_sum[p] += TERM(b_i);                                                      \
+        }                                                                               \
+    }                                                                                   \
+    for (int p = 0; p < NUM_PIXELS; p++) {                                              \
+        scores[p] = (a_sum[p] * a_n[p] + b_sum[p] * b_n[p]) / (a_n[p] + b_n[p]);        \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline double NAME##_split_score(const int *a_freq, const int *b_freq,          \
+                                        const double *weights) {                        \
+    double a_n = 0, b_n = 0, a_sum = 0, b_sum = 0;                                      \
+    for (int k = 0; k < 10; k++) {                                                      \
+        double w = (WEIGHTED) ? weights[k] : 1.0;                                       \
+        a_n += w * a_freq[k];                                                           \
+        b_n += w * b_freq[k];                                                           \
+    }                                                                                   \
+    for (int k = 0; k < 10; k++) {                                                      \
+        double w = (WEIGHTED) ? weights[k] : 1.0;                                       \
+        double a_i = w * a_freq[k] / a_n;                                               \
+        double b_i = w * b_freq[k] / b_n;                                               \
+        a_sum += TERM(a_i);                                                             \
+        b_sum += TERM(b_i);                                                             \
+    }                                                                                   \
+    return (a_sum * a_n + b_sum * b_n) / (a_n + b_n);                                   \
+}                                                                                       \
+                                                                                        \
+static int NAME##_best_threshold(Dataset *data, int M, int *indices,                   \
+                                 const int *segments, int bins,                         \
+                                 const double *weights, DTTuning *tuning,               \
+                                 int *threshold) {                                      \
+    int local_hist[256][10];                                                            \
+    int local_bin_count[256] = {0};                                                     \
+    int total_freq[10];                                                                 \
+    double min_score = INFINITY;                                                        \
+    int best_split = -1;                                                                \
+                                                                                        \
+    memset(local_hist, 0, sizeof(local_hist));                                          \
+    label_frequencies(data, M, indices, segments, total_freq);                          \
+    int image_major = dt_tuning_use_image_major(tuning, data, M)                        \
+                      && dt_tuning_claim_histograms(tuning);                            \
+    if (image_major) {                                                                  \
+        fill_all_histograms(data, M, indices, segments, bins, tuning -> all_hist,       \
+                            tuning -> all_bin_count);                                   \
+    }                                                                                   \
+                                                                                        \
+    for (int pixel = 0; pixel < NUM_PIXELS; pixel++) {                                  \
+        int (*hist)[10] = local_hist;                                                   \
+        int *bin_count = local_bin_count;                                               \
+        if (image_major) {                                                              \
+            hist = tuning -> all_hist[pixel];                                           \
+            bin_count = tuning -> all_bin_count[pixel];                                 \
+        } else {                                                                        \
+            fill_pixel_histogram(data, M, indices, segments, pixel, bins, hist,         \
+                                 bin_count);                                            \
+        }                                                                               \
+                                                                                        \
+        /* scan the thresholds, moving one bin at a time to the left side */            \
+        int a_freq[10] = {0}, a_count = 0;                                              \
+        for (int bin = 0; bin < bins - 1; bin++) {                                      \
+            if (bin_count[bin] == 0) { /* same split as the previous threshold */       \
+                continue;                                                               \
+            }                                                                           \
+            a_count += bin_count[bin];                                                  \
+            int b_freq[10];                                                             \
+            for (int k = 0; k < 10; k++) {                                              \
+                a_freq[k] += hist[bin][k];                                              \
+                b_freq[k] = total_freq[k] - a_freq[k];                                  \
+            }                                                                           \
+            if (a_count == M) { /* every remaining bin is empty */                      \
+                break;                                                                  \
+            }                                                                           \
+            double score = NAME##_split_score(a_freq, b_freq, weights);                 \
+            if (score < min_score) {                                                    \
+                min_score = score;                                                      \
+                best_split = pixel;                                                     \
+                /* smallest color value that falls in bin + 1 */                        \
+                *threshold = ((bin + 1) * 256 + bins - 1) / bins;                       \
+            }                                                                           \
+        }                                                                               \
+        clear_pixel_histogram(bins, hist, bin_count);                                   \
+    }                                                                                   \
+    if (image_major) {                                                                  \
+        dt_tuning_release_histograms(tuning);                                           \
+    }                                                                                   \
+    return best_split;                                                                  \
+}
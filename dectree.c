@@ -1,4 +1,106 @@
+#include <unistd.h>
+
+#include "autotune.h"
 #include "dectree.h"
+#include "criteria.h"
+#include "features.h"
+#include "pool.h"
+
+/**
+ * Allocate a Dataset of `num_items` images of `sx * sy` pixels each, with
+ * uninitialized labels and pixel data. The pixel data of all images is one
+ * contiguous buffer, image i starting at `pixels + i * sx * sy`. Return NULL
+ * if memory runs out.
+ */
+Dataset *alloc_dataset(int num_items, int sx, int sy) {
+    // allocate memory for a Dataset struct
+    Dataset *data_set_ptr = malloc(sizeof(Dataset)); 
+    // check if memory allocation for data_set_ptr was successful
+    if (data_set_ptr == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    
+    // a base dataset owns its storage and starts with a single reference
+    data_set_ptr -> num_items = num_items;
+    data_set_ptr -> refs = 1;
+    data_set_ptr -> num_bases = 0;
+    data_set_ptr -> bases = NULL;
+    data_set_ptr -> owns_items = 1;
+
+    // allocate memory for image, label and pixel arrays
+    size_t image_size = (size_t) sx * sy;
+    data_set_ptr -> images = malloc(sizeof(Image) * num_items);
+    data_set_ptr -> labels = malloc(sizeof(unsigned char) * num_items);
+    data_set_ptr -> pixels = malloc(sizeof(unsigned char) * image_size * num_items);
+    // check if memory allocation was successful
+    if ((data_set_ptr -> images == NULL || data_set_ptr -> labels == NULL || data_set_ptr -> pixels == NULL)
+            && image_size * num_items > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(data_set_ptr -> images);
+        free(data_set_ptr -> labels);
+        free(data_set_ptr -> pixels);
+        free(data_set_ptr);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_items; i++) {
+        data_set_ptr -> images[i].sx = sx;
+        data_set_ptr -> images[i].sy = sy;
+        data_set_ptr -> images[i].data = data_set_ptr -> pixels + image_size * i;
+        data_set_ptr -> images[i].dx = 0;
+        data_set_ptr -> images[i].dy = 0;
+    }
+    return data_set_ptr;
+}
+
+/* The records of images [start, end) of a file, for load_range() */
+typedef struct {
+    int fd;
+    Dataset *data;
+    int failed;     // Set when a range could not be loaded
+    int truncated;  // Set when the file ends before a record
+} LoadJob;
+
+/**
+ * Helper for load_dataset. Read the records of images [start, end), LOAD_CHUNK
+ * at a time, and split each into its label and pixel data.
+ */
+static void load_range(void *arg, int start, int end) {
+    LoadJob *job = arg;
+    const size_t record_size = 1 + NUM_PIXELS;
+    int chunk = end - start < LOAD_CHUNK ? end - start : LOAD_CHUNK;
+    unsigned char *records = malloc(record_size * chunk);
+    if (records == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        __atomic_store_n(&(job -> failed), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int first = start; first < end; first += chunk) {
+        int count = end - first < chunk ? end - first : chunk;
+        // pread does not move the file offset, so ranges can be read concurrently
+        size_t size = record_size * count, done = 0;
+        off_t offset = sizeof(int) + (off_t) record_size * first;
+        while (done < size) {
+            ssize_t got = pread(job -> fd, records + done, size - done, offset + done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+        if (done < size) {
+            __atomic_store_n(&(job -> failed), 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(job -> truncated), 1, __ATOMIC_RELAXED);
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            job -> data -> labels[first + i] = records[record_size * i];
+            memcpy(job -> data -> images[first + i].data, records + record_size * i + 1, NUM_PIXELS);
+        }
+    }
+    free(records);
+}
 
 /**
  * Load the binary file, filename into a Dataset and return a pointer to 
@@ -11,6 +113,9 @@
  *     -   1 byte  : Image N label
  *     - NUM_PIXELS bytes : Image N data (WIDTHxWIDTH)
  *
+ * The records are read in ranges of images by the thread pool (see pool.h).
+ * Return NULL if the file cannot be opened, holds fewer records than it
+ * announces or memory runs out.
  */
 Dataset *load_dataset(const char *filename) {
     // open binary file
@@ -19,39 +124,29 @@ Dataset *load_dataset(const char *filename) {
     // error check if file opened correctly
     if (data_file == NULL) {
         fprintf(stderr, "Error: could not open file\n");
+        return NULL;
     }
 
-    // allocate memory for a Dataset struct
-    Dataset *data_set_ptr = NULL;
-    data_set_ptr = malloc(sizeof(Dataset)); 
-    // check if memory allocation for data_set_ptr was successful
-    if (data_set_ptr == NULL) {
-        fprintf(stderr, "Error: memory allocation\n");
+    // read total number of images in the dataset
+    int total_images = 0;
+    if (fread(&total_images, sizeof(int), 1, data_file) != 1 || total_images < 0) {
+        fprintf(stderr, "Error: %s is truncated\n", filename);
+        fclose(data_file);
+        return NULL;
     }
-    
-    // set total number of images in the dataset
-    int *total_images = malloc(sizeof(int));
-    fread(total_images, sizeof(int), 1, data_file);
-    data_set_ptr -> num_items = (*total_images); 
-    free(total_images);
-
-    // allocate memory for image and label arrays
-    data_set_ptr -> images = malloc(sizeof(Image) * (data_set_ptr -> num_items));
-    data_set_ptr -> labels = malloc(sizeof(unsigned char) * (data_set_ptr -> num_items));
-    // check if memory allocation was successful
-    if (data_set_ptr -> images == NULL || data_set_ptr -> labels == NULL) {
-        fprintf(stderr, "Error: memory allocation\n");
+
+    // allocate the Dataset with its image and label arrays
+    Dataset *data_set_ptr = alloc_dataset(total_images, WIDTH, WIDTH);
+    if (data_set_ptr == NULL) {
+        fclose(data_file);
+        return NULL;
     }
     
     // set array variables for data_set_ptr
-    for (int i = 0; i < (data_set_ptr -> num_items); i++) {
-        // read in image label
-        fread((data_set_ptr -> labels) + (i * sizeof(unsigned char)), sizeof(unsigned char), 1, data_file);
-        // set struct values and read in image pixel values 
-        (data_set_ptr -> images)[i].sx = WIDTH;
-        (data_set_ptr -> images)[i].sy = WIDTH;
-        (data_set_ptr -> images)[i].data = malloc(sizeof(unsigned char) * (WIDTH * WIDTH));
-        fread(data_set_ptr -> images[i].data, sizeof(unsigned char), NUM_PIXELS, data_file);
+    LoadJob job = {fileno(data_file), data_set_ptr, 0, 0};
+    pool_parallel_for(0, data_set_ptr -> num_items, LOAD_CHUNK, load_range, &job);
+    if (job.truncated) {
+        fprintf(stderr, "Error: %s is truncated\n", filename);
     }
 
     // close binary file
@@ -60,48 +155,218 @@ Dataset *load_dataset(const char *filename) {
         fprintf(stderr, "Error: fclose failed\n");
     }
 
+    if (job.failed) {
+        free_dataset(data_set_ptr);
+        return NULL;
+    }
     return data_set_ptr;
 }
 
 /**
- * Compute and return the Gini impurity of M images at a given pixel
- * The M images to analyze are identified by the indices array. The M
- * elements of the indices array are indices into data.
- * This is the objective function used to identify the best 
- * pixel on which to split the dataset when building the decision tree.
- *
- * Note that the gini_impurity implemented here can evaluate to NAN 
- * (Not A Number) and will return that value. Ensure that a pixel whose 
- * gini_impurity evaluates to NAN is not used to split the data.  (see find_best_split)
- * 
+ * Take an additional reference on `data` and return it. Every reference must be
+ * dropped with `free_dataset()`; the storage is released with the last one.
  */
-double gini_impurity(Dataset *data, int M, int *indices, int pixel) {
-    int a_freq[10] = {0}, a_count = 0;
-    int b_freq[10] = {0}, b_count = 0;
+Dataset *dataset_retain(Dataset *data) {
+    __atomic_add_fetch(&(data -> refs), 1, __ATOMIC_RELAXED);
+    return data;
+}
 
+/**
+ * Helper for the view constructors. Allocate an empty view of `num_items` items
+ * over the `num_bases` datasets in `bases`, retaining each of them. When
+ * `owns_items` is set, the `images` and `labels` arrays are allocated for the
+ * view (they hold Image headers only, the pixel data stays with the bases).
+ */
+static Dataset *new_view(int num_items, Dataset **bases, int num_bases, int owns_items) {
+    Dataset *view = malloc(sizeof(Dataset));
+    if (view == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    view -> num_items = num_items;
+    view -> refs = 1;
+    view -> num_bases = num_bases;
+    view -> bases = malloc(sizeof(Dataset *) * num_bases);
+    for (int i = 0; i < num_bases; i++) {
+        view -> bases[i] = dataset_retain(bases[i]);
+    }
+    view -> owns_items = owns_items;
+    view -> pixels = NULL;
+    view -> images = NULL;
+    view -> labels = NULL;
+    if (owns_items) {
+        view -> images = malloc(sizeof(Image) * num_items);
+        view -> labels = malloc(sizeof(unsigned char) * num_items);
+        if (view -> images == NULL || view -> labels == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+        }
+    }
+    return view;
+}
+
+/**
+ * Return a view of the `count` consecutive items of `base` starting at `start`.
+ * The view points straight into the arrays of `base`, so it costs a single
+ * allocation regardless of `count`.
+ */
+Dataset *dataset_range(Dataset *base, int start, int count) {
+    if (start < 0 || count < 0 || start + count > base -> num_items) {
+        fprintf(stderr, "Error: range [%d, %d) out of bounds\n", start, start + count);
+        return NULL;
+    }
+    Dataset *view = new_view(count, &base, 1, 0);
+    view -> images = base -> images + start;
+    view -> labels = base -> labels + start;
+    return view;
+}
+
+/**
+ * Return a view of the M items of `base` identified by the indices array. 
+ * Indices may repeat (as for bootstrap samples). Only the Image headers and
+ * labels are gathered; the pixel data is shared with `base`.
+ */
+Dataset *dataset_subset(Dataset *base, int M, const int *indices) {
+    Dataset *view = new_view(M, &base, 1, 1);
     for (int i = 0; i < M; i++) {
-        int img_idx = indices[i];
+        int index = indices[i];
+        view -> images[i] = base -> images[index];
+        view -> labels[i] = base -> labels[index];
+    }
+    return view;
+}
 
-        // The pixels are always either 0 or 255, but using < 128 for generality.
-        if (data->images[img_idx].data[pixel] < 128) {
-            a_freq[data->labels[img_idx]]++;
-            a_count++;
-        } else {
-            b_freq[data->labels[img_idx]]++;
-            b_count++;
+/**
+ * Return a view of the concatenation of the `num_parts` datasets in `parts`.
+ */
+Dataset *dataset_concat(Dataset **parts, int num_parts) {
+    int total = 0;
+    for (int i = 0; i < num_parts; i++) {
+        total += parts[i] -> num_items;
+    }
+
+    Dataset *view = new_view(total, parts, num_parts, 1);
+    int offset = 0;
+    for (int i = 0; i < num_parts; i++) {
+        int n = parts[i] -> num_items;
+        memcpy(view -> images + offset, parts[i] -> images, sizeof(Image) * n);
+        memcpy(view -> labels + offset, parts[i] -> labels, sizeof(unsigned char) * n);
+        offset += n;
+    }
+    return view;
+}
+
+/**
+ * Split `data` into `k` contiguous folds and store in `*test` a view of fold
+ * number `fold` and in `*train` a view of the remaining k - 1 folds. 
+ * With k = 2 and fold = 1 this is a plain holdout split.
+ */
+void dataset_fold(Dataset *data, int k, int fold, Dataset **train, Dataset **test) {
+    int N = data -> num_items;
+    int start = (int) ((long) N * fold / k);
+    int end = (int) ((long) N * (fold + 1) / k);
+
+    *test = dataset_range(data, start, end - start);
+
+    Dataset *before = dataset_range(data, 0, start);
+    Dataset *after = dataset_range(data, end, N - end);
+    Dataset *parts[2] = {before, after};
+    *train = dataset_concat(parts, 2);
+    // the concatenation holds its own references to the two ranges
+    free_dataset(before);
+    free_dataset(after);
+}
+
+/**
+ * Return a bootstrap sample of M items drawn with replacement from `data`, 
+ * as used for bagging. The same seed always produces the same sample. An
+ * empty dataset gives an empty sample.
+ */
+Dataset *dataset_bootstrap(Dataset *data, int M, unsigned int seed) {
+    if (data -> num_items == 0) { // nothing to draw from
+        return dataset_range(data, 0, 0);
+    }
+    int *indices = malloc(sizeof(int) * (M + 1));
+    if (indices == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    for (int i = 0; i < M; i++) {
+        indices[i] = rand_r(&seed) % data -> num_items;
+    }
+    Dataset *view = dataset_subset(data, M, indices);
+    free(indices);
+    return view;
+}
+
+/**
+ * Return a view of `base` augmented with every shift of up to `max_shift`
+ * pixels in each direction: (2 * max_shift + 1)^2 items per image of `base`,
+ * item `i * shifts + s` being image i shifted by shift number s (shift 0 
+ * first). The items only hold an Image header with the shift (see 
+ * `image_pixel()`), so training on the view reads the pixels of `base`
+ * translated on the fly and never stores a shifted copy.
+ */
+Dataset *dataset_augment(Dataset *base, int max_shift) {
+    if (max_shift < 0 || max_shift >= WIDTH) {
+        fprintf(stderr, "Error: shift of %d pixels out of bounds\n", max_shift);
+        return NULL;
+    }
+    int side = 2 * max_shift + 1;
+    int shifts = side * side;
+    Dataset *view = new_view(base -> num_items * shifts, &base, 1, 1);
+    for (int i = 0; i < base -> num_items; i++) {
+        for (int s = 0; s < shifts; s++) {
+            // shift 0 is (0, 0), then the others in row order
+            int k = s == 0 ? shifts / 2 : (s <= shifts / 2 ? s - 1 : s);
+            Image *img = &(view -> images[i * shifts + s]);
+            *img = base -> images[i];
+            img -> dx += k % side - max_shift;
+            img -> dy += k / side - max_shift;
+            view -> labels[i * shifts + s] = base -> labels[i];
         }
     }
+    return view;
+}
 
-    double a_gini = 0, b_gini = 0;
-    for (int i = 0; i < 10; i++) {
-        double a_i = ((double)a_freq[i]) / ((double)a_count);
-        double b_i = ((double)b_freq[i]) / ((double)b_count);
-        a_gini += a_i * (1 - a_i);
-        b_gini += b_i * (1 - b_i);
+/**
+ * Store the NUM_PIXELS pixels of the image, with its shift applied, in
+ * `pixels`.
+ */
+void image_read(const Image *img, unsigned char *pixels) {
+    if ((img -> dx | img -> dy) == 0) {
+        memcpy(pixels, img -> data, (size_t) img -> sx * img -> sy);
+        return;
+    }
+    // copy the part of each row that stays inside the image, blank the rest
+    int sx = img -> sx, sy = img -> sy, dx = img -> dx;
+    memset(pixels, 0, (size_t) sx * sy);
+    int x_start = dx > 0 ? dx : 0;
+    int x_end = dx < 0 ? sx + dx : sx;
+    for (int y = 0; y < sy && x_start < x_end; y++) {
+        int source_y = y - img -> dy;
+        if (source_y >= 0 && source_y < sy) {
+            memcpy(pixels + y * sx + x_start, img -> data + source_y * sx + x_start - dx, x_end - x_start);
+        }
     }
+}
 
-    // Weighted average of gini impurity of children
-    return (a_gini * a_count + b_gini * b_count) / M;
+/**
+ * Return a 64-bit hash of the labels and pixels (shifts applied) of the items
+ * of `data`, in order. Pixels are mixed in 8 at a time, FNV-1a style.
+ */
+uint64_t dataset_hash(Dataset *data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t words[(NUM_PIXELS + 7) / 8];
+    for (int i = 0; i < data -> num_items; i++) {
+        words[(NUM_PIXELS + 7) / 8 - 1] = 0;
+        image_read(&(data -> images[i]), (unsigned char *) words);
+        hash = (hash ^ data -> labels[i]) * 0x100000001b3ULL;
+        for (int w = 0; w < (NUM_PIXELS + 7) / 8; w++) {
+            hash = (hash ^ words[w]) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+    }
+    return hash;
 }
 
 /**
@@ -143,57 +408,553 @@ void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq
     
 }
 
+/**
+ * Like `get_most_frequent()`, for images grouped by label (see
+ * `dataset_group_labels()`): the frequencies are the segment lengths.
+ */
+void get_most_frequent_grouped(const int *segments, int *label, int *freq) {
+    *label = 0;
+    *freq = segments[1] - segments[0];
+    for (int k = 1; k < 10; k++) {
+        if (segments[k + 1] - segments[k] > *freq) { // strict, so ties keep the smaller label
+            *label = k;
+            *freq = segments[k + 1] - segments[k];
+        }
+    }
+}
+
+/**
+ * Group the M images in `indices` by label: reorder them (stably, and only if
+ * they are not grouped already) so that indices[segments[k]] to
+ * indices[segments[k + 1] - 1] are the images of label k, and store the 11
+ * segment offsets in `segments` (segments[10] is M).
+ *
+ * A stable split of grouped images leaves both sides grouped, so the builder
+ * groups the root once and carries the offsets down the tree.
+ */
+void dataset_group_labels(Dataset *data, int M, int *indices, int *segments) {
+    int counts[10] = {0};
+    int grouped = 1, previous = 0;
+    for (int i = 0; i < M; i++) {
+        int label = data -> labels[indices[i]];
+        counts[label]++;
+        grouped &= label >= previous;
+        previous = label;
+    }
+    segments[0] = 0;
+    for (int k = 0; k < 10; k++) {
+        segments[k + 1] = segments[k] + counts[k];
+    }
+    if (grouped) {
+        return;
+    }
+
+    int *sorted = malloc(sizeof(int) * (M + 1));
+    int next[10];
+    memcpy(next, segments, sizeof(next));
+    for (int i = 0; i < M; i++) {
+        sorted[next[data -> labels[indices[i]]]++] = indices[i];
+    }
+    memcpy(indices, sorted, sizeof(int) * M);
+    free(sorted);
+}
+
+/**
+ * Helper for the split searches. Store the label frequencies of the M images
+ * in `freq`: the segment lengths if they are grouped by label, otherwise by
+ * looking up every label.
+ */
+static void label_frequencies(Dataset *data, int M, const int *indices, const int *segments, int *freq) {
+    if (segments != NULL) {
+        for (int k = 0; k < 10; k++) {
+            freq[k] = segments[k + 1] - segments[k];
+        }
+        return;
+    }
+    memset(freq, 0, sizeof(int) * 10);
+    for (int i = 0; i < M; i++) {
+        freq[data->labels[indices[i]]]++;
+    }
+}
+
+/**
+ * Helper for count_right_labels. Add the comparisons of the shifted image to
+ * the counts in `row`. A shift is a constant offset in the flat pixel array,
+ * so the image is read in one scan like an unshifted one; the pixels that 
+ * scan carries over from the neighbouring row are then taken back out. Pixels
+ * shifted in from outside the image are blank and never reach BINARY_THRESHOLD.
+ */
+static void add_shifted_image(const Image *img, int *row) {
+    int dx = img -> dx;
+    int offset = img -> dy * WIDTH + dx;
+    int start = offset > 0 ? offset : 0;
+    int end = offset < 0 ? NUM_PIXELS + offset : NUM_PIXELS;
+    const unsigned char *source = img -> data;
+    const unsigned char *read = source + (start - offset);
+    int *write = row + start;
+    int p = 0;
+    for (; p + 16 <= end - start; p += 16) { // fixed-length blocks vectorize
+        for (int k = 0; k < 16; k++) {
+            write[p + k] += read[p + k] >= BINARY_THRESHOLD;
+        }
+    }
+    for (; p < end - start; p++) {
+        write[p] += read[p] >= BINARY_THRESHOLD;
+    }
+
+    // the first dx (or last -dx) columns wrapped around from another row
+    int wrap_start = dx > 0 ? 0 : WIDTH + dx;
+    int wrap_end = dx > 0 ? dx : WIDTH;
+    for (int y = 0; y < WIDTH; y++) {
+        for (int x = wrap_start; x < wrap_end; x++) {
+            int p = y * WIDTH + x;
+            if (p >= start && p < end) {
+                row[p] -= source[p - offset] >= BINARY_THRESHOLD;
+            }
+        }
+    }
+}
+
+/**
+ * Helper for the split searches. Given the right-side label frequencies of
+ * every pixel (and the label segments of the images, or NULL), store the label frequencies of all M images in `total_freq` and
+ * the number of images on the right side of each pixel in `right_count`.
+ */
+static void sum_right_labels(Dataset *data, int M, int *indices, const int *segments,
+                             int (*right_freq)[NUM_PIXELS], int *total_freq, int *right_count) {
+    label_frequencies(data, M, indices, segments, total_freq);
+    memset(right_count, 0, sizeof(int) * NUM_PIXELS);
+    for (int k = 0; k < 10; k++) {
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            right_count[p] += right_freq[k][p];
+        }
+    }
+}
+
+/**
+ * Helper for add_right_labels. Add the comparisons of one image to `row`, or
+ * with `features` set, those of its derived features (see features.h).
+ */
+static inline void add_image(const Image *img, int *row, int features) {
+    if (features) { // expanded images are never shifted
+        const unsigned char *derived = img -> data + NUM_PIXELS;
+        for (int f = 0; f < DERIVED_FEATURES; f++) {
+            row[f] += derived[f] >= BINARY_THRESHOLD;
+        }
+    } else if ((img -> dx | img -> dy) != 0) {
+        add_shifted_image(img, row);
+    } else {
+        const unsigned char *pixels = img -> data;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            row[p] += pixels[p] >= BINARY_THRESHOLD;
+        }
+    }
+}
+
+/**
+ * Helper for count_right_labels. Add the comparisons of images indices[start]
+ * to indices[end - 1] to the rows of their labels in `right_freq`.
+ *
+ * Each image is read once, front to back, and its comparisons are added to 
+ * the row of its label, which the compiler vectorizes. Shifted images are
+ * read the same way (see `add_shifted_image()`). Images grouped by label are
+ * counted one segment at a time into the same row, without looking up labels.
+ */
+static void add_right_labels(Dataset *data, int start, int end, const int *indices,
+                             const int *segments, int features, int (*right_freq)[NUM_PIXELS]) {
+    if (segments == NULL) {
+        for (int i = start; i < end; i++) {
+            int img_idx = indices[i];
+            add_image(&(data->images[img_idx]), right_freq[data->labels[img_idx]], features);
+        }
+        return;
+    }
+    for (int k = 0; k < 10; k++) {
+        int first = segments[k] > start ? segments[k] : start;
+        int last = segments[k + 1] < end ? segments[k + 1] : end;
+        int *row = right_freq[k];
+        for (int i = first; i < last; i++) {
+            add_image(&(data->images[indices[i]]), row, features);
+        }
+    }
+}
+
+/* A split count cut in ranges of PARALLEL_COUNT_ITEMS images, for count_ranges() */
+typedef struct {
+    Dataset *data;
+    int M;
+    const int *indices;
+    const int *segments;
+    int features;                       // 1 to count the derived features instead of the pixels
+    const uint16_t (*votes)[10];        // (Soft labels) Votes of each item, or NULL, see add_soft_labels()
+    int (*partials)[10][NUM_PIXELS];    // Counts of each range
+} CountJob;
+
+/**
+ * Helper for the soft-label split search. Add the comparisons of images
+ * indices[start] to indices[end - 1] to `right_freq`, each image weighted by
+ * its votes: it adds votes[index][k] to right_freq[k][p] for every pixel p
+ * where its color is >= BINARY_THRESHOLD. Labels without votes are skipped.
+ */
+static void add_soft_labels(Dataset *data, int start, int end, const int *indices,
+                            const uint16_t (*votes)[10], int (*right_freq)[NUM_PIXELS]) {
+    unsigned char right[NUM_PIXELS];
+    for (int i = start; i < end; i++) {
+        int index = indices[i];
+        image_read(&(data -> images[index]), right);
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            right[p] = right[p] >= BINARY_THRESHOLD;
+        }
+        for (int k = 0; k < 10; k++) {
+            int weight = votes[index][k];
+            if (weight == 0) {
+                continue;
+            }
+            int *row = right_freq[k];
+            for (int p = 0; p < NUM_PIXELS; p++) {
+                row[p] += weight * right[p];
+            }
+        }
+    }
+}
+
+/* Helper for count_in_ranges. Add the images [first, last) of the job to `right_freq` */
+static void count_range(const CountJob *job, int first, int last, int (*right_freq)[NUM_PIXELS]) {
+    if (job -> votes != NULL) {
+        add_soft_labels(job -> data, first, last, job -> indices, job -> votes, right_freq);
+    } else {
+        add_right_labels(job -> data, first, last, job -> indices, job -> segments, job -> features, right_freq);
+    }
+}
+
+/* Helper for count_in_ranges. Count ranges [start, end) into their partials */
+static void count_ranges(void *arg, int start, int end) {
+    CountJob *job = arg;
+    for (int r = start; r < end; r++) {
+        int first = r * PARALLEL_COUNT_ITEMS;
+        int last = job -> M - first < PARALLEL_COUNT_ITEMS ? job -> M : first + PARALLEL_COUNT_ITEMS;
+        memset(job -> partials[r], 0, sizeof(job -> partials[r]));
+        count_range(job, first, last, job -> partials[r]);
+    }
+}
+
+/**
+ * Helper for the split searches. Fill `right_freq` with the counts of the
+ * images of `job`. With a thread pool, large nodes are counted in ranges of
+ * PARALLEL_COUNT_ITEMS images in parallel, and the counts of the ranges are
+ * summed.
+ */
+static void count_in_ranges(CountJob *job, int (*right_freq)[NUM_PIXELS]) {
+    memset(right_freq, 0, sizeof(int) * 10 * NUM_PIXELS);
+    int num_ranges = (job -> M + PARALLEL_COUNT_ITEMS - 1) / PARALLEL_COUNT_ITEMS;
+    if (pool_num_threads() > 1 && num_ranges > 1) {
+        job -> partials = malloc(sizeof(*job -> partials) * num_ranges);
+    }
+    if (job -> partials == NULL) {
+        count_range(job, 0, job -> M, right_freq);
+    } else {
+        pool_parallel_for(0, num_ranges, 1, count_ranges, job);
+        for (int r = 0; r < num_ranges; r++) {
+            for (int k = 0; k < 10; k++) {
+                for (int p = 0; p < NUM_PIXELS; p++) {
+                    right_freq[k][p] += job -> partials[r][k][p];
+                }
+            }
+        }
+        free(job -> partials);
+        job -> partials = NULL;
+    }
+}
+
+/**
+ * Helper for the split searches. For every pixel, count the label frequencies
+ * of the M images whose color at that pixel is >= BINARY_THRESHOLD, and store
+ * them label-major in right_freq[label][pixel]. The label frequencies of all
+ * M images are stored in `total_freq`, and the number of images on the right
+ * side of each pixel in `right_count`. `segments` are the label segments of
+ * the images, or NULL if they are not grouped by label. With `features` set,
+ * column f counts derived feature f instead of pixel f (see features.h), the
+ * columns past DERIVED_FEATURES staying empty.
+ */
+static void count_right_labels(Dataset *data, int M, int *indices, const int *segments, int features,
+                               int (*right_freq)[NUM_PIXELS], int *total_freq, int *right_count) {
+    CountJob job = {data, M, indices, segments, features, NULL, NULL};
+    count_in_ranges(&job, right_freq);
+    sum_right_labels(data, M, indices, segments, right_freq, total_freq, right_count);
+}
+
+/**
+ * Helper for the grayscale split searches. Add the M images to the (bin, label)
+ * histogram of one pixel, with colors grouped into `bins` equal-width bins.
+ * `bin_count` receives the number of images in each bin. Images grouped by
+ * label (`segments` not NULL) are added one label segment at a time.
+ */
+static void fill_pixel_histogram(Dataset *data, int M, int *indices, const int *segments,
+                                 int pixel, int bins, int (*hist)[10], int *bin_count) {
+    if (segments == NULL) {
+        for (int i = 0; i < M; i++) {
+            int img_idx = indices[i];
+            int bin = (image_pixel(&(data->images[img_idx]), pixel) * bins) >> 8;
+            hist[bin][data->labels[img_idx]]++;
+            bin_count[bin]++;
+        }
+        return;
+    }
+    for (int k = 0; k < 10; k++) {
+        for (int i = segments[k]; i < segments[k + 1]; i++) {
+            int bin = (image_pixel(&(data->images[indices[i]]), pixel) * bins) >> 8;
+            hist[bin][k]++;
+            bin_count[bin]++;
+        }
+    }
+}
+
+/**
+ * Helper for the grayscale split searches. Fill the (bin, label) histograms
+ * of every pixel (see `fill_pixel_histogram()`) in a single pass over the M
+ * images, for large nodes (see autotune.h).
+ */
+static void fill_all_histograms(Dataset *data, int M, int *indices, const int *segments, int bins,
+                                int (*all_hist)[256][10], int (*all_bin_count)[256]) {
+    unsigned char pixels[NUM_PIXELS];
+    int label = 0;
+    for (int i = 0; i < M; i++) {
+        int img_idx = indices[i];
+        if (segments == NULL) {
+            label = data->labels[img_idx];
+        } else {
+            while (i >= segments[label + 1]) { // next non-empty segment
+                label++;
+            }
+        }
+        image_read(&(data->images[img_idx]), pixels);
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            all_hist[p][(pixels[p] * bins) >> 8][label]++;
+        }
+    }
+    // the bin counts are summed afterwards, halving the scattered increments
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        for (int bin = 0; bin < bins; bin++) {
+            int count = 0;
+            for (int k = 0; k < 10; k++) {
+                count += all_hist[p][bin][k];
+            }
+            all_bin_count[p][bin] = count;
+        }
+    }
+}
+
+/**
+ * Reset a histogram filled by `fill_pixel_histogram()`, touching only the
+ * bins that received images.
+ */
+static void clear_pixel_histogram(int bins, int (*hist)[10], int *bin_count) {
+    for (int bin = 0; bin < bins; bin++) {
+        if (bin_count[bin] != 0) {
+            memset(hist[bin], 0, sizeof(hist[bin]));
+            bin_count[bin] = 0;
+        }
+    }
+}
+
+// Generate the split searches of every criterion (see criteria.h)
+SPLIT_CRITERIA(DEFINE_SPLIT_SEARCH)
+
+/**
+ * Helper for the binary split searches. Score every column of `right_freq`
+ * with the kernel generated for `params -> criterion`, dispatching once per
+ * node.
+ */
+static void score_right_labels(int (*right_freq)[NUM_PIXELS], const int *total_freq, const DTParams *params,
+                               double *scores) {
+    switch (params -> criterion) {
+#define PIXEL_SCORES_CASE(NAME, ENUM, TERM, WEIGHTED) \
+    case ENUM: NAME##_pixel_scores(right_freq, total_freq, params -> class_weights, scores); return;
+    SPLIT_CRITERIA(PIXEL_SCORES_CASE)
+#undef PIXEL_SCORES_CASE
+    default: gini_pixel_scores(right_freq, total_freq, params -> class_weights, scores);
+    }
+}
+
+/**
+ * Score a binary split (at BINARY_THRESHOLD) of the M images on every pixel 
+ * under `params -> criterion`. The score of pixel p is stored in scores[p] and
+ * the number of images that would go right in right_count[p]. A pixel that 
+ * sends every image the same way scores the impurity of the unsplit images.
+ * `segments` are the label segments of the images (see
+ * `dataset_group_labels()`), or NULL if they are not grouped by label.
+ */
+void pixel_split_scores(Dataset *data, int M, int *indices, const int *segments, const DTParams *params,
+                        double *scores, int *right_count) {
+    int right_freq[10][NUM_PIXELS];
+    int total_freq[10];
+    if (dt_tuning_use_bitset(params -> tuning, data, M)) { // large node: popcount bitsets
+        dt_tuning_count_bitset(params -> tuning, M, indices, segments, right_freq);
+        sum_right_labels(data, M, indices, segments, right_freq, total_freq, right_count);
+    } else {
+        count_right_labels(data, M, indices, segments, 0, right_freq, total_freq, right_count);
+    }
+    score_right_labels(right_freq, total_freq, params, scores);
+}
+
+// the derived features are counted into a table shaped like the pixels' (see feature_split_scores())
+_Static_assert(DERIVED_FEATURES <= NUM_PIXELS, "more derived features than pixels");
+
+/**
+ * Helper for find_best_split. Score a binary split of the M images on every
+ * derived feature (see features.h) the way `pixel_split_scores()` scores the
+ * pixels: the score of feature f is stored in scores[f] and the number of
+ * images that would go right in right_count[f], for f < DERIVED_FEATURES.
+ */
+static void feature_split_scores(Dataset *data, int M, int *indices, const int *segments,
+                                 const DTParams *params, double *scores, int *right_count) {
+    int right_freq[10][NUM_PIXELS];
+    int total_freq[10];
+    count_right_labels(data, M, indices, segments, 1, right_freq, total_freq, right_count);
+    score_right_labels(right_freq, total_freq, params, scores);
+}
+
 /**
  * Given a subset of M images as defined by their indices, find and return
- * the best pixel to split the data. The best pixel is the one which
- * has the minimum Gini impurity as computed by `gini_impurity()` and 
- * is not NAN. 
+ * the best pixel to split the data. The best pixel is the one whose split 
+ * has the minimum score under `params -> criterion` (Gini impurity by 
+ * default), among the splits that leave images on both sides.
+ *
+ * Binary trees split at BINARY_THRESHOLD. In grayscale mode the best threshold
+ * of every pixel is searched as well. Either way, the threshold of the chosen
+ * split is stored in `*threshold`: images with a color < threshold go left.
  * 
  * The return value will be a number between 0-783 (inclusive), representing
- *  the pixel the M images should be split based on.
+ *  the pixel the M images should be split based on, or -1 if every pixel 
+ *  has the same color in all M images (no split is possible). With
+ *  `params -> features`, binary trees also consider the derived features of
+ *  the (expanded) images, returned as NUM_PIXELS + feature (see features.h).
  * 
- * If multiple pixels have the same minimal Gini impurity, return the smallest.
- */
-int find_best_split(Dataset *data, int M, int *indices) {
-    double min_impurity = INFINITY; 
-    int best_split;
-
-    // iterate through all pixels to find the minimum Gini impurity
-    for (int i = 0; i < 784; i++) {
-        double pixel_impurity = gini_impurity(data, M, indices, i);
-        if (pixel_impurity < min_impurity && pixel_impurity != NAN) {
-            best_split = i;
-            min_impurity = pixel_impurity;
-        } else if (pixel_impurity == min_impurity && pixel_impurity != NAN) {
-            if (i < best_split) { // take the smaller pixel if Gini impurity is equal
-                best_split = i;
-                min_impurity = pixel_impurity;
-            }
-        } else {
+ * If multiple pixels have the same minimal score, return the smallest.
+ * `segments` are the label segments of the images, or NULL (see
+ * `pixel_split_scores()`); the split does not depend on them.
+ */
+int find_best_split(Dataset *data, int M, int *indices, const int *segments, const DTParams *params,
+                    int *threshold) {
+    const double *weights = params -> class_weights;
+
+    // grayscale: dispatch once per node to the search generated for the criterion
+    if (params -> grayscale) {
+        int bins = params -> bins < 2 ? 2 : (params -> bins > 256 ? 256 : params -> bins);
+        switch (params -> criterion) {
+#define THRESHOLD_SEARCH_CASE(NAME, ENUM, TERM, WEIGHTED) \
+        case ENUM: return NAME##_best_threshold(data, M, indices, segments, bins, weights, params -> tuning, threshold);
+        SPLIT_CRITERIA(THRESHOLD_SEARCH_CASE)
+#undef THRESHOLD_SEARCH_CASE
+        default: break;
+        }
+        return gini_best_threshold(data, M, indices, segments, bins, weights, params -> tuning, threshold);
+    }
+
+    double scores[NUM_PIXELS];
+    int right_count[NUM_PIXELS];
+    pixel_split_scores(data, M, indices, segments, params, scores, right_count);
+    *threshold = BINARY_THRESHOLD;
+
+    // iterate through all pixels that separate the images to find the minimum score
+    double min_score = INFINITY;
+    int best_split = -1;
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        if (right_count[p] == 0 || right_count[p] == M) { // one side would be empty
             continue;
         }
+        if (scores[p] < min_score) { // strict, so ties keep the smaller pixel
+            min_score = scores[p];
+            best_split = p;
+        }
     }
 
+    // the derived features of expanded images are candidates after the pixels
+    if (params -> features) {
+        feature_split_scores(data, M, indices, segments, params, scores, right_count);
+        for (int f = 0; f < DERIVED_FEATURES; f++) {
+            if (right_count[f] == 0 || right_count[f] == M) {
+                continue;
+            }
+            if (scores[f] < min_score) {
+                min_score = scores[f];
+                best_split = NUM_PIXELS + f;
+            }
+        }
+    }
     return best_split;
 }
 
 /**
- * Helper function for build_subtree. 
- * Splits up the original `indices` array of length M based on whether pixel is less than 128. Updates 'left_size' 
- * and 'right_size' with new sizes of left and right subsets. Returns a nested array, where subsets[0] points to 
- * left node indices (Image indices with pixel value < 128) and subsets[1] points to right node indices 
- * (Image indices with pixel value >= 128).
+ * Find the best binary split (at BINARY_THRESHOLD) of M images with soft
+ * labels: image `index` counts as votes[index][k] images of label k (for
+ * instance the votes of a forest, see forest_vote_batch()), so a side's label
+ * frequencies are the sums of its images' votes and the criterion scores
+ * their mix (soft-label Gini by default). Return the pixel as
+ * `find_best_split()` does, or -1 if no pixel separates the images.
  */
-int **split_data(Dataset *data, int M, int *indices, int pixel, int *left_size, int *right_size) {
-    // iterate through indices and increment size of left or right node array
+int find_best_soft_split(Dataset *data, int M, int *indices, const uint16_t (*votes)[10],
+                         const DTParams *params) {
+    int right_freq[10][NUM_PIXELS];
+    CountJob job = {data, M, indices, NULL, 0, votes, NULL};
+    count_in_ranges(&job, right_freq);
+    int total_freq[10] = {0};
+    int total = 0;
     for (int i = 0; i < M; i++) {
-        int index = indices[i];
-        if (data->images[index].data[pixel] < 128) { // if pixel value < 128, increase size of left node arary.
-            *left_size += 1;
-        } else { // if pixel value >= 128, increase size of right node array.
-            *right_size += 1;
+        for (int k = 0; k < 10; k++) {
+            total_freq[k] += votes[indices[i]][k];
+        }
+    }
+    for (int k = 0; k < 10; k++) {
+        total += total_freq[k];
+    }
+    double scores[NUM_PIXELS];
+    score_right_labels(right_freq, total_freq, params, scores);
+
+    // a side without votes has no images
+    double min_score = INFINITY;
+    int best_split = -1;
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        int right = 0;
+        for (int k = 0; k < 10; k++) {
+            right += right_freq[k][p];
+        }
+        if (right == 0 || right == total) {
+            continue;
         }
+        if (scores[p] < min_score) {
+            min_score = scores[p];
+            best_split = p;
+        }
+    }
+    return best_split;
+}
+
+/**
+ * Helper function for build_subtree. 
+ * Splits up the original `indices` array of length M based on whether pixel is less than threshold. Updates 
+ * 'left_size' and 'right_size' with new sizes of left and right subsets. Returns a nested array, where subsets[0] 
+ * points to left node indices (Image indices with pixel value < threshold) and subsets[1] points to right node 
+ * indices (Image indices with pixel value >= threshold).
+ *
+ * The images are grouped by label along `segments`, and the split is stable, so both subsets stay grouped:
+ * their label segments are stored in `left_segments` and `right_segments`.
+ */
+int **split_data(Dataset *data, int M, int *indices, const int *segments, int pixel, int threshold,
+                 int *left_size, int *right_size, int *left_segments, int *right_segments) {
+    // count the images of each label segment going left
+    for (int k = 0; k < 10; k++) {
+        left_segments[k] = *left_size;
+        right_segments[k] = *right_size;
+        int left = 0;
+        for (int i = segments[k]; i < segments[k + 1]; i++) {
+            left += image_pixel(&(data->images[indices[i]]), pixel) < threshold;
+        }
+        *left_size += left;
+        *right_size += segments[k + 1] - segments[k] - left;
     }
+    left_segments[10] = *left_size;
+    right_segments[10] = *right_size;
 
     int **subsets = malloc(sizeof(int *) * 2); // nested array
     subsets[0] = malloc(sizeof(int) * (*left_size)); // points to array of pixels in left node subset
@@ -204,10 +965,10 @@ int **split_data(Dataset *data, int M, int *indices, int pixel, int *left_size,
     int right_i = 0;
     for (int j = 0; j < M; j++) {
         int index = indices[j];
-        if (data->images[index].data[pixel] < 128) { // if pixel value < 128, add Image index to left subset.
+        if (image_pixel(&(data->images[index]), pixel) < threshold) { // if pixel value < threshold, add Image index to left subset.
             subsets[0][left_i] = index;
             left_i += 1;
-        } else { // if pixel value >= 128, add Image index to right subset.
+        } else { // if pixel value >= threshold, add Image index to right subset.
             subsets[1][right_i] = index;
             right_i += 1;
         }
@@ -216,37 +977,80 @@ int **split_data(Dataset *data, int M, int *indices, int pixel, int *left_size,
     return subsets;
 }
 
+DTNode *build_subtree(Dataset *data, int M, int *indices, const int *segments, const DTParams *params);
+
+/* A subtree to build on the thread pool, see build_subtree_task() */
+typedef struct {
+    Dataset *data;
+    int M;
+    int *indices;
+    const int *segments;
+    const DTParams *params;
+    DTNode *root;       // The built subtree
+} SubtreeJob;
+
+/* Helper for build_subtree. Build the subtree of a SubtreeJob */
+static void build_subtree_task(void *arg) {
+    SubtreeJob *job = arg;
+    job -> root = build_subtree(job -> data, job -> M, job -> indices, job -> segments, job -> params);
+}
+
 /**
  * Create the Decision tree. In each recursive call, consider the subset of the
  * dataset that correspond to the new node. To represent the subset, we pass 
  * an array of indices of these images in the subset of the dataset, along with 
- * its length M. 
+ * its length M. The indices are grouped by label along `segments` (see
+ * `dataset_group_labels()`), so label counts are segment lengths.
+ *
+ * With a thread pool, nodes of at least PARALLEL_MIN_ITEMS images hand their
+ * left subtree to the pool and build the right one themselves. Every node is
+ * built the same way on any thread, so the tree does not depend on the
+ * number of threads.
  */
-DTNode *build_subtree(Dataset *data, int M, int *indices) {
+DTNode *build_subtree(Dataset *data, int M, int *indices, const int *segments, const DTParams *params) {
     // build new node
     DTNode *node = malloc(sizeof(DTNode));
     int *freq = malloc(sizeof(int));
     int *label = malloc(sizeof(int));
-    get_most_frequent(data, M, indices, label, freq);
+    get_most_frequent_grouped(segments, label, freq);
+
+    int pixel_split = -1;
+    int threshold = BINARY_THRESHOLD;
+    if (( (double) *freq / (double) M) < THRESHOLD_RATIO) {
+        pixel_split = find_best_split(data, M, indices, segments, params, &threshold);
+    }
 
-    if (( (double) *freq / (double) M) >= THRESHOLD_RATIO) { // create leaf node 
+    if (pixel_split == -1) { // create leaf node (pure enough, or no pixel separates the images)
         node -> pixel = -1;
+        node -> threshold = 0;
         node -> classification = *label;
         node -> left = NULL;
         node -> right = NULL;
     } else { // create node with left/right children
-        int pixel_split = find_best_split(data, M, indices);
         node -> pixel = pixel_split;
+        node -> threshold = threshold;
         node -> classification = -1;
         // split data using helper function
         int *left_size = malloc(sizeof(int));
         int *right_size = malloc(sizeof(int));
         *left_size = 0;
         *right_size = 0;
-        int **subsets = split_data(data, M, indices, pixel_split, left_size, right_size);
+        int left_segments[11], right_segments[11];
+        int **subsets = split_data(data, M, indices, segments, pixel_split, threshold, left_size, right_size,
+                                   left_segments, right_segments);
         // recurse on child nodes
-        node -> left = build_subtree(data, *left_size, subsets[0]);
-        node -> right = build_subtree(data, *right_size, subsets[1]);
+        if (M >= PARALLEL_MIN_ITEMS && pool_num_threads() > 1) {
+            SubtreeJob left = {data, *left_size, subsets[0], left_segments, params, NULL};
+            TaskGroup group;
+            pool_group_init(&group);
+            pool_submit(&group, build_subtree_task, &left);
+            node -> right = build_subtree(data, *right_size, subsets[1], right_segments, params);
+            pool_wait(&group);
+            node -> left = left.root;
+        } else {
+            node -> left = build_subtree(data, *left_size, subsets[0], left_segments, params);
+            node -> right = build_subtree(data, *right_size, subsets[1], right_segments, params);
+        }
         // free memory for subsets and int pointers
         free(left_size);
         free(right_size);
@@ -262,19 +1066,78 @@ DTNode *build_subtree(Dataset *data, int M, int *indices) {
 }
 
 /**
- * Function exposed to the user. Set up the `indices` array correctly for the 
- * entire dataset and call `build_subtree()`.
+ * Return the default tree building options: binary splits at BINARY_THRESHOLD
+ * scored by Gini impurity.
+ */
+DTParams dt_default_params(void) {
+    DTParams params;
+    params.grayscale = 0;
+    params.bins = GRAY_BINS;
+    params.criterion = CRITERION_GINI;
+    for (int k = 0; k < 10; k++) {
+        params.class_weights[k] = 0;
+    }
+    params.tuning = NULL;
+    params.features = 0;
+    return params;
+}
+
+/**
+ * Fill in the options whose defaults depend on the training data: class 
+ * weights left at 0 default to the inverse label frequency in `data`.
+ */
+void dt_params_resolve(DTParams *params, Dataset *data) {
+    int M = data -> num_items;
+    double weight_sum = 0;
+    for (int k = 0; k < 10; k++) {
+        weight_sum += params -> class_weights[k];
+    }
+    if (weight_sum == 0) {
+        int frequencies[10] = {0};
+        for (int i = 0; i < M; i++) {
+            frequencies[data -> labels[i]]++;
+        }
+        for (int k = 0; k < 10; k++) {
+            params -> class_weights[k] = frequencies[k] ? (double) M / (10.0 * frequencies[k]) : 1.0;
+        }
+    }
+}
+
+/**
+ * Function exposed to the user. Build the tree with the default options.
  */
 DTNode *build_dec_tree(Dataset *data) {
+    DTParams params = dt_default_params();
+    return build_dec_tree_params(data, &params);
+}
+
+/**
+ * Function exposed to the user. Set up the `indices` array correctly for the 
+ * entire dataset, grouped by label, and call `build_subtree()`. Return NULL
+ * if the indices cannot be allocated.
+ */
+DTNode *build_dec_tree_params(Dataset *data, const DTParams *params) {
     // set up 'indices' array
     int M = data -> num_items;
-    int indices[M];
+    int *indices = malloc(sizeof(int) * (M + 1)); // too large for the stack with augmented data
+    if (indices == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
     for (int i = 0; i < M; i++) {
         indices[i] = i;
     }    
+    int segments[11];
+    dataset_group_labels(data, M, indices, segments);
+
+    DTParams node_params = *params;
+    dt_params_resolve(&node_params, data);
 
     // return the built tree
-    return build_subtree(data, M, indices);
+    DTNode *root = build_subtree(data, M, indices, segments, &node_params);
+    free(indices);
+    dt_model_changed();
+    return root;
 }
 
 /**
@@ -284,18 +1147,237 @@ int dec_tree_classify(DTNode *root, Image *img) {
     if (root -> classification != -1) { // base case: if node is a leaf
         return root -> classification;
     } else {
-        if ((img -> data)[root -> pixel] == 0) { // if pixel value is 0, recurse on left child
+        if (image_pixel(img, root -> pixel) < root -> threshold) { // if pixel value is below the threshold, recurse on left child
             return dec_tree_classify(root -> left, img);
-        } else { // if pixel value is 255, recurse on right child
+        } else { // otherwise, recurse on right child
             return dec_tree_classify(root -> right, img);
         }
     }
 }
 
+/* Helper for classify_chunk. Classify the images one by one */
+static void classify_each(DTNode *root, const Image *images, int num_images, int *predictions) {
+    for (int i = 0; i < num_images; i++) {
+        predictions[i] = dec_tree_classify(root, (Image *) &images[i]);
+    }
+}
+
+/**
+ * Helper for dec_tree_classify_batch. Classify a batch of `num_images` images
+ * breadth first, storing the predicted label of images[i] in predictions[i].
+ *
+ * Instead of walking the tree once per image, the whole batch starts at the
+ * root and each node partitions its range of the batch by its pixel (like 
+ * `split_data()`) before handing the two halves to its children. Every node
+ * is visited once per batch and its test is a streaming scan over its images,
+ * so the node stays hot and the branch per image becomes a branch-free
+ * partition.
+ *
+ * The partition is stable, so every range keeps its images in batch order and
+ * the scans walk image memory forwards, with the pixel of upcoming images
+ * prefetched. Nodes of one level read their range from one buffer and write
+ * it to the same positions of the other, the queue being breadth first.
+ *
+ * Large batches are processed BATCH_CHUNK images at a time, so the partition
+ * buffers stay in cache instead of being streamed through memory once per
+ * level. If the buffers cannot be allocated, the images are classified one by
+ * one instead.
+ */
+static void classify_chunk(DTNode *root, const Image *images, int num_images, int *predictions) {
+    typedef struct {
+        const unsigned char *row;   // Pixel data of the image
+        int index;                  // Position of the image in the batch
+    } BatchEntry;
+    typedef struct {
+        DTNode *node;
+        int start;      // First position of the node's images in the buffers
+        int count;      // Number of images that reached the node
+        int buffer;     // Buffer holding the node's range (0 or 1)
+    } BatchTask;
+
+    // two buffers for the node ranges, and a spill area for right-going images
+    BatchEntry *entries = malloc(sizeof(BatchEntry) * 3 * (size_t) num_images);
+    int capacity = 64;
+    BatchTask *queue = malloc(sizeof(BatchTask) * capacity);
+    if (entries == NULL || queue == NULL) {
+        free(entries);
+        free(queue);
+        classify_each(root, images, num_images, predictions);
+        return;
+    }
+    BatchEntry *buffers[2] = {entries, entries + num_images};
+    BatchEntry *spill = entries + 2 * (size_t) num_images;
+    // shifted images (see dataset_augment()) have no row to scan: classify
+    // them one by one
+    int num_entries = 0;
+    for (int i = 0; i < num_images; i++) {
+        if ((images[i].dx | images[i].dy) != 0) {
+            predictions[i] = dec_tree_classify(root, (Image *) &images[i]);
+            continue;
+        }
+        buffers[0][num_entries].row = images[i].data;
+        buffers[0][num_entries].index = i;
+        num_entries++;
+    }
+
+    // queue[head..tail) holds the nodes left to visit, in breadth-first order
+    int head = 0, tail = 0;
+    if (num_entries > 0) {
+        queue[tail++] = (BatchTask) {root, 0, num_entries, 0};
+    }
+    while (head < tail) {
+        BatchTask task = queue[head++];
+        BatchEntry *src = buffers[task.buffer] + task.start;
+
+        if (task.node -> classification != -1) { // leaf: label every image that reached it
+            for (int i = 0; i < task.count; i++) {
+                predictions[src[i].index] = task.node -> classification;
+            }
+            continue;
+        }
+
+        // images going left fill the range from the front, the others are 
+        // spilled in order and appended after them
+        BatchEntry *dst = buffers[!task.buffer] + task.start;
+        int pixel = task.node -> pixel, threshold = task.node -> threshold;
+        int left_count = 0, right_count = 0;
+        for (int i = 0; i < task.count; i++) {
+            BatchEntry entry = src[i];
+            if (i + BATCH_PREFETCH_DISTANCE < task.count) {
+                __builtin_prefetch(src[i + BATCH_PREFETCH_DISTANCE].row + pixel);
+            }
+            int goes_left = entry.row[pixel] < threshold;
+            dst[left_count] = entry;
+            spill[right_count] = entry;
+            left_count += goes_left;
+            right_count += !goes_left;
+        }
+        memcpy(dst + left_count, spill, sizeof(BatchEntry) * right_count);
+
+        // reclaim the visited part of the queue before growing it
+        if (tail + 2 > capacity) {
+            memmove(queue, queue + head, sizeof(BatchTask) * (tail - head));
+            tail -= head;
+            head = 0;
+            if (tail + 2 > capacity) {
+                capacity *= 2;
+                BatchTask *grown = realloc(queue, sizeof(BatchTask) * capacity);
+                if (grown == NULL) { // start over one image at a time
+                    free(entries);
+                    free(queue);
+                    classify_each(root, images, num_images, predictions);
+                    return;
+                }
+                queue = grown;
+            }
+        }
+        if (left_count > 0) {
+            queue[tail++] = (BatchTask) {task.node -> left, task.start, left_count, !task.buffer};
+        }
+        if (right_count > 0) {
+            queue[tail++] = (BatchTask) {task.node -> right, task.start + left_count, right_count, !task.buffer};
+        }
+    }
+
+    free(entries);
+    free(queue);
+}
+
+/* A batch to classify, for classify_chunks() */
+typedef struct {
+    DTNode *root;
+    const Image *images;
+    int num_images;
+    int *predictions;
+} BatchJob;
+
+/* Helper for dec_tree_classify_batch. Classify chunks [start, end) of a batch */
+static void classify_chunks(void *arg, int start, int end) {
+    BatchJob *job = arg;
+    for (int chunk = start; chunk < end; chunk++) {
+        int first = chunk * BATCH_CHUNK;
+        int count = job -> num_images - first < BATCH_CHUNK ? job -> num_images - first : BATCH_CHUNK;
+        classify_chunk(job -> root, job -> images + first, count, job -> predictions + first);
+    }
+}
+
+/**
+ * Classify a batch of images breadth first, BATCH_CHUNK images at a time
+ * (see `classify_chunk()`). The chunks are spread over the thread pool.
+ */
+void dec_tree_classify_batch(DTNode *root, const Image *images, int num_images, int *predictions) {
+    BatchJob job = {root, images, num_images, predictions};
+    pool_parallel_for(0, (num_images + BATCH_CHUNK - 1) / BATCH_CHUNK, 1, classify_chunks, &job);
+}
+
+/**
+ * Classify every image in `data` (in one breadth-first batch) and return the 
+ * number of images whose predicted label matches the label stored in the 
+ * dataset, or -1 if memory ran out.
+ */
+int dec_tree_evaluate(DTNode *root, Dataset *data) {
+    int *predictions = malloc(sizeof(int) * (data -> num_items + 1));
+    if (predictions == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return -1;
+    }
+    dec_tree_classify_batch(root, data -> images, data -> num_items, predictions);
+
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += predictions[i] == data -> labels[i];
+    }
+    free(predictions);
+    return total_correct;
+}
+
+/**
+ * Return the number of nodes (internal and leaf) in the decision tree.
+ */
+int dec_tree_num_nodes(DTNode *root) {
+    if (root -> classification != -1) {
+        return 1;
+    }
+    return 1 + dec_tree_num_nodes(root -> left) + dec_tree_num_nodes(root -> right);
+}
+
+/**
+ * Return the depth of the decision tree (a single leaf has depth 0).
+ */
+int dec_tree_depth(DTNode *root) {
+    if (root -> classification != -1) {
+        return 0;
+    }
+    int left_depth = dec_tree_depth(root -> left);
+    int right_depth = dec_tree_depth(root -> right);
+    return 1 + (left_depth > right_depth ? left_depth : right_depth);
+}
+
+// Incremented whenever a tree is built, modified or freed
+static unsigned long model_generation = 0;
+
+/**
+ * Return a counter that changes whenever a tree may have been built, modified
+ * or freed. Caches of model results (see cache.h) only need to re-check their
+ * model after it moves.
+ */
+unsigned long dt_model_generation(void) {
+    return __atomic_load_n(&model_generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Record that a tree was built, modified or freed. Code that edits DTNode
+ * trees in place must call this.
+ */
+void dt_model_changed(void) {
+    __atomic_add_fetch(&model_generation, 1, __ATOMIC_RELEASE);
+}
+
 /**
  * Free the decision tree.
  */
 void free_dec_tree(DTNode *node) {
+    dt_model_changed();
     if (node -> classification != -1) { // base case: free the leaf node
         free(node);
     } else { // recursive case: free children and then free parent node
@@ -306,18 +1388,31 @@ void free_dec_tree(DTNode *node) {
 }
 
 /**
- * Free all the allocated memory for the dataset.
+ * Drop a reference to the dataset, and free all the allocated memory for it 
+ * once the last reference is gone. Views release their bases in turn.
  */
 void free_dataset(Dataset *data) {
-    // free array of pixel color values for each image
-    for (int i = 0; i < data -> num_items; i++) {
-        free((data -> images)[i].data);
+    if (__atomic_sub_fetch(&(data -> refs), 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (data -> num_bases == 0) {
+        // free the pixel color values of all images
+        free(data -> pixels);
+    } else {
+        // views only drop their references to the datasets they alias
+        for (int i = 0; i < data -> num_bases; i++) {
+            free_dataset(data -> bases[i]);
+        }
+        free(data -> bases);
+    }
+
+    if (data -> owns_items) {
+        // free images array
+        free(data -> images);
+        // free labels array
+        free (data -> labels);
     }
-    
-    // free images array
-    free(data -> images);
-    // free labels array
-    free (data -> labels);
     // free dataset
     free(data);
 }
\ No newline at end of file
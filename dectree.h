@@ -1,6 +1,7 @@
 #pragma once
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,7 +24,42 @@
 #endif
 
 #ifndef NUM_PIXELS
-#define NUM_PIXELS WIDTH * WIDTH
+#define NUM_PIXELS (WIDTH * WIDTH)
+#endif
+
+/* Pixels with a color below this value go left in binary (non-grayscale) trees */
+#ifndef BINARY_THRESHOLD
+#define BINARY_THRESHOLD 128
+#endif
+
+/* Default number of histogram bins used to search thresholds in grayscale mode */
+#ifndef GRAY_BINS
+#define GRAY_BINS 256
+#endif
+
+/* Batch classification partitions at most this many images at a time */
+#ifndef BATCH_CHUNK
+#define BATCH_CHUNK 4096
+#endif
+
+/* How many images ahead batch classification prefetches the tested pixel */
+#ifndef BATCH_PREFETCH_DISTANCE
+#define BATCH_PREFETCH_DISTANCE 16
+#endif
+
+/* Nodes of at least this many images build their two subtrees in parallel (see pool.h) */
+#ifndef PARALLEL_MIN_ITEMS
+#define PARALLEL_MIN_ITEMS 1024
+#endif
+
+/* Binary split searches over at least this many images count in parallel, in ranges of this size */
+#ifndef PARALLEL_COUNT_ITEMS
+#define PARALLEL_COUNT_ITEMS 8192
+#endif
+
+/* Loading reads the file this many images at a time, in parallel */
+#ifndef LOAD_CHUNK
+#define LOAD_CHUNK 4096
 #endif
 
 /**
@@ -35,32 +71,114 @@ typedef struct {
     int sx;               // x resolution
     int sy;               // y resolution
     unsigned char *data;  // Array of `sx * sy` pixel color values [0-255]
+    int dx;               // (Augmented views) Shift to the right applied when reading `data`
+    int dy;               // (Augmented views) Shift down applied when reading `data`
 } Image;
 
-/* This struct stores the images / labels in the dataset */
-typedef struct {
+/**
+ * Return the color of pixel number `pixel` (y * sx + x) of the image. A shifted
+ * image (see `dataset_augment()`) shows pixel (x - dx, y - dy) of its data, and
+ * blank (0) pixels where that falls outside the image. Code reading `data`
+ * directly must handle shifted images itself.
+ */
+static inline int image_pixel(const Image *img, int pixel) {
+    if ((img -> dx | img -> dy) == 0) {
+        return img -> data[pixel];
+    }
+    int x = pixel % img -> sx - img -> dx;
+    int y = pixel / img -> sx - img -> dy;
+    if (x < 0 || x >= img -> sx || y < 0 || y >= img -> sy) {
+        return 0;
+    }
+    return img -> data[y * img -> sx + x];
+}
+
+/**
+ * This struct stores the images / labels in the dataset.
+ *
+ * A Dataset is either a base dataset, loaded from a file or allocated with
+ * `alloc_dataset()` (it owns the pixel data of its images), or is a view over one or more other datasets created with `dataset_range()`,
+ * `dataset_subset()`, `dataset_concat()` or `dataset_augment()`. A view aliases the pixel data of its
+ * bases and holds a reference on each of them, so every function taking a
+ * Dataset accepts views directly and no pixel data is ever copied.
+ */
+typedef struct dataset {
     int num_items;          // Number of images in the dataset
     Image *images;          // Array of `num_items` Image structs
     unsigned char *labels;  // Array of `num_items` labels [0-9]
+    unsigned char *pixels;  // (Base datasets) Buffer holding the pixel data of all images
+    int refs;               // Reference count, see dataset_retain() / free_dataset()
+    int num_bases;          // (Views) Number of datasets whose pixel data is aliased
+    struct dataset **bases; // (Views) Array of `num_bases` retained datasets
+    int owns_items;         // (Views) 1 if `images` and `labels` were allocated for the view
 } Dataset;
 
 
 /* The following struct represents a node in the decision tree. */
 typedef struct dt_node {
     int pixel;              // Which pixel to check in this node
+    int threshold;          // Color at `pixel` below which an image goes left
     int classification;     // (Leaf nodes) Classification for this node
-    struct dt_node *left;   // Left child   (color at `pixel` == 0)  
-    struct dt_node *right;  // Right child  (color at `pixel` == 255)
+    struct dt_node *left;   // Left child   (color at `pixel` <  threshold)  
+    struct dt_node *right;  // Right child  (color at `pixel` >= threshold)
 } DTNode;
 
+/* Objective functions that can score a split (see criteria.h) */
+typedef enum {
+    CRITERION_GINI,             // Gini impurity
+    CRITERION_ENTROPY,          // Shannon entropy (information gain)
+    CRITERION_WEIGHTED_GINI     // Gini impurity with per-label weights
+} SplitCriterion;
 
+/**
+ * Options for building a decision tree. Use `dt_default_params()` to get the 
+ * defaults and override individual fields.
+ */
+typedef struct {
+    int grayscale;          // 0: split at BINARY_THRESHOLD, 1: also search the threshold
+    int bins;               // (Grayscale) Number of histogram bins [2-256]
+    SplitCriterion criterion;   // Objective used to pick the best split
+    double class_weights[10];   // (Weighted Gini) Label weights, all 0 = inverse label frequency
+    struct dt_tuning *tuning;   // (Optional) Per-node search strategies, see autotune.h
+    int features;           // (Binary) 1: also split on the derived features of expanded images, see features.h
+} DTParams;
+
+
+Dataset *alloc_dataset(int num_items, int sx, int sy);
 Dataset *load_dataset(const char *filename);
 
+Dataset *dataset_retain(Dataset *data);
+Dataset *dataset_range(Dataset *base, int start, int count);
+Dataset *dataset_subset(Dataset *base, int M, const int *indices);
+Dataset *dataset_concat(Dataset **parts, int num_parts);
+void dataset_fold(Dataset *data, int k, int fold, Dataset **train, Dataset **test);
+Dataset *dataset_bootstrap(Dataset *data, int M, unsigned int seed);
+Dataset *dataset_augment(Dataset *base, int max_shift);
+void image_read(const Image *img, unsigned char *pixels);
+uint64_t dataset_hash(Dataset *data);
+
+void dataset_group_labels(Dataset *data, int M, int *indices, int *segments);
 void get_most_frequent(Dataset *data, int M, int *indices, int *label, int *freq);
-int find_best_split(Dataset *data, int M, int *indices);
+void get_most_frequent_grouped(const int *segments, int *label, int *freq);
+int find_best_split(Dataset *data, int M, int *indices, const int *segments, const DTParams *params,
+                    int *threshold);
+int find_best_soft_split(Dataset *data, int M, int *indices, const uint16_t (*votes)[10],
+                         const DTParams *params);
+void pixel_split_scores(Dataset *data, int M, int *indices, const int *segments, const DTParams *params,
+                        double *scores, int *right_count);
 
+DTParams dt_default_params(void);
+void dt_params_resolve(DTParams *params, Dataset *data);
 DTNode *build_dec_tree(Dataset *data);
+DTNode *build_dec_tree_params(Dataset *data, const DTParams *params);
 int dec_tree_classify(DTNode *root, Image *img);
+void dec_tree_classify_batch(DTNode *root, const Image *images, int num_images, int *predictions);
+int dec_tree_evaluate(DTNode *root, Dataset *data);
+int dec_tree_num_nodes(DTNode *root);
+int dec_tree_depth(DTNode *root);
+
+unsigned long dt_model_generation(void);
+void dt_model_changed(void);
 
 void free_dataset(Dataset *data);
 void free_dec_tree(DTNode *root);
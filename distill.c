@@ -0,0 +1,154 @@
+#include "distill.h"
+#include "pool.h"
+
+/* What every node of a soft-label tree is built from */
+typedef struct {
+    Dataset *data;
+    const uint16_t (*votes)[10];
+    const DTParams *params;
+} SoftBuild;
+
+static DTNode *build_soft_subtree(const SoftBuild *build, int M, int *indices, int *scratch);
+
+/* A subtree to build on the thread pool, see build_soft_task() */
+typedef struct {
+    const SoftBuild *build;
+    int M;
+    int *indices;
+    int *scratch;
+    DTNode *root;       // The built subtree
+} SoftJob;
+
+/* Helper for build_soft_subtree. Build the subtree of a SoftJob */
+static void build_soft_task(void *arg) {
+    SoftJob *job = arg;
+    job -> root = build_soft_subtree(job -> build, job -> M, job -> indices, job -> scratch);
+}
+
+/**
+ * Helper for build_dec_tree_soft. Build the subtree of the M images in
+ * `indices` like `build_subtree()`, with the votes of the images as their
+ * labels. The indices are partitioned in place (stably) through `scratch`,
+ * which has room for M ints, so the two subtrees use disjoint halves of both
+ * and nodes of at least PARALLEL_MIN_ITEMS images build them in parallel.
+ */
+static DTNode *build_soft_subtree(const SoftBuild *build, int M, int *indices, int *scratch) {
+    Dataset *data = build -> data;
+    int mass[10] = {0};
+    int total = 0;
+    for (int i = 0; i < M; i++) {
+        for (int k = 0; k < 10; k++) {
+            mass[k] += build -> votes[indices[i]][k];
+        }
+    }
+    int label = 0;
+    for (int k = 0; k < 10; k++) {
+        total += mass[k];
+        if (mass[k] > mass[label]) { // strict, so ties keep the smaller label
+            label = k;
+        }
+    }
+
+    DTNode *node = malloc(sizeof(DTNode));
+    node -> left = NULL;
+    node -> right = NULL;
+    int pixel_split = -1;
+    if (M >= DISTILL_MIN_ITEMS && (double) mass[label] / (double) total < THRESHOLD_RATIO) {
+        pixel_split = find_best_soft_split(data, M, indices, build -> votes, build -> params);
+    }
+    if (pixel_split == -1) { // leaf
+        node -> pixel = -1;
+        node -> threshold = 0;
+        node -> classification = label;
+        return node;
+    }
+    node -> pixel = pixel_split;
+    node -> threshold = BINARY_THRESHOLD;
+    node -> classification = -1;
+
+    // images going left keep their order at the front, the others follow
+    int left_size = 0, right_size = 0;
+    for (int i = 0; i < M; i++) {
+        int index = indices[i];
+        if (image_pixel(&(data -> images[index]), pixel_split) < BINARY_THRESHOLD) {
+            indices[left_size++] = index;
+        } else {
+            scratch[right_size++] = index;
+        }
+    }
+    memcpy(indices + left_size, scratch, sizeof(int) * right_size);
+
+    if (M >= PARALLEL_MIN_ITEMS && pool_num_threads() > 1) {
+        SoftJob left = {build, left_size, indices, scratch, NULL};
+        TaskGroup group;
+        pool_group_init(&group);
+        pool_submit(&group, build_soft_task, &left);
+        node -> right = build_soft_subtree(build, right_size, indices + left_size, scratch + left_size);
+        pool_wait(&group);
+        node -> left = left.root;
+    } else {
+        node -> left = build_soft_subtree(build, left_size, indices, scratch);
+        node -> right = build_soft_subtree(build, right_size, indices + left_size, scratch + left_size);
+    }
+
+    // a split between two leaves of the same label changes no prediction
+    DTNode *left = node -> left, *right = node -> right;
+    if (left -> classification != -1 && left -> classification == right -> classification) {
+        node -> pixel = -1;
+        node -> threshold = 0;
+        node -> classification = left -> classification;
+        node -> left = NULL;
+        node -> right = NULL;
+        free(left);
+        free(right);
+    }
+    return node;
+}
+
+/**
+ * Build a binary decision tree for `data` whose item i has the soft label
+ * votes[i] (see distill.h) with `params` (grayscale is ignored: splits are at
+ * BINARY_THRESHOLD). Return NULL if memory runs out.
+ */
+DTNode *build_dec_tree_soft(Dataset *data, const uint16_t (*votes)[10], const DTParams *params) {
+    int M = data -> num_items;
+    int *indices = malloc(sizeof(int) * M);
+    int *scratch = malloc(sizeof(int) * M);
+    if ((indices == NULL || scratch == NULL) && M > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(indices);
+        free(scratch);
+        return NULL;
+    }
+    for (int i = 0; i < M; i++) {
+        indices[i] = i;
+    }
+    DTParams node_params = *params;
+    dt_params_resolve(&node_params, data);
+    SoftBuild build = {data, votes, &node_params};
+
+    DTNode *root = build_soft_subtree(&build, M, indices, scratch);
+    free(indices);
+    free(scratch);
+    dt_model_changed();
+    return root;
+}
+
+/**
+ * Return a single tree distilled from the forest: the forest votes on every
+ * image of `pool` (in batch, on the thread pool), and the tree is built on
+ * the pool with those votes as soft labels. The labels of `pool` are unused.
+ * Return NULL if memory runs out.
+ */
+DTNode *distill_forest(const Forest *forest, Dataset *pool, const DTParams *params) {
+    int N = pool -> num_items;
+    uint16_t (*votes)[10] = malloc(sizeof(*votes) * (N + 1));
+    if (votes == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    forest_vote_batch(forest, pool -> images, N, votes);
+    DTNode *root = build_dec_tree_soft(pool, (const uint16_t (*)[10]) votes, params);
+    free(votes);
+    return root;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+#include "forest.h"
+
+/**
+ * Distillation of a forest into a single tree, which classifies with one
+ * walk instead of one per tree of the forest.
+ *
+ * The forest labels a pool of images (its training images, or more, such as
+ * a virtually augmented view of them, see dataset_augment()) with its soft
+ * predictions: the votes of its trees for each label. A tree is then built on
+ * the pool the way `build_subtree()` builds one, except that each image
+ * counts as its votes instead of its label (see find_best_soft_split()): a
+ * node's label is the label with the most votes, it is a leaf once that label
+ * has at least THRESHOLD_RATIO of its votes, and splits minimize the
+ * soft-label impurity (Gini by default) of the votes on each side. Images
+ * the forest is unsure about thus pull the tree towards the forest's
+ * decision boundaries rather than towards their own label. A split whose two
+ * children end up leaves of the same label is undone.
+ */
+
+/* Nodes of fewer images become leaves (soft labels are rarely pure) */
+#ifndef DISTILL_MIN_ITEMS
+#define DISTILL_MIN_ITEMS 8
+#endif
+
+DTNode *build_dec_tree_soft(Dataset *data, const uint16_t (*votes)[10], const DTParams *params);
+DTNode *distill_forest(const Forest *forest, Dataset *pool, const DTParams *params);
@@ -0,0 +1,759 @@
+#include <unistd.h>
+
+#include "autotune.h"
+#include "cache.h"
+#include "cascade.h"
+#include "dectree.h"
+#include "features.h"
+#include "forest.h"
+#include "oblivious.h"
+#include "packed.h"
+#include "pool.h"
+#include "preprocess.h"
+#include "remap.h"
+#include "store.h"
+#include "tensor.h"
+
+/**
+ * dtbench: micro-benchmarks for the decision tree library.
+ *
+ *    ./dtbench training_data [testing_data]
+ *
+ * Each benchmark prints one line per variant it measures. If testing_data is
+ * omitted, the last sixth of training_data is held out for testing.
+ */
+
+/* Classify the images of `data` one at a time, returning the number correct */
+static int evaluate_one_by_one(DTNode *root, Dataset *data) {
+    int correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        correct += dec_tree_classify(root, &(data -> images[i])) == data -> labels[i];
+    }
+    return correct;
+}
+
+/**
+ * Build a tree with every split criterion, in binary and grayscale mode, and
+ * report build time, tree shape, accuracy and per-image classify latency.
+ */
+static void bench_criteria(Dataset *train, Dataset *test) {
+    const char *names[] = {"gini", "entropy", "weighted-gini"};
+    SplitCriterion criteria[] = {CRITERION_GINI, CRITERION_ENTROPY, CRITERION_WEIGHTED_GINI};
+
+    printf("%-14s %-9s %10s %7s %6s %9s %12s\n",
+           "criterion", "mode", "build_ms", "nodes", "depth", "accuracy", "classify_ns");
+    for (int grayscale = 0; grayscale <= 1; grayscale++) {
+        for (int c = 0; c < 3; c++) {
+            DTParams params = dt_default_params();
+            params.grayscale = grayscale;
+            params.criterion = criteria[c];
+
+            double start = now_seconds();
+            DTNode *root = build_dec_tree_params(train, &params);
+            double build_time = now_seconds() - start;
+
+            start = now_seconds();
+            int correct = dec_tree_evaluate(root, test);
+            double classify_time = now_seconds() - start;
+
+            printf("%-14s %-9s %10.1f %7d %6d %8.2f%% %12.1f\n",
+                   names[c], grayscale ? "grayscale" : "binary", build_time * 1e3,
+                   dec_tree_num_nodes(root), dec_tree_depth(root),
+                   100.0 * correct / test -> num_items, classify_time * 1e9 / test -> num_items);
+            free_dec_tree(root);
+        }
+    }
+}
+
+/**
+ * Compare the pointer tree with oblivious trees of increasing depth: build
+ * time, accuracy and per-image classify latency (one image at a time and in
+ * batch for the oblivious trees).
+ */
+static void bench_oblivious(Dataset *train, Dataset *test) {
+    DTParams params = dt_default_params();
+    int N = test -> num_items;
+    int *predictions = malloc(sizeof(int) * N);
+
+    printf("\n%-14s %10s %9s %12s %12s\n", "model", "build_ms", "accuracy", "classify_ns", "batch_ns");
+    double start = now_seconds();
+    DTNode *root = build_dec_tree_params(train, &params);
+    double build_time = now_seconds() - start;
+    start = now_seconds();
+    int correct = evaluate_one_by_one(root, test);
+    double classify_time = now_seconds() - start;
+    start = now_seconds();
+    dec_tree_classify_batch(root, test -> images, N, predictions);
+    double batch_time = now_seconds() - start;
+    printf("%-14s %10.1f %8.2f%% %12.1f %12.1f\n", "tree", build_time * 1e3,
+           100.0 * correct / N, classify_time * 1e9 / N, batch_time * 1e9 / N);
+    free_dec_tree(root);
+
+    for (int depth = 6; depth <= OBLIVIOUS_MAX_DEPTH; depth += 2) {
+        start = now_seconds();
+        ObliviousTree *tree = build_oblivious_tree(train, &params, depth);
+        build_time = now_seconds() - start;
+
+        correct = 0;
+        start = now_seconds();
+        for (int i = 0; i < N; i++) {
+            correct += oblivious_classify(tree, &(test -> images[i])) == test -> labels[i];
+        }
+        classify_time = now_seconds() - start;
+        start = now_seconds();
+        oblivious_classify_batch(tree, test -> images, N, predictions);
+        double batch_time = now_seconds() - start;
+
+        char name[32];
+        snprintf(name, sizeof(name), "oblivious-%d", tree -> depth);
+        printf("%-14s %10.1f %8.2f%% %12.1f %12.1f\n", name, build_time * 1e3,
+               100.0 * correct / N, classify_time * 1e9 / N, batch_time * 1e9 / N);
+        free_oblivious_tree(tree);
+    }
+    free(predictions);
+}
+
+/**
+ * Compare trees built on the pixels alone with trees that may also split on
+ * the derived features (see features.h): expansion and build time, node
+ * count, depth, accuracy and per-image classify latency, one image at a time
+ * and in batch.
+ */
+static void bench_features(Dataset *train, Dataset *test) {
+    int N = test -> num_items;
+    int *predictions = malloc(sizeof(int) * N);
+
+    printf("\n%-9s %10s %10s %7s %6s %9s %12s %12s\n", "features", "expand_ms", "build_ms", "nodes", "depth",
+           "accuracy", "classify_ns", "batch_ns");
+    for (int features = 0; features <= 1; features++) {
+        DTParams params = dt_default_params();
+        params.features = features;
+        double start = now_seconds();
+        Dataset *train_data = features ? dataset_expand_features(train) : dataset_retain(train);
+        Dataset *test_data = features ? dataset_expand_features(test) : dataset_retain(test);
+        double expand_time = now_seconds() - start;
+
+        start = now_seconds();
+        DTNode *root = build_dec_tree_params(train_data, &params);
+        double build_time = now_seconds() - start;
+        start = now_seconds();
+        int correct = evaluate_one_by_one(root, test_data);
+        double classify_time = now_seconds() - start;
+        start = now_seconds();
+        dec_tree_classify_batch(root, test_data -> images, N, predictions);
+        double batch_time = now_seconds() - start;
+
+        printf("%-9s %10.1f %10.1f %7d %6d %8.2f%% %12.1f %12.1f\n", features ? "derived" : "pixels",
+               expand_time * 1e3, build_time * 1e3, dec_tree_num_nodes(root), dec_tree_depth(root),
+               100.0 * correct / N, classify_time * 1e9 / N, batch_time * 1e9 / N);
+        free_dec_tree(root);
+        free_dataset(train_data);
+        free_dataset(test_data);
+    }
+    free(predictions);
+}
+
+/**
+ * Return a base dataset of N images repeating the images of `data`. Each copy
+ * gets its own pixel data, so that large datasets do not fit in cache, as in
+ * real jobs.
+ */
+static Dataset *replicate_dataset(Dataset *data, int N) {
+    Dataset *copy = alloc_dataset(N, WIDTH, WIDTH);
+    for (int i = 0; i < N; i++) {
+        copy -> labels[i] = data -> labels[i % data -> num_items];
+        image_read(&(data -> images[i % data -> num_items]), copy -> images[i].data);
+    }
+    return copy;
+}
+
+/**
+ * Compare per-image traversal with breadth-first batch classification for
+ * growing batches.
+ */
+static void bench_batch(Dataset *train, Dataset *test) {
+    DTNode *root = build_dec_tree(train);
+    int max_images = 100000;
+    Dataset *batch = replicate_dataset(test, max_images);
+    int *predictions = malloc(sizeof(int) * max_images);
+
+    printf("\n%10s %14s %12s %8s\n", "images", "per_image_ns", "batch_ns", "speedup");
+    for (int N = 1000; N <= max_images; N *= 10) {
+        double start = now_seconds();
+        for (int i = 0; i < N; i++) {
+            predictions[i] = dec_tree_classify(root, &(batch -> images[i]));
+        }
+        double per_image_time = now_seconds() - start;
+        start = now_seconds();
+        dec_tree_classify_batch(root, batch -> images, N, predictions);
+        double batch_time = now_seconds() - start;
+
+        printf("%10d %14.1f %12.1f %7.2fx\n", N, per_image_time * 1e9 / N, batch_time * 1e9 / N,
+               per_image_time / batch_time);
+    }
+    free(predictions);
+    free_dataset(batch);
+    free_dec_tree(root);
+}
+
+/* Images the scalar tensor kernel classifies per batch size in bench_tensor() */
+#ifndef TENSOR_SCALAR_IMAGES
+#define TENSOR_SCALAR_IMAGES 1024
+#endif
+
+/**
+ * Compile trees of growing size (built on the first 100, 1000 and all the
+ * training images) into matrices (see tensor.h) and compare, for growing
+ * batches, per-image traversal, breadth-first batches and the matrix products
+ * with the scalar and AVX2 kernels. Each tree's line ends with the smallest
+ * batch at which the AVX2 products beat the faster pointer traversal, and the
+ * number of test images whose tensor prediction differs from traversal.
+ */
+static void bench_tensor(Dataset *train, Dataset *test) {
+    int max_images = 65536;
+    Dataset *batch = replicate_dataset(test, max_images);
+    int *predictions = malloc(sizeof(int) * max_images);
+    int *expected = malloc(sizeof(int) * max_images);
+    int sizes[] = {100, 1000, train -> num_items};
+
+    printf("\n%8s %6s %8s %14s %12s %12s %12s\n", "nodes", "depth", "images", "per_image_ns", "batch_ns",
+           "scalar_ns", "tensor_ns");
+    for (int s = 0; s < 3; s++) {
+        Dataset *part = dataset_range(train, 0, sizes[s] < train -> num_items ? sizes[s] : train -> num_items);
+        DTNode *root = build_dec_tree(part);
+        TensorTree *tensor = tensor_from_tree(root);
+        int nodes = dec_tree_num_nodes(root), depth = dec_tree_depth(root);
+        int crossover = 0;
+        for (int N = 16; N <= max_images; N *= 16) {
+            int reps = max_images / N;
+            double start = now_seconds();
+            for (int r = 0; r < reps; r++) {
+                for (int i = 0; i < N; i++) {
+                    expected[i] = dec_tree_classify(root, &(batch -> images[i]));
+                }
+            }
+            double per_image_time = now_seconds() - start;
+            start = now_seconds();
+            for (int r = 0; r < reps; r++) {
+                dec_tree_classify_batch(root, batch -> images, N, predictions);
+            }
+            double batch_time = now_seconds() - start;
+            tensor_set_avx2(0); // slow: a single pass of at most TENSOR_SCALAR_IMAGES images
+            int scalar_images = N < TENSOR_SCALAR_IMAGES ? N : TENSOR_SCALAR_IMAGES;
+            start = now_seconds();
+            tensor_classify_batch(tensor, batch -> images, scalar_images, predictions);
+            double scalar_time = now_seconds() - start;
+            tensor_set_avx2(1);
+            start = now_seconds();
+            for (int r = 0; r < reps; r++) {
+                tensor_classify_batch(tensor, batch -> images, N, predictions);
+            }
+            double tensor_time = now_seconds() - start;
+
+            double total = (double) reps * N;
+            printf("%8d %6d %8d %14.1f %12.1f %12.1f %12.1f\n", nodes, depth, N, per_image_time * 1e9 / total,
+                   batch_time * 1e9 / total, scalar_time * 1e9 / scalar_images, tensor_time * 1e9 / total);
+            if (crossover == 0 && tensor_time < per_image_time && tensor_time < batch_time) {
+                crossover = N;
+            }
+        }
+
+        int mismatches = 0;
+        for (int i = 0; i < test -> num_items; i++) {
+            mismatches += predictions[i] != expected[i];
+        }
+        if (crossover > 0) {
+            printf("%8d %6d crossover at %d images, %d mismatches\n", nodes, depth, crossover, mismatches);
+        } else {
+            printf("%8d %6d no crossover up to %d images, %d mismatches\n", nodes, depth, max_images, mismatches);
+        }
+        free_tensor_tree(tensor);
+        free_dec_tree(root);
+        free_dataset(part);
+    }
+    free(predictions);
+    free(expected);
+    free_dataset(batch);
+}
+
+/**
+ * Compare the scalar and AVX2 preprocessing kernels (see preprocess.h) on
+ * batches of raw frames of growing size (the test images enlarged), resized
+ * whole and centered by mass, against the time batch classification takes
+ * per image.
+ */
+static void bench_preprocess(Dataset *train, Dataset *test) {
+    int N = 8192;
+    DTNode *root = build_dec_tree(train);
+    Dataset *batch = replicate_dataset(test, N);
+    int *predictions = malloc(sizeof(int) * N);
+    double start = now_seconds();
+    dec_tree_classify_batch(root, batch -> images, N, predictions);
+    double classify_time = now_seconds() - start;
+
+    unsigned char *normalized[2];
+    unsigned char **out[2];
+    for (int k = 0; k < 2; k++) {
+        normalized[k] = malloc((size_t) N * NUM_PIXELS);
+        out[k] = malloc(sizeof(unsigned char *) * N);
+        for (int i = 0; i < N; i++) {
+            out[k][i] = normalized[k] + (size_t) i * NUM_PIXELS;
+        }
+    }
+    Image *frames = malloc(sizeof(Image) * N);
+    printf("\n%6s %8s %10s %10s %8s %10s\n", "side", "mode", "scalar_ns", "avx2_ns", "speedup", "mismatches");
+    for (int scale = 1; scale <= 4; scale *= 2) {
+        // each frame is an image enlarged `scale` times, off center
+        int side = WIDTH * scale + WIDTH / 4;
+        unsigned char *pixels = calloc((size_t) N * side * side, 1);
+        for (int i = 0; i < N; i++) {
+            frames[i] = (Image) {side, side, pixels + (size_t) i * side * side, 0, 0};
+            for (int y = 0; y < WIDTH * scale; y++) {
+                for (int x = 0; x < WIDTH * scale; x++) {
+                    frames[i].data[y * side + x] = batch -> images[i].data[(y / scale) * WIDTH + x / scale];
+                }
+            }
+        }
+        for (int center = 0; center <= 1; center++) {
+            double times[2];
+            for (int avx2 = 0; avx2 <= 1; avx2++) {
+                if (preprocess_set_avx2(avx2) != avx2) {
+                    times[avx2] = 0;
+                    continue;
+                }
+                preprocess_batch(frames, N, out[avx2], center, 1); // warm up the caches and pages
+                start = now_seconds();
+                preprocess_batch(frames, N, out[avx2], center, 1);
+                times[avx2] = now_seconds() - start;
+            }
+            int mismatches = 0;
+            for (int i = 0; i < N && times[1] > 0; i++) {
+                mismatches += memcmp(out[0][i], out[1][i], NUM_PIXELS) != 0;
+            }
+            if (times[1] > 0) {
+                printf("%6d %8s %10.1f %10.1f %7.2fx %10d\n", side, center ? "center" : "resize",
+                       times[0] * 1e9 / N, times[1] * 1e9 / N, times[0] / times[1], mismatches);
+            } else {
+                printf("%6d %8s %10.1f %10s %8s %10s\n", side, center ? "center" : "resize", times[0] * 1e9 / N,
+                       "-", "-", "-");
+            }
+        }
+        free(pixels);
+    }
+    printf("classify_batch: %.1f ns/image\n", classify_time * 1e9 / N);
+    preprocess_set_avx2(1);
+
+    free(frames);
+    for (int k = 0; k < 2; k++) {
+        free(normalized[k]);
+        free(out[k]);
+    }
+    free(predictions);
+    free_dataset(batch);
+    free_dec_tree(root);
+}
+
+/**
+ * Compare classifying the same images stored in full, projected on the pixels
+ * the tree tests (see remap.h), bit-packed and block-compressed (see 
+ * packed.h): bytes stored per image and per-image classify latency.
+ */
+static void bench_layouts(Dataset *train, Dataset *test) {
+    int N = 100000;
+    DTNode *root = build_dec_tree(train);
+    Dataset *full = replicate_dataset(test, N);
+
+    PixelMap *map = pixel_map_from_tree(root, train);
+    Dataset *projected = project_dataset(full, map);
+    DTNode *remapped = build_dec_tree(train);
+    dec_tree_remap(remapped, map);
+    PackedDataset *packed = pack_dataset(full);
+    CompressedDataset *compressed = compress_dataset(full);
+
+    printf("\n%-10s %12s %14s %9s\n", "layout", "bytes/image", "per_image_ns", "accuracy");
+    for (int layout = 0; layout < 4; layout++) {
+        const char *names[4] = {"full", "projected", "packed", "compressed"};
+        double bytes[4] = {
+            NUM_PIXELS, map -> num_used, sizeof(PackedImage),
+            sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) * (double) compressed -> offsets[N] / N
+        };
+
+        double start = now_seconds();
+        int correct = 0;
+        if (layout == 0) {
+            for (int i = 0; i < N; i++) {
+                correct += dec_tree_classify(root, &(full -> images[i])) == full -> labels[i];
+            }
+        } else if (layout == 1) {
+            for (int i = 0; i < N; i++) {
+                correct += dec_tree_classify(remapped, &(projected -> images[i])) == projected -> labels[i];
+            }
+        } else if (layout == 2) {
+            correct = packed_evaluate(root, packed);
+        } else {
+            correct = compressed_evaluate(root, compressed);
+        }
+        double time = now_seconds() - start;
+
+        printf("%-10s %12.1f %14.1f %8.2f%%\n", names[layout], bytes[layout], time * 1e9 / N,
+               100.0 * correct / N);
+    }
+
+    free(map);
+    free_dataset(full);
+    free_dataset(projected);
+    free_packed_dataset(packed);
+    free_compressed_dataset(compressed);
+    free_dec_tree(root);
+    free_dec_tree(remapped);
+}
+
+/**
+ * Compare direct classification with classification through a DTCache of
+ * 4096 entries, for 100000 requests spread over a growing number of image
+ * buffers (whose contents repeat every `test -> num_items` buffers, see
+ * replicate_dataset()): per-request latency and hit rate.
+ */
+static void bench_cache(Dataset *train, Dataset *test) {
+    int N = 100000;
+    DTNode *root = build_dec_tree(train);
+    Dataset *requests = replicate_dataset(test, N);
+
+    printf("\n%10s %12s %12s %9s\n", "buffers", "direct_ns", "cached_ns", "hit_rate");
+    for (int buffers = 10; buffers <= N; buffers *= 10) {
+        // request i reads buffer (i * 7919) % buffers, in scattered order
+        int *order = malloc(sizeof(int) * N);
+        for (int i = 0; i < N; i++) {
+            order[i] = (int) (((long) i * 7919) % buffers);
+        }
+
+        double start = now_seconds();
+        int direct = 0;
+        for (int i = 0; i < N; i++) {
+            direct += dec_tree_classify(root, &(requests -> images[order[i]]));
+        }
+        double direct_time = now_seconds() - start;
+
+        DTCache *cache = dt_cache_new(4096, 0);
+        start = now_seconds();
+        int cached = 0;
+        for (int i = 0; i < N; i++) {
+            cached += dt_cache_classify(cache, root, &(requests -> images[order[i]]));
+        }
+        double cached_time = now_seconds() - start;
+
+        DTCacheStats stats;
+        dt_cache_stats(cache, &stats);
+        printf("%10d %12.1f %12.1f %8.2f%%%s\n", buffers, direct_time * 1e9 / N,
+               cached_time * 1e9 / N, 100 * stats.hit_rate, direct == cached ? "" : " (mismatch)");
+        free_dt_cache(cache);
+        free(order);
+    }
+
+    free_dataset(requests);
+    free_dec_tree(root);
+}
+
+/**
+ * Compare training on shifted copies of the training images with training on
+ * a virtual augmented view of them (see dataset_augment()): bytes held per
+ * training item, build time and accuracy.
+ */
+static void bench_augment(Dataset *train, Dataset *test) {
+    printf("\n%-6s %-13s %8s %12s %10s %9s\n", "shift", "storage", "items", "bytes/item", "build_ms", "accuracy");
+    for (int max_shift = 1; max_shift <= 2; max_shift++) {
+        Dataset *augmented = dataset_augment(train, max_shift);
+        int N = augmented -> num_items;
+        Dataset *copies = alloc_dataset(N, WIDTH, WIDTH);
+        for (int i = 0; i < N; i++) {
+            copies -> labels[i] = augmented -> labels[i];
+            image_read(&(augmented -> images[i]), copies -> images[i].data);
+        }
+
+        for (int is_view = 0; is_view <= 1; is_view++) {
+            Dataset *data = is_view ? augmented : copies;
+            // a view holds an Image header and label per item, the pixels stay with `train`
+            double bytes = is_view ? sizeof(Image) + 1.0 : sizeof(Image) + 1.0 + NUM_PIXELS;
+
+            double start = now_seconds();
+            DTNode *root = build_dec_tree(data);
+            double build_time = now_seconds() - start;
+            int correct = dec_tree_evaluate(root, test);
+
+            printf("%-6d %-13s %8d %12.1f %10.1f %8.2f%%\n", max_shift, is_view ? "virtual" : "copies", N,
+                   bytes, build_time * 1e3, 100.0 * correct / test -> num_items);
+            free_dec_tree(root);
+        }
+        free_dataset(copies);
+        free_dataset(augmented);
+    }
+}
+
+/**
+ * Calibrate the split search strategies on the training data (see autotune.h)
+ * and compare the build time of the default and the tuned search.
+ */
+static void bench_autotune(Dataset *train) {
+    printf("\n%-9s %12s %14s %12s %10s\n", "mode", "calibrate_ms", "crossover", "default_ms", "tuned_ms");
+    for (int grayscale = 0; grayscale <= 1; grayscale++) {
+        DTParams params = dt_default_params();
+        params.grayscale = grayscale;
+
+        double start = now_seconds();
+        DTTuning *tuning = dt_autotune(train, &params, NULL);
+        double calibrate_time = now_seconds() - start;
+
+        start = now_seconds();
+        DTNode *root = build_dec_tree_params(train, &params);
+        double default_time = now_seconds() - start;
+        free_dec_tree(root);
+
+        params.tuning = tuning;
+        start = now_seconds();
+        root = build_dec_tree_params(train, &params);
+        double tuned_time = now_seconds() - start;
+        free_dec_tree(root);
+
+        printf("%-9s %12.1f %14d %12.1f %10.1f\n", grayscale ? "grayscale" : "binary", calibrate_time * 1e3,
+               grayscale ? tuning -> profile.image_major_min_items : tuning -> profile.bitset_min_items,
+               default_time * 1e3, tuned_time * 1e3);
+        free_dt_tuning(tuning);
+    }
+}
+
+/**
+ * Build and evaluate on the shifted training images (see dataset_augment())
+ * with thread pools of increasing size, and report how busy the workers were.
+ */
+static void bench_pool(Dataset *train) {
+    printf("\n%-8s %10s %10s %8s %8s\n", "threads", "build_ms", "eval_ms", "busy", "steals");
+    Dataset *augmented = dataset_augment(train, 1);
+    for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+        pool_init(num_threads, 0);
+        double start = now_seconds();
+        DTNode *root = build_dec_tree(augmented);
+        double build_time = now_seconds() - start;
+        start = now_seconds();
+        dec_tree_evaluate(root, augmented);
+        double eval_time = now_seconds() - start;
+        free_dec_tree(root);
+
+        PoolWorkerStats stats[8];
+        int num_workers = pool_stats(stats, 8);
+        double busy = 0, idle = 0;
+        unsigned long steals = 0;
+        for (int i = 0; i < num_workers; i++) {
+            busy += stats[i].busy_ns;
+            idle += stats[i].idle_ns;
+            steals += stats[i].steals;
+        }
+        printf("%-8d %10.1f %10.1f %7.0f%% %8lu\n", num_threads, build_time * 1e3, eval_time * 1e3,
+               busy + idle > 0 ? 100 * busy / (busy + idle) : 100.0, steals);
+        pool_shutdown();
+    }
+    free_dataset(augmented);
+}
+
+/* Time the forest's batch classification of `batch`, in ns per image, and check it against `expected` */
+static double time_forest(const Forest *forest, Dataset *batch, const int *expected, int *predictions) {
+    double start = now_seconds();
+    forest_classify_batch(forest, batch -> images, batch -> num_items, predictions);
+    double elapsed = now_seconds() - start;
+    if (memcmp(predictions, expected, sizeof(int) * batch -> num_items) != 0) {
+        printf("(mismatch) ");
+    }
+    return elapsed * 1e9 / batch -> num_items;
+}
+
+/**
+ * Classify a batch with forests of growing size (trees built on bootstrap
+ * samples of 2000 training images, to keep the build short) image by image,
+ * tree by tree over each chunk, in the tiles the cache sizes suggest, and in
+ * the tiles forest_tune() picks, and report the ns per image of each.
+ */
+static void bench_forest(Dataset *train, Dataset *test) {
+    int N = 8192;
+    Dataset *batch = replicate_dataset(test, N);
+    int *expected = malloc(sizeof(int) * N);
+    int *predictions = malloc(sizeof(int) * N);
+    DTParams params = dt_default_params();
+
+    printf("\n%-6s %8s %10s %10s %10s %10s %10s %9s\n", "trees", "nodes", "per_image", "tree_major",
+           "cache_tile", "tuned_tile", "tile", "accuracy");
+    for (int num_trees = 16; num_trees <= 256; num_trees *= 4) {
+        Forest *forest = build_forest(train, &params, num_trees, 2000, 1);
+        double start = now_seconds();
+        for (int i = 0; i < N; i++) {
+            expected[i] = forest_classify(forest, &(batch -> images[i]));
+        }
+        double per_image = (now_seconds() - start) * 1e9 / N;
+
+        int tree_block = forest -> tree_block, image_block = forest -> image_block;
+        forest -> tree_block = 1;
+        forest -> image_block = FOREST_CHUNK;
+        double tree_major = time_forest(forest, batch, expected, predictions);
+        forest -> tree_block = tree_block;
+        forest -> image_block = image_block;
+        double cache_tile = time_forest(forest, batch, expected, predictions);
+        forest_tune(forest, train);
+        double tuned_tile = time_forest(forest, batch, expected, predictions);
+
+        char tile[32];
+        snprintf(tile, sizeof(tile), "%dx%d", forest -> tree_block, forest -> image_block);
+        printf("%-6d %8d %10.0f %10.0f %10.0f %10.0f %10s %8.1f%%\n", num_trees, forest -> num_nodes,
+               per_image, tree_major, cache_tile, tuned_tile, tile,
+               100.0 * forest_evaluate(forest, test) / test -> num_items);
+        free_forest(forest);
+    }
+
+    free(predictions);
+    free(expected);
+    free_dataset(batch);
+}
+
+/**
+ * Put first stages of several depths in front of a tree (both trained on five
+ * sixths of the training images, the threshold calibrated on the rest) and
+ * report, for a few accuracy losses allowed, the share of images the first
+ * stage answers, the latency per image and the accuracy, next to the tree's.
+ */
+static void bench_cascade(Dataset *train, Dataset *test) {
+    Dataset *fit, *calibration;
+    dataset_fold(train, 6, 5, &fit, &calibration);
+    DTParams params = dt_default_params();
+    DTNode *root = build_dec_tree_params(fit, &params);
+    int N = test -> num_items;
+    int *predictions = malloc(sizeof(int) * (N + 1));
+
+    double start = now_seconds();
+    dec_tree_classify_batch(root, test -> images, N, predictions);
+    double tree_time = now_seconds() - start;
+    int correct = 0;
+    for (int i = 0; i < N; i++) {
+        correct += predictions[i] == test -> labels[i];
+    }
+    printf("\n%-6s %6s %6s %10s %9s %9s %9s\n", "depth", "loss", "nodes", "threshold", "stage1", "ns/image", "accuracy");
+    printf("%-6s %6s %6d %10s %9s %9.1f %8.1f%%\n", "tree", "-", dec_tree_num_nodes(root), "-", "-",
+           tree_time * 1e9 / N, 100.0 * correct / N);
+
+    for (int depth = 4; depth <= 8; depth += 2) {
+        for (int loss = 0; loss <= 2; loss++) { // percent
+            Cascade *cascade = build_cascade(fit, calibration, &params, depth, root, NULL, loss / 100.0);
+            correct = cascade_evaluate(cascade, test);
+            const CascadeStats *stats = &(cascade -> stats);
+            printf("%-6d %5d%% %6d %10.3f %8.1f%% %9.1f %8.1f%%\n", depth, loss,
+                   cascade -> num_nodes, cascade -> threshold, 100.0 * stats -> images[0] / N,
+                   (double) (stats -> ns[0] + stats -> ns[1]) / N, 100.0 * correct / N);
+            free_cascade(cascade);
+        }
+    }
+
+    free(predictions);
+    free_dec_tree(root);
+    free_dataset(fit);
+    free_dataset(calibration);
+}
+
+/* Number of models served by bench_store() */
+#ifndef STORE_BENCH_MODELS
+#define STORE_BENCH_MODELS 1000
+#endif
+
+/**
+ * Serve STORE_BENCH_MODELS copies of one model from a store that keeps a
+ * tenth of them mapped, picking models with a skewed (1 / rank) popularity,
+ * and report the store's load rate and its latency per image.
+ */
+static void bench_store(Dataset *train, Dataset *test) {
+    char directory[] = "/tmp/dtbench-store-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        fprintf(stderr, "Error: could not create a model directory\n");
+        return;
+    }
+    DTNode *root = build_dec_tree(train);
+    char path[sizeof(directory) + 32];
+    for (int i = 0; i < STORE_BENCH_MODELS; i++) {
+        sprintf(path, "%s/m%d.dtm", directory, i);
+        dec_tree_save_model(root, path);
+    }
+    DTModel *model = model_from_tree(root);
+    size_t budget = model -> map_size * (STORE_BENCH_MODELS / 10);
+    model_unmap(model);
+    free_dec_tree(root);
+
+    ModelStore *store = store_new(directory, budget);
+    double harmonic = 0;
+    for (int i = 1; i <= STORE_BENCH_MODELS; i++) {
+        harmonic += 1.0 / i;
+    }
+    srand(42);
+    int requests = 20 * STORE_BENCH_MODELS, correct = 0;
+    double start = now_seconds();
+    for (int r = 0; r < requests; r++) {
+        // model of rank k with probability (1 / k) / harmonic
+        double u = (double) rand() / RAND_MAX * harmonic, sum = 0;
+        int k = 1;
+        while (k < STORE_BENCH_MODELS && (sum += 1.0 / k) < u) {
+            k++;
+        }
+        char id[32];
+        sprintf(id, "m%d", k - 1);
+        int i = r % test -> num_items;
+        correct += store_classify(store, id, &(test -> images[i])) == test -> labels[i];
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("\n%-8s %10s %10s %10s %10s\n", "models", "requests", "load_rate", "ns/image", "accuracy");
+    printf("%-8d %10d %9.1f%% %10.0f %9.2f%%\n", STORE_BENCH_MODELS, requests,
+           100.0 * store -> loads / requests, elapsed * 1e9 / requests, 100.0 * correct / requests);
+    free_model_store(store);
+    for (int i = 0; i < STORE_BENCH_MODELS; i++) {
+        sprintf(path, "%s/m%d.dtm", directory, i);
+        unlink(path);
+    }
+    rmdir(directory);
+}
+
+int main(int argc, char *argv[]) {
+    Dataset *train = NULL, *test = NULL;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s training_data [testing_data]\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3) {
+        train = load_dataset(argv[1]);
+        test = train == NULL ? NULL : load_dataset(argv[2]);
+    } else {
+        Dataset *all_data = load_dataset(argv[1]);
+        if (all_data != NULL) {
+            dataset_fold(all_data, 6, 5, &train, &test);
+            free_dataset(all_data);
+        }
+    }
+    if (test == NULL) {
+        if (train != NULL) {
+            free_dataset(train);
+        }
+        return 1;
+    }
+
+    bench_criteria(train, test);
+    bench_oblivious(train, test);
+    bench_features(train, test);
+    bench_batch(train, test);
+    bench_tensor(train, test);
+    bench_preprocess(train, test);
+    bench_layouts(train, test);
+    bench_cache(train, test);
+    bench_augment(train, test);
+    bench_autotune(train);
+    bench_cascade(train, test);
+    bench_forest(train, test);
+    bench_pool(train);
+    bench_store(train, test);
+
+    free_dataset(train);
+    free_dataset(test);
+    return 0;
+}
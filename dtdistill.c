@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dectree.h"
+#include "distill.h"
+#include "forest.h"
+#include "model.h"
+#include "pool.h"
+
+/**
+ * dtdistill: distill a forest into a single tree (see distill.h).
+ *
+ *    ./dtdistill [--trees=T] [--augment=S] [--threads=N] [--save-model=F] training_data [testing_data]
+ *
+ * Builds a forest of T trees (default FOREST_TREES) on the training data,
+ * labels a pool of images with its votes (the training images, with every
+ * shift of up to S pixels if given, see dataset_augment()) and builds a tree
+ * on the pool with the votes as soft labels. Prints, for the forest, a tree
+ * built on the pool with its hard labels and the distilled tree: the node
+ * count, depth, accuracy on the testing data, agreement with the forest and
+ * classify latency (one image at a time and in batch), so the accuracy the
+ * single tree gives up can be weighed against the latency it saves. If
+ * testing_data is omitted, the last sixth of training_data is held out for
+ * testing. With --save-model, the distilled tree is saved as a flat model
+ * file F (see model.h).
+ */
+
+/**
+ * Print the line of a model: `forest` if not NULL, `root` otherwise. The
+ * predictions of the forest on `test` are `expected`.
+ */
+static void report_model(const char *name, const Forest *forest, DTNode *root, Dataset *test,
+                         const int *expected, int *predictions) {
+    int N = test -> num_items;
+    double start = now_seconds();
+    for (int i = 0; i < N; i++) {
+        predictions[i] = forest != NULL ? forest_classify(forest, &(test -> images[i]))
+                                        : dec_tree_classify(root, &(test -> images[i]));
+    }
+    double image_time = now_seconds() - start;
+    start = now_seconds();
+    if (forest != NULL) {
+        forest_classify_batch(forest, test -> images, N, predictions);
+    } else {
+        dec_tree_classify_batch(root, test -> images, N, predictions);
+    }
+    double batch_time = now_seconds() - start;
+
+    int correct = 0, agree = 0;
+    for (int i = 0; i < N; i++) {
+        correct += predictions[i] == test -> labels[i];
+        agree += predictions[i] == expected[i];
+    }
+    int nodes = forest != NULL ? forest -> num_nodes : dec_tree_num_nodes(root);
+    int depth = forest != NULL ? -1 : dec_tree_depth(root);
+    printf("%-10s %8d %6d %8.2f%% %9.2f%% %12.1f %12.1f\n", name, nodes, depth, 100.0 * correct / N,
+           100.0 * agree / N, image_time * 1e9 / N, batch_time * 1e9 / N);
+}
+
+int main(int argc, char *argv[]) {
+    int num_trees = FOREST_TREES;
+    int max_shift = 0;
+    int num_threads = 1;
+    const char *model_file = NULL;
+    char *files[2];
+    int num_files = 0;
+    int usage = 0;
+
+    // parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--trees=", 8) == 0) {
+            num_trees = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--augment=", 10) == 0) {
+            max_shift = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            num_threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--save-model=", 13) == 0) {
+            model_file = argv[i] + 13;
+        } else if (argv[i][0] != '-' && num_files < 2) {
+            files[num_files++] = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || num_files == 0 || num_trees < 1 || max_shift < 0) {
+        fprintf(stderr, "Usage: %s [--trees=T] [--augment=S] [--threads=N] [--save-model=F] training_data"
+                " [testing_data]\n", argv[0]);
+        return 1;
+    }
+    if (num_threads != 1 && pool_init(num_threads, 0) != 0) {
+        return 1;
+    }
+
+    Dataset *train = NULL, *test = NULL;
+    if (num_files == 2) {
+        train = load_dataset(files[0]);
+        test = train == NULL ? NULL : load_dataset(files[1]);
+    } else {
+        Dataset *all_data = load_dataset(files[0]);
+        if (all_data != NULL) {
+            dataset_fold(all_data, 6, 5, &train, &test);
+            free_dataset(all_data);
+        }
+    }
+    if (test == NULL) {
+        if (train != NULL) {
+            free_dataset(train);
+        }
+        return 1;
+    }
+    Dataset *pool = max_shift > 0 ? dataset_augment(train, max_shift) : dataset_retain(train);
+    if (pool == NULL) {
+        free_dataset(train);
+        free_dataset(test);
+        return 1;
+    }
+    DTParams params = dt_default_params();
+
+    double start = now_seconds();
+    Forest *forest = build_forest(train, &params, num_trees, 0, 1);
+    if (forest == NULL) {
+        free_dataset(pool);
+        free_dataset(train);
+        free_dataset(test);
+        return 1;
+    }
+    forest_tune(forest, train);
+    double forest_time = now_seconds() - start;
+    start = now_seconds();
+    DTNode *hard = build_dec_tree_params(pool, &params);
+    double hard_time = now_seconds() - start;
+    start = now_seconds();
+    DTNode *distilled = distill_forest(forest, pool, &params);
+    double distill_time = now_seconds() - start;
+    printf("forest of %d trees built in %.1f ms; pool of %d images: hard-label tree built in %.1f ms,"
+           " labelled and distilled in %.1f ms\n", forest -> num_trees, forest_time * 1e3, pool -> num_items,
+           hard_time * 1e3, distill_time * 1e3);
+
+    int status = 0;
+    if (hard == NULL || distilled == NULL) {
+        status = 1;
+    } else {
+        int N = test -> num_items;
+        int *expected = malloc(sizeof(int) * (N + 1));
+        int *predictions = malloc(sizeof(int) * (N + 1));
+        forest_classify_batch(forest, test -> images, N, expected);
+        printf("\n%-10s %8s %6s %9s %10s %12s %12s\n", "model", "nodes", "depth", "accuracy", "agreement",
+               "classify_ns", "batch_ns");
+        report_model("forest", forest, NULL, test, expected, predictions);
+        report_model("tree", NULL, hard, test, expected, predictions);
+        report_model("distilled", NULL, distilled, test, expected, predictions);
+        if (model_file != NULL && dec_tree_save_model(distilled, model_file) != 0) {
+            status = 1;
+        }
+        free(expected);
+        free(predictions);
+    }
+
+    if (hard != NULL) {
+        free_dec_tree(hard);
+    }
+    if (distilled != NULL) {
+        free_dec_tree(distilled);
+    }
+    free_forest(forest);
+    free_dataset(pool);
+    free_dataset(train);
+    free_dataset(test);
+    if (pool_stats(NULL, 0) > 0) {
+        pool_shutdown();
+    }
+    return status;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "multieval.h"
+#include "pool.h"
+
+/**
+ * dteval: compare model candidates on the same testing data in one pass.
+ *
+ *    ./dteval [--block=B] [--threads=N] [--separate] model_file... testing_data
+ *
+ * Maps every flat model file (see model.h) and streams the dataset file
+ * testing_data once, B images at a time (default EVAL_BLOCK), each block
+ * being classified by every model while it is in cache (see multieval.h).
+ * Prints each model's node count, depth, accuracy and classify latency, the
+ * number of images each pair of models labels differently, and the time the
+ * pass took. With --separate, each model is then also evaluated in a pass of
+ * its own, as separate runs would, and the time of those passes is printed
+ * for comparison.
+ */
+
+int main(int argc, char *argv[]) {
+    int block = EVAL_BLOCK;
+    int num_threads = 1;
+    int separate = 0;
+    char **files = malloc(sizeof(char *) * argc);
+    int num_files = 0;
+    int usage = 0;
+
+    // parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--block=", 8) == 0) {
+            block = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            num_threads = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--separate") == 0) {
+            separate = 1;
+        } else if (argv[i][0] != '-') {
+            files[num_files++] = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || num_files < 2 || block < 1) {
+        fprintf(stderr, "Usage: %s [--block=B] [--threads=N] [--separate] model_file... testing_data\n", argv[0]);
+        free(files);
+        return 1;
+    }
+    if (num_threads != 1 && pool_init(num_threads, 0) != 0) {
+        free(files);
+        return 1;
+    }
+
+    // the last file is the testing data, the others the models
+    int num_models = num_files - 1;
+    const char *testing_file = files[num_models];
+    const DTModel **models = malloc(sizeof(DTModel *) * num_models);
+    int status = 0;
+    for (int m = 0; m < num_models; m++) {
+        models[m] = model_map(files[m]);
+        if (models[m] == NULL) {
+            num_models = m;
+            status = 1;
+            break;
+        }
+    }
+
+    if (status == 0) {
+        MultiEval *eval = multi_eval_create(models, num_models, block);
+        double start = now_seconds();
+        status = eval == NULL || multi_eval_file(eval, testing_file) != 0;
+        double elapsed = now_seconds() - start;
+        if (eval != NULL && eval -> images > 0) { // what was read of a truncated file still counts
+            multi_eval_print(eval, files, stdout);
+            printf("\none pass for %d models: %.1f ms\n", num_models, elapsed * 1e3);
+        }
+        if (eval != NULL) {
+            free_multi_eval(eval);
+        }
+    }
+    if (status == 0 && separate) {
+        double start = now_seconds();
+        for (int m = 0; m < num_models && status == 0; m++) {
+            MultiEval *eval = multi_eval_create(&(models[m]), 1, block);
+            status = eval == NULL || multi_eval_file(eval, testing_file) != 0;
+            if (eval != NULL) {
+                free_multi_eval(eval);
+            }
+        }
+        printf("one pass per model: %.1f ms\n", (now_seconds() - start) * 1e3);
+    }
+
+    for (int m = 0; m < num_models; m++) {
+        model_unmap((DTModel *) models[m]);
+    }
+    free(models);
+    free(files);
+    if (pool_stats(NULL, 0) > 0) {
+        pool_shutdown();
+    }
+    return status;
+}
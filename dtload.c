@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dectree.h"
+#include "histogram.h"
+#include "model.h"
+#include "pool.h"
+
+/**
+ * dtload: open-loop load generator for the inference path.
+ *
+ *    ./dtload [--rate=R] [--duration=S] [--sweep[=F]]
+ *             (--model=F [--threads=N] | --socket=PATH [--connections=C] [--id=ID]) data
+ *
+ * Replays the images of the dataset file `data` (cycling through them) at R
+ * images per second (default 1000) for S seconds (default 2), against either
+ *
+ *  - the flat model file F (see model.h) classified in-process by N threads
+ *    (default 1), or
+ *  - a dtserve listening on the Unix socket PATH, over C pipelined
+ *    connections (default 1; dtserve serves one connection per worker, so C
+ *    should not exceed its workers). With --id, every connection first names
+ *    model ID of a dtserve --models store.
+ *
+ * The schedule is open-loop: image i is due at start + i / R whatever happened
+ * to the images before it, and its latency is measured from when it was due,
+ * not from when it could be sent. A server that stalls therefore shows its
+ * stall in the latency of every image that should have been sent meanwhile,
+ * instead of silently slowing the generator down (coordinated omission).
+ *
+ * Prints the target and achieved throughput, latency percentiles from an HDR
+ * histogram (see histogram.h) in microseconds, and the accuracy of the
+ * answers. With --sweep, the rate is multiplied by F (default 2) after each
+ * run until the target saturates (it falls short of the rate by more than
+ * LOAD_SATURATION_RATIO, or its p99 latency grows LOAD_LATENCY_FACTOR times
+ * past the first run's), then the knee between the last sustained rate and
+ * the first saturated one is narrowed down by bisection.
+ */
+
+/* A run saturates when it achieves less than this fraction of its target rate */
+#ifndef LOAD_SATURATION_RATIO
+#define LOAD_SATURATION_RATIO 0.95
+#endif
+
+/* ... or when its p99 latency exceeds the first run's this many times */
+#ifndef LOAD_LATENCY_FACTOR
+#define LOAD_LATENCY_FACTOR 10
+#endif
+
+/* Runs spent narrowing down the knee of a sweep */
+#ifndef LOAD_BISECT_STEPS
+#define LOAD_BISECT_STEPS 3
+#endif
+
+/* Waits end with a spin of this many ns, which wakes up on time more reliably than a sleep */
+#ifndef LOAD_SPIN_NS
+#define LOAD_SPIN_NS 50000
+#endif
+
+/* Most connections and in-process threads */
+#ifndef LOAD_MAX_STREAMS
+#define LOAD_MAX_STREAMS 256
+#endif
+
+/* Where the load goes, and the images it replays */
+typedef struct {
+    Dataset *data;
+    unsigned char *pixels;      // The images of `data`, NUM_PIXELS bytes each
+    const DTModel *model;       // In-process target, or NULL
+    int num_threads;
+    const char *socket_path;    // Socket target, or NULL
+    const char *model_id;       // Model of a dtserve store, or NULL
+    int num_connections;
+} Target;
+
+/* One run at a fixed rate */
+typedef struct {
+    const Target *target;
+    double rate;                // Images per second
+    uint64_t total;             // Images sent
+    uint64_t start;             // When image 0 is due, in ns
+    double interval;            // Between two images, in ns
+    uint64_t next;              // Next image to classify (in-process)
+} LoadRun;
+
+/* What a thread of a run measured */
+typedef struct {
+    LoadRun *run;
+    int stream;                 // Connection or thread number
+    int fd;                     // Connection (socket target)
+    Histogram latency;          // Latency of each image, from when it was due, in ns
+    uint64_t completed;
+    uint64_t correct;
+    uint64_t last;              // Last completion, in ns
+    pthread_t thread;
+} Stream;
+
+/* Wait until the monotonic time `due` (in ns), if it is still ahead */
+static void sleep_until(uint64_t due) {
+    uint64_t now = now_ns();
+    if (now + LOAD_SPIN_NS < due) {
+        uint64_t wake = due - LOAD_SPIN_NS;
+        struct timespec ts = {(time_t) (wake / 1000000000u), (long) (wake % 1000000000u)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+    }
+    while (now_ns() < due) {
+    }
+}
+
+/* Return when image i of the run is due, in ns */
+static inline uint64_t due_time(const LoadRun *run, uint64_t i) {
+    return run -> start + (uint64_t) (i * run -> interval);
+}
+
+/* Count the answer `label` to image i of the run, received at `done` */
+static inline void complete(Stream *stream, uint64_t i, int label, uint64_t done) {
+    const Dataset *data = stream -> run -> target -> data;
+    hist_record(&(stream -> latency), done - due_time(stream -> run, i));
+    stream -> completed++;
+    stream -> correct += label == data -> labels[i % data -> num_items];
+    stream -> last = done;
+}
+
+/**
+ * Body of an in-process thread: take the next image, wait until it is due,
+ * classify it. Late threads take overdue images at once, so a backlog shows
+ * up in the latencies.
+ */
+static void *classify_stream(void *arg) {
+    Stream *stream = arg;
+    LoadRun *run = stream -> run;
+    const Target *target = run -> target;
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&(run -> next), 1, __ATOMIC_RELAXED);
+        if (i >= run -> total) {
+            break;
+        }
+        sleep_until(due_time(run, i));
+        int label = model_classify(target -> model, &(target -> data -> images[i % target -> data -> num_items]));
+        complete(stream, i, label, now_ns());
+    }
+    return NULL;
+}
+
+/**
+ * Body of the receiver of a connection: read the labels of its images, which
+ * are images stream, stream + C, stream + 2C, ... of the run, until it has
+ * them all or the connection ends.
+ */
+static void *receive_stream(void *arg) {
+    Stream *stream = arg;
+    LoadRun *run = stream -> run;
+    int C = run -> target -> num_connections;
+    uint64_t i = stream -> stream;
+    unsigned char labels[4096];
+    while (i < run -> total) {
+        ssize_t got = read(stream -> fd, labels, sizeof(labels));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        uint64_t done = now_ns();
+        for (ssize_t k = 0; k < got && i < run -> total; k++, i += C) {
+            complete(stream, i, labels[k], done);
+        }
+    }
+    return NULL;
+}
+
+/* Write the `size` bytes of `buffer` to `fd`. Return 0 on success, -1 on error */
+static int write_all(int fd, const unsigned char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Connect to the server at `path`, naming model `id` first if not NULL.
+ * Return the connection, or -1 on error.
+ */
+static int connect_server(const char *path, const char *id) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: could not connect to %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (id != NULL) {
+        unsigned char status = 1;
+        int ok = write_all(fd, (const unsigned char *) id, strlen(id)) == 0
+                 && write_all(fd, (const unsigned char *) "\n", 1) == 0 && read(fd, &status, 1) == 1;
+        if (!ok || status != 0) {
+            fprintf(stderr, "Error: %s does not serve model %s\n", path, id);
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/**
+ * Send the images of the run over the connections of `streams`, image i on
+ * connection i % C as soon as it is due (the images already due go out
+ * together), then close the sending side so the server finishes.
+ */
+static void send_images(LoadRun *run, Stream *streams) {
+    const Target *target = run -> target;
+    int C = target -> num_connections;
+    int N = target -> data -> num_items;
+    for (uint64_t i = 0; i < run -> total; i++) {
+        sleep_until(due_time(run, i));
+        Stream *stream = &(streams[i % C]);
+        if (stream -> fd >= 0
+                && write_all(stream -> fd, target -> pixels + (size_t) (i % N) * NUM_PIXELS, NUM_PIXELS) != 0) {
+            fprintf(stderr, "Error: connection %d closed by the server\n", stream -> stream);
+            shutdown(stream -> fd, SHUT_RDWR);
+            stream -> fd = -1;
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        if (streams[c].fd >= 0) {
+            shutdown(streams[c].fd, SHUT_WR);
+        }
+    }
+}
+
+/**
+ * Run the load at `rate` images per second for `duration` seconds and print
+ * one line of results. The latencies of all streams are merged into
+ * `latency`, and the achieved rate is returned (0 if the run failed).
+ */
+static double run_load(const Target *target, double rate, double duration, Histogram *latency) {
+    LoadRun run = {target, rate, (uint64_t) (rate * duration), 0, 1e9 / rate, 0};
+    run.total = run.total < 1 ? 1 : run.total;
+    int num_streams = target -> model != NULL ? target -> num_threads : target -> num_connections;
+    Stream *streams = calloc(num_streams, sizeof(Stream));
+    int ok = 1;
+    for (int s = 0; s < num_streams; s++) {
+        streams[s].run = &run;
+        streams[s].stream = s;
+        streams[s].fd = -1;
+        hist_clear(&(streams[s].latency));
+        if (target -> model == NULL) {
+            streams[s].fd = connect_server(target -> socket_path, target -> model_id);
+            ok = ok && streams[s].fd >= 0;
+        }
+    }
+
+    if (ok) {
+        run.start = now_ns() + 1000000; // 1 ms for the threads to start
+        for (int s = 0; s < num_streams; s++) {
+            pthread_create(&(streams[s].thread), NULL, target -> model != NULL ? classify_stream : receive_stream,
+                           &(streams[s]));
+        }
+        if (target -> model == NULL) {
+            send_images(&run, streams);
+        }
+        for (int s = 0; s < num_streams; s++) {
+            pthread_join(streams[s].thread, NULL);
+        }
+    }
+
+    hist_clear(latency);
+    uint64_t completed = 0, correct = 0, last = run.start;
+    for (int s = 0; s < num_streams; s++) {
+        hist_merge(latency, &(streams[s].latency));
+        completed += streams[s].completed;
+        correct += streams[s].correct;
+        last = streams[s].last > last ? streams[s].last : last;
+        if (streams[s].fd >= 0) {
+            close(streams[s].fd);
+        }
+    }
+    free(streams);
+    if (!ok) {
+        return 0;
+    }
+
+    double achieved = last > run.start ? completed / ((last - run.start) * 1e-9) : 0;
+    printf("%10.0f %10.0f %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.1f%%\n", rate, achieved,
+           (unsigned long long) (run.total - completed), hist_mean(latency) * 1e-3,
+           hist_percentile(latency, 50) * 1e-3, hist_percentile(latency, 90) * 1e-3,
+           hist_percentile(latency, 99) * 1e-3, hist_percentile(latency, 99.9) * 1e-3,
+           latency -> max * 1e-3, completed > 0 ? 100.0 * correct / completed : 0.0);
+    fflush(stdout);
+    return completed == run.total ? achieved : 0;
+}
+
+/* Return 1 if a run at `rate` that achieved `achieved` with `latency` saturated the target */
+static int saturated(double rate, double achieved, const Histogram *latency, uint64_t first_p99) {
+    return achieved < LOAD_SATURATION_RATIO * rate
+           || hist_percentile(latency, 99) > LOAD_LATENCY_FACTOR * (first_p99 > 0 ? first_p99 : 1);
+}
+
+int main(int argc, char *argv[]) {
+    Target target = {NULL, NULL, NULL, 1, NULL, NULL, 1};
+    const char *model_file = NULL;
+    const char *data_file = NULL;
+    double rate = 1000;
+    double duration = 2;
+    double sweep_factor = 0;
+
+    // parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--rate=", 7) == 0) {
+            rate = atof(argv[i] + 7);
+        } else if (strncmp(argv[i], "--duration=", 11) == 0) {
+            duration = atof(argv[i] + 11);
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            sweep_factor = 2;
+        } else if (strncmp(argv[i], "--sweep=", 8) == 0) {
+            sweep_factor = atof(argv[i] + 8);
+        } else if (strncmp(argv[i], "--model=", 8) == 0) {
+            model_file = argv[i] + 8;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            target.num_threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--socket=", 9) == 0) {
+            target.socket_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--connections=", 14) == 0) {
+            target.num_connections = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--id=", 5) == 0) {
+            target.model_id = argv[i] + 5;
+        } else if (argv[i][0] != '-' && data_file == NULL) {
+            data_file = argv[i];
+        } else {
+            data_file = NULL;
+            break;
+        }
+    }
+    if (data_file == NULL || (model_file == NULL) == (target.socket_path == NULL) || rate <= 0 || duration <= 0
+            || (sweep_factor != 0 && sweep_factor <= 1)
+            || target.num_threads < 1 || target.num_threads > LOAD_MAX_STREAMS
+            || target.num_connections < 1 || target.num_connections > LOAD_MAX_STREAMS) {
+        fprintf(stderr, "Usage: %s [--rate=R] [--duration=S] [--sweep[=F]] (--model=F [--threads=N]"
+                " | --socket=PATH [--connections=C] [--id=ID]) data\n", argv[0]);
+        return 1;
+    }
+
+    target.data = load_dataset(data_file);
+    if (target.data == NULL) {
+        return 1;
+    }
+    if (target.data -> num_items == 0) {
+        fprintf(stderr, "Error: no images in %s\n", data_file);
+        free_dataset(target.data);
+        return 1;
+    }
+    target.pixels = malloc((size_t) target.data -> num_items * NUM_PIXELS);
+    for (int i = 0; i < target.data -> num_items; i++) {
+        image_read(&(target.data -> images[i]), target.pixels + (size_t) i * NUM_PIXELS);
+    }
+    DTModel *model = NULL;
+    if (model_file != NULL) {
+        model = model_map(model_file);
+        if (model == NULL) {
+            free(target.pixels);
+            free_dataset(target.data);
+            return 1;
+        }
+        target.model = model;
+    }
+    signal(SIGPIPE, SIG_IGN); // a server that goes away is reported, not fatal
+
+    printf("%10s %10s %8s %9s %9s %9s %9s %9s %9s %9s\n", "rate", "achieved", "missing", "mean_us", "p50_us",
+           "p90_us", "p99_us", "p99.9_us", "max_us", "accuracy");
+    Histogram *latency = malloc(sizeof(Histogram));
+    double achieved = run_load(&target, rate, duration, latency);
+    int status = achieved > 0 ? 0 : 1;
+    if (sweep_factor > 0 && achieved > 0) {
+        // multiply the rate until the target saturates, then bisect the knee
+        uint64_t first_p99 = hist_percentile(latency, 99);
+        double good = 0, bad = 0;
+        if (saturated(rate, achieved, latency, first_p99)) {
+            bad = rate;
+        } else {
+            good = rate;
+            while (bad == 0) {
+                rate *= sweep_factor;
+                achieved = run_load(&target, rate, duration, latency);
+                if (achieved == 0 || saturated(rate, achieved, latency, first_p99)) {
+                    bad = rate;
+                } else {
+                    good = rate;
+                }
+            }
+        }
+        for (int step = 0; step < LOAD_BISECT_STEPS && good > 0; step++) {
+            rate = sqrt(good * bad);
+            achieved = run_load(&target, rate, duration, latency);
+            if (achieved == 0 || saturated(rate, achieved, latency, first_p99)) {
+                bad = rate;
+            } else {
+                good = rate;
+            }
+        }
+        if (good > 0) {
+            printf("knee: sustained %.0f images/s, saturated at %.0f images/s\n", good, bad);
+        } else {
+            printf("knee: saturated at the first rate, %.0f images/s\n", bad);
+        }
+    }
+
+    free(latency);
+    if (model != NULL) {
+        model_unmap(model);
+    }
+    free(target.pixels);
+    free_dataset(target.data);
+    return status;
+}
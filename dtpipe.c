@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "pipeline.h"
+
+/**
+ * dtpipe: classify a stream of frames from capture to label.
+ *
+ *    ./dtpipe --model=F [--dataset] [--center] [--depth=Q] [--batch=B] [--pin[=CPU]] [--quiet] [input]
+ *
+ * Reads frames from `input` (default: standard input), a frame stream or,
+ * with --dataset, a dataset file (see pipeline.h), and classifies them with
+ * the flat model file F through the staged pipeline: rings of Q frames
+ * between stages (default PIPE_DEPTH), batches of up to B frames (default
+ * PIPE_BATCH). With --center, frames are cropped to their ink and centered
+ * by mass like MNIST digits instead of resized whole. With --pin, stage s
+ * runs on the (CPU + s)-th allowed CPU (default CPU 0). Prints the predicted
+ * labels to standard output, one per line in stream order (unless --quiet),
+ * and the measurements of each stage to standard error.
+ */
+
+int main(int argc, char *argv[]) {
+    const char *model_file = NULL;
+    const char *input_file = NULL;
+    PipeFormat format = PIPE_FRAMES;
+    int depth = PIPE_DEPTH;
+    int batch = PIPE_BATCH;
+    int pin = 0;
+    int first_cpu = 0;
+    int center = 0;
+    int quiet = 0;
+    int usage = 0;
+
+    // parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--model=", 8) == 0) {
+            model_file = argv[i] + 8;
+        } else if (strcmp(argv[i], "--dataset") == 0) {
+            format = PIPE_DATASET;
+        } else if (strcmp(argv[i], "--center") == 0) {
+            center = 1;
+        } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+            depth = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = atoi(argv[i] + 8);
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin = 1;
+        } else if (strncmp(argv[i], "--pin=", 6) == 0) {
+            pin = 1;
+            first_cpu = atoi(argv[i] + 6);
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            quiet = 1;
+        } else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) && input_file == NULL) {
+            input_file = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || model_file == NULL || depth < 1 || batch < 1 || first_cpu < 0) {
+        fprintf(stderr, "Usage: %s --model=F [--dataset] [--center] [--depth=Q] [--batch=B] [--pin[=CPU]]"
+                " [--quiet] [input]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *input = stdin;
+    if (input_file != NULL && strcmp(input_file, "-") != 0) {
+        input = fopen(input_file, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "Error: could not open %s\n", input_file);
+            return 1;
+        }
+    }
+    DTModel *model = model_map(model_file);
+    if (model == NULL) {
+        return 1;
+    }
+    Pipeline *pipeline = pipeline_create(model, depth, batch, center, pin, first_cpu);
+    if (pipeline == NULL) {
+        model_unmap(model);
+        return 1;
+    }
+
+    int status = pipeline_run(pipeline, input, format, quiet ? NULL : stdout);
+    pipeline_print_stats(pipeline, stderr);
+
+    free_pipeline(pipeline);
+    model_unmap(model);
+    if (input != stdin) {
+        fclose(input);
+    }
+    return status == 0 ? 0 : 1;
+}
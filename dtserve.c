@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dectree.h"
+#include "model.h"
+#include "pool.h"
+#include "store.h"
+
+/**
+ * dtserve: pre-forked classification server.
+ *
+ *    ./dtserve [--workers=N] [--pin] [--socket=PATH] (model_file | --train=training_data
+ *                                                     | --models=DIR [--budget=MB])
+ *
+ * The parent maps the model read-only once (a model file written by
+ * `classifier --save-model`, or a tree trained on `training_data` and
+ * flattened into an anonymous shared mapping), then forks N workers (default:
+ * one per CPU) that inherit the mapping: the model's pages are shared, not
+ * copied. Workers accept connections on the Unix socket PATH and classify
+ * against the shared pages; with --pin worker i runs on the i-th CPU.
+ *
+ * A worker that exits or crashes is respawned in its slot from the parent,
+ * which still holds the mapping, so nothing is loaded again. SIGINT or SIGTERM
+ * stops the workers and removes the socket.
+ *
+ * Protocol: the client writes images of NUM_PIXELS bytes (row-major colors),
+ * and reads back one byte per image, its predicted label, in order. Images
+ * may be pipelined; the connection ends when the client closes it.
+ *
+ * With --models=DIR, the server hosts every model of a ModelStore (see
+ * store.h) over DIR: model `id` is the file DIR/id.dtm, mapped on demand and
+ * unmapped when it is among the least recently used once more than MB
+ * megabytes of models are mapped (per worker; the pages of the files are
+ * shared by all of them). A connection then starts with the model id and a
+ * newline, answered by one status byte (0: the model is served, 1: no such
+ * model, and the connection is closed) before the images. On exit, every
+ * worker prints the counters of its store.
+ */
+
+/* Socket the server listens on when --socket is not given */
+#ifndef DTSERVE_SOCKET
+#define DTSERVE_SOCKET "dtserve.sock"
+#endif
+
+/* A worker classifies the images of a connection this many at a time */
+#ifndef SERVE_BATCH
+#define SERVE_BATCH 64
+#endif
+
+/* Number of models whose counters a worker prints on exit */
+#ifndef STATS_MODELS
+#define STATS_MODELS 10
+#endif
+
+/* Workers that die sooner than this many seconds after starting are respawned after a pause */
+#ifndef RESPAWN_MIN_SECONDS
+#define RESPAWN_MIN_SECONDS 1.0
+#endif
+
+/* Set by the signal handler of the workers, and by the parent when it takes a stop signal */
+static volatile sig_atomic_t stopping = 0;
+
+/* Signal mask of the workers (the parent blocks SIGINT, SIGTERM and SIGCHLD to wait for them) */
+static sigset_t worker_mask;
+
+static void handle_stop(int signal_number) {
+    (void) signal_number;
+    stopping = 1;
+}
+
+/* Write the `size` bytes of `buffer` to `fd`. Return 0 on success, -1 on error */
+static int write_all(int fd, const unsigned char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Read from `fd` into buffer[*filled ..] (of `size` bytes). Return the number
+ * of bytes read, or 0 when the connection ended or the server is stopping.
+ */
+static size_t read_more(int fd, unsigned char *buffer, size_t size, size_t *filled) {
+    while (!stopping) {
+        ssize_t got = read(fd, buffer + *filled, size - *filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return 0;
+        }
+        *filled += got;
+        return got;
+    }
+    return 0;
+}
+
+/**
+ * Classify the images sent on connection `fd` until the client closes it,
+ * answering each batch of complete images as soon as it has arrived. With a
+ * store, the connection first names its model (see the protocol above).
+ */
+static void serve_connection(const DTModel *model, ModelStore *store, int fd) {
+    static unsigned char buffer[SERVE_BATCH * NUM_PIXELS];
+    unsigned char labels[SERVE_BATCH];
+    size_t filled = 0;
+
+    StoreEntry *entry = NULL;
+    if (store != NULL) {
+        // the model id, up to the newline
+        unsigned char *newline = NULL;
+        while (newline == NULL && filled <= STORE_ID_MAX && read_more(fd, buffer, sizeof(buffer), &filled) > 0) {
+            newline = memchr(buffer, '\n', filled);
+        }
+        if (newline != NULL) {
+            *newline = '\0';
+            entry = store_acquire(store, (char *) buffer);
+        }
+        unsigned char status = entry != NULL ? 0 : 1;
+        if (write_all(fd, &status, 1) != 0 || entry == NULL) {
+            if (entry != NULL) {
+                store_release(store, entry);
+            }
+            close(fd);
+            return;
+        }
+        model = entry -> model;
+        filled -= newline + 1 - buffer;
+        memmove(buffer, newline + 1, filled);
+    }
+
+    do {
+        int count = filled / (NUM_PIXELS);
+        for (int i = 0; i < count; i++) {
+            Image img = {WIDTH, WIDTH, buffer + (size_t) i * NUM_PIXELS, 0, 0};
+            labels[i] = model_classify(model, &img);
+        }
+        if (count > 0) {
+            if (write_all(fd, labels, count) != 0) {
+                break;
+            }
+            if (entry != NULL) {
+                store_count(entry, count);
+            }
+        }
+        // keep the start of an incomplete image for the next read
+        filled -= (size_t) count * NUM_PIXELS;
+        memmove(buffer, buffer + (size_t) count * NUM_PIXELS, filled);
+    } while (read_more(fd, buffer, sizeof(buffer), &filled) > 0);
+
+    if (entry != NULL) {
+        store_release(store, entry);
+    }
+    close(fd);
+}
+
+/**
+ * Body of a worker process: accept connections and serve them, one at a time,
+ * until the server stops.
+ */
+static void worker_main(const DTModel *model, ModelStore *store, int listen_fd, int slot, int pin) {
+    if (pin) {
+        cpu_set_t allowed, set;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            int num_cpus = CPU_COUNT(&allowed), seen = 0;
+            CPU_ZERO(&set);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed) && seen++ == slot % num_cpus) {
+                    CPU_SET(cpu, &set);
+                    break;
+                }
+            }
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+                fprintf(stderr, "Error: could not pin worker %d\n", slot);
+            }
+        }
+    }
+
+    while (!stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // the parent shut the socket down
+        }
+        serve_connection(model, store, fd);
+    }
+    if (store != NULL) {
+        fprintf(stderr, "worker %d: ", slot);
+        store_print_stats(store, stderr, STATS_MODELS);
+    }
+}
+
+/* Fork the worker of `slot` and return its pid, or -1 on error */
+static pid_t spawn_worker(const DTModel *model, ModelStore *store, int listen_fd, int slot, int pin) {
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &worker_mask, NULL);
+        worker_main(model, store, listen_fd, slot, pin);
+        _exit(0);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Error: could not fork worker %d\n", slot);
+    }
+    return pid;
+}
+
+/* Return a socket listening on the Unix socket `path`, or -1 on error */
+static int listen_unix(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // a socket left over by a previous server
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "Error: could not listen on %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int num_workers = 0;
+    int pin = 0;
+    const char *socket_path = DTSERVE_SOCKET;
+    const char *model_file = NULL;
+    const char *training_file = NULL;
+    const char *model_dir = NULL;
+    double budget_mb = 0;
+
+    // parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--workers=", 10) == 0) {
+            num_workers = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin = 1;
+        } else if (strncmp(argv[i], "--socket=", 9) == 0) {
+            socket_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--train=", 8) == 0) {
+            training_file = argv[i] + 8;
+        } else if (strncmp(argv[i], "--models=", 9) == 0) {
+            model_dir = argv[i] + 9;
+        } else if (strncmp(argv[i], "--budget=", 9) == 0) {
+            budget_mb = atof(argv[i] + 9);
+        } else if (argv[i][0] != '-' && model_file == NULL) {
+            model_file = argv[i];
+        } else {
+            model_file = training_file = model_dir = NULL;
+            break;
+        }
+    }
+    if ((model_file != NULL) + (training_file != NULL) + (model_dir != NULL) != 1) {
+        fprintf(stderr, "Usage: %s [--workers=N] [--pin] [--socket=PATH] (model_file | --train=training_data"
+                " | --models=DIR [--budget=MB])\n", argv[0]);
+        return 1;
+    }
+    if (num_workers <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = online > 0 ? online : 1;
+    }
+
+    // map the model once; the workers inherit the mapping
+    DTModel *model = NULL;
+    ModelStore *store = NULL;
+    if (model_dir != NULL) {
+        // each worker maps the models it is asked for into its copy of the store
+        store = store_new(model_dir, (size_t) (budget_mb * (1 << 20)));
+    } else if (model_file != NULL) {
+        model = model_map(model_file);
+    } else {
+        Dataset *training_data = load_dataset(training_file);
+        DTNode *root = training_data == NULL ? NULL : build_dec_tree(training_data);
+        if (root != NULL) {
+            model = model_from_tree(root);
+            free_dec_tree(root);
+        }
+        if (training_data != NULL) {
+            free_dataset(training_data);
+        }
+    }
+    if (model == NULL && store == NULL) {
+        return 1;
+    }
+
+    int listen_fd = listen_unix(socket_path);
+    if (listen_fd < 0) {
+        if (model != NULL) {
+            model_unmap(model);
+        } else {
+            free_model_store(store);
+        }
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop; // no SA_RESTART: accept() and read() return on a signal
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // a client that leaves early must not kill its worker
+    // the parent takes stop signals and worker deaths with sigtimedwait(), so
+    // none can arrive between a check and the wait
+    sigset_t parent_signals;
+    sigemptyset(&parent_signals);
+    sigaddset(&parent_signals, SIGINT);
+    sigaddset(&parent_signals, SIGTERM);
+    sigaddset(&parent_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &parent_signals, &worker_mask);
+
+    pid_t *pids = malloc(sizeof(pid_t) * num_workers);
+    double *started = malloc(sizeof(double) * num_workers);
+    for (int slot = 0; slot < num_workers; slot++) {
+        pids[slot] = spawn_worker(model, store, listen_fd, slot, pin);
+        started[slot] = now_seconds();
+    }
+    if (store != NULL) {
+        fprintf(stderr, "dtserve: models of %s (%zu bytes mapped at most per worker) served by %d workers on %s\n",
+                model_dir, store -> budget, num_workers, socket_path);
+    } else {
+        fprintf(stderr, "dtserve: %u-node model (%zu bytes, mapped once) served by %d workers on %s\n",
+                model -> header -> num_nodes, model -> map_size, num_workers, socket_path);
+    }
+
+    // respawn workers as they die, until stopped
+    int respawns = 0;
+    while (!stopping) {
+        // slots whose worker could not be forked are retried after a pause
+        int empty = 0;
+        for (int slot = 0; slot < num_workers; slot++) {
+            if (pids[slot] <= 0 && now_seconds() - started[slot] >= RESPAWN_MIN_SECONDS) {
+                pids[slot] = spawn_worker(model, store, listen_fd, slot, pin);
+                started[slot] = now_seconds();
+                respawns += pids[slot] > 0;
+            }
+            empty += pids[slot] <= 0;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0) {
+            // nothing to reap: wait for a worker to die or a stop signal (or
+            // for a second, to retry the empty slots)
+            struct timespec pause = {1, 0};
+            int signal_number = sigtimedwait(&parent_signals, NULL, empty > 0 ? &pause : NULL);
+            if (signal_number == SIGINT || signal_number == SIGTERM) {
+                stopping = 1;
+            }
+            continue;
+        }
+        for (int slot = 0; slot < num_workers && !stopping; slot++) {
+            if (pids[slot] != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "dtserve: worker %d (pid %d) killed by signal %d, respawning\n",
+                        slot, (int) pid, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "dtserve: worker %d (pid %d) exited with status %d, respawning\n",
+                        slot, (int) pid, WEXITSTATUS(status));
+            }
+            if (now_seconds() - started[slot] < RESPAWN_MIN_SECONDS) { // crashing at once: back off
+                sleep(1);
+            }
+            pids[slot] = spawn_worker(model, store, listen_fd, slot, pin);
+            started[slot] = now_seconds();
+            respawns++;
+        }
+    }
+
+    // stop the workers: shutting the socket down wakes those waiting in accept()
+    shutdown(listen_fd, SHUT_RDWR);
+    for (int slot = 0; slot < num_workers; slot++) {
+        if (pids[slot] > 0) {
+            kill(pids[slot], SIGTERM);
+        }
+    }
+    for (int slot = 0; slot < num_workers; slot++) {
+        if (pids[slot] > 0) {
+            waitpid(pids[slot], NULL, 0);
+        }
+    }
+    fprintf(stderr, "dtserve: stopped after %d respawns\n", respawns);
+    close(listen_fd);
+    unlink(socket_path);
+    free(pids);
+    free(started);
+    if (model != NULL) {
+        model_unmap(model);
+    } else {
+        free_model_store(store);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "features.h"
+#include "pool.h"
+
+/**
+ * Store in `features` the DERIVED_FEATURES features (see features.h) of the
+ * WIDTH x WIDTH image `pixels`, in one pass over its pixels.
+ */
+void features_expand(const unsigned char *pixels, unsigned char *features) {
+    unsigned char pool2[FEATURE_POOL2] = {0};
+    unsigned char pool4[FEATURE_POOL4] = {0};
+    int row_ink[WIDTH] = {0};
+    int column_ink[WIDTH] = {0};
+    for (int y = 0; y < WIDTH; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int ink = pixels[y * WIDTH + x] >= BINARY_THRESHOLD;
+            pool2[(y / 2) * FEATURE_POOL2_SIDE + x / 2] |= ink;
+            pool4[(y / 4) * FEATURE_POOL4_SIDE + x / 4] |= ink;
+            row_ink[y] += ink;
+            column_ink[x] += ink;
+        }
+    }
+
+    unsigned char *out = features;
+    for (int b = 0; b < FEATURE_POOL2; b++) {
+        *out++ = pool2[b] ? 255 : 0;
+    }
+    for (int b = 0; b < FEATURE_POOL4; b++) {
+        *out++ = pool4[b] ? 255 : 0;
+    }
+    for (int y = 0; y < WIDTH; y++) {
+        for (int s = 0; s < FEATURE_COUNT_STEPS; s++) {
+            *out++ = row_ink[y] >= (FEATURE_MIN_INK << s) ? 255 : 0;
+        }
+    }
+    for (int x = 0; x < WIDTH; x++) {
+        for (int s = 0; s < FEATURE_COUNT_STEPS; s++) {
+            *out++ = column_ink[x] >= (FEATURE_MIN_INK << s) ? 255 : 0;
+        }
+    }
+}
+
+/* Helper for dataset_expand_features. Expand images [start, end) */
+static void expand_range(void *arg, int start, int end) {
+    Dataset **pair = arg; // source, expanded
+    for (int i = start; i < end; i++) {
+        unsigned char *record = pair[1] -> images[i].data;
+        image_read(&(pair[0] -> images[i]), record);
+        features_expand(record, record + NUM_PIXELS);
+        pair[1] -> labels[i] = pair[0] -> labels[i];
+    }
+}
+
+/**
+ * Return a base dataset holding the images of `data` expanded with their
+ * derived features: NUM_FEATURES bytes per image, the pixels (shifts applied)
+ * followed by the features. The images are expanded in parallel, LOAD_CHUNK
+ * at a time.
+ */
+Dataset *dataset_expand_features(Dataset *data) {
+    int N = data -> num_items;
+    // one record of NUM_FEATURES bytes per image, each seen as a WIDTH x WIDTH image
+    Dataset *expanded = alloc_dataset(N, NUM_FEATURES, 1);
+    if (expanded == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < N; i++) {
+        expanded -> images[i].sx = WIDTH;
+        expanded -> images[i].sy = WIDTH;
+    }
+    Dataset *pair[2] = {data, expanded};
+    pool_parallel_for(0, N, LOAD_CHUNK, expand_range, pair);
+    return expanded;
+}
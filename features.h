@@ -0,0 +1,46 @@
+#pragma once
+
+#include "dectree.h"
+
+/**
+ * Derived binary features: cheap summaries of the strokes that a single
+ * pixel test cannot see, for binary trees to split on like pixels (see
+ * `DTParams.features`). A pixel is ink when its color is at least
+ * BINARY_THRESHOLD. The features of an image are, in order:
+ *
+ *   - for each 2 x 2 block, in row order: whether it holds any ink
+ *     (OR-pooling), FEATURE_POOL2 features
+ *   - for each 4 x 4 block, likewise, FEATURE_POOL4 features
+ *   - for each row, then each column: whether it holds at least
+ *     FEATURE_MIN_INK << s ink pixels, for s from 0 to FEATURE_COUNT_STEPS - 1
+ *
+ * Each is stored as a color, 255 if true and 0 if not, right after the pixels
+ * of an expanded image: feature f is "pixel" NUM_PIXELS + f of the image, so
+ * `image_pixel()`, batch classification and the forests read it the same way
+ * and a tree testing it needs no other change. Expanded images are never
+ * shifted, and expanding shifted views would copy each of them: expand base
+ * images only.
+ */
+
+/* Ink pixels a row or column needs for its first ink count feature */
+#ifndef FEATURE_MIN_INK
+#define FEATURE_MIN_INK 2
+#endif
+
+/* Ink count features per row and per column (thresholds doubling from FEATURE_MIN_INK) */
+#ifndef FEATURE_COUNT_STEPS
+#define FEATURE_COUNT_STEPS 3
+#endif
+
+#define FEATURE_POOL2_SIDE ((WIDTH + 1) / 2)
+#define FEATURE_POOL4_SIDE ((WIDTH + 3) / 4)
+#define FEATURE_POOL2 (FEATURE_POOL2_SIDE * FEATURE_POOL2_SIDE)
+#define FEATURE_POOL4 (FEATURE_POOL4_SIDE * FEATURE_POOL4_SIDE)
+#define FEATURE_COUNTS (2 * WIDTH * FEATURE_COUNT_STEPS)
+
+/* Derived features of an image, and the bytes of an expanded image */
+#define DERIVED_FEATURES (FEATURE_POOL2 + FEATURE_POOL4 + FEATURE_COUNTS)
+#define NUM_FEATURES (NUM_PIXELS + DERIVED_FEATURES)
+
+void features_expand(const unsigned char *pixels, unsigned char *features);
+Dataset *dataset_expand_features(Dataset *data);
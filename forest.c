@@ -0,0 +1,291 @@
+#include <unistd.h>
+
+#include "forest.h"
+#include "pool.h"
+
+/* Return the size in bytes of cache `name` (a sysconf name), or `fallback` if unknown */
+static long cache_bytes(int name, long fallback) {
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+/**
+ * Set the tile sizes of the forest from the cache sizes: an image tile of
+ * L1 bytes of pixels, and a tree block of L2 bytes of (average) trees.
+ */
+static void default_tiles(Forest *forest) {
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    long l1 = cache_bytes(_SC_LEVEL1_DCACHE_SIZE, FOREST_L1_BYTES);
+    long l2 = cache_bytes(_SC_LEVEL2_CACHE_SIZE, FOREST_L2_BYTES);
+#else
+    long l1 = FOREST_L1_BYTES, l2 = FOREST_L2_BYTES;
+#endif
+    long tree_bytes = (long) sizeof(FlatNode) * forest -> num_nodes / forest -> num_trees + 1;
+    long image_block = l1 / NUM_PIXELS;
+    long tree_block = l2 / tree_bytes;
+    forest -> image_block = image_block < 1 ? 1 : (image_block > FOREST_CHUNK ? FOREST_CHUNK : image_block);
+    forest -> tree_block = tree_block < 1 ? 1 : (tree_block > forest -> num_trees ? forest -> num_trees : tree_block);
+}
+
+/* Return the label the flat tree starting at `tree` gives the image */
+static inline int tree_classify(const FlatNode *tree, const Image *img) {
+    int i = 0;
+    while (tree[i].pixel != -1) {
+        i = image_pixel(img, tree[i].pixel) < tree[i].threshold ? i + 1 : tree[i].right;
+    }
+    return tree[i].classification;
+}
+
+/* Return the label with the most votes, the smallest one on ties */
+static inline int most_voted(const uint16_t *votes) {
+    int label = 0;
+    for (int k = 1; k < 10; k++) {
+        if (votes[k] > votes[label]) {
+            label = k;
+        }
+    }
+    return label;
+}
+
+/**
+ * Return a forest of the trees, flattened, or NULL if memory runs out. The
+ * trees are not freed. The tile sizes are set from the cache sizes, see
+ * forest_tune() to measure them.
+ */
+Forest *forest_from_trees(DTNode **trees, int num_trees) {
+    Forest *forest = malloc(sizeof(Forest));
+    if (forest == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    forest -> num_trees = num_trees;
+    forest -> roots = malloc(sizeof(int) * (num_trees + 1));
+    if (forest -> roots == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(forest);
+        return NULL;
+    }
+    forest -> num_nodes = 0;
+    for (int t = 0; t < num_trees; t++) {
+        forest -> roots[t] = forest -> num_nodes;
+        forest -> num_nodes += dec_tree_num_nodes(trees[t]);
+    }
+    forest -> roots[num_trees] = forest -> num_nodes;
+    forest -> nodes = malloc(sizeof(FlatNode) * (forest -> num_nodes + 1));
+    if (forest -> nodes == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(forest -> roots);
+        free(forest);
+        return NULL;
+    }
+    for (int t = 0; t < num_trees; t++) {
+        dec_tree_flatten(trees[t], forest -> nodes + forest -> roots[t]);
+    }
+    default_tiles(forest);
+    return forest;
+}
+
+/* The trees of a forest being built, see build_trees() */
+typedef struct {
+    Dataset *data;
+    const DTParams *params;
+    int sample_size;
+    unsigned int seed;
+    DTNode **trees;
+} ForestBuild;
+
+/* Helper for build_forest. Build trees [start, end), each on its own bootstrap sample */
+static void build_trees(void *arg, int start, int end) {
+    ForestBuild *build = arg;
+    for (int t = start; t < end; t++) {
+        Dataset *sample = dataset_bootstrap(build -> data, build -> sample_size, build -> seed + t);
+        build -> trees[t] = NULL;
+        if (sample != NULL) {
+            build -> trees[t] = build_dec_tree_params(sample, build -> params);
+            free_dataset(sample);
+        }
+    }
+}
+
+/**
+ * Build a forest of `num_trees` trees (at most 65535) with `params`, tree t
+ * on a bootstrap sample of `sample_size` items of `data` (0: as many as
+ * `data` has) drawn with seed `seed + t`, so the forest does not depend on
+ * the number of threads. The trees are built in parallel on the thread pool.
+ * Return NULL if memory runs out.
+ */
+Forest *build_forest(Dataset *data, const DTParams *params, int num_trees, int sample_size,
+                     unsigned int seed) {
+    num_trees = num_trees < 1 ? 1 : (num_trees > UINT16_MAX ? UINT16_MAX : num_trees);
+    ForestBuild build = {data, params, sample_size > 0 ? sample_size : data -> num_items, seed,
+                         malloc(sizeof(DTNode *) * num_trees)};
+    if (build.trees == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    pool_parallel_for(0, num_trees, 1, build_trees, &build);
+
+    int built = 0;
+    for (int t = 0; t < num_trees; t++) {
+        built += build.trees[t] != NULL;
+    }
+    Forest *forest = built == num_trees ? forest_from_trees(build.trees, num_trees) : NULL;
+    for (int t = 0; t < num_trees; t++) {
+        if (build.trees[t] != NULL) {
+            free_dec_tree(build.trees[t]);
+        }
+    }
+    free(build.trees);
+    return forest;
+}
+
+/* Return the label most trees of the forest give the image */
+int forest_classify(const Forest *forest, const Image *img) {
+    uint16_t votes[10] = {0};
+    for (int t = 0; t < forest -> num_trees; t++) {
+        votes[tree_classify(forest -> nodes + forest -> roots[t], img)]++;
+    }
+    return most_voted(votes);
+}
+
+/**
+ * Helper for the batch classifiers. Count the votes of the trees for a chunk
+ * of at most FOREST_CHUNK images in tiles of `tree_block` trees x
+ * `image_block` images, block of trees after block of trees.
+ */
+static void vote_chunk(const Forest *forest, const Image *images, int num_images, int tree_block,
+                       int image_block, uint16_t (*votes)[10]) {
+    memset(votes, 0, sizeof(votes[0]) * num_images);
+    int num_trees = forest -> num_trees;
+    for (int t0 = 0; t0 < num_trees; t0 += tree_block) {
+        int t1 = num_trees - t0 < tree_block ? num_trees : t0 + tree_block;
+        for (int i0 = 0; i0 < num_images; i0 += image_block) {
+            int i1 = num_images - i0 < image_block ? num_images : i0 + image_block;
+            for (int t = t0; t < t1; t++) {
+                const FlatNode *tree = forest -> nodes + forest -> roots[t];
+                for (int i = i0; i < i1; i++) {
+                    votes[i][tree_classify(tree, &(images[i]))]++;
+                }
+            }
+        }
+    }
+}
+
+/* Helper for forest_classify_batch. Classify a chunk of at most FOREST_CHUNK images */
+static void classify_chunk(const Forest *forest, const Image *images, int num_images,
+                           int tree_block, int image_block, int *predictions) {
+    uint16_t votes[FOREST_CHUNK][10];
+    vote_chunk(forest, images, num_images, tree_block, image_block, votes);
+    for (int i = 0; i < num_images; i++) {
+        predictions[i] = most_voted(votes[i]);
+    }
+}
+
+/* A batch classified by forest_classify_batch() */
+typedef struct {
+    const Forest *forest;
+    const Image *images;
+    int num_images;
+    int *predictions;
+    uint16_t (*votes)[10];  // Where forest_vote_batch() stores the votes, or NULL
+} ForestBatch;
+
+/* Helper for the batch classifiers. Classify chunks [start, end) of a batch */
+static void classify_chunks(void *arg, int start, int end) {
+    ForestBatch *batch = arg;
+    const Forest *forest = batch -> forest;
+    for (int chunk = start; chunk < end; chunk++) {
+        int first = chunk * FOREST_CHUNK;
+        int count = batch -> num_images - first < FOREST_CHUNK ? batch -> num_images - first : FOREST_CHUNK;
+        if (batch -> votes != NULL) {
+            vote_chunk(forest, batch -> images + first, count, forest -> tree_block, forest -> image_block,
+                       batch -> votes + first);
+        } else {
+            classify_chunk(forest, batch -> images + first, count, forest -> tree_block, forest -> image_block,
+                           batch -> predictions + first);
+        }
+    }
+}
+
+/**
+ * Classify a batch of images with the forest, FOREST_CHUNK images at a time
+ * in tiles (see forest.h). The chunks are spread over the thread pool.
+ */
+void forest_classify_batch(const Forest *forest, const Image *images, int num_images, int *predictions) {
+    ForestBatch batch = {forest, images, num_images, predictions, NULL};
+    pool_parallel_for(0, (num_images + FOREST_CHUNK - 1) / FOREST_CHUNK, 1, classify_chunks, &batch);
+}
+
+/**
+ * Store in votes[i][k] the number of trees of the forest that give images[i]
+ * label k: its soft prediction. The batch is classified like by
+ * `forest_classify_batch()`.
+ */
+void forest_vote_batch(const Forest *forest, const Image *images, int num_images, uint16_t (*votes)[10]) {
+    ForestBatch batch = {forest, images, num_images, NULL, votes};
+    pool_parallel_for(0, (num_images + FOREST_CHUNK - 1) / FOREST_CHUNK, 1, classify_chunks, &batch);
+}
+
+/**
+ * Classify every image in `data` with the forest (in one batch) and return
+ * the number of images whose predicted label matches the label stored in
+ * the dataset.
+ */
+int forest_evaluate(const Forest *forest, Dataset *data) {
+    int *predictions = malloc(sizeof(int) * (data -> num_items + 1));
+    forest_classify_batch(forest, data -> images, data -> num_items, predictions);
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += predictions[i] == data -> labels[i];
+    }
+    free(predictions);
+    return total_correct;
+}
+
+/**
+ * Set the tile sizes of the forest to the fastest on this machine: classify
+ * up to FOREST_TUNE_IMAGES images of `data` (on the calling thread) with tree
+ * blocks of 1, 2, 4, ... trees up to the whole forest, and image tiles of 1,
+ * 2, 4, ... images up to FOREST_CHUNK, for at least FOREST_TUNE_SECONDS each.
+ * (The whole forest over tiles of 1 image classifies image by image.)
+ */
+void forest_tune(Forest *forest, Dataset *data) {
+    int N = data -> num_items < FOREST_TUNE_IMAGES ? data -> num_items : FOREST_TUNE_IMAGES;
+    if (N == 0) {
+        return;
+    }
+    int *predictions = malloc(sizeof(int) * N);
+    double best_time = INFINITY;
+    for (int tree_block = 1; ; tree_block *= 2) {
+        tree_block = tree_block < forest -> num_trees ? tree_block : forest -> num_trees;
+        for (int image_block = 1; image_block <= FOREST_CHUNK; image_block *= 2) {
+            int rounds = 0;
+            double start = now_seconds(), elapsed;
+            do {
+                for (int first = 0; first < N; first += FOREST_CHUNK) {
+                    int count = N - first < FOREST_CHUNK ? N - first : FOREST_CHUNK;
+                    classify_chunk(forest, data -> images + first, count, tree_block, image_block,
+                                   predictions + first);
+                }
+                rounds++;
+                elapsed = now_seconds() - start;
+            } while (elapsed < FOREST_TUNE_SECONDS);
+            if (elapsed / rounds < best_time) {
+                best_time = elapsed / rounds;
+                forest -> tree_block = tree_block;
+                forest -> image_block = image_block;
+            }
+        }
+        if (tree_block == forest -> num_trees) {
+            break;
+        }
+    }
+    free(predictions);
+}
+
+/* Free the forest */
+void free_forest(Forest *forest) {
+    free(forest -> nodes);
+    free(forest -> roots);
+    free(forest);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+#include "model.h"
+
+/**
+ * Random forests: trees built on bootstrap samples of the training data (see
+ * `dataset_bootstrap()`), which vote on every image.
+ *
+ * The trees are stored back to back in one array of FlatNodes, each in the
+ * preorder layout of model files (see model.h). A batch is classified in
+ * chunks of FOREST_CHUNK images, each chunk in tiles of `tree_block` trees x
+ * `image_block` images: every tree of a tile classifies every image of the
+ * tile before the next tile starts. The image tiles of a chunk are all
+ * classified by a block of trees before the next block is read, so a block
+ * of trees that fits in L2 is read from memory once per chunk, and an image
+ * tile that fits in L1 stays there while the block's trees walk it. Votes
+ * accumulate in a FOREST_CHUNK x 10 buffer.
+ *
+ * The tile sizes start from the cache sizes the system reports and are set
+ * by timing every candidate with `forest_tune()`.
+ */
+
+/* Number of trees when none is given */
+#ifndef FOREST_TREES
+#define FOREST_TREES 100
+#endif
+
+/* Images classified at a time, with their votes in one buffer */
+#ifndef FOREST_CHUNK
+#define FOREST_CHUNK 1024
+#endif
+
+/* Images classified per candidate tiling by forest_tune() */
+#ifndef FOREST_TUNE_IMAGES
+#define FOREST_TUNE_IMAGES 1024
+#endif
+
+/* Minimum time spent on each candidate tiling by forest_tune(), in seconds */
+#ifndef FOREST_TUNE_SECONDS
+#define FOREST_TUNE_SECONDS 0.005
+#endif
+
+/* Cache sizes assumed when the system does not report them */
+#ifndef FOREST_L1_BYTES
+#define FOREST_L1_BYTES (32 << 10)
+#endif
+#ifndef FOREST_L2_BYTES
+#define FOREST_L2_BYTES (1 << 20)
+#endif
+
+typedef struct {
+    FlatNode *nodes;        // Every tree in preorder, one after the other
+    int *roots;             // Index of the first node of each tree, then num_nodes
+    int num_trees;
+    int num_nodes;
+    int tree_block;         // Trees of a tile
+    int image_block;        // Images of a tile
+} Forest;
+
+Forest *build_forest(Dataset *data, const DTParams *params, int num_trees, int sample_size,
+                     unsigned int seed);
+Forest *forest_from_trees(DTNode **trees, int num_trees);
+int forest_classify(const Forest *forest, const Image *img);
+void forest_classify_batch(const Forest *forest, const Image *images, int num_images, int *predictions);
+void forest_vote_batch(const Forest *forest, const Image *images, int num_images, uint16_t (*votes)[10]);
+int forest_evaluate(const Forest *forest, Dataset *data);
+void forest_tune(Forest *forest, Dataset *data);
+void free_forest(Forest *forest);
@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/* Return the bucket of `value` */
+static inline int bucket_of(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return (int) value;
+    }
+    int level = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1; // >= 1
+    int sub = (int) (value >> level);                              // in [HIST_SUB_COUNT / 2, HIST_SUB_COUNT)
+    return HIST_SUB_COUNT + (level - 1) * (HIST_SUB_COUNT / 2) + sub - HIST_SUB_COUNT / 2;
+}
+
+/* Return the largest value that falls in `bucket` */
+static uint64_t bucket_max(int bucket) {
+    if (bucket < HIST_SUB_COUNT) {
+        return bucket;
+    }
+    int level = (bucket - HIST_SUB_COUNT) / (HIST_SUB_COUNT / 2) + 1;
+    uint64_t sub = (bucket - HIST_SUB_COUNT) % (HIST_SUB_COUNT / 2) + HIST_SUB_COUNT / 2;
+    return ((sub + 1) << level) - 1;
+}
+
+/* Empty the histogram */
+void hist_clear(Histogram *hist) {
+    memset(hist, 0, sizeof(Histogram));
+    hist -> min = UINT64_MAX;
+}
+
+/* Count one value */
+void hist_record(Histogram *hist, uint64_t value) {
+    hist -> counts[bucket_of(value)]++;
+    hist -> total++;
+    hist -> sum += value;
+    hist -> min = value < hist -> min ? value : hist -> min;
+    hist -> max = value > hist -> max ? value : hist -> max;
+}
+
+/* Add the values of `from` to `into` */
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into -> counts[b] += from -> counts[b];
+    }
+    into -> total += from -> total;
+    into -> sum += from -> sum;
+    into -> min = from -> min < into -> min ? from -> min : into -> min;
+    into -> max = from -> max > into -> max ? from -> max : into -> max;
+}
+
+/**
+ * Return the value below which `percentile` percent of the recorded values
+ * fall (the largest value of its bucket, at most the maximum recorded), or 0
+ * if the histogram is empty.
+ */
+uint64_t hist_percentile(const Histogram *hist, double percentile) {
+    if (hist -> total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100 * hist -> total + 0.5);
+    rank = rank < 1 ? 1 : (rank > hist -> total ? hist -> total : rank);
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist -> counts[b];
+        if (seen >= rank) {
+            uint64_t value = bucket_max(b);
+            return value < hist -> max ? value : hist -> max;
+        }
+    }
+    return hist -> max;
+}
+
+/* Return the mean of the recorded values, or 0 if there are none */
+double hist_mean(const Histogram *hist) {
+    return hist -> total > 0 ? hist -> sum / hist -> total : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Latency histograms with a fixed relative precision over the whole range of
+ * uint64_t values (HDR histograms): values below 2^HIST_SUB_BITS are counted
+ * exactly, and larger ones in buckets of 2^(HIST_SUB_BITS - 1) per power of
+ * two, so a recorded value is known to within 1 / 2^(HIST_SUB_BITS - 1) of
+ * itself (1.6% with the default) whatever its magnitude. Recording is a few
+ * instructions and never allocates; histograms of several threads are merged
+ * with hist_merge().
+ */
+
+/* Bits of precision of the buckets */
+#ifndef HIST_SUB_BITS
+#define HIST_SUB_BITS 7
+#endif
+
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * (HIST_SUB_COUNT / 2))
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;         // Values recorded
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+void hist_clear(Histogram *hist);
+void hist_record(Histogram *hist, uint64_t value);
+void hist_merge(Histogram *into, const Histogram *from);
+uint64_t hist_percentile(const Histogram *hist, double percentile);
+double hist_mean(const Histogram *hist);
@@ -0,0 +1,310 @@
+#include <limits.h>
+
+#include "levelwise.h"
+#include "pool.h"
+
+/* A node of the tree being built. Leaves and open nodes have pixel -1 */
+typedef struct {
+    int pixel;              // As in DTNode
+    int threshold;
+    int label;              // Most frequent label of the node's training items
+    int left;               // Index of the left child, or -1
+    int right;              // Index of the right child, or -1
+    int level;              // Depth of the node, the root being at level 0
+} LevelNode;
+
+/**
+ * An open node of the current level. Its training items are order[start ..
+ * start + count - 1], grouped by label along `segments` (relative to
+ * `start`), and the validation images whose current node it is are
+ * valid_order[valid_start .. valid_start + valid_count - 1].
+ */
+typedef struct {
+    int node;
+    int start;
+    int count;
+    int segments[11];
+    int valid_start;
+    int valid_count;
+    int stale;              // Splits without improvement on its path, see LEVEL_FREEZE
+    int pixel;              // Split found by search_splits(), or -1 for a leaf
+    int threshold;
+} LevelOpen;
+
+/* State of a level-wise build */
+typedef struct {
+    Dataset *train;
+    Dataset *valid;
+    DTParams params;            // Resolved options
+    int *order;                 // Permutation of the training items, see LevelOpen
+    int *scratch;               // Partition buffer of `train -> num_items` ints
+    int *valid_order;           // Permutation of the validation images, see LevelOpen
+    int *valid_scratch;
+    LevelNode *nodes;           // The root first
+    int num_nodes;
+    int node_capacity;
+    LevelOpen *open;            // Open nodes of the current level
+    int num_open;
+    LevelOpen *next;            // Open nodes of the next level
+    int num_next;
+    int open_capacity;
+    int correct;                // Validation images whose current node has their label
+} LevelBuild;
+
+/* Append a leaf of label `label` at `level` and return its index */
+static int add_node(LevelBuild *build, int label, int level) {
+    if (build -> num_nodes == build -> node_capacity) {
+        build -> node_capacity = 2 * build -> node_capacity + 64;
+        build -> nodes = realloc(build -> nodes, sizeof(LevelNode) * build -> node_capacity);
+    }
+    build -> nodes[build -> num_nodes] = (LevelNode) {-1, 0, label, -1, -1, level};
+    return build -> num_nodes++;
+}
+
+/* Append an open node to the next level */
+static void push_next(LevelBuild *build, LevelOpen open) {
+    if (build -> num_next == build -> open_capacity) {
+        build -> open_capacity = 2 * build -> open_capacity + 64;
+        build -> open = realloc(build -> open, sizeof(LevelOpen) * build -> open_capacity);
+        build -> next = realloc(build -> next, sizeof(LevelOpen) * build -> open_capacity);
+    }
+    build -> next[build -> num_next++] = open;
+}
+
+/**
+ * Range function of pool_parallel_for: search the best split of the open
+ * nodes `start` to `end - 1` the way `build_subtree()` does, leaving pixel -1
+ * to the nodes that become leaves. The nodes own disjoint ranges of the
+ * training items, so they are searched independently.
+ */
+static void search_splits(void *arg, int start, int end) {
+    LevelBuild *build = arg;
+    for (int i = start; i < end; i++) {
+        LevelOpen *open = &(build -> open[i]);
+        int label, freq;
+        get_most_frequent_grouped(open -> segments, &label, &freq);
+        open -> pixel = -1;
+        open -> threshold = BINARY_THRESHOLD;
+        if (((double) freq / (double) open -> count) < THRESHOLD_RATIO) {
+            open -> pixel = find_best_split(build -> train, open -> count, build -> order + open -> start,
+                                            open -> segments, &(build -> params), &(open -> threshold));
+        }
+    }
+}
+
+/**
+ * Split the open node `open` at the pixel and threshold its search found:
+ * partition its training items (stably, so the children stay grouped by
+ * label) and advance its validation images to the children, updating the
+ * validation count of `build`. Return the change of that count, and store
+ * the children's open nodes in `children`.
+ */
+static int split_open(LevelBuild *build, const LevelOpen *open, LevelOpen children[2]) {
+    Dataset *train = build -> train;
+    Dataset *valid = build -> valid;
+    int pixel = open -> pixel;
+    int threshold = open -> threshold;
+
+    // training items going left keep their order at the front, the others follow
+    int *indices = build -> order + open -> start;
+    int left_size = 0, right_size = 0;
+    for (int k = 0; k < 10; k++) {
+        children[0].segments[k] = left_size;
+        children[1].segments[k] = right_size;
+        for (int i = open -> segments[k]; i < open -> segments[k + 1]; i++) {
+            int index = indices[i];
+            if (image_pixel(&(train -> images[index]), pixel) < threshold) {
+                indices[left_size++] = index;
+            } else {
+                build -> scratch[right_size++] = index;
+            }
+        }
+    }
+    children[0].segments[10] = left_size;
+    children[1].segments[10] = right_size;
+    memcpy(indices + left_size, build -> scratch, sizeof(int) * right_size);
+
+    // so do the validation images, which are counted by label on each side
+    int *valid_indices = build -> valid_order + open -> valid_start;
+    int valid_counts[2][10] = {{0}};
+    int valid_left = 0, valid_right = 0;
+    for (int i = 0; i < open -> valid_count; i++) {
+        int index = valid_indices[i];
+        if (image_pixel(&(valid -> images[index]), pixel) < threshold) {
+            valid_indices[valid_left++] = index;
+            valid_counts[0][valid -> labels[index]]++;
+        } else {
+            build -> valid_scratch[valid_right++] = index;
+            valid_counts[1][valid -> labels[index]]++;
+        }
+    }
+    memcpy(valid_indices + valid_left, build -> valid_scratch, sizeof(int) * valid_right);
+
+    int level = build -> nodes[open -> node].level + 1;
+    int label = build -> nodes[open -> node].label;
+    int gain = -(valid_counts[0][label] + valid_counts[1][label]);
+    for (int side = 0; side < 2; side++) {
+        int child_label, freq;
+        get_most_frequent_grouped(children[side].segments, &child_label, &freq);
+        gain += valid_counts[side][child_label];
+        children[side].node = add_node(build, child_label, level);
+    }
+    LevelNode *node = &(build -> nodes[open -> node]); // add_node() may have moved the nodes
+    node -> pixel = pixel;
+    node -> threshold = threshold;
+    node -> left = children[0].node;
+    node -> right = children[1].node;
+
+    children[0].start = open -> start;
+    children[0].count = left_size;
+    children[0].valid_start = open -> valid_start;
+    children[0].valid_count = valid_left;
+    children[1].start = open -> start + left_size;
+    children[1].count = right_size;
+    children[1].valid_start = open -> valid_start + valid_left;
+    children[1].valid_count = valid_right;
+    build -> correct += gain;
+    return gain;
+}
+
+/**
+ * Return the DTNode tree of node `id` and its descendants, the nodes at
+ * `max_level` becoming leaves of their label.
+ */
+static DTNode *tree_from_nodes(const LevelNode *nodes, int id, int max_level) {
+    DTNode *node = malloc(sizeof(DTNode));
+    node -> left = NULL;
+    node -> right = NULL;
+    if (nodes[id].pixel == -1 || nodes[id].level >= max_level) {
+        node -> pixel = -1;
+        node -> threshold = 0;
+        node -> classification = nodes[id].label;
+    } else {
+        node -> pixel = nodes[id].pixel;
+        node -> threshold = nodes[id].threshold;
+        node -> classification = -1;
+        node -> left = tree_from_nodes(nodes, nodes[id].left, max_level);
+        node -> right = tree_from_nodes(nodes, nodes[id].right, max_level);
+    }
+    return node;
+}
+
+/**
+ * Build the decision tree for `train` one level at a time, tracking its
+ * accuracy on the validation images `valid` after each level, and stop early
+ * once it has not improved for `patience` levels, the way `mode` says (see
+ * levelwise.h). A line per level (nodes split, open nodes left, validation
+ * accuracy, time) is written to `report` unless it is NULL.
+ */
+DTNode *build_dec_tree_levelwise(Dataset *train, Dataset *valid, const DTParams *params, int patience,
+                                 LevelMode mode, FILE *report) {
+    int N = train -> num_items;
+    int V = valid -> num_items;
+    LevelBuild build = {0};
+    build.train = train;
+    build.valid = valid;
+    build.params = *params;
+    dt_params_resolve(&(build.params), train);
+    build.order = malloc(sizeof(int) * N);
+    build.scratch = malloc(sizeof(int) * N);
+    build.valid_order = malloc(sizeof(int) * V);
+    build.valid_scratch = malloc(sizeof(int) * V);
+    if ((build.order == NULL || build.scratch == NULL) && N > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+    if ((build.valid_order == NULL || build.valid_scratch == NULL) && V > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+    for (int i = 0; i < N; i++) {
+        build.order[i] = i;
+    }
+    for (int i = 0; i < V; i++) {
+        build.valid_order[i] = i;
+    }
+
+    // the root: every validation image starts there
+    LevelOpen root = {0};
+    root.count = N;
+    root.valid_count = V;
+    dataset_group_labels(train, N, build.order, root.segments);
+    int label, freq;
+    get_most_frequent_grouped(root.segments, &label, &freq);
+    root.node = add_node(&build, label, 0);
+    for (int i = 0; i < V; i++) {
+        build.correct += valid -> labels[i] == label;
+    }
+    push_next(&build, root);
+
+    double start = now_seconds();
+    int level = 0;
+    int best_correct = build.correct;
+    int best_level = 0;
+    int stale_levels = 0;
+    int stopped = 0;
+    if (report != NULL) {
+        fprintf(report, "level %2d: %6d nodes split, %6d open, validation accuracy %.2f%%\n", 0, 0, 1,
+                V > 0 ? 100.0 * build.correct / V : 0.0);
+    }
+    while (build.num_next > 0) {
+        LevelOpen *swap = build.open;
+        build.open = build.next;
+        build.next = swap;
+        build.num_open = build.num_next;
+        build.num_next = 0;
+
+        // the splits of a level are searched in parallel, then applied in order
+        pool_parallel_for(0, build.num_open, 1, search_splits, &build);
+        int num_split = 0;
+        for (int i = 0; i < build.num_open; i++) {
+            LevelOpen open = build.open[i];
+            if (open.pixel == -1) {
+                continue; // leaf
+            }
+            LevelOpen children[2];
+            int gain = split_open(&build, &open, children);
+            num_split++;
+            for (int side = 0; side < 2; side++) {
+                children[side].stale = gain > 0 ? 0 : open.stale + 1;
+                if (mode == LEVEL_FREEZE && children[side].stale >= patience) {
+                    continue; // frozen: stays a leaf
+                }
+                push_next(&build, children[side]);
+            }
+        }
+        if (num_split == 0) {
+            break;
+        }
+        level++;
+        if (report != NULL) {
+            fprintf(report, "level %2d: %6d nodes split, %6d open, validation accuracy %.2f%%, %.2f s\n",
+                    level, num_split, build.num_next, V > 0 ? 100.0 * build.correct / V : 0.0,
+                    now_seconds() - start);
+        }
+
+        if (build.correct > best_correct) {
+            best_correct = build.correct;
+            best_level = level;
+            stale_levels = 0;
+        } else if (++stale_levels >= patience && mode == LEVEL_STOP) {
+            stopped = 1; // the open nodes left stay leaves
+            break;
+        }
+    }
+
+    int max_level = stopped ? best_level : INT_MAX;
+    if (report != NULL && stopped) {
+        fprintf(report, "early stop: built %d levels, kept %d (validation accuracy %.2f%%)\n", level,
+                best_level, V > 0 ? 100.0 * best_correct / V : 0.0);
+    }
+    DTNode *tree = tree_from_nodes(build.nodes, 0, max_level);
+    dt_model_changed();
+
+    free(build.order);
+    free(build.scratch);
+    free(build.valid_order);
+    free(build.valid_scratch);
+    free(build.nodes);
+    free(build.open);
+    free(build.next);
+    return tree;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "dectree.h"
+
+/**
+ * Level-wise tree building with early stopping on held-out validation images.
+ *
+ * The tree is grown one level at a time: the best splits of all the open
+ * nodes of a level are searched (in parallel, see pool.h), then the nodes are
+ * split. Each validation image has a current node, the deepest node built so
+ * far that it reaches: the validation images are kept ordered by current node,
+ * each open node owning a range of them, so splitting a node only advances
+ * (partitions) the validation images of its own range. The number of them
+ * classified correctly, if every node of the tree being built were a leaf of
+ * its majority label, is updated from the counts of those images alone, which
+ * gives the validation accuracy after each level at no extra cost.
+ *
+ * When nothing stops it, the tree is the one `build_dec_tree_params()` builds.
+ * With `patience` levels:
+ *
+ *   LEVEL_STOP     the build stops after `patience` levels that did not
+ *                  improve the validation accuracy, and the tree is cut back
+ *                  to the depth at which it was best (the nodes at that depth
+ *                  becoming leaves of their majority label)
+ *   LEVEL_FREEZE   each subtree stops growing on its own: a node becomes a
+ *                  leaf when the last `patience` splits on its path from the
+ *                  root did not improve the accuracy on its validation images
+ */
+
+/* Default number of levels without improvement before stopping */
+#ifndef LEVEL_PATIENCE
+#define LEVEL_PATIENCE 2
+#endif
+
+/* How the build stops early */
+typedef enum {
+    LEVEL_STOP,             // Stop the whole build and cut the tree back to its best depth
+    LEVEL_FREEZE            // Stop growing the subtrees that stopped improving
+} LevelMode;
+
+DTNode *build_dec_tree_levelwise(Dataset *train, Dataset *valid, const DTParams *params, int patience,
+                                 LevelMode mode, FILE *report);
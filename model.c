@@ -0,0 +1,195 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "model.h"
+
+/* Return the size in bytes of a model of `num_nodes` nodes */
+static size_t model_size(int num_nodes) {
+    return sizeof(ModelHeader) + sizeof(FlatNode) * (size_t) num_nodes;
+}
+
+/**
+ * Helper for dec_tree_flatten. Store the subtree of `node` in preorder from
+ * nodes[next] on, and return the index following it.
+ */
+static int flatten_subtree(DTNode *node, FlatNode *nodes, int next) {
+    int index = next++;
+    if (node -> classification != -1) { // leaf
+        nodes[index] = (FlatNode) {-1, 0, node -> classification, 0, -1};
+        return next;
+    }
+    next = flatten_subtree(node -> left, nodes, next);
+    nodes[index] = (FlatNode) {node -> pixel, node -> threshold, -1, 0, next};
+    return flatten_subtree(node -> right, nodes, next);
+}
+
+/**
+ * Store the tree in `nodes`, of dec_tree_num_nodes(root) entries, in the
+ * preorder layout of model files: the tree's root is nodes[0] and `right`
+ * indices count from it.
+ */
+void dec_tree_flatten(DTNode *root, FlatNode *nodes) {
+    flatten_subtree(root, nodes, 0);
+}
+
+/* Write the model of the tree into `buffer`, of model_size() bytes */
+static void write_model(DTNode *root, int num_nodes, void *buffer) {
+    ModelHeader *header = buffer;
+    *header = (ModelHeader) {MODEL_MAGIC, MODEL_VERSION, WIDTH, num_nodes, dec_tree_depth(root), 0};
+    dec_tree_flatten(root, (FlatNode *) (header + 1));
+}
+
+/**
+ * Return 1 if the `size` bytes at `map` hold a model for images of WIDTH x
+ * WIDTH pixels whose every path ends at a leaf, so that classifying with it
+ * cannot read out of bounds or loop.
+ */
+static int valid_model(const void *map, size_t size) {
+    const ModelHeader *header = map;
+    if (size < sizeof(ModelHeader) || header -> magic != MODEL_MAGIC || header -> version != MODEL_VERSION
+            || header -> width != WIDTH || header -> num_nodes == 0
+            || size != model_size(header -> num_nodes)) {
+        return 0;
+    }
+    const FlatNode *nodes = (const FlatNode *) (header + 1);
+    int num_nodes = header -> num_nodes;
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].pixel == -1) {
+            if (nodes[i].classification < 0 || nodes[i].classification > 9) {
+                return 0;
+            }
+        } else if (nodes[i].pixel < 0 || nodes[i].pixel >= NUM_PIXELS
+                   || nodes[i].right <= i + 1 || nodes[i].right >= num_nodes) {
+            return 0; // children always come after their parent, so walks end
+        }
+    }
+    return 1;
+}
+
+/**
+ * Save the tree to `path` as a flat model: it is written to a temporary file
+ * next to `path`, flushed to disk and renamed over `path`, so that processes
+ * mapping `path` never see a partial model. Return 0 on success, -1 on error.
+ */
+int dec_tree_save_model(DTNode *root, const char *path) {
+    int num_nodes = dec_tree_num_nodes(root);
+    size_t size = model_size(num_nodes);
+    char *buffer = malloc(size);
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+    if (buffer == NULL || temp_path == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(buffer);
+        free(temp_path);
+        return -1;
+    }
+    write_model(root, num_nodes, buffer);
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    FILE *file = fopen(temp_path, "wb");
+    int ok = file != NULL && fwrite(buffer, 1, size, file) == size && fflush(file) == 0
+        && fsync(fileno(file)) == 0;
+    if (file != NULL && fclose(file) != 0) {
+        ok = 0;
+    }
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Error: could not write model %s\n", path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+    free(buffer);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Map the model file at `path` read-only and return it, or NULL if it cannot
+ * be read or is not a valid model. The pages are those of the file in the
+ * page cache, shared by every process that maps it.
+ */
+DTModel *model_map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open model %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mapping keeps the file alive
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map model %s\n", path);
+        return NULL;
+    }
+    if (!valid_model(map, st.st_size)) {
+        fprintf(stderr, "Error: %s is not a valid model\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    DTModel *model = malloc(sizeof(DTModel));
+    model -> map = map;
+    model -> map_size = st.st_size;
+    model -> header = map;
+    model -> nodes = (const FlatNode *) (model -> header + 1);
+    return model;
+}
+
+/**
+ * Return the model of the tree in an anonymous shared mapping, made read-only
+ * once written. Processes forked after this call share its pages.
+ */
+DTModel *model_from_tree(DTNode *root) {
+    int num_nodes = dec_tree_num_nodes(root);
+    size_t size = model_size(num_nodes);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map model\n");
+        return NULL;
+    }
+    write_model(root, num_nodes, map);
+    mprotect(map, size, PROT_READ);
+
+    DTModel *model = malloc(sizeof(DTModel));
+    model -> map = map;
+    model -> map_size = size;
+    model -> header = map;
+    model -> nodes = (const FlatNode *) (model -> header + 1);
+    return model;
+}
+
+/**
+ * Given a model and an image to classify, return the predicted label (the
+ * same as `dec_tree_classify()` with the tree the model was made from).
+ */
+int model_classify(const DTModel *model, const Image *img) {
+    const FlatNode *nodes = model -> nodes;
+    int i = 0;
+    while (nodes[i].pixel != -1) {
+        i = image_pixel(img, nodes[i].pixel) < nodes[i].threshold ? i + 1 : nodes[i].right;
+    }
+    return nodes[i].classification;
+}
+
+/**
+ * Classify every image in `data` with the model and return the number of
+ * images whose predicted label matches the label stored in the dataset.
+ */
+int model_evaluate(const DTModel *model, Dataset *data) {
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += model_classify(model, &(data -> images[i])) == data -> labels[i];
+    }
+    return total_correct;
+}
+
+/* Unmap the model and free it */
+void model_unmap(DTModel *model) {
+    munmap(model -> map, model -> map_size);
+    free(model);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dectree.h"
+
+/**
+ * Flat model files: a decision tree stored as one array of fixed-size nodes,
+ * so that it can be mapped read-only and classified in place, without being
+ * parsed into DTNodes. Processes that map the same model (a file, or an
+ * anonymous shared mapping inherited across fork()) share its pages.
+ *
+ * The file is a ModelHeader followed by `num_nodes` FlatNodes in preorder:
+ * the left child of an internal node is the node after it, and `right` is
+ * the index of its right child.
+ */
+
+/* First bytes of a model file ("DTMD"), and its format version */
+#define MODEL_MAGIC 0x444d5444u
+#define MODEL_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;         // WIDTH of the images the tree was built for
+    uint32_t num_nodes;
+    uint32_t depth;         // Depth of the tree (a single leaf has depth 0)
+    uint32_t reserved;
+} ModelHeader;
+
+typedef struct {
+    int16_t pixel;          // Pixel tested, or -1 for a leaf
+    int16_t threshold;      // Images with a color < threshold go left
+    int16_t classification; // Label of a leaf, -1 for internal nodes
+    int16_t reserved;
+    int32_t right;          // Index of the right child (internal nodes)
+} FlatNode;
+
+/* A model mapped read-only */
+typedef struct {
+    const ModelHeader *header;
+    const FlatNode *nodes;
+    void *map;              // Start of the mapping
+    size_t map_size;        // Size of the mapping in bytes
+} DTModel;
+
+void dec_tree_flatten(DTNode *root, FlatNode *nodes);
+int dec_tree_save_model(DTNode *root, const char *path);
+DTModel *model_map(const char *path);
+DTModel *model_from_tree(DTNode *root);
+int model_classify(const DTModel *model, const Image *img);
+int model_evaluate(const DTModel *model, Dataset *data);
+void model_unmap(DTModel *model);
@@ -0,0 +1,184 @@
+#include "multieval.h"
+#include "pool.h"
+
+/**
+ * Return an evaluation of the `num_models` models (which must stay mapped
+ * until it is freed) in blocks of `block` images (EVAL_BLOCK if < 1).
+ */
+MultiEval *multi_eval_create(const DTModel **models, int num_models, int block) {
+    MultiEval *eval = calloc(1, sizeof(MultiEval));
+    if (eval == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    eval -> num_models = num_models;
+    eval -> models = models;
+    eval -> block = block < 1 ? EVAL_BLOCK : block;
+    eval -> predictions = malloc((size_t) num_models * eval -> block);
+    eval -> correct = calloc(num_models, sizeof(uint64_t));
+    eval -> ns = calloc(num_models, sizeof(uint64_t));
+    eval -> disagree = calloc((size_t) num_models * num_models, sizeof(uint64_t));
+    if (eval -> predictions == NULL || eval -> correct == NULL || eval -> ns == NULL
+            || eval -> disagree == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free_multi_eval(eval);
+        return NULL;
+    }
+    return eval;
+}
+
+/* A block being classified, see classify_range() */
+typedef struct {
+    MultiEval *eval;
+    const Image *images;
+} BlockJob;
+
+/**
+ * Helper for multi_eval_block. Classify images [start, end) of the block
+ * with every model in turn, storing the predictions and adding up the time
+ * each model takes.
+ */
+static void classify_range(void *arg, int start, int end) {
+    BlockJob *job = arg;
+    MultiEval *eval = job -> eval;
+    for (int m = 0; m < eval -> num_models; m++) {
+        const DTModel *model = eval -> models[m];
+        unsigned char *predictions = eval -> predictions + (size_t) m * eval -> block;
+        uint64_t begin = now_ns();
+        for (int i = start; i < end; i++) {
+            predictions[i] = model_classify(model, &(job -> images[i]));
+        }
+        __atomic_add_fetch(&(eval -> ns[m]), now_ns() - begin, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Classify the `num_images` images with every model, a block at a time, and
+ * count the correct predictions (given the `labels` of the images) and the
+ * disagreements.
+ */
+void multi_eval_block(MultiEval *eval, const Image *images, const unsigned char *labels, int num_images) {
+    int n = eval -> num_models;
+    for (int first = 0; first < num_images; first += eval -> block) {
+        int count = num_images - first < eval -> block ? num_images - first : eval -> block;
+        BlockJob job = {eval, images + first};
+        pool_parallel_for(0, count, EVAL_GRAIN, classify_range, &job);
+
+        for (int a = 0; a < n; a++) {
+            const unsigned char *pa = eval -> predictions + (size_t) a * eval -> block;
+            uint64_t correct = 0;
+            for (int i = 0; i < count; i++) {
+                correct += pa[i] == labels[first + i];
+            }
+            eval -> correct[a] += correct;
+            for (int b = a + 1; b < n; b++) {
+                const unsigned char *pb = eval -> predictions + (size_t) b * eval -> block;
+                uint64_t differ = 0;
+                for (int i = 0; i < count; i++) {
+                    differ += pa[i] != pb[i];
+                }
+                eval -> disagree[a * n + b] += differ;
+            }
+        }
+        eval -> images += count;
+    }
+}
+
+/**
+ * Evaluate the models on the dataset file `path` (see load_dataset()),
+ * streamed a block at a time: each block of records is read into one buffer
+ * and its images point into it, so nothing is copied. Return 0 on success,
+ * -1 if the file cannot be read or is truncated (the blocks read before
+ * count).
+ */
+int multi_eval_file(MultiEval *eval, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: could not open %s\n", path);
+        return -1;
+    }
+    const size_t record_size = 1 + NUM_PIXELS;
+    int block = eval -> block;
+    unsigned char *records = malloc(record_size * block);
+    unsigned char *labels = malloc(block);
+    Image *images = malloc(sizeof(Image) * block);
+    int status = 0;
+    int total = 0;
+    if (records == NULL || labels == NULL || images == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        status = -1;
+    } else if (fread(&total, sizeof(int), 1, file) != 1 || total < 0) {
+        fprintf(stderr, "Error: %s is not a dataset\n", path);
+        status = -1;
+    }
+    for (int i = 0; i < block && status == 0; i++) {
+        images[i] = (Image) {WIDTH, WIDTH, records + record_size * i + 1, 0, 0};
+    }
+
+    for (int first = 0; first < total && status == 0; first += block) {
+        int count = total - first < block ? total - first : block;
+        uint64_t begin = now_ns();
+        size_t got = fread(records, record_size, count, file);
+        for (size_t i = 0; i < got; i++) {
+            labels[i] = records[record_size * i];
+        }
+        eval -> read_ns += now_ns() - begin;
+        if (got < (size_t) count) {
+            fprintf(stderr, "Error: %s is truncated\n", path);
+            status = -1;
+        }
+        multi_eval_block(eval, images, labels, (int) got);
+    }
+
+    free(records);
+    free(labels);
+    free(images);
+    fclose(file);
+    return status;
+}
+
+/**
+ * Print the node count, depth, accuracy and classify latency of each model
+ * (named by `names`, or by number if NULL), then the number of images each
+ * pair of models labels differently.
+ */
+void multi_eval_print(const MultiEval *eval, char **names, FILE *out) {
+    int n = eval -> num_models;
+    uint64_t images = eval -> images > 0 ? eval -> images : 1;
+    fprintf(out, "%lu images read once in blocks of %d (%.1f ns/image), classified by %d models\n",
+            (unsigned long) eval -> images, eval -> block, (double) eval -> read_ns / images, n);
+    fprintf(out, "\n%-4s %-24s %8s %6s %9s %12s\n", "#", "model", "nodes", "depth", "accuracy", "classify_ns");
+    for (int m = 0; m < n; m++) {
+        const ModelHeader *header = eval -> models[m] -> header;
+        fprintf(out, "%-4d %-24s %8u %6u %8.2f%% %12.1f\n", m, names != NULL ? names[m] : "", header -> num_nodes,
+                header -> depth, 100.0 * eval -> correct[m] / images, (double) eval -> ns[m] / images);
+    }
+    if (n < 2) {
+        return;
+    }
+    fprintf(out, "\ndisagreements (images)\n%-4s", "#");
+    for (int b = 1; b < n; b++) {
+        fprintf(out, " %8d", b);
+    }
+    fprintf(out, "\n");
+    for (int a = 0; a < n - 1; a++) {
+        fprintf(out, "%-4d", a);
+        for (int b = 1; b < n; b++) {
+            if (b <= a) {
+                fprintf(out, " %8s", "");
+            } else {
+                fprintf(out, " %8lu", (unsigned long) eval -> disagree[a * n + b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/* Free the evaluation (not its models) */
+void free_multi_eval(MultiEval *eval) {
+    free(eval -> predictions);
+    free(eval -> correct);
+    free(eval -> ns);
+    free(eval -> disagree);
+    free(eval);
+}
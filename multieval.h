@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dectree.h"
+#include "model.h"
+
+/**
+ * Evaluation of several models in one pass over the testing data: the data
+ * is read once, a block of EVAL_BLOCK images at a time, and each block is
+ * classified by every model in turn while its images are still in cache, so
+ * reading and decoding the data costs the same whatever the number of
+ * models. Blocks are split in ranges of EVAL_GRAIN images over the thread
+ * pool (see pool.h), each range going through every model.
+ *
+ * For each model, the number of correct predictions and the time spent
+ * classifying are counted, and for each pair of models the number of images
+ * they label differently.
+ */
+
+/* Images read and classified at a time (about 200 KB of pixels, for L2) */
+#ifndef EVAL_BLOCK
+#define EVAL_BLOCK 256
+#endif
+
+/* Images of a block classified by one task */
+#ifndef EVAL_GRAIN
+#define EVAL_GRAIN 64
+#endif
+
+typedef struct {
+    int num_models;
+    const DTModel **models;     // Not owned
+    int block;                  // Images per block
+    unsigned char *predictions; // Predictions of each model for the current block, model-major
+
+    uint64_t images;
+    uint64_t *correct;          // Correct predictions of each model
+    uint64_t *ns;               // Time each model spent classifying, in ns
+    uint64_t *disagree;         // disagree[a * num_models + b]: images models a < b label differently
+    uint64_t read_ns;           // Time spent reading and decoding the data
+} MultiEval;
+
+MultiEval *multi_eval_create(const DTModel **models, int num_models, int block);
+void multi_eval_block(MultiEval *eval, const Image *images, const unsigned char *labels, int num_images);
+int multi_eval_file(MultiEval *eval, const char *path);
+void multi_eval_print(const MultiEval *eval, char **names, FILE *out);
+void free_multi_eval(MultiEval *eval);
@@ -0,0 +1,225 @@
+#include "oblivious.h"
+
+/**
+ * Helper for build_oblivious_tree. Group the image indices of the dataset by
+ * the node (at the current level) they fall into: on return, the images of
+ * node n are order[node_start[n]] .. order[node_start[n + 1] - 1], in
+ * increasing index order.
+ */
+static void group_by_node(int N, const int *node_of, int num_nodes, int *order, int *node_start) {
+    memset(node_start, 0, sizeof(int) * (num_nodes + 1));
+    for (int i = 0; i < N; i++) {
+        node_start[node_of[i] + 1]++;
+    }
+    for (int n = 0; n < num_nodes; n++) {
+        node_start[n + 1] += node_start[n];
+    }
+
+    int *next = malloc(sizeof(int) * num_nodes);
+    memcpy(next, node_start, sizeof(int) * num_nodes);
+    for (int i = 0; i < N; i++) {
+        order[next[node_of[i]]++] = i;
+    }
+    free(next);
+}
+
+/**
+ * Helper for build_oblivious_tree. Store in node_label[n] the most frequent
+ * label of each of the `num_nodes` nodes of a level, or -1 for empty nodes,
+ * and return 1 if every non-empty node is pure enough to be a leaf (see
+ * THRESHOLD_RATIO).
+ */
+static int label_nodes(Dataset *data, int num_nodes, int *order, const int *node_start,
+                       int *node_label) {
+    int all_pure = 1;
+    for (int n = 0; n < num_nodes; n++) {
+        int M = node_start[n + 1] - node_start[n];
+        node_label[n] = -1;
+        if (M == 0) {
+            continue;
+        }
+        int label, freq;
+        get_most_frequent(data, M, order + node_start[n], &label, &freq);
+        node_label[n] = label;
+        if (((double) freq / (double) M) < THRESHOLD_RATIO) {
+            all_pure = 0;
+        }
+    }
+    return all_pure;
+}
+
+/**
+ * Build an oblivious tree of at most `max_depth` levels (see ObliviousTree).
+ *
+ * The tree is grown one level at a time. For each level, every node's label
+ * frequencies are counted with the same per-node histograms as
+ * `find_best_split()` (see `pixel_split_scores()`), and the pixel whose split
+ * minimizes the total score over all nodes of the level, each node weighted by
+ * its number of images, is chosen for the whole level. Growth stops early when
+ * every node is pure enough, or when no pixel separates the images of any node.
+ *
+ * Only the binary split criteria of `params` are used; grayscale mode does not
+ * apply to oblivious trees. Leaves that receive no training images take the
+ * classification of their closest non-empty ancestor. Return NULL if memory
+ * runs out.
+ */
+ObliviousTree *build_oblivious_tree(Dataset *data, const DTParams *params, int max_depth) {
+    int N = data -> num_items;
+    if (max_depth < 0) {
+        max_depth = 0;
+    } else if (max_depth > OBLIVIOUS_MAX_DEPTH) {
+        max_depth = OBLIVIOUS_MAX_DEPTH;
+    }
+
+    ObliviousTree *tree = malloc(sizeof(ObliviousTree));
+    int *node_of = calloc(N + 1, sizeof(int));  // node of each image at the current level
+    int *order = malloc(sizeof(int) * (N + 1));
+    int *node_start = malloc(sizeof(int) * ((1 << max_depth) + 1));
+    // label of the node n of level l at node_label[(1 << l) + n]
+    int *node_label = malloc(sizeof(int) * (2 << max_depth));
+    double *level_score = malloc(sizeof(double) * NUM_PIXELS);
+    char *separates = malloc(sizeof(char) * NUM_PIXELS);
+    double scores[NUM_PIXELS];
+    int right_count[NUM_PIXELS];
+    if (tree == NULL || node_of == NULL || order == NULL || node_start == NULL || node_label == NULL
+            || level_score == NULL || separates == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(tree);
+        free(node_of);
+        free(order);
+        free(node_start);
+        free(node_label);
+        free(level_score);
+        free(separates);
+        return NULL;
+    }
+
+    DTParams level_params = *params;
+    dt_params_resolve(&level_params, data);
+
+    tree -> depth = 0;
+    for (int level = 0; level <= max_depth; level++) {
+        int num_nodes = 1 << level;
+        group_by_node(N, node_of, num_nodes, order, node_start);
+        int all_pure = label_nodes(data, num_nodes, order, node_start, node_label + num_nodes);
+        if (all_pure || level == max_depth) {
+            break;
+        }
+
+        // sum the score of each pixel over all the nodes of the level
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            level_score[p] = 0;
+            separates[p] = 0;
+        }
+        for (int n = 0; n < num_nodes; n++) {
+            int M = node_start[n + 1] - node_start[n];
+            if (M == 0) {
+                continue;
+            }
+            pixel_split_scores(data, M, order + node_start[n], NULL, &level_params, scores, right_count);
+            for (int p = 0; p < NUM_PIXELS; p++) {
+                level_score[p] += scores[p] * M;
+                separates[p] |= (right_count[p] != 0 && right_count[p] != M);
+            }
+        }
+
+        double min_score = INFINITY;
+        int best_split = -1;
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            if (separates[p] && level_score[p] < min_score) {
+                min_score = level_score[p];
+                best_split = p;
+            }
+        }
+        if (best_split == -1) {
+            break;
+        }
+
+        // route every image to its node at the next level
+        tree -> pixels[level] = best_split;
+        tree -> depth = level + 1;
+        for (int i = 0; i < N; i++) {
+            node_of[i] |= (image_pixel(&(data -> images[i]), best_split) >= BINARY_THRESHOLD) << level;
+        }
+    }
+
+    // fill the leaf table, falling back to the closest non-empty ancestor
+    int num_leaves = 1 << tree -> depth;
+    tree -> leaves = malloc(sizeof(unsigned char) * num_leaves);
+    for (int n = 0; n < num_leaves && tree -> leaves != NULL; n++) {
+        int label = -1;
+        for (int level = tree -> depth; level >= 0 && label == -1; level--) {
+            label = node_label[(1 << level) + (n & ((1 << level) - 1))];
+        }
+        tree -> leaves[n] = label == -1 ? 0 : label;
+    }
+
+    free(node_of);
+    free(order);
+    free(node_start);
+    free(node_label);
+    free(level_score);
+    free(separates);
+    if (tree -> leaves == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+/**
+ * Given an oblivious tree and an image to classify, return the predicted label.
+ */
+int oblivious_classify(const ObliviousTree *tree, const Image *img) {
+    unsigned int index = 0;
+    for (int level = 0; level < tree -> depth; level++) {
+        index |= (unsigned int) (image_pixel(img, tree -> pixels[level]) >= BINARY_THRESHOLD) << level;
+    }
+    return tree -> leaves[index];
+}
+
+/**
+ * Classify `num_images` images, storing the predicted label of images[i] in
+ * predictions[i]. Levels are processed for all images at once, so each pass
+ * reads a single pixel of every image and the inner loop vectorizes.
+ */
+void oblivious_classify_batch(const ObliviousTree *tree, const Image *images, int num_images,
+                              int *predictions) {
+    for (int i = 0; i < num_images; i++) {
+        predictions[i] = 0;
+    }
+    for (int level = 0; level < tree -> depth; level++) {
+        int pixel = tree -> pixels[level];
+        for (int i = 0; i < num_images; i++) {
+            predictions[i] |= (image_pixel(&images[i], pixel) >= BINARY_THRESHOLD) << level;
+        }
+    }
+    for (int i = 0; i < num_images; i++) {
+        predictions[i] = tree -> leaves[predictions[i]];
+    }
+}
+
+/**
+ * Classify every image in `data` and return the number of images whose
+ * predicted label matches the label stored in the dataset.
+ */
+int oblivious_evaluate(const ObliviousTree *tree, Dataset *data) {
+    int *predictions = malloc(sizeof(int) * data -> num_items);
+    oblivious_classify_batch(tree, data -> images, data -> num_items, predictions);
+
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += predictions[i] == data -> labels[i];
+    }
+    free(predictions);
+    return total_correct;
+}
+
+/**
+ * Free the oblivious tree.
+ */
+void free_oblivious_tree(ObliviousTree *tree) {
+    free(tree -> leaves);
+    free(tree);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "dectree.h"
+
+/* Maximum (and default) depth of an oblivious tree: its leaf table has 2^depth entries */
+#ifndef OBLIVIOUS_MAX_DEPTH
+#define OBLIVIOUS_MAX_DEPTH 16
+#endif
+
+#ifndef OBLIVIOUS_DEFAULT_DEPTH
+#define OBLIVIOUS_DEFAULT_DEPTH 12
+#endif
+
+/**
+ * An oblivious (symmetric) decision tree: every node at level l tests the same
+ * pixel, pixels[l], at BINARY_THRESHOLD. The outcomes of the `depth` tests
+ * form a `depth`-bit index (the test at level l gives bit l, 1 when the color
+ * is >= BINARY_THRESHOLD) into a table of 2^depth leaf classifications, so
+ * classifying an image is `depth` pixel reads and a single lookup, with no
+ * branches.
+ */
+typedef struct {
+    int depth;                          // Number of levels (tested pixels)
+    int pixels[OBLIVIOUS_MAX_DEPTH];    // Pixel tested by every node of each level
+    unsigned char *leaves;              // Array of 2^depth classifications [0-9]
+} ObliviousTree;
+
+ObliviousTree *build_oblivious_tree(Dataset *data, const DTParams *params, int max_depth);
+int oblivious_classify(const ObliviousTree *tree, const Image *img);
+void oblivious_classify_batch(const ObliviousTree *tree, const Image *images, int num_images,
+                              int *predictions);
+int oblivious_evaluate(const ObliviousTree *tree, Dataset *data);
+void free_oblivious_tree(ObliviousTree *tree);
@@ -0,0 +1,326 @@
+#include "packed.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Return 1 if every node of the tree splits a pixel (not a derived feature,
+ * see features.h) at BINARY_THRESHOLD, so that the tree can classify packed
+ * and compressed images.
+ */
+int dec_tree_is_binary(DTNode *root) {
+    if (root -> classification != -1) {
+        return 1;
+    }
+    return root -> threshold == BINARY_THRESHOLD && root -> pixel >= 0 && root -> pixel < NUM_PIXELS
+        && dec_tree_is_binary(root -> left) && dec_tree_is_binary(root -> right);
+}
+
+/**
+ * Helper for pack_image. Return the bits of the 16 pixels at `pixels` as a
+ * 16-bit mask. A pixel is >= 128 exactly when its top bit is set, so with the
+ * default threshold the bits are gathered with one SSE2 `movemask`, or a
+ * multiply per 8 pixels that moves the top bit of byte i to bit 56 + i.
+ */
+static inline uint32_t pixel_mask16(const unsigned char *pixels) {
+#if BINARY_THRESHOLD == 128 && defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) pixels));
+#elif BINARY_THRESHOLD == 128 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t words[2];
+    memcpy(words, pixels, sizeof(words));
+    uint32_t low = (((words[0] >> 7) & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+    uint32_t high = (((words[1] >> 7) & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+    return low | high << 8;
+#else
+    uint32_t mask = 0;
+    for (int j = 0; j < 16; j++) {
+        mask |= (uint32_t) (pixels[j] >= BINARY_THRESHOLD) << j;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Pack the NUM_PIXELS-pixel image `pixels` into `packed`, one bit per pixel.
+ * The bits are gathered 16 pixels at a time into a bit stream, which is cut
+ * into rows of WIDTH bits.
+ */
+void pack_image(const unsigned char *pixels, PackedImage *packed) {
+    uint64_t stream = 0;
+    int num_bits = 0, y = 0, i = 0;
+    for (; i + 16 <= NUM_PIXELS; i += 16) {
+        stream |= (uint64_t) pixel_mask16(pixels + i) << num_bits;
+        num_bits += 16;
+        while (num_bits >= WIDTH) {
+            packed -> rows[y++] = stream & ((1ULL << WIDTH) - 1);
+            stream >>= WIDTH;
+            num_bits -= WIDTH;
+        }
+    }
+    for (; i < NUM_PIXELS; i++) {
+        stream |= (uint64_t) (pixels[i] >= BINARY_THRESHOLD) << num_bits++;
+        if (num_bits == WIDTH) {
+            packed -> rows[y++] = stream;
+            stream = 0;
+            num_bits = 0;
+        }
+    }
+}
+
+/**
+ * Shift the packed image `dx` pixels to the right and `dy` pixels down, as
+ * `image_pixel()` reads a shifted image: bits shifted in are blank.
+ */
+void shift_packed_image(PackedImage *packed, int dx, int dy) {
+    const uint32_t row_mask = (uint32_t) ((1ULL << WIDTH) - 1);
+    PackedImage source = *packed;
+    for (int y = 0; y < WIDTH; y++) {
+        int source_y = y - dy;
+        uint32_t row = 0;
+        if (source_y >= 0 && source_y < WIDTH && dx > -WIDTH && dx < WIDTH) {
+            row = source.rows[source_y];
+            row = dx >= 0 ? (row << dx) & row_mask : row >> -dx;
+        }
+        packed -> rows[y] = row;
+    }
+}
+
+/**
+ * Helper for the packed loaders. Allocate a PackedDataset of `num_items`
+ * images with uninitialized contents.
+ */
+static PackedDataset *alloc_packed_dataset(int num_items) {
+    PackedDataset *packed = malloc(sizeof(PackedDataset));
+    if (packed == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    packed -> num_items = num_items;
+    packed -> images = malloc(sizeof(PackedImage) * num_items);
+    packed -> labels = malloc(sizeof(unsigned char) * num_items);
+    if ((packed -> images == NULL || packed -> labels == NULL) && num_items > 0) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+    return packed;
+}
+
+/**
+ * Return a packed copy of the images of `data`.
+ */
+PackedDataset *pack_dataset(Dataset *data) {
+    PackedDataset *packed = alloc_packed_dataset(data -> num_items);
+    for (int i = 0; i < data -> num_items; i++) {
+        packed -> labels[i] = data -> labels[i];
+        const Image *img = &(data -> images[i]);
+        pack_image(img -> data, &(packed -> images[i]));
+        if ((img -> dx | img -> dy) != 0) {
+            shift_packed_image(&(packed -> images[i]), img -> dx, img -> dy);
+        }
+    }
+    return packed;
+}
+
+/**
+ * Load the binary file `filename` (in the format read by `load_dataset()`)
+ * directly in packed form, one record at a time.
+ */
+PackedDataset *load_dataset_packed(const char *filename) {
+    FILE *data_file = fopen(filename, "rb");
+    if (data_file == NULL) {
+        fprintf(stderr, "Error: could not open file\n");
+        return NULL;
+    }
+
+    int total_images = 0;
+    fread(&total_images, sizeof(int), 1, data_file);
+    PackedDataset *packed = alloc_packed_dataset(total_images);
+
+    unsigned char record[NUM_PIXELS];
+    for (int i = 0; i < total_images; i++) {
+        fread(packed -> labels + i, sizeof(unsigned char), 1, data_file);
+        fread(record, sizeof(unsigned char), NUM_PIXELS, data_file);
+        pack_image(record, &(packed -> images[i]));
+    }
+
+    if (fclose(data_file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+    }
+    return packed;
+}
+
+/**
+ * Given a binary decision tree and a packed image, return the predicted label.
+ * Each node tests a single bit of the image.
+ */
+int dec_tree_classify_packed(DTNode *root, const PackedImage *img) {
+    DTNode *node = root;
+    while (node -> classification == -1) {
+        int pixel = node -> pixel;
+        uint32_t bit = (img -> rows[pixel / WIDTH] >> (pixel % WIDTH)) & 1;
+        node = bit ? node -> right : node -> left;
+    }
+    return node -> classification;
+}
+
+/**
+ * Classify every packed image in `data` and return the number of images whose
+ * predicted label matches the label stored in the dataset.
+ */
+int packed_evaluate(DTNode *root, PackedDataset *data) {
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += dec_tree_classify_packed(root, &(data -> images[i])) == data -> labels[i];
+    }
+    return total_correct;
+}
+
+/**
+ * Free all the allocated memory for the packed dataset.
+ */
+void free_packed_dataset(PackedDataset *data) {
+    free(data -> images);
+    free(data -> labels);
+    free(data);
+}
+
+/**
+ * Helper for the compressed loaders. Append the image `pixels` as image
+ * `index` of `data`, growing the mask pool (of `*capacity` masks) as needed.
+ */
+static void compress_image(CompressedDataset *data, int index, const unsigned char *pixels,
+                           uint32_t *capacity) {
+    uint32_t offset = data -> offsets[index];
+    if (offset + COMPRESSED_NUM_BLOCKS > *capacity) {
+        *capacity = 2 * (*capacity) + COMPRESSED_NUM_BLOCKS;
+        data -> masks = realloc(data -> masks, sizeof(uint16_t) * (*capacity));
+    }
+
+    uint64_t present = 0;
+    for (int b = 0; b < COMPRESSED_NUM_BLOCKS; b++) {
+        uint16_t mask = 0;
+        for (int j = 0; j < COMPRESSED_BLOCK && b * COMPRESSED_BLOCK + j < NUM_PIXELS; j++) {
+            mask |= (uint16_t) (pixels[b * COMPRESSED_BLOCK + j] >= BINARY_THRESHOLD) << j;
+        }
+        if (mask != 0) {
+            present |= (uint64_t) 1 << b;
+            data -> masks[offset++] = mask;
+        }
+    }
+    data -> present[index] = present;
+    data -> offsets[index + 1] = offset;
+}
+
+/**
+ * Helper for the compressed loaders. Allocate a CompressedDataset of
+ * `num_items` images, with an empty mask pool.
+ */
+static CompressedDataset *alloc_compressed_dataset(int num_items) {
+    CompressedDataset *data = malloc(sizeof(CompressedDataset));
+    if (data == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    data -> num_items = num_items;
+    data -> present = malloc(sizeof(uint64_t) * num_items);
+    data -> offsets = malloc(sizeof(uint32_t) * (num_items + 1));
+    data -> labels = malloc(sizeof(unsigned char) * num_items);
+    data -> masks = NULL;
+    data -> offsets[0] = 0;
+    return data;
+}
+
+/**
+ * Return a block-compressed copy of the images of `data`.
+ */
+CompressedDataset *compress_dataset(Dataset *data) {
+    CompressedDataset *compressed = alloc_compressed_dataset(data -> num_items);
+    uint32_t capacity = 0;
+    unsigned char shifted[NUM_PIXELS];
+    for (int i = 0; i < data -> num_items; i++) {
+        const Image *img = &(data -> images[i]);
+        compressed -> labels[i] = data -> labels[i];
+        if ((img -> dx | img -> dy) != 0) {
+            image_read(img, shifted);
+            compress_image(compressed, i, shifted, &capacity);
+        } else {
+            compress_image(compressed, i, img -> data, &capacity);
+        }
+    }
+    return compressed;
+}
+
+/**
+ * Load the binary file `filename` (in the format read by `load_dataset()`)
+ * directly in block-compressed form, one record at a time.
+ */
+CompressedDataset *load_dataset_compressed(const char *filename) {
+    FILE *data_file = fopen(filename, "rb");
+    if (data_file == NULL) {
+        fprintf(stderr, "Error: could not open file\n");
+        return NULL;
+    }
+
+    int total_images = 0;
+    fread(&total_images, sizeof(int), 1, data_file);
+    CompressedDataset *compressed = alloc_compressed_dataset(total_images);
+
+    unsigned char record[NUM_PIXELS];
+    uint32_t capacity = 0;
+    for (int i = 0; i < total_images; i++) {
+        fread(compressed -> labels + i, sizeof(unsigned char), 1, data_file);
+        fread(record, sizeof(unsigned char), NUM_PIXELS, data_file);
+        compress_image(compressed, i, record, &capacity);
+    }
+
+    if (fclose(data_file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+    }
+    return compressed;
+}
+
+/**
+ * Given a binary decision tree and the compressed image number `index` of
+ * `data`, return the predicted label. Each node decodes only the block of
+ * the pixel it tests: blocks missing from `present` are blank, and the mask
+ * of a present block is found by counting the present blocks before it.
+ */
+int dec_tree_classify_compressed(DTNode *root, const CompressedDataset *data, int index) {
+    uint64_t present = data -> present[index];
+    const uint16_t *masks = data -> masks + data -> offsets[index];
+
+    DTNode *node = root;
+    while (node -> classification == -1) {
+        int block = node -> pixel / COMPRESSED_BLOCK;
+        int bit = 0;
+        if ((present >> block) & 1) {
+            uint16_t mask = masks[__builtin_popcountll(present & (((uint64_t) 1 << block) - 1))];
+            bit = (mask >> (node -> pixel % COMPRESSED_BLOCK)) & 1;
+        }
+        node = bit ? node -> right : node -> left;
+    }
+    return node -> classification;
+}
+
+/**
+ * Classify every compressed image in `data` and return the number of images
+ * whose predicted label matches the label stored in the dataset.
+ */
+int compressed_evaluate(DTNode *root, CompressedDataset *data) {
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += dec_tree_classify_compressed(root, data, i) == data -> labels[i];
+    }
+    return total_correct;
+}
+
+/**
+ * Free all the allocated memory for the compressed dataset.
+ */
+void free_compressed_dataset(CompressedDataset *data) {
+    free(data -> present);
+    free(data -> offsets);
+    free(data -> masks);
+    free(data -> labels);
+    free(data);
+}
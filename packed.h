@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+
+/**
+ * Packed and compressed storage for binarized images, and classification
+ * straight from them. Both forms keep one bit per pixel, set when the color
+ * is >= BINARY_THRESHOLD, so they can only be classified by binary trees
+ * (every node splitting at BINARY_THRESHOLD, see `dec_tree_is_binary()`).
+ * Classification tests the bits of the pixels the tree visits and never
+ * rebuilds the full image.
+ */
+
+/* Compressed images are split into blocks of this many consecutive pixels */
+#define COMPRESSED_BLOCK 16
+#define COMPRESSED_NUM_BLOCKS ((NUM_PIXELS + COMPRESSED_BLOCK - 1) / COMPRESSED_BLOCK)
+
+#if WIDTH > 32
+#error "Packed images store each row in 32 bits"
+#endif
+#if COMPRESSED_NUM_BLOCKS > 64
+#error "Compressed images index their blocks with a 64-bit mask"
+#endif
+
+/* A bit-packed image: bit x of rows[y] is pixel y * WIDTH + x */
+typedef struct {
+    uint32_t rows[WIDTH];
+} PackedImage;
+
+/* A dataset of bit-packed images */
+typedef struct {
+    int num_items;          // Number of images in the dataset
+    PackedImage *images;    // Array of `num_items` packed images
+    unsigned char *labels;  // Array of `num_items` labels [0-9]
+} PackedDataset;
+
+/**
+ * A dataset of block-compressed images. Image i keeps a 16-bit mask for each
+ * of its blocks that has a set pixel, and `present[i]` says which blocks
+ * those are (bit b for block b). The masks of image i are stored in block
+ * order at masks[offsets[i]] .. masks[offsets[i + 1] - 1], so the mask of
+ * any block is found with a popcount, without decoding the others.
+ */
+typedef struct {
+    int num_items;          // Number of images in the dataset
+    uint64_t *present;      // Array of `num_items` block masks
+    uint32_t *offsets;      // Array of `num_items + 1` offsets into `masks`
+    uint16_t *masks;        // Pixel masks of the non-empty blocks of all images
+    unsigned char *labels;  // Array of `num_items` labels [0-9]
+} CompressedDataset;
+
+int dec_tree_is_binary(DTNode *root);
+
+void pack_image(const unsigned char *pixels, PackedImage *packed);
+void shift_packed_image(PackedImage *packed, int dx, int dy);
+PackedDataset *pack_dataset(Dataset *data);
+PackedDataset *load_dataset_packed(const char *filename);
+int dec_tree_classify_packed(DTNode *root, const PackedImage *img);
+int packed_evaluate(DTNode *root, PackedDataset *data);
+void free_packed_dataset(PackedDataset *data);
+
+CompressedDataset *compress_dataset(Dataset *data);
+CompressedDataset *load_dataset_compressed(const char *filename);
+int dec_tree_classify_compressed(DTNode *root, const CompressedDataset *data, int index);
+int compressed_evaluate(DTNode *root, CompressedDataset *data);
+void free_compressed_dataset(CompressedDataset *data);
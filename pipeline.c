@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "pool.h"
+#include "preprocess.h"
+
+/* Names of the stages, for the report */
+static const char *stage_names[PIPE_STAGES] = {"ingest", "binarize", "normalize", "classify"};
+
+/* Return 1 if every internal node of the model splits at BINARY_THRESHOLD */
+static int model_is_binary(const DTModel *model) {
+    for (uint32_t i = 0; i < model -> header -> num_nodes; i++) {
+        if (model -> nodes[i].pixel != -1 && model -> nodes[i].threshold != BINARY_THRESHOLD) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Return a pipeline classifying with `model`, with rings of `depth` frames
+ * between its stages (0: PIPE_DEPTH) and batches of up to `batch` frames (0:
+ * PIPE_BATCH). With `center` set, frames are cropped and centered by mass
+ * rather than resized whole (see preprocess.h). With `pin` set, stage s runs
+ * on the (first_cpu + s)-th CPU the process may run on, wrapping around.
+ */
+Pipeline *pipeline_create(const DTModel *model, int depth, int batch, int center, int pin, int first_cpu) {
+    Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+    if (pipeline == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    depth = depth > 0 ? depth : PIPE_DEPTH;
+    pipeline -> model = model;
+    pipeline -> binarize = model_is_binary(model);
+    pipeline -> batch = batch > 0 ? batch : PIPE_BATCH;
+    pipeline -> center = center;
+    pipeline -> pin = pin;
+    pipeline -> first_cpu = first_cpu;
+
+    // enough frames to fill the three rings between stages while each consumer holds a batch,
+    // plus the one being read, so backpressure comes from full rings rather than missing frames
+    pipeline -> num_frames = 3 * depth + 3 * pipeline -> batch + 1;
+    pipeline -> frames = calloc(pipeline -> num_frames, sizeof(Frame));
+    int ok = pipeline -> frames != NULL && ring_init(&(pipeline -> rings[STAGE_INGEST]), pipeline -> num_frames) == 0;
+    for (int s = STAGE_BINARIZE; s < PIPE_STAGES && ok; s++) {
+        ok = ring_init(&(pipeline -> rings[s]), depth) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free_pipeline(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+/* Pin the calling thread to the CPU of `stage` */
+static void pin_stage(const Pipeline *pipeline, int stage) {
+    cpu_set_t allowed, set;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int target = (pipeline -> first_cpu + stage) % CPU_COUNT(&allowed);
+    int cpu = 0;
+    for (int seen = -1; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && ++seen == target) {
+            break;
+        }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Error: could not pin stage %s to CPU %d\n", stage_names[stage], cpu);
+    }
+}
+
+/**
+ * Helper for the ingest stage. Read the next frame of the stream into `frame`.
+ * Return 1 if one was read, 0 at the end of the stream, -1 if the stream is
+ * malformed. `remaining` counts down the records of a dataset file.
+ */
+static int read_frame(Pipeline *pipeline, Frame *frame, int64_t *remaining) {
+    FILE *input = pipeline -> input;
+    unsigned char label;
+    if (pipeline -> format == PIPE_DATASET) {
+        if (*remaining == 0) {
+            return 0;
+        }
+        frame -> sx = frame -> sy = WIDTH;
+        if (fread(&label, 1, 1, input) != 1) {
+            fprintf(stderr, "Error: dataset truncated after %llu images\n", (unsigned long long) frame -> index);
+            return -1;
+        }
+        (*remaining)--;
+    } else {
+        uint16_t size[2];
+        size_t got = fread(size, sizeof(uint16_t), 2, input);
+        if (got == 0 && feof(input)) {
+            return 0;
+        }
+        if (got != 2 || fread(&label, 1, 1, input) != 1) {
+            fprintf(stderr, "Error: frame %llu truncated\n", (unsigned long long) frame -> index);
+            return -1;
+        }
+        if (size[0] == 0 || size[1] == 0 || size[0] > PIPE_MAX_SIDE || size[1] > PIPE_MAX_SIDE) {
+            fprintf(stderr, "Error: frame %llu is %dx%d, frames must be 1x1 to %dx%d\n",
+                    (unsigned long long) frame -> index, size[0], size[1], PIPE_MAX_SIDE, PIPE_MAX_SIDE);
+            return -1;
+        }
+        frame -> sx = size[0];
+        frame -> sy = size[1];
+    }
+
+    size_t bytes = (size_t) frame -> sx * frame -> sy;
+    if (bytes > frame -> capacity) {
+        unsigned char *pixels = realloc(frame -> pixels, bytes);
+        if (pixels == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+            return -1;
+        }
+        frame -> pixels = pixels;
+        frame -> capacity = bytes;
+    }
+    if (fread(frame -> pixels, 1, bytes, input) != bytes) {
+        fprintf(stderr, "Error: frame %llu truncated\n", (unsigned long long) frame -> index);
+        return -1;
+    }
+    frame -> label = label < 10 ? label : PIPE_NO_LABEL;
+    return 1;
+}
+
+/* Threshold the pixels of the frame at BINARY_THRESHOLD, to 0 or 255 */
+static void binarize_frame(Frame *frame) {
+    size_t bytes = (size_t) frame -> sx * frame -> sy;
+    unsigned char *pixels = frame -> pixels;
+    for (size_t p = 0; p < bytes; p++) {
+        pixels[p] = pixels[p] >= BINARY_THRESHOLD ? 255 : 0;
+    }
+}
+
+/* Push the frame into ring `ring` of the pipeline */
+static inline void pass_on(Pipeline *pipeline, int ring, Frame *frame) {
+    frame -> queued = now_ns();
+    ring_push(&(pipeline -> rings[ring]), frame);
+}
+
+/* A stage thread: the pipeline and the stage it runs */
+typedef struct {
+    Pipeline *pipeline;
+    int stage;
+    pthread_t thread;
+} StageThread;
+
+/**
+ * Body of the ingest stage: take a free frame, read the next frame of the
+ * stream into it, pass it on, until the stream ends.
+ */
+static void run_ingest(Pipeline *pipeline) {
+    StageStats *stats = &(pipeline -> stages[STAGE_INGEST]);
+    int64_t remaining = 0;
+    if (pipeline -> format == PIPE_DATASET) {
+        int num_items = 0;
+        if (fread(&num_items, sizeof(int), 1, pipeline -> input) != 1 || num_items < 0) {
+            fprintf(stderr, "Error: not a dataset file\n");
+            pipeline -> failed = 1;
+            return;
+        }
+        remaining = num_items;
+    }
+    for (uint64_t index = 0; ; index++) {
+        Frame *frame = ring_pop(&(pipeline -> rings[STAGE_INGEST]));
+        uint64_t start = now_ns();
+        frame -> index = index;
+        int status = read_frame(pipeline, frame, &remaining);
+        if (status <= 0) {
+            pipeline -> failed = status < 0;
+            break;
+        }
+        frame -> arrived = now_ns();
+        hist_record(&(stats -> service), frame -> arrived - start);
+        stats -> frames++;
+        pass_on(pipeline, STAGE_BINARIZE, frame);
+    }
+}
+
+/**
+ * Body of the other stages: take the frames waiting in the input ring (up to
+ * a batch), process them, pass them on, until the input ring is closed and
+ * drained. The classify stage hands its frames back to the ingest stage.
+ */
+static void run_stage(Pipeline *pipeline, int stage) {
+    StageStats *stats = &(pipeline -> stages[stage]);
+    Frame *batch[pipeline -> batch];
+    for (;;) {
+        int count = ring_pop_some(&(pipeline -> rings[stage]), (void **) batch, pipeline -> batch);
+        if (count == 0) {
+            break;
+        }
+        uint64_t start = now_ns();
+        for (int i = 0; i < count; i++) {
+            hist_record(&(stats -> wait), start - batch[i] -> queued);
+        }
+        if (stage == STAGE_CLASSIFY) {
+            // classify the batch, then account for it as a whole
+            for (int i = 0; i < count; i++) {
+                Image img = {WIDTH, WIDTH, batch[i] -> normalized, 0, 0};
+                batch[i] -> prediction = model_classify(pipeline -> model, &img);
+            }
+            uint64_t done = now_ns();
+            for (int i = 0; i < count; i++) {
+                Frame *frame = batch[i];
+                hist_record(&(stats -> service), (done - start) / count);
+                hist_record(&(pipeline -> latency), done - frame -> arrived);
+                if (frame -> label != PIPE_NO_LABEL) {
+                    pipeline -> labelled++;
+                    pipeline -> correct += frame -> prediction == frame -> label;
+                }
+                if (pipeline -> predictions != NULL) {
+                    fprintf(pipeline -> predictions, "%d\n", frame -> prediction);
+                }
+                pass_on(pipeline, STAGE_INGEST, frame);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                if (stage == STAGE_BINARIZE) {
+                    if (pipeline -> binarize) {
+                        binarize_frame(batch[i]);
+                    }
+                } else {
+                    Image raw = {batch[i] -> sx, batch[i] -> sy, batch[i] -> pixels, 0, 0};
+                    if (pipeline -> center) {
+                        preprocess_center(&raw, batch[i] -> normalized, pipeline -> binarize);
+                    } else {
+                        preprocess_resize(&raw, batch[i] -> normalized, pipeline -> binarize);
+                    }
+                }
+                hist_record(&(stats -> service), now_ns() - start);
+                pass_on(pipeline, stage + 1, batch[i]);
+                start = now_ns(); // not counting the time blocked on a full ring
+            }
+        }
+        stats -> frames += count;
+    }
+}
+
+/* Body of the stage threads */
+static void *stage_main(void *arg) {
+    StageThread *self = arg;
+    Pipeline *pipeline = self -> pipeline;
+    if (pipeline -> pin) {
+        pin_stage(pipeline, self -> stage);
+    }
+    if (self -> stage == STAGE_INGEST) {
+        run_ingest(pipeline);
+    } else {
+        run_stage(pipeline, self -> stage);
+    }
+    // the end of the input of the next stage (the free frames are not closed: ingest is done with them)
+    if (self -> stage != STAGE_CLASSIFY) {
+        ring_close(&(pipeline -> rings[self -> stage + 1]));
+    }
+    return NULL;
+}
+
+/**
+ * Classify the frames of `input` (in `format`) through the pipeline until the
+ * stream ends, writing the predicted labels to `predictions` (one per line,
+ * in stream order) if it is not NULL. The measurements of the run replace
+ * those of the previous one. Return 0 on success, -1 if the stream is
+ * malformed (the frames before the error are still classified) or the rings
+ * cannot be reallocated (nothing is classified).
+ */
+int pipeline_run(Pipeline *pipeline, FILE *input, PipeFormat format, FILE *predictions) {
+    pipeline -> input = input;
+    pipeline -> format = format;
+    pipeline -> predictions = predictions;
+    pipeline -> failed = 0;
+    for (int s = 0; s < PIPE_STAGES; s++) {
+        int capacity = ring_capacity(&(pipeline -> rings[s]));
+        ring_free(&(pipeline -> rings[s]));
+        if (ring_init(&(pipeline -> rings[s]), capacity) != 0) {
+            return -1;
+        }
+        pipeline -> stages[s].frames = 0;
+        hist_clear(&(pipeline -> stages[s].wait));
+        hist_clear(&(pipeline -> stages[s].service));
+    }
+    hist_clear(&(pipeline -> latency));
+    pipeline -> labelled = pipeline -> correct = 0;
+    for (int f = 0; f < pipeline -> num_frames; f++) {
+        ring_push(&(pipeline -> rings[STAGE_INGEST]), &(pipeline -> frames[f]));
+    }
+
+    StageThread threads[PIPE_STAGES];
+    uint64_t start = now_ns();
+    for (int s = 0; s < PIPE_STAGES; s++) {
+        threads[s].pipeline = pipeline;
+        threads[s].stage = s;
+        pthread_create(&(threads[s].thread), NULL, stage_main, &(threads[s]));
+    }
+    for (int s = 0; s < PIPE_STAGES; s++) {
+        pthread_join(threads[s].thread, NULL);
+    }
+    pipeline -> elapsed_ns = now_ns() - start;
+    if (predictions != NULL) {
+        fflush(predictions);
+    }
+    return pipeline -> failed ? -1 : 0;
+}
+
+/**
+ * Print what the last run measured: per stage, the frames it processed, the
+ * share of the run it was busy, how long frames waited in its input ring and
+ * how long it spent on each (p50 / p99, in microseconds), how many frames
+ * were waiting in its input ring whenever it took some (mean / max) and how
+ * long the stage before it was blocked on that ring (backpressure); then the
+ * latency from arrival to classification, the throughput and the accuracy.
+ */
+void pipeline_print_stats(const Pipeline *pipeline, FILE *out) {
+    fprintf(out, "%-10s %9s %6s %9s %9s %9s %9s %8s %8s %10s\n", "stage", "frames", "busy", "wait_p50",
+            "wait_p99", "svc_p50", "svc_p99", "occ_mean", "occ_max", "blocked_ms");
+    for (int s = 0; s < PIPE_STAGES; s++) {
+        const StageStats *stats = &(pipeline -> stages[s]);
+        RingStats ring;
+        ring_stats(&(pipeline -> rings[s]), &ring);
+        double busy = pipeline -> elapsed_ns > 0 ? 100 * stats -> service.sum / pipeline -> elapsed_ns : 0;
+        if (s == STAGE_INGEST) {
+            // its input ring holds the free frames, and nothing waits on it but the reads
+            fprintf(out, "%-10s %9llu %5.1f%% %9s %9s %9.1f %9.1f %8s %8s %10s\n", stage_names[s],
+                    (unsigned long long) stats -> frames, busy, "-", "-",
+                    hist_percentile(&(stats -> service), 50) * 1e-3, hist_percentile(&(stats -> service), 99) * 1e-3,
+                    "-", "-", "-");
+            continue;
+        }
+        fprintf(out, "%-10s %9llu %5.1f%% %9.1f %9.1f %9.1f %9.1f %8.1f %8llu %10.1f\n", stage_names[s],
+                (unsigned long long) stats -> frames, busy,
+                hist_percentile(&(stats -> wait), 50) * 1e-3, hist_percentile(&(stats -> wait), 99) * 1e-3,
+                hist_percentile(&(stats -> service), 50) * 1e-3, hist_percentile(&(stats -> service), 99) * 1e-3,
+                ring.pops > 0 ? (double) ring.occupancy_sum / ring.pops : 0.0,
+                (unsigned long long) ring.max_occupancy, ring.full_ns * 1e-6);
+    }
+
+    const Histogram *latency = &(pipeline -> latency);
+    uint64_t frames = pipeline -> stages[STAGE_CLASSIFY].frames;
+    fprintf(out, "latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us; %llu frames in %.3f s "
+            "(%.0f frames/s)%s\n", hist_percentile(latency, 50) * 1e-3, hist_percentile(latency, 99) * 1e-3,
+            hist_percentile(latency, 99.9) * 1e-3, latency -> max * 1e-3, (unsigned long long) frames,
+            pipeline -> elapsed_ns * 1e-9, pipeline -> elapsed_ns > 0 ? frames / (pipeline -> elapsed_ns * 1e-9) : 0,
+            pipeline -> binarize ? "" : ", not binarized (grayscale model)");
+    if (pipeline -> labelled > 0) {
+        fprintf(out, "accuracy: %.2f%% of %llu labelled frames\n", 100.0 * pipeline -> correct / pipeline -> labelled,
+                (unsigned long long) pipeline -> labelled);
+    }
+}
+
+/* Free the pipeline and its frames (not its model) */
+void free_pipeline(Pipeline *pipeline) {
+    for (int s = 0; s < PIPE_STAGES; s++) {
+        ring_free(&(pipeline -> rings[s]));
+    }
+    for (int f = 0; f < pipeline -> num_frames && pipeline -> frames != NULL; f++) {
+        free(pipeline -> frames[f].pixels);
+    }
+    free(pipeline -> frames);
+    free(pipeline);
+}
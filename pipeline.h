@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dectree.h"
+#include "histogram.h"
+#include "model.h"
+#include "ring.h"
+
+/**
+ * Streaming classification: frames go from capture to label through four
+ * stages, each on its own thread (optionally pinned to its own CPU):
+ *
+ *   ingest     reads raw grayscale frames of any size from a stream
+ *   binarize   thresholds them at BINARY_THRESHOLD (binary models only:
+ *              frames for models with other thresholds pass unchanged)
+ *   normalize  resizes them to WIDTH x WIDTH, or crops, rescales and
+ *              centers them by mass like MNIST digits (see preprocess.h)
+ *   classify   classifies them with a flat model (see model.h), in batches
+ *              of whatever is waiting, up to `batch` frames
+ *
+ * Consecutive stages are connected by bounded single-producer /
+ * single-consumer rings (see ring.h) of `depth` frames, and the classify
+ * stage hands finished frames back to the ingest stage through one more ring,
+ * so a fixed set of frames circulates and nothing is allocated per frame once
+ * the buffers have grown to the frame size. A stage that falls behind fills
+ * its input ring, which blocks the stage before it, and so on back to the
+ * reads: the stream is read no faster than it is classified (backpressure).
+ *
+ * A frame stream is a sequence of frames, each
+ *
+ *     -   2 bytes : width `W` (native byte order)
+ *     -   2 bytes : height `H`
+ *     -   1 byte  : label [0-9], or PIPE_NO_LABEL if unknown
+ *     - W * H bytes : pixel colors, row after row
+ *
+ * A dataset file (see load_dataset()) can be streamed as well, as frames of
+ * WIDTH x WIDTH.
+ */
+
+/* Frames each ring between two stages holds */
+#ifndef PIPE_DEPTH
+#define PIPE_DEPTH 64
+#endif
+
+/* Most frames a stage takes from its input ring at a time */
+#ifndef PIPE_BATCH
+#define PIPE_BATCH 32
+#endif
+
+/* Largest width and height of a frame */
+#ifndef PIPE_MAX_SIDE
+#define PIPE_MAX_SIDE 4096
+#endif
+
+/* Label of the frames whose label is unknown */
+#define PIPE_NO_LABEL 255
+
+/* Stages of the pipeline, in order */
+enum {
+    STAGE_INGEST,
+    STAGE_BINARIZE,
+    STAGE_NORMALIZE,
+    STAGE_CLASSIFY,
+    PIPE_STAGES
+};
+
+/* Formats of the stream read by the ingest stage */
+typedef enum {
+    PIPE_FRAMES,            // A frame stream
+    PIPE_DATASET            // A dataset file
+} PipeFormat;
+
+/* A frame and its progress through the pipeline */
+typedef struct {
+    uint64_t index;         // Position in the stream
+    int label;              // Label read with the frame, or PIPE_NO_LABEL
+    int prediction;
+    int sx;
+    int sy;
+    unsigned char *pixels;  // `sx * sy` pixel colors
+    size_t capacity;        // Bytes allocated for `pixels`
+    unsigned char normalized[NUM_PIXELS];
+    uint64_t arrived;       // When the ingest stage finished reading it, in ns
+    uint64_t queued;        // When it was pushed into the ring it is in, in ns
+} Frame;
+
+/* What a stage measured */
+typedef struct {
+    uint64_t frames;
+    Histogram wait;         // Time each frame spent in the stage's input ring, in ns
+    Histogram service;      // Time the stage spent on each frame, in ns
+} StageStats;
+
+typedef struct {
+    const DTModel *model;
+    int binarize;           // 1 if the model only splits at BINARY_THRESHOLD
+    int batch;
+    int center;             // 1 to center frames by mass, 0 to resize them whole
+    int pin;                // 1 to pin stage s to CPU first_cpu + s (of those allowed)
+    int first_cpu;
+
+    Ring rings[PIPE_STAGES];    // Ring s feeds stage s; ring STAGE_INGEST holds the free frames
+    Frame *frames;
+    int num_frames;
+
+    // the current run
+    FILE *input;
+    PipeFormat format;
+    FILE *predictions;          // Where predicted labels go, one per line, or NULL
+    int failed;                 // Set when the stream is malformed
+
+    // what the last run measured
+    StageStats stages[PIPE_STAGES];
+    Histogram latency;          // From arrival to classification, in ns
+    uint64_t labelled;          // Frames with a label
+    uint64_t correct;           // ... that were classified correctly
+    uint64_t elapsed_ns;
+} Pipeline;
+
+Pipeline *pipeline_create(const DTModel *model, int depth, int batch, int center, int pin, int first_cpu);
+int pipeline_run(Pipeline *pipeline, FILE *input, PipeFormat format, FILE *predictions);
+void pipeline_print_stats(const Pipeline *pipeline, FILE *out);
+void free_pipeline(Pipeline *pipeline);
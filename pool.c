@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* Upper bound on the number of threads of the pool */
+#ifndef POOL_MAX_THREADS
+#define POOL_MAX_THREADS 256
+#endif
+
+/* Rounds an idle worker keeps looking for tasks (yielding in between) before parking */
+#ifndef POOL_SPIN_ROUNDS
+#define POOL_SPIN_ROUNDS 64
+#endif
+
+/* A parallel for is cut in at most this many ranges per thread */
+#ifndef POOL_RANGES_PER_THREAD
+#define POOL_RANGES_PER_THREAD 4
+#endif
+
+typedef struct {
+    PoolTaskFn fn;
+    void *arg;
+    TaskGroup *group;
+} PoolTask;
+
+/**
+ * A worker and its deque, a ring buffer of `size` tasks starting at `head`.
+ * The owner pushes and pops at the back; thieves take from the front.
+ */
+typedef struct {
+    pthread_mutex_t lock;       // Guards the deque
+    PoolTask *tasks;
+    int capacity;
+    int head;
+    int size;                   // Written under the lock, read without it as a hint
+    int id;
+    pthread_t thread;
+    PoolWorkerStats stats;      // Updated by the worker only, atomically
+} PoolWorker;
+
+/* The process-wide pool */
+static struct {
+    PoolWorker *workers;
+    int num_threads;            // Workers, including the thread that started the pool
+    int queued;                 // Tasks submitted and not yet taken from a deque
+    int parked;                 // Workers waiting on `wake`
+    int stop;                   // Set by pool_shutdown()
+    pthread_mutex_t park_lock;
+    pthread_cond_t wake;
+    int pin;                    // 1 if workers are pinned to CPUs
+    int num_cpus;
+    int cpus[POOL_MAX_THREADS]; // CPUs the process may run on, in order
+} pool = {.num_threads = 0};
+
+/* Worker the current thread is, or -1 for threads outside the pool */
+static __thread int worker_id = -1;
+
+/* Time the current thread has spent in pool_wait(), nested tasks included */
+static __thread uint64_t waited_ns = 0;
+
+/* Return a monotonic timestamp in nanoseconds */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Return a monotonic timestamp in seconds */
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Helper for the workers. Add `value` to one of the calling worker's counters */
+static void add_stat(uint64_t *counter, uint64_t value) {
+    if (worker_id >= 0) {
+        __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+    }
+}
+
+/* Push `task` at the back of the deque of `worker` */
+static void deque_push(PoolWorker *worker, PoolTask task) {
+    pthread_mutex_lock(&(worker -> lock));
+    if (worker -> size == worker -> capacity) { // full: unroll the ring into a larger buffer
+        int capacity = worker -> capacity ? 2 * worker -> capacity : 64;
+        PoolTask *tasks = malloc(sizeof(PoolTask) * capacity);
+        for (int i = 0; i < worker -> size; i++) {
+            tasks[i] = worker -> tasks[(worker -> head + i) % worker -> capacity];
+        }
+        free(worker -> tasks);
+        worker -> tasks = tasks;
+        worker -> capacity = capacity;
+        worker -> head = 0;
+    }
+    worker -> tasks[(worker -> head + worker -> size) % worker -> capacity] = task;
+    __atomic_store_n(&(worker -> size), worker -> size + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(worker -> lock));
+}
+
+/**
+ * Take a task from the deque of `worker` into `*task`: the newest one if
+ * `back` is set (the owner), the oldest one otherwise (a thief). Return 0 if
+ * the deque is empty.
+ */
+static int deque_take(PoolWorker *worker, int back, PoolTask *task) {
+    if (__atomic_load_n(&(worker -> size), __ATOMIC_RELAXED) == 0) { // cheap check before locking
+        return 0;
+    }
+    pthread_mutex_lock(&(worker -> lock));
+    int found = worker -> size > 0;
+    if (found) {
+        if (back) {
+            *task = worker -> tasks[(worker -> head + worker -> size - 1) % worker -> capacity];
+        } else {
+            *task = worker -> tasks[worker -> head];
+            worker -> head = (worker -> head + 1) % worker -> capacity;
+        }
+        __atomic_store_n(&(worker -> size), worker -> size - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(worker -> lock));
+    return found;
+}
+
+/**
+ * Find a task for worker `id` (-1 outside the pool): the newest task of its
+ * own deque, or else the oldest task of another worker, visiting them from
+ * id + 1 onwards. Return 0 if every deque is empty.
+ */
+static int find_task(int id, PoolTask *task) {
+    if (id >= 0 && deque_take(&(pool.workers[id]), 1, task)) {
+        __atomic_sub_fetch(&(pool.queued), 1, __ATOMIC_SEQ_CST);
+        return 1;
+    }
+    for (int i = 1; i <= pool.num_threads; i++) {
+        int victim = (id + i) % pool.num_threads;
+        if (victim != id && deque_take(&(pool.workers[victim]), 0, task)) {
+            __atomic_sub_fetch(&(pool.queued), 1, __ATOMIC_SEQ_CST);
+            if (id >= 0) {
+                add_stat(&(pool.workers[id].stats.steals), 1);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Run `task` on worker `id` and mark it finished in its group. The time the
+ * task spends waiting for tasks of its own is accounted by pool_wait() (and
+ * the tasks it runs meanwhile), so it is left out of the task's busy time.
+ */
+static void run_task(int id, PoolTask *task) {
+    uint64_t waited = waited_ns;
+    uint64_t start = now_ns();
+    task -> fn(task -> arg);
+    if (id >= 0) {
+        add_stat(&(pool.workers[id].stats.busy_ns), now_ns() - start - (waited_ns - waited));
+        add_stat(&(pool.workers[id].stats.tasks), 1);
+    }
+    __atomic_sub_fetch(&(task -> group -> pending), 1, __ATOMIC_RELEASE);
+}
+
+/* Pin the calling thread to the CPU of worker `id` */
+static void pin_thread(int id) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pool.cpus[id % pool.num_cpus], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Error: could not pin worker %d to CPU %d\n", id, pool.cpus[id % pool.num_cpus]);
+    }
+}
+
+/**
+ * Body of the pool threads: run tasks while there are any, then spin for a
+ * while and park until a task is submitted or the pool shuts down.
+ */
+static void *worker_main(void *arg) {
+    PoolWorker *self = arg;
+    worker_id = self -> id;
+    if (pool.pin) {
+        pin_thread(self -> id);
+    }
+
+    uint64_t idle_start = now_ns();
+    int spins = 0;
+    for (;;) {
+        PoolTask task;
+        if (find_task(self -> id, &task)) {
+            add_stat(&(self -> stats.idle_ns), now_ns() - idle_start);
+            run_task(self -> id, &task);
+            idle_start = now_ns();
+            spins = 0;
+            continue;
+        }
+        if (spins++ < POOL_SPIN_ROUNDS) {
+            sched_yield();
+            continue;
+        }
+        spins = 0;
+
+        // `parked` is raised before `queued` is read, and pool_submit() raises
+        // `queued` before reading `parked`: one of the two sees the other
+        pthread_mutex_lock(&pool.park_lock);
+        __atomic_add_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) == 0 && !pool.stop) {
+            pthread_cond_wait(&pool.wake, &pool.park_lock);
+        }
+        __atomic_sub_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+        int stop = pool.stop && __atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool.park_lock);
+        if (stop) {
+            break;
+        }
+    }
+    add_stat(&(self -> stats.idle_ns), now_ns() - idle_start);
+    return NULL;
+}
+
+/**
+ * Start the process-wide pool with `num_threads` threads, the calling thread
+ * included (0: one per CPU the process may run on). With `pin` set, worker i
+ * (the caller being worker 0) is bound to the i-th of those CPUs, wrapping
+ * around. Return 0 on success, -1 on error.
+ */
+int pool_init(int num_threads, int pin) {
+    if (pool.num_threads > 0) {
+        fprintf(stderr, "Error: the thread pool is already running\n");
+        return -1;
+    }
+
+    cpu_set_t allowed;
+    pool.num_cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && pool.num_cpus < POOL_MAX_THREADS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                pool.cpus[pool.num_cpus++] = cpu;
+            }
+        }
+    }
+    if (pool.num_cpus == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.num_cpus = online > 0 ? (online < POOL_MAX_THREADS ? online : POOL_MAX_THREADS) : 1;
+        for (int cpu = 0; cpu < pool.num_cpus; cpu++) {
+            pool.cpus[cpu] = cpu;
+        }
+    }
+    if (num_threads <= 0) {
+        num_threads = pool.num_cpus;
+    }
+    if (num_threads > POOL_MAX_THREADS) {
+        num_threads = POOL_MAX_THREADS;
+    }
+
+    pool.workers = calloc(num_threads, sizeof(PoolWorker));
+    if (pool.workers == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return -1;
+    }
+    pool.num_threads = num_threads;
+    pool.queued = 0;
+    pool.parked = 0;
+    pool.stop = 0;
+    pool.pin = pin;
+    pthread_mutex_init(&pool.park_lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&(pool.workers[i].lock), NULL);
+        pool.workers[i].id = i;
+    }
+
+    worker_id = 0;
+    if (pin) {
+        pin_thread(0);
+    }
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&(pool.workers[i].thread), NULL, worker_main, &(pool.workers[i])) != 0) {
+            fprintf(stderr, "Error: could not start worker %d\n", i);
+            pool.num_threads = i;   // run with the workers started so far
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stop the pool once every submitted task has run, and join its threads. The
+ * statistics are lost; read them first.
+ */
+void pool_shutdown(void) {
+    if (pool.num_threads == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.park_lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.park_lock);
+    for (int i = 1; i < pool.num_threads; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool.num_threads; i++) {
+        pthread_mutex_destroy(&(pool.workers[i].lock));
+        free(pool.workers[i].tasks);
+    }
+    pthread_mutex_destroy(&pool.park_lock);
+    pthread_cond_destroy(&pool.wake);
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.num_threads = 0;
+    worker_id = -1;
+}
+
+/* Return the number of threads of the pool (1 when it is not running) */
+int pool_num_threads(void) {
+    return pool.num_threads > 0 ? pool.num_threads : 1;
+}
+
+/* Initialize an empty task group */
+void pool_group_init(TaskGroup *group) {
+    group -> pending = 0;
+}
+
+/**
+ * Submit the task fn(arg) as part of `group`. It goes to the back of the
+ * calling worker's deque (worker 0's for threads outside the pool), and a
+ * parked worker is woken to steal it. Without a pool the task runs at once.
+ */
+void pool_submit(TaskGroup *group, PoolTaskFn fn, void *arg) {
+    if (pool.num_threads <= 1) {
+        fn(arg);
+        return;
+    }
+    __atomic_add_fetch(&(group -> pending), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+    deque_push(&(pool.workers[worker_id >= 0 ? worker_id : 0]), (PoolTask) {fn, arg, group});
+    if (__atomic_load_n(&pool.parked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool.park_lock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.park_lock);
+    }
+}
+
+/**
+ * Return once every task of `group` has finished. The caller runs queued
+ * tasks (its own first, then stolen ones) while it waits, so waiting inside a
+ * task keeps its thread busy instead of blocking it.
+ */
+void pool_wait(TaskGroup *group) {
+    if (pool.num_threads <= 1) {
+        return;
+    }
+    int id = worker_id;
+    uint64_t waited = waited_ns;
+    uint64_t wait_start = now_ns();
+    uint64_t idle_start = wait_start;
+    while (__atomic_load_n(&(group -> pending), __ATOMIC_ACQUIRE) > 0) {
+        PoolTask task;
+        if (find_task(id, &task)) {
+            if (id >= 0) {
+                add_stat(&(pool.workers[id].stats.idle_ns), now_ns() - idle_start);
+            }
+            run_task(id, &task);
+            idle_start = now_ns();
+        } else {
+            sched_yield();
+        }
+    }
+    uint64_t end = now_ns();
+    if (id >= 0) {
+        add_stat(&(pool.workers[id].stats.idle_ns), end - idle_start);
+    }
+    // waits of the tasks run meanwhile are part of this one
+    waited_ns = waited + (end - wait_start);
+}
+
+/* One range of a parallel for */
+typedef struct {
+    PoolRangeFn fn;
+    void *arg;
+    int start;
+    int end;
+} PoolRange;
+
+/* Helper for pool_parallel_for. Run one range */
+static void run_range(void *arg) {
+    PoolRange *range = arg;
+    range -> fn(range -> arg, range -> start, range -> end);
+}
+
+/**
+ * Call fn(arg, start, end) on consecutive ranges covering [start, end), in
+ * parallel, and return when all of them are done. Ranges hold at least `grain`
+ * items, and there are at most POOL_RANGES_PER_THREAD per thread so the ones
+ * that finish early can take over the rest. Without a pool, or for ranges of
+ * less than two grains, fn runs once over [start, end) on the calling thread.
+ */
+void pool_parallel_for(int start, int end, int grain, PoolRangeFn fn, void *arg) {
+    int n = end - start;
+    if (n <= 0) {
+        return;
+    }
+    grain = grain < 1 ? 1 : grain;
+    int num_ranges = n / grain;
+    int max_ranges = POOL_RANGES_PER_THREAD * pool_num_threads();
+    num_ranges = num_ranges < max_ranges ? num_ranges : max_ranges;
+    if (pool.num_threads <= 1 || num_ranges <= 1) {
+        fn(arg, start, end);
+        return;
+    }
+
+    PoolRange *ranges = malloc(sizeof(PoolRange) * num_ranges);
+    TaskGroup group;
+    pool_group_init(&group);
+    for (int i = 0; i < num_ranges; i++) {
+        ranges[i] = (PoolRange) {fn, arg, start + (int) ((long) n * i / num_ranges),
+                                 start + (int) ((long) n * (i + 1) / num_ranges)};
+        pool_submit(&group, run_range, &ranges[i]);
+    }
+    pool_wait(&group);
+    free(ranges);
+}
+
+/**
+ * Copy the counters of up to `max_workers` workers into `stats` and return the
+ * number of workers of the pool (0 when it is not running).
+ */
+int pool_stats(PoolWorkerStats *stats, int max_workers) {
+    for (int i = 0; i < pool.num_threads && i < max_workers; i++) {
+        PoolWorkerStats *worker = &(pool.workers[i].stats);
+        stats[i].busy_ns = __atomic_load_n(&(worker -> busy_ns), __ATOMIC_RELAXED);
+        stats[i].idle_ns = __atomic_load_n(&(worker -> idle_ns), __ATOMIC_RELAXED);
+        stats[i].tasks = __atomic_load_n(&(worker -> tasks), __ATOMIC_RELAXED);
+        stats[i].steals = __atomic_load_n(&(worker -> steals), __ATOMIC_RELAXED);
+    }
+    return pool.num_threads;
+}
+
+/**
+ * Print the busy and idle time, tasks run and tasks stolen of every worker.
+ * Worker 0 is the thread that started the pool: its time outside the pool is
+ * neither busy nor idle.
+ */
+void pool_print_stats(FILE *out) {
+    PoolWorkerStats stats[POOL_MAX_THREADS];
+    int num_workers = pool_stats(stats, POOL_MAX_THREADS);
+    for (int i = 0; i < num_workers; i++) {
+        double busy = stats[i].busy_ns * 1e-6, idle = stats[i].idle_ns * 1e-6;
+        char cpu[32] = "";
+        if (pool.pin) {
+            snprintf(cpu, sizeof(cpu), " (CPU %d)", pool.cpus[i % pool.num_cpus]);
+        }
+        fprintf(out, "Worker %d%s: busy %.1f ms, idle %.1f ms (%.0f%% busy), %llu tasks, %llu stolen\n",
+                i, cpu, busy, idle,
+                busy + idle > 0 ? 100.0 * busy / (busy + idle) : 0.0,
+                (unsigned long long) stats[i].tasks, (unsigned long long) stats[i].steals);
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The process-wide worker pool. `pool_init()` starts it once; every phase
+ * (loading, training, evaluation) then submits tasks or parallel-for ranges
+ * to the same threads instead of creating its own.
+ *
+ * Each worker owns a deque: it pushes and pops its own tasks at the back, and
+ * idle workers steal from the front of the others. Workers that find no task
+ * park on a condition variable until a task is submitted. A thread waiting
+ * for tasks (`pool_wait()`, `pool_parallel_for()`) runs queued tasks itself
+ * while it waits, so tasks may submit and wait for tasks of their own (nested
+ * parallelism) without ever adding threads. The thread that called
+ * `pool_init()` counts as worker 0.
+ *
+ * Without `pool_init()` (or with a single thread) tasks simply run inline.
+ */
+
+/* A task: fn(arg) */
+typedef void (*PoolTaskFn)(void *arg);
+
+/* The body of a parallel for: fn(arg, start, end) handles [start, end) */
+typedef void (*PoolRangeFn)(void *arg, int start, int end);
+
+/* A set of tasks that can be waited for together */
+typedef struct {
+    int pending;            // Tasks submitted and not yet finished
+} TaskGroup;
+
+/* Counters of one worker, see pool_stats() */
+typedef struct {
+    uint64_t busy_ns;       // Time spent running tasks
+    uint64_t idle_ns;       // Time spent looking for tasks, parked or waiting
+    uint64_t tasks;         // Tasks run
+    uint64_t steals;        // Tasks taken from other workers' deques
+} PoolWorkerStats;
+
+int pool_init(int num_threads, int pin);
+void pool_shutdown(void);
+int pool_num_threads(void);
+
+void pool_group_init(TaskGroup *group);
+void pool_submit(TaskGroup *group, PoolTaskFn fn, void *arg);
+void pool_wait(TaskGroup *group);
+void pool_parallel_for(int start, int end, int grain, PoolRangeFn fn, void *arg);
+
+int pool_stats(PoolWorkerStats *stats, int max_workers);
+void pool_print_stats(FILE *out);
+
+/* The monotonic clock every timer of the library and the tools reads */
+uint64_t now_ns(void);
+double now_seconds(void);
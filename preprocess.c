@@ -0,0 +1,417 @@
+#include <stdint.h>
+
+#include "pool.h"
+#include "preprocess.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREP_HAVE_AVX2 1
+#endif
+
+/* Crops at most this wide use scratch space on the stack */
+#define PREP_STACK_WIDTH 1024
+
+/* The bounding box [x0, x1) x [y0, y1) of the ink of an image */
+typedef struct {
+    int x0, y0, x1, y1;
+} InkBox;
+
+/* The passes over raw pixels, in a scalar and an AVX2 version */
+typedef struct {
+    // find the ink of the sx x sy pixels, marking its columns in `cols` (sx + 32 bytes); return 0 if there is none
+    int (*ink_box)(const unsigned char *pixels, int sx, int sy, unsigned char *cols, InkBox *box);
+    // sums[x] = the sum of column x < width over `rows` rows of `stride` pixels
+    void (*sum_rows)(const unsigned char *pixels, int stride, int width, int rows, uint32_t *sums);
+    // out[i] = sums[i] * scale[i], rounded and capped at 255, for i < count
+    void (*scale_sums)(const uint32_t *sums, const float *scale, int count, unsigned char *out);
+    // threshold the pixels at BINARY_THRESHOLD, to 0 or 255
+    void (*threshold)(unsigned char *pixels, int num_pixels);
+} PrepKernels;
+
+/**
+ * Helper for the ink_box kernels. Set the box from the rows with ink (already
+ * in `box`) and the columns marked in `cols`. Return 0 if there is no ink.
+ */
+static int finish_box(const unsigned char *cols, int sx, InkBox *box) {
+    if (box -> y1 == 0) {
+        return 0;
+    }
+    box -> x0 = 0;
+    while (cols[box -> x0] == 0) {
+        box -> x0++;
+    }
+    box -> x1 = sx;
+    while (cols[box -> x1 - 1] == 0) {
+        box -> x1--;
+    }
+    return 1;
+}
+
+static int ink_box_scalar(const unsigned char *pixels, int sx, int sy, unsigned char *cols, InkBox *box) {
+    memset(cols, 0, sx);
+    box -> y0 = sy;
+    box -> y1 = 0;
+    for (int y = 0; y < sy; y++) {
+        const unsigned char *row = pixels + (size_t) y * sx;
+        unsigned char found = 0;
+        for (int x = 0; x < sx; x++) {
+            unsigned char ink = row[x] >= PREP_INK;
+            cols[x] |= ink;
+            found |= ink;
+        }
+        if (found) {
+            box -> y0 = box -> y0 < y ? box -> y0 : y;
+            box -> y1 = y + 1;
+        }
+    }
+    return finish_box(cols, sx, box);
+}
+
+static void sum_rows_scalar(const unsigned char *pixels, int stride, int width, int rows, uint32_t *sums) {
+    memset(sums, 0, sizeof(uint32_t) * width);
+    for (int r = 0; r < rows; r++) {
+        const unsigned char *row = pixels + (size_t) r * stride;
+        for (int x = 0; x < width; x++) {
+            sums[x] += row[x];
+        }
+    }
+}
+
+static void scale_sums_scalar(const uint32_t *sums, const float *scale, int count, unsigned char *out) {
+    for (int i = 0; i < count; i++) {
+        float average = sums[i] * scale[i] + 0.5f;
+        out[i] = average < 255 ? (unsigned char) average : 255;
+    }
+}
+
+static void threshold_scalar(unsigned char *pixels, int num_pixels) {
+    for (int p = 0; p < num_pixels; p++) {
+        pixels[p] = pixels[p] >= BINARY_THRESHOLD ? 255 : 0;
+    }
+}
+
+static const PrepKernels scalar_kernels = {ink_box_scalar, sum_rows_scalar, scale_sums_scalar, threshold_scalar};
+
+#ifdef PREP_HAVE_AVX2
+/* 32 pixels at a time: 0xff where the color is at least `level` */
+__attribute__((target("avx2")))
+static inline __m256i at_least(__m256i colors, __m256i level) {
+    return _mm256_cmpeq_epi8(_mm256_max_epu8(colors, level), colors);
+}
+
+__attribute__((target("avx2")))
+static int ink_box_avx2(const unsigned char *pixels, int sx, int sy, unsigned char *cols, InkBox *box) {
+    memset(cols, 0, sx + 32);
+    box -> y0 = sy;
+    box -> y1 = 0;
+    __m256i level = _mm256_set1_epi8((char) PREP_INK);
+    // the last sx % 32 pixels of a row are read with the start of the next row, which is masked out
+    int tail = sx % 32;
+    __m256i lanes = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
+                                     21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    __m256i tail_mask = _mm256_cmpgt_epi8(_mm256_set1_epi8((char) tail), lanes);
+    for (int y = 0; y < sy; y++) {
+        const unsigned char *row = pixels + (size_t) y * sx;
+        __m256i any = _mm256_setzero_si256();
+        int x = 0;
+        for (; x + 32 <= sx; x += 32) {
+            __m256i ink = at_least(_mm256_loadu_si256((const __m256i *) (row + x)), level);
+            __m256i marked = _mm256_loadu_si256((const __m256i *) (cols + x));
+            _mm256_storeu_si256((__m256i *) (cols + x), _mm256_or_si256(marked, ink));
+            any = _mm256_or_si256(any, ink);
+        }
+        if (tail > 0 && (size_t) (y + 1) * sx + 32 - tail <= (size_t) sx * sy) {
+            __m256i ink = _mm256_and_si256(at_least(_mm256_loadu_si256((const __m256i *) (row + x)), level),
+                                           tail_mask);
+            __m256i marked = _mm256_loadu_si256((const __m256i *) (cols + x));
+            _mm256_storeu_si256((__m256i *) (cols + x), _mm256_or_si256(marked, ink));
+            any = _mm256_or_si256(any, ink);
+            x = sx;
+        }
+        unsigned char found = !_mm256_testz_si256(any, any);
+        for (; x < sx; x++) {
+            unsigned char ink = row[x] >= PREP_INK;
+            cols[x] |= ink;
+            found |= ink;
+        }
+        if (found) {
+            box -> y0 = box -> y0 < y ? box -> y0 : y;
+            box -> y1 = y + 1;
+        }
+    }
+    return finish_box(cols, sx, box);
+}
+
+__attribute__((target("avx2")))
+static void sum_rows_avx2(const unsigned char *pixels, int stride, int width, int rows, uint32_t *sums) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+        for (int r = 0; r < rows; r++) {
+            __m128i colors = _mm_loadu_si128((const __m128i *) (pixels + (size_t) r * stride + x));
+            low = _mm256_add_epi32(low, _mm256_cvtepu8_epi32(colors));
+            high = _mm256_add_epi32(high, _mm256_cvtepu8_epi32(_mm_srli_si128(colors, 8)));
+        }
+        _mm256_storeu_si256((__m256i *) (sums + x), low);
+        _mm256_storeu_si256((__m256i *) (sums + x + 8), high);
+    }
+    if (x + 8 <= width) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int r = 0; r < rows; r++) {
+            __m128i colors = _mm_loadl_epi64((const __m128i *) (pixels + (size_t) r * stride + x));
+            sum = _mm256_add_epi32(sum, _mm256_cvtepu8_epi32(colors));
+        }
+        _mm256_storeu_si256((__m256i *) (sums + x), sum);
+        x += 8;
+    }
+    if (x < width) {
+        sum_rows_scalar(pixels + x, stride, width - x, rows, sums + x);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scale_sums_avx2(const uint32_t *sums, const float *scale, int count, unsigned char *out) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 values = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) (sums + i)));
+        __m256 average = _mm256_add_ps(_mm256_mul_ps(values, _mm256_loadu_ps(scale + i)), _mm256_set1_ps(0.5f));
+        __m256i rounded = _mm256_cvttps_epi32(average);
+        // narrow to bytes, saturating at 255
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+        _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(words, words));
+    }
+    scale_sums_scalar(sums + i, scale + i, count - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void threshold_avx2(unsigned char *pixels, int num_pixels) {
+    __m256i level = _mm256_set1_epi8((char) BINARY_THRESHOLD);
+    int p = 0;
+    for (; p + 32 <= num_pixels; p += 32) {
+        __m256i colors = _mm256_loadu_si256((const __m256i *) (pixels + p));
+        _mm256_storeu_si256((__m256i *) (pixels + p), at_least(colors, level));
+    }
+    threshold_scalar(pixels + p, num_pixels - p);
+}
+
+static const PrepKernels avx2_kernels = {ink_box_avx2, sum_rows_avx2, scale_sums_avx2, threshold_avx2};
+#endif
+
+/* The kernels in use, chosen on first use */
+static const PrepKernels *active_kernels = NULL;
+
+/**
+ * Use the AVX2 kernels if `enable` is set and the CPU supports AVX2, the
+ * scalar ones otherwise. Return 1 if the AVX2 kernels are now in use.
+ */
+int preprocess_set_avx2(int enable) {
+#ifdef PREP_HAVE_AVX2
+    if (enable && __builtin_cpu_supports("avx2")) {
+        __atomic_store_n(&active_kernels, &avx2_kernels, __ATOMIC_RELEASE);
+        return 1;
+    }
+#endif
+    __atomic_store_n(&active_kernels, &scalar_kernels, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Return the kernels in use, the fastest the CPU supports unless chosen otherwise */
+static const PrepKernels *prep_kernels(void) {
+    const PrepKernels *kernels = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+    if (kernels == NULL) {
+        preprocess_set_avx2(1);
+        kernels = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+    }
+    return kernels;
+}
+
+/**
+ * Helper for the preprocessing functions. Rescale the `box` of the sx-wide
+ * pixels to `nw` x `nh` (at most WIDTH x WIDTH) into `digit`, each output
+ * pixel averaging the block it covers. `sums` has room for the box's width + 1.
+ */
+static void rescale_box(const PrepKernels *kernels, const unsigned char *pixels, int sx, const InkBox *box,
+                        int nw, int nh, uint32_t *sums, unsigned char *digit) {
+    int w = box -> x1 - box -> x0, h = box -> y1 - box -> y0;
+    int col_start[WIDTH], col_end[WIDTH];
+    float col_scale[WIDTH], scale[WIDTH];
+    for (int i = 0; i < nw; i++) {
+        col_start[i] = i * w / nw;
+        col_end[i] = (i + 1) * w / nw > col_start[i] ? (i + 1) * w / nw : col_start[i] + 1;
+        col_scale[i] = 1.0f / (col_end[i] - col_start[i]);
+    }
+    uint32_t block_sums[WIDTH];
+    for (int j = 0; j < nh; j++) {
+        int y0 = j * h / nh;
+        int y1 = (j + 1) * h / nh > y0 ? (j + 1) * h / nh : y0 + 1;
+        // sum the block rows column by column, then take the sum of the columns of each block from
+        // their running totals (a loop over the columns of each block would mispredict its exit)
+        kernels -> sum_rows(pixels + (size_t) (box -> y0 + y0) * sx + box -> x0, sx, w, y1 - y0, sums + 1);
+        uint32_t total = sums[0] = 0;
+        for (int x = 1; x <= w; x++) {
+            total += sums[x];
+            sums[x] = total;
+        }
+        // averages multiply by the reciprocal of the block areas rather than divide
+        float row_scale = 1.0f / (y1 - y0);
+        for (int i = 0; i < nw; i++) {
+            block_sums[i] = sums[col_end[i]] - sums[col_start[i]];
+            scale[i] = col_scale[i] * row_scale;
+        }
+        kernels -> scale_sums(block_sums, scale, nw, digit + j * nw);
+    }
+}
+
+/**
+ * Helper for the preprocessing functions. Return the pixels of the image,
+ * copying them into `*copy` (to be freed) if it is a shifted view, or NULL if
+ * the copy cannot be allocated.
+ */
+static const unsigned char *raw_pixels(const Image *img, unsigned char **copy) {
+    *copy = NULL;
+    if ((img -> dx | img -> dy) == 0) {
+        return img -> data;
+    }
+    *copy = malloc((size_t) img -> sx * img -> sy);
+    if (*copy == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    image_read(img, *copy);
+    return *copy;
+}
+
+/**
+ * Preprocess the image (a raw crop of any size) into the WIDTH x WIDTH pixels
+ * `out`: crop to its ink, rescale to PREP_BOX, center by mass and threshold
+ * if `binarize` is set (see preprocess.h). An empty image, or one without
+ * ink, comes out blank (as does one that runs out of memory).
+ */
+void preprocess_center(const Image *img, unsigned char *out, int binarize) {
+    const PrepKernels *kernels = prep_kernels();
+    int sx = img -> sx, sy = img -> sy;
+    memset(out, 0, NUM_PIXELS);
+    if (sx <= 0 || sy <= 0) {
+        return;
+    }
+    unsigned char *copy;
+    const unsigned char *pixels = raw_pixels(img, &copy);
+    unsigned char cols_stack[PREP_STACK_WIDTH + 32];
+    uint32_t sums_stack[PREP_STACK_WIDTH + 1];
+    unsigned char *cols = sx <= PREP_STACK_WIDTH ? cols_stack : malloc(sx + 32);
+    uint32_t *sums = sx <= PREP_STACK_WIDTH ? sums_stack : malloc(sizeof(uint32_t) * (sx + 1));
+    if (cols == NULL || sums == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+    }
+
+    InkBox box;
+    if (pixels != NULL && cols != NULL && sums != NULL && kernels -> ink_box(pixels, sx, sy, cols, &box)) {
+        // the longer side of the box becomes PREP_BOX pixels
+        int w = box.x1 - box.x0, h = box.y1 - box.y0;
+        int side = w > h ? w : h;
+        int nw = (w * PREP_BOX + side / 2) / side, nh = (h * PREP_BOX + side / 2) / side;
+        nw = nw > 0 ? nw : 1;
+        nh = nh > 0 ? nh : 1;
+        unsigned char digit[PREP_BOX * PREP_BOX];
+        rescale_box(kernels, pixels, sx, &box, nw, nh, sums, digit);
+
+        // place it with its center of mass (in half pixels) at the center of the image
+        uint64_t mass = 0, mx = 0, my = 0;
+        for (int j = 0; j < nh; j++) {
+            for (int i = 0; i < nw; i++) {
+                unsigned int color = digit[j * nw + i];
+                mass += color;
+                mx += color * (2 * i + 1);
+                my += color * (2 * j + 1);
+            }
+        }
+        int ox = mass > 0 ? (int) lround(WIDTH / 2.0 - mx / (2.0 * mass)) : (WIDTH - nw) / 2;
+        int oy = mass > 0 ? (int) lround(WIDTH / 2.0 - my / (2.0 * mass)) : (WIDTH - nh) / 2;
+        ox = ox < 0 ? 0 : (ox > WIDTH - nw ? WIDTH - nw : ox);
+        oy = oy < 0 ? 0 : (oy > WIDTH - nh ? WIDTH - nh : oy);
+        for (int j = 0; j < nh; j++) {
+            memcpy(out + (oy + j) * WIDTH + ox, digit + j * nw, nw);
+        }
+        if (binarize) {
+            kernels -> threshold(out, NUM_PIXELS);
+        }
+    }
+
+    if (cols != cols_stack) {
+        free(cols);
+        free(sums);
+    }
+    free(copy);
+}
+
+/**
+ * Resample the whole image (of any size, not keeping its aspect ratio) to the
+ * WIDTH x WIDTH pixels `out`, each output pixel averaging the block it covers,
+ * and threshold them if `binarize` is set. A WIDTH x WIDTH image is copied.
+ * An empty image comes out blank (as does one that runs out of memory).
+ */
+void preprocess_resize(const Image *img, unsigned char *out, int binarize) {
+    const PrepKernels *kernels = prep_kernels();
+    int sx = img -> sx, sy = img -> sy;
+    if (sx <= 0 || sy <= 0) { // there is no block to average
+        memset(out, 0, NUM_PIXELS);
+        return;
+    }
+    unsigned char *copy;
+    const unsigned char *pixels = raw_pixels(img, &copy);
+    if (pixels == NULL) {
+        memset(out, 0, NUM_PIXELS);
+        return;
+    }
+    if (sx == WIDTH && sy == WIDTH) {
+        memcpy(out, pixels, NUM_PIXELS);
+    } else {
+        uint32_t sums_stack[PREP_STACK_WIDTH + 1];
+        uint32_t *sums = sx <= PREP_STACK_WIDTH ? sums_stack : malloc(sizeof(uint32_t) * (sx + 1));
+        InkBox whole = {0, 0, sx, sy};
+        if (sums == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+            memset(out, 0, NUM_PIXELS);
+        } else {
+            rescale_box(kernels, pixels, sx, &whole, WIDTH, WIDTH, sums, out);
+        }
+        if (sums != sums_stack) {
+            free(sums);
+        }
+    }
+    if (binarize) {
+        kernels -> threshold(out, NUM_PIXELS);
+    }
+    free(copy);
+}
+
+/* A batch preprocessed by preprocess_batch() */
+typedef struct {
+    const Image *images;
+    unsigned char **out;
+    int center;
+    int binarize;
+} PrepBatch;
+
+/* Helper for preprocess_batch. Preprocess images [start, end) of the batch */
+static void preprocess_range(void *arg, int start, int end) {
+    PrepBatch *batch = arg;
+    for (int i = start; i < end; i++) {
+        if (batch -> center) {
+            preprocess_center(&(batch -> images[i]), batch -> out[i], batch -> binarize);
+        } else {
+            preprocess_resize(&(batch -> images[i]), batch -> out[i], batch -> binarize);
+        }
+    }
+}
+
+/**
+ * Preprocess each of the images into the WIDTH x WIDTH pixels `out[i]`, with
+ * preprocess_center() if `center` is set, preprocess_resize() otherwise.
+ * Tasks of PREP_GRAIN images are spread over the thread pool.
+ */
+void preprocess_batch(const Image *images, int num_images, unsigned char **out, int center, int binarize) {
+    prep_kernels(); // choose the kernels before the tasks race to
+    PrepBatch batch = {images, out, center, binarize};
+    pool_parallel_for(0, num_images, PREP_GRAIN, preprocess_range, &batch);
+}
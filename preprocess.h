@@ -0,0 +1,44 @@
+#pragma once
+
+#include "dectree.h"
+
+/**
+ * Preprocessing of raw crops of any size into the WIDTH x WIDTH images the
+ * trees classify. preprocess_center() normalizes them the way MNIST digits
+ * are:
+ *
+ *  1. crop to the bounding box of the ink (pixels of at least PREP_INK),
+ *  2. rescale the crop, keeping its aspect ratio, so its longer side is
+ *     PREP_BOX pixels: each output pixel averages the block of crop pixels it
+ *     covers (one pixel when enlarging),
+ *  3. pad it to WIDTH x WIDTH with its center of mass at the center,
+ *  4. optionally, threshold at BINARY_THRESHOLD (to 0 or 255).
+ *
+ * preprocess_resize() only rescales the whole crop to WIDTH x WIDTH, for
+ * crops that are already framed like the training images.
+ *
+ * The passes over the raw pixels (the bounding box scan and the block sums of
+ * the rescaling) and the threshold have AVX2 versions, used when the CPU
+ * supports it (checked once, at run time) unless preprocess_set_avx2() turns
+ * them off. Batches are spread over the thread pool (see pool.h).
+ */
+
+/* Pixels of at least this color are ink when cropping */
+#ifndef PREP_INK
+#define PREP_INK 64
+#endif
+
+/* Longer side of the digit once rescaled (20 for 28 x 28 images) */
+#ifndef PREP_BOX
+#define PREP_BOX (WIDTH * 5 / 7)
+#endif
+
+/* Images a task of preprocess_batch() handles */
+#ifndef PREP_GRAIN
+#define PREP_GRAIN 64
+#endif
+
+void preprocess_center(const Image *img, unsigned char *out, int binarize);
+void preprocess_resize(const Image *img, unsigned char *out, int binarize);
+void preprocess_batch(const Image *images, int num_images, unsigned char **out, int center, int binarize);
+int preprocess_set_avx2(int enable);
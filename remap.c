@@ -0,0 +1,171 @@
+#include <limits.h>
+
+#include "remap.h"
+
+/* One pixel tested by the tree, with the statistics used to order it */
+typedef struct {
+    int pixel;
+    double visits;      // (Expected) number of images testing the pixel
+    int depth;          // Depth of the shallowest node testing the pixel
+} PixelUse;
+
+/**
+ * Helper for pixel_map_from_tree. Record the shallowest depth at which every
+ * pixel is tested, and credit each test with the fraction of images expected
+ * to reach it if every split were even (2^-depth).
+ */
+static void record_tests(DTNode *node, int depth, PixelUse *uses) {
+    if (node -> classification != -1) {
+        return;
+    }
+    PixelUse *use = &uses[node -> pixel];
+    use -> visits += ldexp(1.0, -depth);
+    if (depth < use -> depth) {
+        use -> depth = depth;
+    }
+    record_tests(node -> left, depth + 1, uses);
+    record_tests(node -> right, depth + 1, uses);
+}
+
+/* qsort comparator: most visited first, then shallowest, then lowest pixel */
+static int compare_uses(const void *a, const void *b) {
+    const PixelUse *x = a, *y = b;
+    if (x -> visits != y -> visits) {
+        return x -> visits > y -> visits ? -1 : 1;
+    }
+    if (x -> depth != y -> depth) {
+        return x -> depth - y -> depth;
+    }
+    return x -> pixel - y -> pixel;
+}
+
+/**
+ * Derive the pixel permutation of a trained tree. Pixels are ordered by how
+ * many images test them: when `data` is given, its images are run through the
+ * tree and every node visit counts; otherwise each test counts for the 
+ * fraction of images expected to reach it (2^-depth). Ties go to the pixel
+ * tested closest to the root. Pixels the tree never tests are dropped.
+ */
+PixelMap *pixel_map_from_tree(DTNode *root, Dataset *data) {
+    PixelUse uses[NUM_PIXELS];
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        uses[p].pixel = p;
+        uses[p].visits = 0;
+        uses[p].depth = INT_MAX;
+    }
+    record_tests(root, 0, uses);
+
+    if (data != NULL) {
+        // replace the estimates with the actual visits of every tested pixel
+        for (int p = 0; p < NUM_PIXELS; p++) {
+            if (uses[p].depth != INT_MAX) {
+                uses[p].visits = 0;
+            }
+        }
+        for (int i = 0; i < data -> num_items; i++) {
+            const Image *img = &(data -> images[i]);
+            DTNode *node = root;
+            while (node -> classification == -1) {
+                uses[node -> pixel].visits += 1;
+                node = image_pixel(img, node -> pixel) < node -> threshold ? node -> left : node -> right;
+            }
+        }
+    }
+
+    PixelMap *map = malloc(sizeof(PixelMap));
+    if (map == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    qsort(uses, NUM_PIXELS, sizeof(PixelUse), compare_uses);
+    map -> num_used = 0;
+    for (int p = 0; p < NUM_PIXELS; p++) {
+        map -> position[p] = -1;
+    }
+    for (int j = 0; j < NUM_PIXELS && uses[j].depth != INT_MAX; j++) {
+        map -> source[j] = uses[j].pixel;
+        map -> position[uses[j].pixel] = j;
+        map -> num_used++;
+    }
+    return map;
+}
+
+/**
+ * Rewrite the pixel indices of the tree to their positions under `map`. The
+ * tree can then only classify images projected with the same map.
+ */
+void dec_tree_remap(DTNode *root, const PixelMap *map) {
+    dt_model_changed();
+    if (root -> classification != -1) {
+        return;
+    }
+    root -> pixel = map -> position[root -> pixel];
+    dec_tree_remap(root -> left, map);
+    dec_tree_remap(root -> right, map);
+}
+
+/**
+ * Store in `dst` the `map -> num_used` pixels of the NUM_PIXELS-pixel image
+ * `src` that the map keeps, in map order.
+ */
+void project_image(const PixelMap *map, const unsigned char *src, unsigned char *dst) {
+    for (int j = 0; j < map -> num_used; j++) {
+        dst[j] = src[map -> source[j]];
+    }
+}
+
+/**
+ * Return a new dataset holding the images of `data` projected with `map`. Its
+ * images are `map -> num_used` x 1 pixels, stored back to back, so scanning
+ * the dataset reads only the bytes a remapped tree can test.
+ */
+Dataset *project_dataset(Dataset *data, const PixelMap *map) {
+    Dataset *projected = alloc_dataset(data -> num_items, map -> num_used, 1);
+    if (projected == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < data -> num_items; i++) {
+        const Image *img = &(data -> images[i]);
+        projected -> labels[i] = data -> labels[i];
+        if ((img -> dx | img -> dy) != 0) { // shifted: translate each kept pixel
+            for (int j = 0; j < map -> num_used; j++) {
+                projected -> images[i].data[j] = image_pixel(img, map -> source[j]);
+            }
+        } else {
+            project_image(map, img -> data, projected -> images[i].data);
+        }
+    }
+    return projected;
+}
+
+/**
+ * Load the binary file `filename` (in the format read by `load_dataset()`)
+ * directly in projected form: only the pixels kept by `map` are ever stored.
+ */
+Dataset *load_dataset_projected(const char *filename, const PixelMap *map) {
+    FILE *data_file = fopen(filename, "rb");
+    if (data_file == NULL) {
+        fprintf(stderr, "Error: could not open file\n");
+        return NULL;
+    }
+
+    int total_images = 0;
+    fread(&total_images, sizeof(int), 1, data_file);
+    Dataset *projected = alloc_dataset(total_images, map -> num_used, 1);
+    if (projected == NULL) {
+        fclose(data_file);
+        return NULL;
+    }
+
+    unsigned char record[NUM_PIXELS];
+    for (int i = 0; i < total_images; i++) {
+        fread(projected -> labels + i, sizeof(unsigned char), 1, data_file);
+        fread(record, sizeof(unsigned char), NUM_PIXELS, data_file);
+        project_image(map, record, projected -> images[i].data);
+    }
+
+    if (fclose(data_file) != 0) {
+        fprintf(stderr, "Error: fclose failed\n");
+    }
+    return projected;
+}
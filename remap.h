@@ -0,0 +1,22 @@
+#pragma once
+
+#include "dectree.h"
+
+/**
+ * A permutation of the pixels of an image derived from a trained tree. Only
+ * the pixels the tree tests are kept, ordered from the most to the least 
+ * visited, so the pixels tested near the root share the first cache line of
+ * every projected image.
+ */
+typedef struct {
+    int num_used;               // Number of pixels tested by the tree
+    int source[NUM_PIXELS];     // source[j]: original pixel stored at position j (j < num_used)
+    int position[NUM_PIXELS];   // position[p]: position of original pixel p, or -1 if unused
+} PixelMap;
+
+PixelMap *pixel_map_from_tree(DTNode *root, Dataset *data);
+void dec_tree_remap(DTNode *root, const PixelMap *map);
+
+void project_image(const PixelMap *map, const unsigned char *src, unsigned char *dst);
+Dataset *project_dataset(Dataset *data, const PixelMap *map);
+Dataset *load_dataset_projected(const char *filename, const PixelMap *map);
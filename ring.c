@@ -0,0 +1,132 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "ring.h"
+
+/* Wait before the next check of a ring, after `rounds` checks failed */
+static inline void ring_backoff(int rounds) {
+    if (rounds < RING_SPIN_ROUNDS) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+/**
+ * Set up an empty ring of at least `capacity` slots (rounded up to a power of
+ * two). Return 0 on success, -1 on error.
+ */
+int ring_init(Ring *ring, int capacity) {
+    uint64_t size = 1;
+    while (size < (uint64_t) capacity) {
+        size *= 2;
+    }
+    ring -> slots = malloc(sizeof(void *) * size);
+    if (ring -> slots == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return -1;
+    }
+    ring -> mask = size - 1;
+    ring -> tail = ring -> cached_head = 0;
+    ring -> head = 0;
+    ring -> closed = 0;
+    ring -> pushes = ring -> pops = ring -> occupancy_sum = ring -> max_occupancy = 0;
+    ring -> full_ns = ring -> empty_ns = 0;
+    return 0;
+}
+
+/* Producer: add `item` at the tail of the ring, waiting while it is full */
+void ring_push(Ring *ring, void *item) {
+    uint64_t tail = ring -> tail;
+    if (tail - ring -> cached_head > ring -> mask) {
+        ring -> cached_head = __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE);
+        if (tail - ring -> cached_head > ring -> mask) {
+            uint64_t start = now_ns();
+            for (int rounds = 0; tail - ring -> cached_head > ring -> mask; rounds++) {
+                ring_backoff(rounds);
+                ring -> cached_head = __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE);
+            }
+            ring -> full_ns += now_ns() - start;
+        }
+    }
+    ring -> slots[tail & ring -> mask] = item;
+    __atomic_store_n(&(ring -> tail), tail + 1, __ATOMIC_RELEASE);
+    ring -> pushes++;
+}
+
+/**
+ * Consumer: wait until the ring holds items or is closed, then take up to
+ * `max_items` of them (all that are there, without waiting for more) into
+ * `items`. Return how many were taken: 0 only once the ring is closed and
+ * drained.
+ */
+int ring_pop_some(Ring *ring, void **items, int max_items) {
+    uint64_t head = ring -> head;
+    uint64_t tail = __atomic_load_n(&(ring -> tail), __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        uint64_t start = now_ns();
+        for (int rounds = 0; tail == head; rounds++) {
+            // `closed` is set after the last push: read it first, then the tail once more
+            if (__atomic_load_n(&(ring -> closed), __ATOMIC_ACQUIRE)) {
+                tail = __atomic_load_n(&(ring -> tail), __ATOMIC_ACQUIRE);
+                if (tail == head) {
+                    ring -> empty_ns += now_ns() - start;
+                    return 0;
+                }
+                break;
+            }
+            ring_backoff(rounds);
+            tail = __atomic_load_n(&(ring -> tail), __ATOMIC_ACQUIRE);
+        }
+        ring -> empty_ns += now_ns() - start;
+    }
+    uint64_t available = tail - head;
+    ring -> pops++;
+    ring -> occupancy_sum += available;
+    ring -> max_occupancy = available > ring -> max_occupancy ? available : ring -> max_occupancy;
+    int count = available < (uint64_t) max_items ? (int) available : max_items;
+    for (int i = 0; i < count; i++) {
+        items[i] = ring -> slots[(head + i) & ring -> mask];
+    }
+    __atomic_store_n(&(ring -> head), head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/**
+ * Consumer: take the item at the head of the ring, waiting while it is empty.
+ * Return NULL once the ring is closed and drained.
+ */
+void *ring_pop(Ring *ring) {
+    void *item;
+    return ring_pop_some(ring, &item, 1) == 1 ? item : NULL;
+}
+
+/* Producer: push nothing more, so the consumer sees the end once it drains the ring */
+void ring_close(Ring *ring) {
+    __atomic_store_n(&(ring -> closed), 1, __ATOMIC_RELEASE);
+}
+
+/* Return the number of slots of the ring */
+int ring_capacity(const Ring *ring) {
+    return (int) (ring -> mask + 1);
+}
+
+/* Copy the metrics of the ring into `stats` (once both sides are done with it) */
+void ring_stats(const Ring *ring, RingStats *stats) {
+    stats -> pushes = ring -> pushes;
+    stats -> pops = ring -> pops;
+    stats -> occupancy_sum = ring -> occupancy_sum;
+    stats -> max_occupancy = ring -> max_occupancy;
+    stats -> full_ns = ring -> full_ns;
+    stats -> empty_ns = ring -> empty_ns;
+}
+
+/* Free the slots of the ring (not the items left in it) */
+void ring_free(Ring *ring) {
+    free(ring -> slots);
+    ring -> slots = NULL;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Bounded single-producer / single-consumer rings of pointers, lock-free: the
+ * producer only writes `tail` and the consumer only writes `head`, each on
+ * its own cache line. The producer keeps a cached copy of `head` and only
+ * reads the shared one when the copy says the ring is full; the consumer
+ * reads `tail` once per pop, which takes every item waiting (up to a limit),
+ * and samples the occupancy of the ring at the same time. A push into a full
+ * ring waits until the consumer makes room (backpressure), a pop from an
+ * empty ring until the producer pushes or closes the ring. Waiting spins for
+ * RING_SPIN_ROUNDS rounds, then yields the CPU between checks, so stages
+ * sharing a CPU still make progress.
+ *
+ * Each side counts its own metrics (see RingStats), so they cost no shared
+ * writes either.
+ */
+
+/* Checks a waiting side makes before it starts yielding the CPU between checks */
+#ifndef RING_SPIN_ROUNDS
+#define RING_SPIN_ROUNDS 128
+#endif
+
+#define RING_CACHE_LINE 64
+
+/* Metrics of a ring, each written by one side only */
+typedef struct {
+    uint64_t pushes;
+    uint64_t pops;              // Calls of ring_pop_some() that found items
+    uint64_t occupancy_sum;     // Items waiting in the ring at each of them
+    uint64_t max_occupancy;
+    uint64_t full_ns;           // Time the producer waited on a full ring
+    uint64_t empty_ns;          // Time the consumer waited on an empty ring
+} RingStats;
+
+typedef struct {
+    void **slots;
+    uint64_t mask;              // Capacity - 1 (a power of two)
+
+    // producer side
+    uint64_t tail __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t cached_head;       // Last `head` the producer read
+    int closed;                 // No more pushes, see ring_close()
+    uint64_t pushes;
+    uint64_t full_ns;
+
+    // consumer side
+    uint64_t head __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t pops;
+    uint64_t occupancy_sum;
+    uint64_t max_occupancy;
+    uint64_t empty_ns;
+} Ring;
+
+int ring_init(Ring *ring, int capacity);
+void ring_push(Ring *ring, void *item);
+void *ring_pop(Ring *ring);
+int ring_pop_some(Ring *ring, void **items, int max_items);
+void ring_close(Ring *ring);
+int ring_capacity(const Ring *ring);
+void ring_stats(const Ring *ring, RingStats *stats);
+void ring_free(Ring *ring);
@@ -0,0 +1,287 @@
+#include <unistd.h>
+
+#include "store.h"
+
+/* Return the FNV-1a hash of a string */
+static uint64_t id_hash(const char *id) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *id != '\0'; id++) {
+        hash = (hash ^ (unsigned char) *id) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Return 1 if `id` can name a model: 1 to STORE_ID_MAX letters, digits, '-',
+ * '_' or '.', not starting with '.', so that it names a file of the store's
+ * directory and nothing else.
+ */
+static int valid_id(const char *id) {
+    size_t length = strlen(id);
+    if (length == 0 || length > STORE_ID_MAX || id[0] == '.') {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        char c = id[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+              || c == '-' || c == '_' || c == '.')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Return `size` bytes of the store's arena, aligned for any entry */
+static void *arena_alloc(ModelStore *store, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    StoreChunk *chunk = store -> arena;
+    if (chunk == NULL || chunk -> used + size > STORE_ARENA_CHUNK) {
+        size_t capacity = size > STORE_ARENA_CHUNK ? size : STORE_ARENA_CHUNK;
+        chunk = malloc(sizeof(StoreChunk) + capacity);
+        if (chunk == NULL) {
+            fprintf(stderr, "Error: memory allocation\n");
+            return NULL;
+        }
+        chunk -> next = store -> arena;
+        chunk -> used = 0;
+        store -> arena = chunk;
+    }
+    void *block = chunk -> data + chunk -> used;
+    chunk -> used += size;
+    return block;
+}
+
+/**
+ * Return the slot of the table holding the entry of `id`, or the empty slot
+ * where it belongs.
+ */
+static StoreEntry **find_slot(ModelStore *store, const char *id, uint64_t hash) {
+    int mask = store -> table_size - 1;
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        StoreEntry *entry = store -> table[i];
+        if (entry == NULL || (entry -> hash == hash && strcmp(entry -> id, id) == 0)) {
+            return &(store -> table[i]);
+        }
+    }
+}
+
+/* Double the size of the table, keeping it at most half full */
+static void grow_table(ModelStore *store) {
+    StoreEntry **old_table = store -> table;
+    int old_size = store -> table_size;
+    store -> table_size *= 2;
+    store -> table = calloc(store -> table_size, sizeof(StoreEntry *));
+    for (int i = 0; i < old_size; i++) {
+        if (old_table[i] != NULL) {
+            *find_slot(store, old_table[i] -> id, old_table[i] -> hash) = old_table[i];
+        }
+    }
+    free(old_table);
+}
+
+/* Take the mapped `entry` out of the LRU list */
+static void lru_remove(ModelStore *store, StoreEntry *entry) {
+    if (entry -> newer != NULL) {
+        entry -> newer -> older = entry -> older;
+    } else {
+        store -> newest = entry -> older;
+    }
+    if (entry -> older != NULL) {
+        entry -> older -> newer = entry -> newer;
+    } else {
+        store -> oldest = entry -> newer;
+    }
+    entry -> newer = entry -> older = NULL;
+}
+
+/* Put the mapped `entry` at the front of the LRU list */
+static void lru_push(ModelStore *store, StoreEntry *entry) {
+    entry -> older = store -> newest;
+    entry -> newer = NULL;
+    if (store -> newest != NULL) {
+        store -> newest -> newer = entry;
+    } else {
+        store -> oldest = entry;
+    }
+    store -> newest = entry;
+}
+
+/**
+ * Unmap the least recently used models nobody holds until the mapped models
+ * fit in the budget (or only held ones are left).
+ */
+static void enforce_budget(ModelStore *store) {
+    StoreEntry *entry = store -> oldest;
+    while (store -> mapped > store -> budget && entry != NULL) {
+        StoreEntry *newer = entry -> newer;
+        if (entry -> pins == 0) {
+            lru_remove(store, entry);
+            store -> mapped -= entry -> model -> map_size;
+            model_unmap(entry -> model);
+            entry -> model = NULL;
+            entry -> unloads++;
+            store -> unloads++;
+        }
+        entry = newer;
+    }
+}
+
+/**
+ * Return an empty store of the models in `directory`, keeping at most
+ * `budget` bytes of models mapped (0: STORE_BUDGET).
+ */
+ModelStore *store_new(const char *directory, size_t budget) {
+    ModelStore *store = calloc(1, sizeof(ModelStore));
+    if (store == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    store -> directory = strdup(directory);
+    store -> budget = budget > 0 ? budget : STORE_BUDGET;
+    store -> table_size = 64;
+    store -> table = calloc(store -> table_size, sizeof(StoreEntry *));
+    pthread_mutex_init(&(store -> lock), NULL);
+    return store;
+}
+
+/**
+ * Return the entry of model `id`, with its model mapped, or NULL if there is
+ * no such model. The model stays mapped until the matching store_release().
+ */
+StoreEntry *store_acquire(ModelStore *store, const char *id) {
+    if (!valid_id(id)) {
+        __atomic_add_fetch(&(store -> unknown), 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uint64_t hash = id_hash(id);
+    pthread_mutex_lock(&(store -> lock));
+
+    StoreEntry **slot = find_slot(store, id, hash);
+    StoreEntry *entry = *slot;
+    if (entry == NULL) { // first request: the model is known once its file is
+        char path[strlen(store -> directory) + STORE_ID_MAX + 6];
+        sprintf(path, "%s/%s.dtm", store -> directory, id);
+        if (access(path, R_OK) != 0) {
+            __atomic_add_fetch(&(store -> unknown), 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&(store -> lock));
+            return NULL;
+        }
+        size_t id_size = strlen(id) + 1;
+        entry = arena_alloc(store, sizeof(StoreEntry) + id_size);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&(store -> lock));
+            return NULL;
+        }
+        memset(entry, 0, sizeof(StoreEntry));
+        entry -> id = memcpy((char *) (entry + 1), id, id_size);
+        entry -> hash = hash;
+        *slot = entry;
+        if (++store -> num_entries * 2 > store -> table_size) {
+            grow_table(store);
+        }
+    }
+
+    if (entry -> model == NULL) { // (re)map the model, its pages are read in as they are used
+        char path[strlen(store -> directory) + STORE_ID_MAX + 6];
+        sprintf(path, "%s/%s.dtm", store -> directory, id);
+        entry -> model = model_map(path);
+        if (entry -> model == NULL) {
+            pthread_mutex_unlock(&(store -> lock));
+            return NULL;
+        }
+        entry -> loads++;
+        store -> loads++;
+        store -> mapped += entry -> model -> map_size;
+    } else {
+        lru_remove(store, entry);
+    }
+    lru_push(store, entry);
+    entry -> pins++;
+    entry -> requests++;
+    enforce_budget(store);
+
+    pthread_mutex_unlock(&(store -> lock));
+    return entry;
+}
+
+/* Count `num_images` images classified with the model of `entry` */
+void store_count(StoreEntry *entry, int num_images) {
+    __atomic_add_fetch(&(entry -> images), num_images, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release a model returned by store_acquire(). It may be unmapped from then
+ * on, once it is the least recently used model and the store is over budget.
+ */
+void store_release(ModelStore *store, StoreEntry *entry) {
+    pthread_mutex_lock(&(store -> lock));
+    entry -> pins--;
+    enforce_budget(store);
+    pthread_mutex_unlock(&(store -> lock));
+}
+
+/* Classify one image with model `id` and return the label, or -1 if there is no such model */
+int store_classify(ModelStore *store, const char *id, const Image *img) {
+    StoreEntry *entry = store_acquire(store, id);
+    if (entry == NULL) {
+        return -1;
+    }
+    int label = model_classify(entry -> model, img);
+    store_count(entry, 1);
+    store_release(store, entry);
+    return label;
+}
+
+/* qsort comparator: entries with more requests first */
+static int compare_requests(const void *a, const void *b) {
+    const StoreEntry *x = *(StoreEntry * const *) a, *y = *(StoreEntry * const *) b;
+    return (x -> requests < y -> requests) - (x -> requests > y -> requests);
+}
+
+/**
+ * Print the totals of the store, then one line for each of the `max_models`
+ * most requested models: its mapped size (0 while unloaded), requests,
+ * images, loads and unloads.
+ */
+void store_print_stats(ModelStore *store, FILE *out, int max_models) {
+    pthread_mutex_lock(&(store -> lock));
+    fprintf(out, "store %s: %d models, %zu of %zu bytes mapped, %llu loads, %llu unloads, %llu unknown\n",
+            store -> directory, store -> num_entries, store -> mapped, store -> budget,
+            (unsigned long long) store -> loads, (unsigned long long) store -> unloads,
+            (unsigned long long) store -> unknown);
+
+    StoreEntry **entries = malloc(sizeof(StoreEntry *) * (store -> num_entries + 1));
+    int num_entries = 0;
+    for (int i = 0; i < store -> table_size; i++) {
+        if (store -> table[i] != NULL) {
+            entries[num_entries++] = store -> table[i];
+        }
+    }
+    qsort(entries, num_entries, sizeof(StoreEntry *), compare_requests);
+    for (int i = 0; i < num_entries && i < max_models; i++) {
+        StoreEntry *entry = entries[i];
+        fprintf(out, "  %s: %zu bytes mapped, %llu requests, %llu images, %llu loads, %llu unloads\n",
+                entry -> id, entry -> model != NULL ? entry -> model -> map_size : 0,
+                (unsigned long long) entry -> requests,
+                (unsigned long long) __atomic_load_n(&(entry -> images), __ATOMIC_RELAXED),
+                (unsigned long long) entry -> loads, (unsigned long long) entry -> unloads);
+    }
+    free(entries);
+    pthread_mutex_unlock(&(store -> lock));
+}
+
+/* Unmap every model and free the store. No model may be held any more */
+void free_model_store(ModelStore *store) {
+    for (StoreEntry *entry = store -> newest; entry != NULL; entry = entry -> older) {
+        model_unmap(entry -> model);
+    }
+    while (store -> arena != NULL) {
+        StoreChunk *next = store -> arena -> next;
+        free(store -> arena);
+        store -> arena = next;
+    }
+    pthread_mutex_destroy(&(store -> lock));
+    free(store -> table);
+    free(store -> directory);
+    free(store);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "model.h"
+
+/**
+ * A store of many flat models (see model.h), each addressed by an id: model
+ * `id` is the file `<directory>/<id>.dtm`. A model is mapped the first time it
+ * is requested, and its pages are read in by the kernel as classification
+ * touches them. When the mapped models exceed the store's byte budget, the
+ * least recently used ones that nobody holds are unmapped: their pages go back
+ * to the file, and the next request maps it again.
+ *
+ * The entries and their ids live in an arena owned by the store, and are
+ * found through an open-addressing table, so that thousands of known models
+ * cost a few hundred bytes each while unloaded. Every entry counts its
+ * requests, classified images, loads and unloads.
+ *
+ * All functions may be called from several threads.
+ */
+
+/* Bytes of models a store keeps mapped when no budget is given */
+#ifndef STORE_BUDGET
+#define STORE_BUDGET (64u << 20)
+#endif
+
+/* Longest model id */
+#ifndef STORE_ID_MAX
+#define STORE_ID_MAX 128
+#endif
+
+/* Size of the chunks of the store's arena */
+#ifndef STORE_ARENA_CHUNK
+#define STORE_ARENA_CHUNK (64 << 10)
+#endif
+
+/* A model known to the store */
+typedef struct store_entry {
+    const char *id;             // In the store's arena
+    uint64_t hash;              // Hash of the id
+    DTModel *model;             // Mapped model, or NULL while unloaded
+    int pins;                   // Holders of the model (see store_acquire())
+    uint64_t requests;          // store_acquire() calls
+    uint64_t images;            // Images classified (see store_count())
+    uint64_t loads;             // Times the model was mapped
+    uint64_t unloads;           // Times the model was unmapped to stay within the budget
+    struct store_entry *newer;  // Mapped models, in order of last use
+    struct store_entry *older;
+} StoreEntry;
+
+/* A chunk of the arena */
+typedef struct store_chunk {
+    struct store_chunk *next;
+    size_t used;
+    char data[];
+} StoreChunk;
+
+typedef struct {
+    char *directory;
+    size_t budget;              // Bytes of models kept mapped, when possible
+    size_t mapped;              // Bytes of models mapped now
+    StoreEntry **table;         // Open addressing on the id hash, NULL: empty
+    int table_size;             // Power of 2
+    int num_entries;
+    StoreChunk *arena;          // Chunk being filled, then older ones
+    StoreEntry *newest;         // Most recently used mapped model
+    StoreEntry *oldest;         // Least recently used mapped model
+    pthread_mutex_t lock;
+    uint64_t loads;             // Totals over every entry
+    uint64_t unloads;
+    uint64_t unknown;           // Requests for ids without a model file
+} ModelStore;
+
+ModelStore *store_new(const char *directory, size_t budget);
+StoreEntry *store_acquire(ModelStore *store, const char *id);
+void store_count(StoreEntry *entry, int num_images);
+void store_release(ModelStore *store, StoreEntry *entry);
+int store_classify(ModelStore *store, const char *id, const Image *img);
+void store_print_stats(ModelStore *store, FILE *out, int max_models);
+void free_model_store(ModelStore *store);
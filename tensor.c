@@ -0,0 +1,315 @@
+#include "pool.h"
+#include "tensor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TENSOR_HAVE_AVX2 1
+#endif
+
+/**
+ * Helper for tensor_from_tree. Number the internal nodes and leaves of the
+ * subtree in preorder, filling their entries of the matrices. The `depth`
+ * internal nodes above `node` are `path_nodes`, and `path_dirs` is 1 where the
+ * path goes right.
+ */
+static void compile_node(TensorTree *tree, DTNode *node, int *path_nodes, unsigned char *path_dirs, int depth,
+                         int *next_internal, int *next_leaf) {
+    if (node -> classification != -1) {
+        int leaf = (*next_leaf)++;
+        int8_t *row = tree -> paths + (size_t) leaf * tree -> width;
+        int left_turns = 0;
+        for (int d = 0; d < depth; d++) {
+            row[path_nodes[d]] = path_dirs[d] ? -1 : 1;
+            left_turns += !path_dirs[d];
+        }
+        tree -> left_turns[leaf] = left_turns;
+        tree -> labels[leaf] = node -> classification;
+        return;
+    }
+    int internal = (*next_internal)++;
+    tree -> pixels[internal] = node -> pixel;
+    tree -> thresholds[internal] = node -> threshold;
+    path_nodes[depth] = internal;
+    path_dirs[depth] = 0;
+    compile_node(tree, node -> left, path_nodes, path_dirs, depth + 1, next_internal, next_leaf);
+    path_dirs[depth] = 1;
+    compile_node(tree, node -> right, path_nodes, path_dirs, depth + 1, next_internal, next_leaf);
+}
+
+/**
+ * Compile the tree into its matrices (see tensor.h). The tree itself is not
+ * kept and may be freed.
+ */
+TensorTree *tensor_from_tree(DTNode *root) {
+    int num_nodes = dec_tree_num_nodes(root);
+    int depth = dec_tree_depth(root);
+    TensorTree *tree = calloc(1, sizeof(TensorTree));
+    if (tree == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return NULL;
+    }
+    tree -> num_leaves = (num_nodes + 1) / 2;
+    tree -> num_internal = num_nodes - tree -> num_leaves;
+    tree -> width = (tree -> num_internal + TENSOR_LANES - 1) / TENSOR_LANES * TENSOR_LANES;
+    tree -> padded_leaves = (tree -> num_leaves + TENSOR_COLS - 1) / TENSOR_COLS * TENSOR_COLS;
+    tree -> pixels = malloc(sizeof(int16_t) * (tree -> num_internal + 1));
+    tree -> thresholds = malloc(sizeof(int16_t) * (tree -> num_internal + 1));
+    tree -> paths = calloc((size_t) tree -> padded_leaves * tree -> width + 1, 1);
+    tree -> left_turns = malloc(sizeof(int16_t) * tree -> padded_leaves);
+    tree -> labels = calloc(tree -> padded_leaves, 1);
+    int *path_nodes = malloc(sizeof(int) * (depth + 1));
+    unsigned char *path_dirs = malloc(depth + 1);
+    if (tree -> pixels == NULL || tree -> thresholds == NULL || tree -> paths == NULL
+            || tree -> left_turns == NULL || tree -> labels == NULL || path_nodes == NULL || path_dirs == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        free(path_nodes);
+        free(path_dirs);
+        free_tensor_tree(tree);
+        return NULL;
+    }
+
+    // a padding leaf has an empty path, which sums to 0 for every image
+    for (int leaf = tree -> num_leaves; leaf < tree -> padded_leaves; leaf++) {
+        tree -> left_turns[leaf] = -1;
+    }
+    int next_internal = 0, next_leaf = 0;
+    compile_node(tree, root, path_nodes, path_dirs, 0, &next_internal, &next_leaf);
+    free(path_nodes);
+    free(path_dirs);
+    return tree;
+}
+
+/**
+ * The kernel computing a tile of T C: for the `rows` images (a multiple of
+ * TENSOR_ROWS) of `turns` (rows of T) and the `cols` leaves (a multiple of
+ * TENSOR_COLS) of `paths` (rows of C transposed), both rows of `width` bytes,
+ * set leaves[i] to first_leaf + l for the leaf l whose sum matches
+ * left_turns[l]. Images reaching none of the leaves are left alone.
+ */
+typedef void (*MatchKernel)(const uint8_t *turns, int rows, const int8_t *paths, const int16_t *left_turns,
+                            int cols, int width, int first_leaf, int *leaves);
+
+static void match_leaves_scalar(const uint8_t *turns, int rows, const int8_t *paths, const int16_t *left_turns,
+                                int cols, int width, int first_leaf, int *leaves) {
+    for (int i = 0; i < rows; i += TENSOR_ROWS) {
+        for (int l = 0; l < cols; l += TENSOR_COLS) {
+            int sums[TENSOR_ROWS][TENSOR_COLS] = {{0}};
+            for (int k = 0; k < width; k++) {
+                for (int r = 0; r < TENSOR_ROWS; r++) {
+                    int turn = turns[(size_t) (i + r) * width + k];
+                    for (int c = 0; c < TENSOR_COLS; c++) {
+                        sums[r][c] += turn * paths[(size_t) (l + c) * width + k];
+                    }
+                }
+            }
+            for (int r = 0; r < TENSOR_ROWS; r++) {
+                for (int c = 0; c < TENSOR_COLS; c++) {
+                    if (sums[r][c] == left_turns[l + c]) {
+                        leaves[i + r] = first_leaf + l + c;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef TENSOR_HAVE_AVX2
+/* The sums of the 16-bit lanes of each of a, b, c and d, as 4 ints */
+__attribute__((target("avx2")))
+static inline __m128i sum_lanes4(__m256i a, __m256i b, __m256i c, __m256i d) {
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i ab = _mm256_hadd_epi32(_mm256_madd_epi16(a, ones), _mm256_madd_epi16(b, ones));
+    __m256i cd = _mm256_hadd_epi32(_mm256_madd_epi16(c, ones), _mm256_madd_epi16(d, ones));
+    __m256i abcd = _mm256_hadd_epi32(ab, cd);
+    return _mm_add_epi32(_mm256_castsi256_si128(abcd), _mm256_extracti128_si256(abcd, 1));
+}
+
+/* Set leaves[r] to `leaf` for each of the 4 `sums` (of images r) equal to `left_turns` */
+__attribute__((target("avx2")))
+static inline void match4(__m128i sums, int left_turns, int leaf, int *leaves) {
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(sums, _mm_set1_epi32(left_turns))));
+    while (mask != 0) {
+        leaves[__builtin_ctz(mask)] = leaf;
+        mask &= mask - 1;
+    }
+}
+
+/*
+ * 32 internal nodes at a time: each product of a 0/1 byte by a -1/0/+1 byte
+ * pair fits in 16 bits, and so does the sum of a lane over the whole row (a
+ * path has fewer than 32768 nodes).
+ */
+__attribute__((target("avx2")))
+static void match_leaves_avx2(const uint8_t *turns, int rows, const int8_t *paths, const int16_t *left_turns,
+                              int cols, int width, int first_leaf, int *leaves) {
+    _Static_assert(TENSOR_ROWS == 4 && TENSOR_COLS == 2, "match_leaves_avx2 computes 4 x 2 blocks");
+    for (int i = 0; i < rows; i += 4) {
+        const uint8_t *t0 = turns + (size_t) i * width;
+        const uint8_t *t1 = t0 + width, *t2 = t1 + width, *t3 = t2 + width;
+        for (int l = 0; l < cols; l += 2) {
+            const int8_t *c0 = paths + (size_t) l * width, *c1 = c0 + width;
+            __m256i s00 = _mm256_setzero_si256(), s10 = s00, s20 = s00, s30 = s00;
+            __m256i s01 = s00, s11 = s00, s21 = s00, s31 = s00;
+            for (int k = 0; k < width; k += 32) {
+                __m256i b0 = _mm256_loadu_si256((const __m256i *) (c0 + k));
+                __m256i b1 = _mm256_loadu_si256((const __m256i *) (c1 + k));
+                __m256i a = _mm256_loadu_si256((const __m256i *) (t0 + k));
+                s00 = _mm256_add_epi16(s00, _mm256_maddubs_epi16(a, b0));
+                s01 = _mm256_add_epi16(s01, _mm256_maddubs_epi16(a, b1));
+                a = _mm256_loadu_si256((const __m256i *) (t1 + k));
+                s10 = _mm256_add_epi16(s10, _mm256_maddubs_epi16(a, b0));
+                s11 = _mm256_add_epi16(s11, _mm256_maddubs_epi16(a, b1));
+                a = _mm256_loadu_si256((const __m256i *) (t2 + k));
+                s20 = _mm256_add_epi16(s20, _mm256_maddubs_epi16(a, b0));
+                s21 = _mm256_add_epi16(s21, _mm256_maddubs_epi16(a, b1));
+                a = _mm256_loadu_si256((const __m256i *) (t3 + k));
+                s30 = _mm256_add_epi16(s30, _mm256_maddubs_epi16(a, b0));
+                s31 = _mm256_add_epi16(s31, _mm256_maddubs_epi16(a, b1));
+            }
+            match4(sum_lanes4(s00, s10, s20, s30), left_turns[l], first_leaf + l, leaves + i);
+            match4(sum_lanes4(s01, s11, s21, s31), left_turns[l + 1], first_leaf + l + 1, leaves + i);
+        }
+    }
+}
+#endif
+
+/* The kernel in use, chosen on first use */
+static MatchKernel active_kernel = NULL;
+
+/**
+ * Use the AVX2 kernel if `enable` is set and the CPU supports AVX2, the
+ * scalar one otherwise. Return 1 if the AVX2 kernel is now in use.
+ */
+int tensor_set_avx2(int enable) {
+#ifdef TENSOR_HAVE_AVX2
+    if (enable && __builtin_cpu_supports("avx2")) {
+        __atomic_store_n(&active_kernel, match_leaves_avx2, __ATOMIC_RELEASE);
+        return 1;
+    }
+#endif
+    __atomic_store_n(&active_kernel, match_leaves_scalar, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Return the kernel in use, the fastest the CPU supports unless chosen otherwise */
+static MatchKernel match_kernel(void) {
+    MatchKernel kernel = __atomic_load_n(&active_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        tensor_set_avx2(1);
+        kernel = __atomic_load_n(&active_kernel, __ATOMIC_ACQUIRE);
+    }
+    return kernel;
+}
+
+/* A batch being classified, see classify_blocks() */
+typedef struct {
+    const TensorTree *tree;
+    const Image *images;
+    int num_images;
+    int *predictions;
+    int failed;         // Set if a range could not be classified
+} TensorJob;
+
+/**
+ * Helper for tensor_classify_batch. Classify blocks [start, end) of
+ * TENSOR_BLOCK images: compute the block's rows of T, then sweep the leaves a
+ * tile at a time.
+ */
+static void classify_blocks(void *arg, int start, int end) {
+    TensorJob *job = arg;
+    const TensorTree *tree = job -> tree;
+    MatchKernel kernel = match_kernel();
+    int width = tree -> width;
+    int tile = TENSOR_TILE_BYTES / (width > 0 ? width : 1) / TENSOR_COLS * TENSOR_COLS;
+    if (tile < TENSOR_COLS) {
+        tile = TENSOR_COLS;
+    }
+    uint8_t *turns = calloc((size_t) TENSOR_BLOCK * width + 1, 1); // the padding of each row stays 0
+    int leaves[TENSOR_BLOCK];
+    if (turns == NULL) { // the range is labelled -1
+        fprintf(stderr, "Error: memory allocation\n");
+        int last = end * TENSOR_BLOCK < job -> num_images ? end * TENSOR_BLOCK : job -> num_images;
+        for (int i = start * TENSOR_BLOCK; i < last; i++) {
+            job -> predictions[i] = -1;
+        }
+        __atomic_store_n(&(job -> failed), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int block = start; block < end; block++) {
+        int first = block * TENSOR_BLOCK;
+        int count = job -> num_images - first < TENSOR_BLOCK ? job -> num_images - first : TENSOR_BLOCK;
+        int rows = (count + TENSOR_ROWS - 1) / TENSOR_ROWS * TENSOR_ROWS;
+        for (int i = 0; i < rows; i++) {
+            uint8_t *row = turns + (size_t) i * width;
+            leaves[i] = 0;
+            if (i >= count) {
+                memset(row, 0, width);
+                continue;
+            }
+            const Image *img = &(job -> images[first + i]);
+            if ((img -> dx | img -> dy) == 0) {
+                for (int j = 0; j < tree -> num_internal; j++) {
+                    row[j] = img -> data[tree -> pixels[j]] < tree -> thresholds[j];
+                }
+            } else {
+                for (int j = 0; j < tree -> num_internal; j++) {
+                    row[j] = image_pixel(img, tree -> pixels[j]) < tree -> thresholds[j];
+                }
+            }
+        }
+        for (int l = 0; l < tree -> padded_leaves; l += tile) {
+            int cols = tree -> padded_leaves - l < tile ? tree -> padded_leaves - l : tile;
+            kernel(turns, rows, tree -> paths + (size_t) l * width, tree -> left_turns + l, cols, width, l, leaves);
+        }
+        for (int i = 0; i < count; i++) {
+            job -> predictions[first + i] = tree -> labels[leaves[i]];
+        }
+    }
+    free(turns);
+}
+
+/**
+ * Classify a batch of images through the tree's matrices (see tensor.h), in
+ * blocks of TENSOR_BLOCK images spread over the thread pool. The predictions
+ * are those of `dec_tree_classify()` on the compiled tree. Return 0 on
+ * success, -1 if memory ran out (the images left unclassified get -1).
+ */
+int tensor_classify_batch(const TensorTree *tree, const Image *images, int num_images, int *predictions) {
+    TensorJob job = {tree, images, num_images, predictions, 0};
+    pool_parallel_for(0, (num_images + TENSOR_BLOCK - 1) / TENSOR_BLOCK, 1, classify_blocks, &job);
+    return job.failed ? -1 : 0;
+}
+
+/**
+ * Classify every image in `data` through the tree's matrices and return the
+ * number of correct predictions, or -1 if memory ran out.
+ */
+int tensor_evaluate(const TensorTree *tree, Dataset *data) {
+    int *predictions = malloc(sizeof(int) * (data -> num_items + 1));
+    if (predictions == NULL) {
+        fprintf(stderr, "Error: memory allocation\n");
+        return -1;
+    }
+    if (tensor_classify_batch(tree, data -> images, data -> num_items, predictions) != 0) {
+        free(predictions);
+        return -1;
+    }
+
+    int total_correct = 0;
+    for (int i = 0; i < data -> num_items; i++) {
+        total_correct += predictions[i] == data -> labels[i];
+    }
+    free(predictions);
+    return total_correct;
+}
+
+/* Free the matrices of the tree */
+void free_tensor_tree(TensorTree *tree) {
+    free(tree -> pixels);
+    free(tree -> thresholds);
+    free(tree -> paths);
+    free(tree -> left_turns);
+    free(tree -> labels);
+    free(tree);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dectree.h"
+
+/**
+ * Tensorized classification of large batches: the tree is compiled into
+ * dense matrices and a batch is classified with matrix products and
+ * comparisons instead of pointer walks, in the style of the GEMM strategy of
+ * Hummingbird. With I internal nodes and L leaves (in preorder):
+ *
+ *  A  (NUM_PIXELS x I) selects the pixel each internal node tests; it has a
+ *     single 1 per column, so X A is computed as a gather (`pixels`),
+ *  B  (I) holds the thresholds: T = (X A < B) is 1 where an image goes left,
+ *  C  (I x L) is +1 where the leaf is in the left subtree of the node, -1
+ *     where it is in the right subtree and 0 elsewhere (`paths`, stored
+ *     transposed, one row of I bytes per leaf),
+ *  D  (L) counts the left turns on the path to each leaf: the leaf an image
+ *     reaches is the one column of T C equal to D (any other leaf has an
+ *     ancestor where the image turns the other way, which lowers its sum),
+ *  E  (L) maps each leaf to its label (`labels`).
+ *
+ * T C is a product of a 0/1 byte matrix by a -1/0/+1 byte matrix, computed by
+ * a register-blocked kernel (TENSOR_ROWS images x TENSOR_COLS leaves at a
+ * time, with an AVX2 version used when the CPU supports it unless
+ * tensor_set_avx2() turns it off). Batches are classified TENSOR_BLOCK images
+ * at a time, their T rows staying in L1, against tiles of leaves whose rows
+ * of C fit in TENSOR_TILE_BYTES (for L2). Blocks are spread over the thread
+ * pool (see pool.h).
+ *
+ * The work per image grows with I x L, not with the depth: pointer traversal
+ * stays faster for deep trees on a CPU, and `dtbench` measures the batch size
+ * at which the matrices catch up, if they do, for trees of growing size.
+ */
+
+/* Rows of C (internal nodes) are padded to a multiple of this many bytes */
+#define TENSOR_LANES 32
+
+/* Images and leaves of the kernel's register block */
+#define TENSOR_ROWS 4
+#define TENSOR_COLS 2
+
+/* Images classified at a time (their rows of T stay in L1) */
+#ifndef TENSOR_BLOCK
+#define TENSOR_BLOCK 64
+#endif
+
+/* Bytes of C swept by a block of images at a time (for L2) */
+#ifndef TENSOR_TILE_BYTES
+#define TENSOR_TILE_BYTES 131072
+#endif
+
+typedef struct {
+    int num_internal;       // I
+    int num_leaves;         // L
+    int width;              // I rounded up to TENSOR_LANES: bytes per row of `paths` and of T
+    int padded_leaves;      // L rounded up to TENSOR_COLS (the extra leaves never match)
+    int16_t *pixels;        // [I] Pixel tested by each internal node (A)
+    int16_t *thresholds;    // [I] Threshold of each internal node (B)
+    int8_t *paths;          // [padded_leaves x width] C transposed
+    int16_t *left_turns;    // [padded_leaves] D
+    unsigned char *labels;  // [padded_leaves] E
+} TensorTree;
+
+TensorTree *tensor_from_tree(DTNode *root);
+int tensor_set_avx2(int enable);
+int tensor_classify_batch(const TensorTree *tree, const Image *images, int num_images, int *predictions);
+int tensor_evaluate(const TensorTree *tree, Dataset *data);
+void free_tensor_tree(TensorTree *tree);